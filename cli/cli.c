@@ -2,16 +2,55 @@
 // Created by Kosho on 2020/1/9.
 //
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "cli.h"
 #include "vm.h"
 #include "core.h"
 #include "parser.h"
 #include "token.h"
+#include "gc.h"
+#include "heap_snapshot.h"
 
 void printToken(const char *path, const VM *vm, const char *sourceCode);
 
-static void runFile(const char *path) {
+// 退出前是否打印gc耗时
+static bool printGCStats = false;
+// 退出前把堆快照写入此文件, 为NULL时不写
+static const char *heapSnapshotPath = NULL;
+
+// 与ObjType的顺序一致
+static const char *objTypeNames[OBJ_TYPE_NUM] = {
+        "class", "list", "map", "module", "range", "string",
+        "upvalue", "function", "closure", "instance", "thread"
+};
+
+// 打印全堆回收各阶段的累计耗时和内存占用
+static void printStats(VM *vm) {
+    GCStats *stats = &vm->gcStats;
+    fprintf(stderr, "gc: %u full collections, mark %.3fms, sweep %.3fms (last mark %.3fms, sweep %.3fms)\n",
+            stats->fullGCNum, stats->markNs / 1e6, stats->sweepNs / 1e6,
+            stats->lastMarkNs / 1e6, stats->lastSweepNs / 1e6);
+    fprintf(stderr, "memory: %llu bytes in use, peak %llu bytes\n",
+            (unsigned long long) vm->allocatedBytes, (unsigned long long) vm->peakBytes);
+    if (stats->dedupNum > 0) {
+        fprintf(stderr, "dedup: %llu strings, %llu bytes saved\n",
+                (unsigned long long) stats->dedupNum, (unsigned long long) stats->dedupBytes);
+    }
+
+    HeapStats heap;
+    gcHeapStats(vm, &heap);
+    uint32_t type = 0;
+    while (type < OBJ_TYPE_NUM) {
+        if (heap.objectNum[type] > 0) {
+            fprintf(stderr, "  %-8s %10llu objects %12llu bytes\n", objTypeNames[type],
+                    (unsigned long long) heap.objectNum[type], (unsigned long long) heap.bytes[type]);
+        }
+        type++;
+    }
+}
+
+static void runFile(const char *path, const Configuration *config) {
     const char *lastSlash = strrchr(path, '/');
     if (lastSlash != NULL) {
         char *root = (char *) malloc(lastSlash - path + 2);
@@ -20,10 +59,17 @@ static void runFile(const char *path) {
         rootDir = root;
     }
 
-    VM *vm = newVM();
+    // 配置在建立核心类之前生效, 核心对象的分配也受堆上限约束
+    VM *vm = newVMWithConfig(config);
     const char *sourceCode = readFile(path);
 
     executeModule(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode);
+    if (printGCStats) {
+        printStats(vm);
+    }
+    if (heapSnapshotPath != NULL && !writeHeapSnapshot(vm, heapSnapshotPath)) {
+        fprintf(stderr, "write heap snapshot to %s failed!\n", heapSnapshotPath);
+    }
 
     // printToken(path, vm, sourceCode);
 }
@@ -42,13 +88,50 @@ void printToken(const char *path, const VM *vm, const char *sourceCode) {
 
         printf("]\n");
     }
+    arenaRelease(parser.vm, &parser.arena);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [--gc-threads n] [--max-heap bytes] [--dedup-strings n] "
+                    "[--heap-snapshot file] [--gc-stats] [script]\n", program);
+    exit(1);
+}
+
+// 选项argv[*idx]的值, 缺少值时报用法错误, 而不是把选项本身当作脚本路径
+static const char *optionValue(int argc, const char **argv, int *idx) {
+    if (*idx + 1 >= argc) {
+        fprintf(stderr, "option %s requires a value!\n", argv[*idx]);
+        usage(argv[0]);
+    }
+    return argv[++*idx];
 }
 
 int main(int argc, const char **argv) {
-    if (argc == 1) {
+    Configuration config;
+    initConfiguration(&config);
+    const char *path = NULL;
+    int idx = 1;
+    while (idx < argc) {
+        if (strcmp(argv[idx], "--gc-threads") == 0) {
+            config.gcThreads = (uint32_t) strtoul(optionValue(argc, argv, &idx), NULL, 10);
+        } else if (strcmp(argv[idx], "--max-heap") == 0) {
+            config.maxHeapSize = strtoull(optionValue(argc, argv, &idx), NULL, 10);
+        } else if (strcmp(argv[idx], "--dedup-strings") == 0) {
+            config.dedupInterval = (uint32_t) strtoul(optionValue(argc, argv, &idx), NULL, 10);
+        } else if (strcmp(argv[idx], "--heap-snapshot") == 0) {
+            heapSnapshotPath = optionValue(argc, argv, &idx);
+        } else if (strcmp(argv[idx], "--gc-stats") == 0) {
+            printGCStats = true;
+        } else {
+            path = argv[idx];
+        }
+        idx++;
+    }
+
+    if (path == NULL) {
 
     } else {
-        runFile(argv[1]);
+        runFile(path, &config);
     }
     return 0;
-}
\ No newline at end of file
+}
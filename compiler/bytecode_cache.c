@@ -0,0 +1,592 @@
+//
+// Created by Kosho on 2020/2/28.
+//
+
+#include "bytecode_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "compiler.h"
+#include "core.h"
+#include "gc.h"
+#include "obj_string.h"
+#if DEBUG
+#include "debug.h"
+#endif
+
+// 常量的类型标记
+#define CACHE_CONST_NULL 'n'
+#define CACHE_CONST_FALSE 'f'
+#define CACHE_CONST_TRUE 't'
+#define CACHE_CONST_NUM 'd'
+#define CACHE_CONST_STRING 's'
+#define CACHE_CONST_FN 'F'
+
+// 函数最大嵌套深度, 防止损坏的缓存文件耗尽栈
+#define CACHE_MAX_FN_DEPTH 256
+
+#if DEBUG
+#define CACHE_FLAGS BYTECODE_CACHE_DEBUG
+#else
+#define CACHE_FLAGS 0
+#endif
+
+/**
+ * 写缓存时的状态, 内存一律直接用malloc, 不经memManager以免触发gc
+ */
+typedef struct {
+    FILE *file;
+    // 全局方法符号索引到缓存中索引的映射, -1表示尚未引用
+    int *localIndex;
+    // 按缓存中的索引排列的全局方法符号索引
+    int *symbols;
+    uint32_t symbolNum;
+    // 遇到无法缓存的常量时置为false
+    bool ok;
+} CacheWriter;
+
+/**
+ * 读缓存时的状态, cursor在映射的文件中前进, 越界或格式不符时ok置为false
+ */
+typedef struct {
+    const uint8_t *cursor;
+    const uint8_t *end;
+    bool ok;
+} CacheReader;
+
+// 64位FNV-1a哈希, 用于判断源码是否改变
+static uint64_t hashBytes(uint64_t hash, const void *bytes, uint32_t length) {
+    const uint8_t *ptr = (const uint8_t *) bytes;
+    uint32_t idx = 0;
+    while (idx < length) {
+        hash ^= ptr[idx++];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+
+// 模块中前count个模块变量名的哈希, 缓存中的模块变量索引依赖它们
+static uint64_t hashModuleVarNames(ObjModule *objModule, uint32_t count) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint32_t idx = 0;
+    while (idx < count) {
+        String *name = &objModule->moduleVarName.datas[idx++];
+        hash = hashBytes(hash, &name->length, sizeof(uint32_t));
+        hash = hashBytes(hash, name->str, name->length);
+    }
+    return hash;
+}
+
+static void writeVarint(FILE *file, uint64_t value) {
+    while (value >= 0x80) {
+        fputc((int) (value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int) value, file);
+}
+
+static void writeBytes(FILE *file, const void *bytes, uint32_t length) {
+    writeVarint(file, length);
+    fwrite(bytes, 1, length, file);
+}
+
+// 把全局方法符号换成缓存中的索引, 首次引用时登记
+static int localSymbol(int symbolIndex, void *arg) {
+    CacheWriter *writer = (CacheWriter *) arg;
+    if (writer->localIndex[symbolIndex] == -1) {
+        writer->localIndex[symbolIndex] = (int) writer->symbolNum;
+        writer->symbols[writer->symbolNum++] = symbolIndex;
+    }
+    return writer->localIndex[symbolIndex];
+}
+
+static void writeFn(CacheWriter *writer, ObjFn *fn);
+
+static void writeConstant(CacheWriter *writer, Value constant) {
+    FILE *file = writer->file;
+    switch (VALUE_TYPE(constant)) {
+        case VT_NULL:
+            fputc(CACHE_CONST_NULL, file);
+            return;
+        case VT_FALSE:
+            fputc(CACHE_CONST_FALSE, file);
+            return;
+        case VT_TRUE:
+            fputc(CACHE_CONST_TRUE, file);
+            return;
+        case VT_NUM: {
+            double num = VALUE_TO_NUM(constant);
+            fputc(CACHE_CONST_NUM, file);
+            fwrite(&num, 1, sizeof(double), file);
+            return;
+        }
+        case VT_OBJ:
+            break;
+        default:
+            writer->ok = false;
+            return;
+    }
+
+    switch (OBJ_TYPE(VALUE_TO_OBJ(constant))) {
+        case OT_STRING: {
+            ObjString *objString = VALUE_TO_OBJSTR(constant);
+            fputc(CACHE_CONST_STRING, file);
+            writeBytes(file, objString->value.start, objString->value.length);
+            return;
+        }
+        case OT_FUNCTION:
+            fputc(CACHE_CONST_FN, file);
+            writeFn(writer, VALUE_TO_OBJFN(constant));
+            return;
+        default:
+            writer->ok = false;
+            return;
+    }
+}
+
+static void writeFn(CacheWriter *writer, ObjFn *fn) {
+    FILE *file = writer->file;
+    writeVarint(file, fn->argNum);
+    writeVarint(file, fn->upvalueNum);
+    writeVarint(file, fn->maxStackSlotUsedNum);
+
+    // 指令流中的方法符号在副本中改写为缓存中的索引, fn本身不变
+    uint32_t count = fn->instrStream.count;
+    Byte *instrStream = (Byte *) malloc(count > 0 ? count : 1);
+    if (instrStream == NULL) {
+        MEM_ERROR("allocate bytecode cache buffer failed!");
+    }
+    memcpy(instrStream, fn->instrStream.datas, count);
+    relocateInstrSymbols(instrStream, count, fn->constants.datas, localSymbol, writer);
+    writeBytes(file, instrStream, count);
+    free(instrStream);
+
+    writeVarint(file, fn->constants.count);
+    uint32_t idx = 0;
+    while (idx < fn->constants.count && writer->ok) {
+        writeConstant(writer, fn->constants.datas[idx++]);
+    }
+
+#if DEBUG
+    const char *fnName = fn->debug->fnName != NULL ? fn->debug->fnName : "";
+    writeBytes(file, fnName, strlen(fnName));
+    writeVarint(file, fn->debug->lineNo.count);
+    idx = 0;
+    while (idx < fn->debug->lineNo.count) {
+        writeVarint(file, (uint32_t) fn->debug->lineNo.datas[idx++]);
+    }
+#endif
+}
+
+/**
+ * 把模块objModule编译出的函数fn写入字节码缓存文件path
+ * moduleVarBase为编译前模块变量的个数, 此后的模块变量是编译时定义的, 随缓存一起保存
+ * 先写临时文件再改名, 读者不会看到写了一半的文件; 常量中有无法保存的对象或写文件失败时返回false
+ */
+bool writeBytecodeCache(VM *vm, ObjModule *objModule, uint32_t moduleVarBase,
+                        ObjFn *fn, const char *moduleCode, const char *path) {
+    // 先写到内存中, 算出校验和后再落盘
+    char *data = NULL;
+    size_t size = 0;
+    FILE *file = open_memstream(&data, &size);
+    if (file == NULL) {
+        return false;
+    }
+
+    CacheWriter writer;
+    writer.file = file;
+    uint32_t globalNum = vm->allMethodNames.count;
+    writer.localIndex = (int *) malloc((globalNum > 0 ? globalNum : 1) * sizeof(int));
+    writer.symbols = (int *) malloc((globalNum > 0 ? globalNum : 1) * sizeof(int));
+    if (writer.localIndex == NULL || writer.symbols == NULL) {
+        MEM_ERROR("allocate bytecode cache symbols failed!");
+    }
+    memset(writer.localIndex, -1, globalNum * sizeof(int));
+    writer.symbolNum = 0;
+    writer.ok = true;
+
+    uint32_t codeLen = (uint32_t) strlen(moduleCode);
+    fwrite(BYTECODE_CACHE_MAGIC, 1, BYTECODE_CACHE_MAGIC_LEN, file);
+    writeVarint(file, BYTECODE_CACHE_VERSION);
+    writeVarint(file, CACHE_FLAGS);
+    writeVarint(file, hashBytes(FNV_OFFSET_BASIS, moduleCode, codeLen));
+    writeVarint(file, codeLen);
+    writeVarint(file, moduleVarBase);
+    writeVarint(file, hashModuleVarNames(objModule, moduleVarBase));
+
+    uint32_t idx = moduleVarBase;
+    writeVarint(file, objModule->moduleVarName.count - moduleVarBase);
+    while (idx < objModule->moduleVarName.count) {
+        String *name = &objModule->moduleVarName.datas[idx++];
+        writeBytes(file, name->str, name->length);
+    }
+
+    writeFn(&writer, fn);
+
+    writeVarint(file, writer.symbolNum);
+    idx = 0;
+    while (idx < writer.symbolNum) {
+        String *name = &vm->allMethodNames.datas[writer.symbols[idx++]];
+        writeBytes(file, name->str, name->length);
+    }
+    fputc(BYTECODE_CACHE_END, file);
+
+    free(writer.localIndex);
+    free(writer.symbols);
+    bool ok = writer.ok && !ferror(file);
+    if (fclose(file) != 0 || !ok) {
+        free(data);
+        return false;
+    }
+    uint64_t checksum = hashBytes(FNV_OFFSET_BASIS, data, (uint32_t) size);
+
+    size_t pathLen = strlen(path);
+    char *tmpPath = (char *) malloc(pathLen + 16);
+    if (tmpPath == NULL) {
+        free(data);
+        return false;
+    }
+    snprintf(tmpPath, pathLen + 16, "%s.%d", path, (int) getpid());
+    file = fopen(tmpPath, "wb");
+    if (file != NULL) {
+        fwrite(data, 1, size, file);
+        fwrite(&checksum, 1, sizeof(uint64_t), file);
+        ok = !ferror(file);
+        if (fclose(file) != 0) {
+            ok = false;
+        }
+        if (ok && rename(tmpPath, path) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            unlink(tmpPath);
+        }
+    }
+    free(tmpPath);
+    free(data);
+    return ok;
+}
+
+static uint64_t readVarint(CacheReader *reader) {
+    uint64_t value = 0;
+    uint32_t shift = 0;
+    while (reader->ok) {
+        if (reader->cursor >= reader->end || shift > 63) {
+            reader->ok = false;
+            break;
+        }
+        uint8_t byte = *reader->cursor++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+// 读取长度和字节, 返回指向映射中字节的指针
+static const uint8_t *readBytes(CacheReader *reader, uint32_t *length) {
+    uint64_t len = readVarint(reader);
+    if (!reader->ok || len > (uint64_t) (reader->end - reader->cursor)) {
+        reader->ok = false;
+        *length = 0;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->cursor;
+    reader->cursor += len;
+    *length = (uint32_t) len;
+    return bytes;
+}
+
+static ObjFn *readFn(VM *vm, CacheReader *reader, ObjModule *objModule, uint32_t depth);
+
+// 读取一个常量, 失败时返回null并置reader->ok为false
+static Value readConstant(VM *vm, CacheReader *reader, ObjModule *objModule, uint32_t depth) {
+    if (reader->cursor >= reader->end) {
+        reader->ok = false;
+        return VT_TO_VALUE(VT_NULL);
+    }
+    switch (*reader->cursor++) {
+        case CACHE_CONST_NULL:
+            return VT_TO_VALUE(VT_NULL);
+        case CACHE_CONST_FALSE:
+            return VT_TO_VALUE(VT_FALSE);
+        case CACHE_CONST_TRUE:
+            return VT_TO_VALUE(VT_TRUE);
+        case CACHE_CONST_NUM: {
+            double num;
+            if (reader->end - reader->cursor < (long) sizeof(double)) {
+                reader->ok = false;
+                return VT_TO_VALUE(VT_NULL);
+            }
+            memcpy(&num, reader->cursor, sizeof(double));
+            reader->cursor += sizeof(double);
+            return NUM_TO_VALUE(num);
+        }
+        case CACHE_CONST_STRING: {
+            uint32_t length;
+            const uint8_t *bytes = readBytes(reader, &length);
+            if (!reader->ok) {
+                return VT_TO_VALUE(VT_NULL);
+            }
+            return OBJ_TO_VALUE(newObjString(vm, (const char *) bytes, length));
+        }
+        case CACHE_CONST_FN: {
+            ObjFn *fn = readFn(vm, reader, objModule, depth + 1);
+            return fn != NULL ? OBJ_TO_VALUE(fn) : VT_TO_VALUE(VT_NULL);
+        }
+        default:
+            reader->ok = false;
+            return VT_TO_VALUE(VT_NULL);
+    }
+}
+
+static ObjFn *readFn(VM *vm, CacheReader *reader, ObjModule *objModule, uint32_t depth) {
+    if (depth > CACHE_MAX_FN_DEPTH) {
+        reader->ok = false;
+        return NULL;
+    }
+    uint64_t argNum = readVarint(reader);
+    uint64_t upvalueNum = readVarint(reader);
+    uint64_t maxStackSlotUsedNum = readVarint(reader);
+    uint32_t instrLen;
+    const uint8_t *instrStream = readBytes(reader, &instrLen);
+    uint64_t constantNum = readVarint(reader);
+    if (!reader->ok || argNum > UINT8_MAX || upvalueNum > UINT32_MAX || maxStackSlotUsedNum > UINT32_MAX ||
+        constantNum > (uint64_t) (reader->end - reader->cursor)) {
+        reader->ok = false;
+        return NULL;
+    }
+
+    ObjFn *fn = newObjFn(vm, objModule, (uint32_t) maxStackSlotUsedNum);
+    fn->argNum = (uint8_t) argNum;
+    fn->upvalueNum = (uint32_t) upvalueNum;
+    ByteBufferAppendMany(vm, &fn->instrStream, instrStream, instrLen);
+
+    ValueBufferReserve(vm, &fn->constants, (uint32_t) constantNum);
+    uint32_t idx = 0;
+    while (idx < constantNum && reader->ok) {
+        Value constant = readConstant(vm, reader, objModule, depth);
+        gcLockHeap(vm);
+        ValueBufferAdd(vm, &fn->constants, constant);
+        gcWriteBarrier(vm, (ObjHeader *) fn, constant);
+        gcUnlockHeap(vm);
+        idx++;
+    }
+
+#if DEBUG
+    uint32_t nameLen;
+    const uint8_t *fnName = readBytes(reader, &nameLen);
+    uint64_t lineNum = readVarint(reader);
+    if (!reader->ok || lineNum != instrLen) {
+        reader->ok = false;
+        return NULL;
+    }
+    bindDebugFnName(vm, fn->debug, (const char *) fnName, nameLen);
+    IntBufferReserve(vm, &fn->debug->lineNo, instrLen);
+    idx = 0;
+    while (idx < lineNum && reader->ok) {
+        IntBufferAdd(vm, &fn->debug->lineNo, (int) readVarint(reader));
+        idx++;
+    }
+#endif
+    return reader->ok ? fn : NULL;
+}
+
+// 检查指令流的结构: 操作码合法, 操作数不越界, 闭包指令引用的常量是函数
+static bool checkInstrStream(ObjFn *fn) {
+    Byte *instrStream = fn->instrStream.datas;
+    uint32_t count = fn->instrStream.count;
+    uint32_t ip = 0;
+    while (ip < count) {
+        OpCode opCode = (OpCode) instrStream[ip];
+        if (opCode > OPCODE_END) {
+            return false;
+        }
+        if (opCode == OPCODE_CREATE_CLOSURE) {
+            if (ip + 2 >= count) {
+                return false;
+            }
+            uint32_t fnIdx = (instrStream[ip + 1] << 8) | instrStream[ip + 2];
+            if (fnIdx >= fn->constants.count ||
+                !VALUE_IS_CERTAIN_OBJ(fn->constants.datas[fnIdx], OT_FUNCTION)) {
+                return false;
+            }
+        }
+        uint32_t length = 1 + getBytesOfOperands(instrStream, fn->constants.datas, ip);
+        if (length > count - ip) {
+            return false;
+        }
+        ip += length;
+    }
+    return true;
+}
+
+/**
+ * 方法符号重定位的状态: 缓存中的索引到全局索引的映射
+ */
+typedef struct {
+    const int *symbolMap;
+    uint32_t symbolNum;
+    bool ok;
+} SymbolLinker;
+
+static int linkSymbol(int symbolIndex, void *arg) {
+    SymbolLinker *linker = (SymbolLinker *) arg;
+    if ((uint32_t) symbolIndex >= linker->symbolNum) {
+        linker->ok = false;
+        return 0;
+    }
+    return linker->symbolMap[symbolIndex];
+}
+
+// 检查fn及其内层函数的指令流并把方法符号重定位为全局索引
+static bool linkFn(ObjFn *fn, SymbolLinker *linker) {
+    if (!checkInstrStream(fn)) {
+        return false;
+    }
+    relocateInstrSymbols(fn->instrStream.datas, fn->instrStream.count, fn->constants.datas, linkSymbol, linker);
+    uint32_t idx = 0;
+    while (idx < fn->constants.count && linker->ok) {
+        if (VALUE_IS_CERTAIN_OBJ(fn->constants.datas[idx], OT_FUNCTION) &&
+            !linkFn(VALUE_TO_OBJFN(fn->constants.datas[idx]), linker)) {
+            return false;
+        }
+        idx++;
+    }
+    return linker->ok;
+}
+
+// 从映射的缓存文件中读出模块函数, 过期或损坏时返回NULL且不改动模块
+static ObjFn *readCache(VM *vm, CacheReader *reader, ObjModule *objModule, const char *moduleCode) {
+    if (reader->end - reader->cursor < BYTECODE_CACHE_MAGIC_LEN ||
+        memcmp(reader->cursor, BYTECODE_CACHE_MAGIC, BYTECODE_CACHE_MAGIC_LEN) != 0) {
+        return NULL;
+    }
+    reader->cursor += BYTECODE_CACHE_MAGIC_LEN;
+    uint64_t version = readVarint(reader);
+    uint64_t flags = readVarint(reader);
+    uint64_t codeHash = readVarint(reader);
+    uint64_t codeLen = readVarint(reader);
+    uint64_t moduleVarBase = readVarint(reader);
+    uint64_t baseHash = readVarint(reader);
+    uint32_t actualLen = (uint32_t) strlen(moduleCode);
+    if (!reader->ok || version != BYTECODE_CACHE_VERSION || flags != CACHE_FLAGS ||
+        codeLen != actualLen || codeHash != hashBytes(FNV_OFFSET_BASIS, moduleCode, actualLen) ||
+        moduleVarBase != objModule->moduleVarValue.count ||
+        baseHash != hashModuleVarNames(objModule, objModule->moduleVarValue.count)) {
+        return NULL;
+    }
+
+    // 模块变量名在确认整个文件有效后才定义, 先记下位置
+    uint64_t varNum = readVarint(reader);
+    const uint8_t *varNames = reader->cursor;
+    uint32_t idx = 0;
+    while (idx < varNum && reader->ok) {
+        uint32_t length;
+        readBytes(reader, &length);
+        if (length == 0 || length > MAX_ID_LEN) {
+            reader->ok = false;
+        }
+        idx++;
+    }
+    if (!reader->ok) {
+        return NULL;
+    }
+
+    ObjFn *fn = readFn(vm, reader, objModule, 0);
+    uint64_t symbolNum = readVarint(reader);
+    if (fn == NULL || !reader->ok || symbolNum > (uint64_t) (reader->end - reader->cursor)) {
+        return NULL;
+    }
+
+    // 方法名登记到vm->allMethodNames, 得到缓存中索引到全局索引的映射
+    int *symbolMap = (int *) malloc((symbolNum > 0 ? symbolNum : 1) * sizeof(int));
+    if (symbolMap == NULL) {
+        MEM_ERROR("allocate bytecode cache symbols failed!");
+    }
+    idx = 0;
+    while (idx < symbolNum && reader->ok) {
+        uint32_t length;
+        const char *name = (const char *) readBytes(reader, &length);
+        if (length == 0) {
+            reader->ok = false;
+            break;
+        }
+        symbolMap[idx++] = ensureSymbolExist(vm, &vm->allMethodNames, name, length);
+    }
+    if (reader->ok && (reader->cursor >= reader->end || *reader->cursor != BYTECODE_CACHE_END)) {
+        reader->ok = false;
+    }
+    SymbolLinker linker;
+    linker.symbolMap = symbolMap;
+    linker.symbolNum = (uint32_t) symbolNum;
+    linker.ok = true;
+    bool ok = reader->ok && linkFn(fn, &linker);
+    free(symbolMap);
+    if (!ok) {
+        return NULL;
+    }
+
+    // 按原顺序定义模块变量, 指令流中的模块变量索引因此与编译时一致
+    CacheReader names;
+    names.cursor = varNames;
+    names.end = reader->end;
+    names.ok = true;
+    idx = 0;
+    while (idx < varNum) {
+        uint32_t length;
+        const char *name = (const char *) readBytes(&names, &length);
+        defineModuleVar(vm, objModule, name, length, VT_TO_VALUE(VT_NULL));
+        idx++;
+    }
+    return fn;
+}
+
+/**
+ * 从字节码缓存文件path中载入模块objModule的函数, 用于代替compileModule
+ * 文件以mmap映射后读取, 方法符号重新链接到vm->allMethodNames, 编译时定义的模块变量按原顺序重新定义
+ * 文件不存在、已损坏或与源码moduleCode不符时返回NULL, 此时调用者应重新编译
+ */
+ObjFn *loadBytecodeCache(VM *vm, ObjModule *objModule, const char *moduleCode, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > UINT32_MAX) {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    // 末尾8字节是其前所有字节的校验和, 不符说明文件已损坏
+    CacheReader reader;
+    reader.cursor = (const uint8_t *) data;
+    reader.end = reader.cursor + st.st_size - sizeof(uint64_t);
+    reader.ok = true;
+    uint64_t checksum;
+    ObjFn *fn = NULL;
+    if (st.st_size > (off_t) sizeof(uint64_t)) {
+        memcpy(&checksum, reader.end, sizeof(uint64_t));
+        if (checksum == hashBytes(FNV_OFFSET_BASIS, reader.cursor, (uint32_t) (reader.end - reader.cursor))) {
+            // 读出的函数在返回前无处可达, 整个过程暂停gc
+            vm->gcPauseNum++;
+            fn = readCache(vm, &reader, objModule, moduleCode);
+            vm->gcPauseNum--;
+        }
+    }
+    munmap(data, st.st_size);
+    return fn;
+}
@@ -0,0 +1,38 @@
+//
+// Created by Kosho on 2020/2/28.
+//
+
+#ifndef _COMPILER_BYTECODE_CACHE_H
+#define _COMPILER_BYTECODE_CACHE_H
+
+#include "vm.h"
+#include "obj_fn.h"
+
+/**
+ * .crabc字节码缓存文件格式, 整数都是LEB128变长编码:
+ *   文件头     BYTECODE_CACHE_MAGIC, 版本号, 标志位, 源码哈希, 源码长度,
+ *             编译前的模块变量数, 这些模块变量名的哈希
+ *   模块变量   个数, 各变量名(长度 字节), 即编译时新定义的模块变量, 按索引顺序
+ *   函数树     模块函数, 见下
+ *   方法名     个数, 各方法名(长度 字节), 指令流中的方法符号是此表中的索引
+ *   结束标记   BYTECODE_CACHE_END
+ *   校验和     其前所有字节的64位FNV-1a哈希, 8字节
+ * 函数: argNum upvalueNum maxStackSlotUsedNum 指令流(长度 字节) 常量个数 各常量
+ *       [标志位含调试信息时] 函数名(长度 字节) 行号个数 各行号
+ * 常量: 类型标记, 数字为8字节的double, 字符串为长度和字节, 函数为嵌套的函数
+ * 源码或编译前的模块变量与缓存不符时视为过期
+ */
+#define BYTECODE_CACHE_MAGIC "CRABCODE"
+#define BYTECODE_CACHE_MAGIC_LEN 8
+#define BYTECODE_CACHE_VERSION 1
+#define BYTECODE_CACHE_END 'E'
+
+// 标志位: 含调试信息
+#define BYTECODE_CACHE_DEBUG 1
+
+bool writeBytecodeCache(VM *vm, ObjModule *objModule, uint32_t moduleVarBase,
+                        ObjFn *fn, const char *moduleCode, const char *path);
+
+ObjFn *loadBytecodeCache(VM *vm, ObjModule *objModule, const char *moduleCode, const char *path);
+
+#endif
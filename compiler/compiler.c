@@ -5,7 +5,11 @@
 #include "compiler.h"
 #include "parser.h"
 #include "core.h"
+#include "gc.h"
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
 
 #if DEBUG
 #include "debug.h"
@@ -138,6 +142,8 @@ static void compileProgram(CompileUnit *cu);
  */
 static void initCompileUnit(Parser *parser, CompileUnit *cu,
                             CompileUnit *enclosingUnit, bool isMethod) {
+    // 先清空fn, 以免newObjFn触发的gc通过parser访问到未初始化的cu
+    cu->fn = NULL;
     parser->curCompileUnit = cu;
     cu->curParser = parser;
     cu->enclosingUnit = enclosingUnit;
@@ -190,6 +196,15 @@ static int writeByte(CompileUnit *cu, int byte) {
     return cu->fn->instrStream.count - 1;
 }
 
+// 往函数的指令流中一次写入num字节
+static void writeBytes(CompileUnit *cu, const Byte *bytes, uint32_t num) {
+#if DEBUG
+    IntBufferFillWrite(cu->curParser->vm,
+     &cu->fn->debug->lineNo, cu->curParser->preToken.lineNo, num);
+#endif
+    ByteBufferAppendMany(cu->curParser->vm, &cu->fn->instrStream, bytes, num);
+}
+
 // 写入操作码
 static void writeOpCode(CompileUnit *cu, OpCode opCode) {
     writeByte(cu, opCode);
@@ -207,8 +222,10 @@ static int writeByteOperand(CompileUnit *cu, int operand) {
 
 // 写入2个字节的操作数 按大端字节序写入参数,低地址写高位,高地址写低位
 inline static void writeShortOperand(CompileUnit *cu, int operand) {
-    writeByte(cu, (operand >> 8) & 0xff); // 先写高8位
-    writeByte(cu, operand & 0xff);        // 再写低8位
+    Byte bytes[2];
+    bytes[0] = (operand >> 8) & 0xff; // 先写高8位
+    bytes[1] = operand & 0xff;        // 再写低8位
+    writeBytes(cu, bytes, 2);
 }
 
 // 写入操作数为1字节大小的指令
@@ -241,6 +258,8 @@ int defineModuleVar(VM *vm, ObjModule *objModule, const char *name, uint32_t len
         }
     }
 
+    ASSERT(!isImmortalObject(vm, (ObjHeader *) objModule), "can't define variable in immortal module!");
+    gcLockHeap(vm);
     // 从模块变量名中查找变量,若不存在就添加
     int symbolIndex = getIndexFromSymbolTable(&objModule->moduleVarName, name, length);
     if (symbolIndex == -1) {
@@ -258,6 +277,10 @@ int defineModuleVar(VM *vm, ObjModule *objModule, const char *name, uint32_t len
         symbolIndex = -1;
     }
 
+    if (symbolIndex != -1) {
+        gcWriteBarrier(vm, (ObjHeader *) objModule, value);
+    }
+    gcUnlockHeap(vm);
     return symbolIndex;
 }
 
@@ -432,7 +455,10 @@ static void emitCallBySignature(CompileUnit *cu, Signature *sign, OpCode opcode)
 // 声明模块变量, 与defineModuleVar的区别是不做重定义检查, 默认为声明
 static int declareModuleVar(VM *vm, ObjModule *objModule,
                             const char *name, uint32_t length, Value value) {
+    gcLockHeap(vm);
     ValueBufferAdd(vm, &objModule->moduleVarValue, value);
+    gcWriteBarrier(vm, (ObjHeader *) objModule, value);
+    gcUnlockHeap(vm);
     return addSymbol(vm, &objModule->moduleVarName, name, length);
 }
 
@@ -782,12 +808,21 @@ static ObjFn *endCompileUnit(CompileUnit *cu) {
         // 下面为每个upvalue生成参数.
         index = 0;
         while (index < cu->fn->upvalueNum) {
-            writeByte(cu->enclosingUnit, cu->upvalues[index].isEnclosingLocalVar ? 1 : 0);
-            writeByte(cu->enclosingUnit, cu->upvalues[index].index);
+            Byte bytes[2];
+            bytes[0] = cu->upvalues[index].isEnclosingLocalVar ? 1 : 0;
+            bytes[1] = cu->upvalues[index].index;
+            writeBytes(cu->enclosingUnit, bytes, 2);
             index++;
         }
     }
 
+    // 函数编译完成后指令流和常量表不再增长, 释放倍增留下的空闲容量
+    ByteBufferShrinkToFit(cu->curParser->vm, &cu->fn->instrStream);
+    ValueBufferShrinkToFit(cu->curParser->vm, &cu->fn->constants);
+#if DEBUG
+    IntBufferShrinkToFit(cu->curParser->vm, &cu->fn->debug->lineNo);
+#endif
+
     // 下掉本编译单元, 使当前编译单元指向外层编译单元
     cu->curParser->curCompileUnit = cu->enclosingUnit;
     return cu->fn;
@@ -858,7 +893,17 @@ static void emitGetterMethodCall(CompileUnit *cu, Signature *sign, OpCode opCode
 
 // 添加常量并返回其索引
 static uint32_t addConstant(CompileUnit *cu, Value constant) {
+    // 常量(如内层函数)可能尚未被任何根引用, 扩容常量表时要防止其被回收
+    if (VALUE_IS_OBJ(constant)) {
+        pushTmpRoot(cu->curParser->vm, VALUE_TO_OBJ(constant));
+    }
+    gcLockHeap(cu->curParser->vm);
     ValueBufferAdd(cu->curParser->vm, &cu->fn->constants, constant);
+    gcWriteBarrier(cu->curParser->vm, (ObjHeader *) cu->fn, constant);
+    gcUnlockHeap(cu->curParser->vm);
+    if (VALUE_IS_OBJ(constant)) {
+        popTmpRoot(cu->curParser->vm);
+    }
     return cu->fn->constants.count - 1;
 }
 
@@ -977,6 +1022,14 @@ static void compileProgram(CompileUnit *cu) {
 ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode) {
     // 各源码模块文件需要单独的parser
     Parser parser;
+    arenaInit(&parser.arena);
+    // 编译中内存耗尽时释放arena, 再交给外层恢复点; 跳转时curParser已恢复为外层parser
+    MemErrorHandler handler;
+    memErrorPush(vm, &handler);
+    if (setjmp(handler.jump) != 0) {
+        arenaRelease(vm, &parser.arena);
+        memErrorThrow(vm);
+    }
     parser.parent = vm->curParser;
     vm->curParser = &parser;
     if (objModule->name == NULL) {
@@ -998,4 +1051,280 @@ ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode) {
     while (!matchToken(&parser, TOKEN_EOF)) {
         compileProgram(&moduleCU);
     }
+
+    // 模块编译完成,生成return null返回,避免执行下面endCompileUnit中添加的OPCODE_END
+    writeOpCode(&moduleCU, OPCODE_PUSH_NULL);
+    writeOpCode(&moduleCU, OPCODE_RETURN);
+
+    // 检查在函数id.led中预先声明的模块变量是否都有定义
+    uint32_t idx = moduleVarNumBefore;
+    while (idx < objModule->moduleVarValue.count) {
+        if (VALUE_IS_NUM(objModule->moduleVarValue.datas[idx])) {
+            char *str = objModule->moduleVarName.datas[idx].str;
+            ASSERT(str[objModule->moduleVarName.datas[idx].length] == '\0', "module var name is not closed!");
+            uint32_t lineNo = (uint32_t) VALUE_TO_NUM(objModule->moduleVarValue.datas[idx]);
+            COMPILE_ERROR(&parser, "line:%d, variable \"%s\" not defined!", lineNo, str);
+        }
+        idx++;
+    }
+
+#if DEBUG
+    ObjFn *fn = endCompileUnit(&moduleCU, "(script)", 8);
+#else
+    ObjFn *fn = endCompileUnit(&moduleCU);
+#endif
+
+    // endCompileUnit仍可能分配内存, 编译完成后再下掉parser, 使fn在此之前一直可达
+    vm->curParser = vm->curParser->parent;
+    memErrorPop(vm);
+    arenaRelease(vm, &parser.arena);
+    return fn;
+}
+
+/**
+ * 获取ip所指向的操作码的操作数占用的字节数
+ */
+int getBytesOfOperands(Byte *instrStream, Value *constants, int ip) {
+    switch ((OpCode) instrStream[ip]) {
+        case OPCODE_CONSTRUCT:
+        case OPCODE_RETURN:
+        case OPCODE_END:
+        case OPCODE_CLOSE_UPVALUE:
+        case OPCODE_PUSH_NULL:
+        case OPCODE_PUSH_FALSE:
+        case OPCODE_PUSH_TRUE:
+        case OPCODE_POP:
+            return 0;
+
+        case OPCODE_CREATE_CLASS:
+        case OPCODE_LOAD_THIS_FIELD:
+        case OPCODE_STORE_THIS_FIELD:
+        case OPCODE_LOAD_FIELD:
+        case OPCODE_STORE_FIELD:
+        case OPCODE_LOAD_LOCAL_VAR:
+        case OPCODE_STORE_LOCAL_VAR:
+        case OPCODE_LOAD_UPVALUE:
+        case OPCODE_STORE_UPVALUE:
+            return 1;
+
+        case OPCODE_CALL0:
+        case OPCODE_CALL1:
+        case OPCODE_CALL2:
+        case OPCODE_CALL3:
+        case OPCODE_CALL4:
+        case OPCODE_CALL5:
+        case OPCODE_CALL6:
+        case OPCODE_CALL7:
+        case OPCODE_CALL8:
+        case OPCODE_CALL9:
+        case OPCODE_CALL10:
+        case OPCODE_CALL11:
+        case OPCODE_CALL12:
+        case OPCODE_CALL13:
+        case OPCODE_CALL14:
+        case OPCODE_CALL15:
+        case OPCODE_CALL16:
+        case OPCODE_LOAD_CONSTANT:
+        case OPCODE_LOAD_MODULE_VAR:
+        case OPCODE_STORE_MODULE_VAR:
+        case OPCODE_LOOP:
+        case OPCODE_JUMP:
+        case OPCODE_JUMP_IF_FALSE:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_INSTANCE_METHOD:
+        case OPCODE_STATIC_METHOD:
+            return 2;
+
+        case OPCODE_SUPER0:
+        case OPCODE_SUPER1:
+        case OPCODE_SUPER2:
+        case OPCODE_SUPER3:
+        case OPCODE_SUPER4:
+        case OPCODE_SUPER5:
+        case OPCODE_SUPER6:
+        case OPCODE_SUPER7:
+        case OPCODE_SUPER8:
+        case OPCODE_SUPER9:
+        case OPCODE_SUPER10:
+        case OPCODE_SUPER11:
+        case OPCODE_SUPER12:
+        case OPCODE_SUPER13:
+        case OPCODE_SUPER14:
+        case OPCODE_SUPER15:
+        case OPCODE_SUPER16:
+            // OPCODE_SUPERx的操作数是分别由writeOpCodeShortOperand
+            // 和writeShortOperand写入的,共1个操作码和4个字节的操作数
+            return 4;
+
+        case OPCODE_CREATE_CLOSURE: {
+            // CREATE_CLOSURE操作码的前两字节是待创建闭包的函数在常量表中的索引
+            uint32_t fnIdx = (instrStream[ip + 1] << 8) | instrStream[ip + 2];
+            // 每个upvalue占2字节: isEnclosingLocalVar和index
+            return 2 + (VALUE_TO_OBJFN(constants[fnIdx]))->upvalueNum * 2;
+        }
+
+        default:
+            NOT_REACHED();
+    }
+    return 0;
+}
+
+
+/**
+ * 并行编译任务
+ */
+typedef struct {
+    // 工作线程私有的分配上下文, 编译期间创建的对象和方法名都暂存于此
+    VM vm;
+    ObjModule *module;
+    const char *moduleCode;
+    ObjFn *fn;
+} CompileJob;
+
+typedef struct {
+    CompileJob *jobs;
+    uint32_t jobNum;
+    // 下一个待领取的任务
+    uint32_t nextJob;
+} CompileQueue;
+
+// 工作线程: 不断领取任务直到队列为空
+static void *compileWorker(void *arg) {
+    CompileQueue *queue = (CompileQueue *) arg;
+    uint32_t idx;
+    while ((idx = __atomic_fetch_add(&queue->nextJob, 1, __ATOMIC_RELAXED)) < queue->jobNum) {
+        CompileJob *job = &queue->jobs[idx];
+        job->fn = compileModule(&job->vm, job->module, job->moduleCode);
+    }
+    return NULL;
+}
+
+/**
+ * 以relocate的返回值改写指令流中的每个方法符号操作数, 不处理内层函数
+ * constants为指令流所属函数的常量表, 用于计算闭包指令的操作数长度
+ */
+void relocateInstrSymbols(Byte *instrStream, uint32_t count, Value *constants,
+                          SymbolRelocator relocate, void *arg) {
+    uint32_t ip = 0;
+    while (ip < count) {
+        OpCode opCode = (OpCode) instrStream[ip];
+        if ((opCode >= OPCODE_CALL0 && opCode <= OPCODE_SUPER16) ||
+            opCode == OPCODE_INSTANCE_METHOD || opCode == OPCODE_STATIC_METHOD) {
+            int symbolIndex = relocate((instrStream[ip + 1] << 8) | instrStream[ip + 2], arg);
+            instrStream[ip + 1] = (symbolIndex >> 8) & 0xff;
+            instrStream[ip + 2] = symbolIndex & 0xff;
+        }
+        ip += 1 + getBytesOfOperands(instrStream, constants, ip);
+    }
+}
+
+static int mapSymbol(int symbolIndex, void *arg) {
+    return ((const int *) arg)[symbolIndex];
+}
+
+/**
+ * 把fn及其内层函数中的方法符号按symbolMap重定位
+ */
+void relocateMethodSymbols(ObjFn *fn, const int *symbolMap) {
+    relocateInstrSymbols(fn->instrStream.datas, fn->instrStream.count, fn->constants.datas,
+                         mapSymbol, (void *) symbolMap);
+
+    uint32_t idx = 0;
+    while (idx < fn->constants.count) {
+        if (VALUE_IS_CERTAIN_OBJ(fn->constants.datas[idx], OT_FUNCTION)) {
+            relocateMethodSymbols(VALUE_TO_OBJFN(fn->constants.datas[idx]), symbolMap);
+        }
+        idx++;
+    }
+}
+
+// 在主线程中把任务的暂存结果合并到vm
+static void commitCompileJob(VM *vm, CompileJob *job) {
+    SymbolTable *staged = &job->vm.allMethodNames;
+
+    // 按暂存表的顺序登记方法名, 与串行编译时首次出现的顺序一致
+    int *symbolMap = ALLOCATE_ARRAY(vm, int, staged->count);
+    uint32_t idx = 0;
+    while (idx < staged->count) {
+        symbolMap[idx] = ensureSymbolExist(vm, &vm->allMethodNames,
+                                           staged->datas[idx].str, staged->datas[idx].length);
+        idx++;
+    }
+    relocateMethodSymbols(job->fn, symbolMap);
+    DEALLOCATE_ARRAY(vm, symbolMap, staged->count);
+    symbolTableClear(&job->vm, staged);
+
+    // 暂存的对象、新生代和内存统计整体并入vm
+    gcAdoptWorker(vm, &job->vm);
+}
+
+/**
+ * 在多个工作线程中并行编译相互独立的模块
+ * 每个模块在私有的分配上下文(见initWorkerVM)中暂存对象和方法名, 全部完成后在主线程中按模块顺序统一提交,
+ * 因此vm->allMethodNames中的符号索引与串行编译完全一致
+ */
+void compileModulesParallel(VM *vm, uint32_t moduleNum, ObjModule **modules,
+                            const char **moduleCodes, ObjFn **fns) {
+    // 工作线程会修改已有的模块, 不能与并发标记同时进行
+    gcFinishConcurrentMark(vm);
+    CompileJob *jobs = ALLOCATE_ARRAY(vm, CompileJob, moduleNum);
+    uint32_t idx = 0;
+    while (idx < moduleNum) {
+        CompileJob *job = &jobs[idx];
+        initWorkerVM(&job->vm, vm);
+        job->module = modules[idx];
+        job->moduleCode = moduleCodes[idx];
+        job->fn = NULL;
+        idx++;
+    }
+
+    CompileQueue queue = {jobs, moduleNum, 0};
+    long cpuNum = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threadNum = cpuNum > 0 && (uint32_t) cpuNum < moduleNum ? (uint32_t) cpuNum : moduleNum;
+    pthread_t *threads = ALLOCATE_ARRAY(vm, pthread_t, threadNum);
+
+    // 线程创建失败时由已创建的线程和主线程消化剩余任务
+    uint32_t started = 0;
+    while (started < threadNum &&
+           pthread_create(&threads[started], NULL, compileWorker, &queue) == 0) {
+        started++;
+    }
+    compileWorker(&queue);
+    idx = 0;
+    while (idx < started) {
+        pthread_join(threads[idx++], NULL);
+    }
+    DEALLOCATE_ARRAY(vm, threads, threadNum);
+
+    // 唯一的提交点
+    idx = 0;
+    while (idx < moduleNum) {
+        commitCompileJob(vm, &jobs[idx]);
+        fns[idx] = jobs[idx].fn;
+        idx++;
+    }
+    DEALLOCATE_ARRAY(vm, jobs, moduleNum);
+}
+
+/**
+ * 访问编译期间的对象: 各层parser的token值、模块以及编译单元中的函数和类名
+ */
+void visitCompileUnitSlots(VM *vm, SlotVisitor visitor) {
+    Parser *parser = vm->curParser;
+    while (parser != NULL) {
+        visitValue(vm, &parser->curToken.value, visitor);
+        visitValue(vm, &parser->preToken.value, visitor);
+        visitor(vm, (ObjHeader **) &parser->curModule);
+
+        CompileUnit *cu = parser->curCompileUnit;
+        while (cu != NULL) {
+            visitor(vm, (ObjHeader **) &cu->fn);
+            if (cu->enclosingClassBK != NULL) {
+                visitor(vm, (ObjHeader **) &cu->enclosingClassBK->name);
+            }
+            cu = cu->enclosingUnit;
+        }
+        parser = parser->parent;
+    }
 }
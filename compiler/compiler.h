@@ -89,4 +89,19 @@ int defineModuleVar(VM *vm, ObjModule *objModule, const char *name, uint32_t len
 
 ObjFn* compileModule(VM* vm, ObjModule* objModule, const char* moduleCode);
 
+int getBytesOfOperands(Byte *instrStream, Value *constants, int ip);
+
+// 方法符号重定位函数, 返回symbolIndex的新索引
+typedef int (*SymbolRelocator)(int symbolIndex, void *arg);
+
+void relocateInstrSymbols(Byte *instrStream, uint32_t count, Value *constants,
+                          SymbolRelocator relocate, void *arg);
+
+void relocateMethodSymbols(ObjFn *fn, const int *symbolMap);
+
+void compileModulesParallel(VM *vm, uint32_t moduleNum, ObjModule **modules,
+                            const char **moduleCodes, ObjFn **fns);
+
+void visitCompileUnitSlots(VM *vm, SlotVisitor visitor);
+
 #endif
@@ -0,0 +1,2151 @@
+//
+// Created by Kosho on 2020/2/14.
+//
+
+#include "gc.h"
+#include "compiler.h"
+#include "obj_list.h"
+#include "obj_range.h"
+#include "obj_map.h"
+#include "obj_thread.h"
+#include "large_space.h"
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#if DEBUG
+#include <stdio.h>
+#include <time.h>
+#endif
+
+// 新生代对象按8字节对齐
+#define ALIGN_SIZE(size) (((size) + 7) & ~7u)
+// 新生代块连同块头的字节数
+#define NURSERY_CHUNK_BYTES (sizeof(NurseryChunk) + NURSERY_CHUNK_SIZE)
+// 增量回收每处理这么多对象检查一次时间预算
+#define GC_CHECK_INTERVAL 128
+// 并发标记线程每次持锁处理的对象数
+#define MARK_BATCH_NUM 256
+// 并行回收的最大线程数
+#define MAX_GC_THREADS 64
+// 并行标记时每次最多窃取的对象数
+#define STEAL_BATCH_NUM 32
+
+/**
+ * 在新生代中按指针碰撞分配size字节, 当前块用尽时追加新块
+ * 分配量达到阈值时先进行新生代回收, 存活的新生代对象因此会移动, 死亡对象的内存被复用:
+ * 调用者跨越新生代分配持有的新生代对象须放入tmpRoots, 并在分配后从tmpRoots重新读取,
+ * 也不能把新生代对象内部的数据(如字符串内容)作为新对象的初始数据传入
+ * 过大的对象直接在老年代分配
+ */
+void *allocateYoung(VM *vm, uint32_t size) {
+    // 大对象晋升时要复制, 即使阈值调得很小也不放入新生代
+    if (size > NURSERY_MAX_OBJ_SIZE || size >= vm->config.largeObjectSize) {
+        return memManager(vm, NULL, 0, size);
+    }
+    size = ALIGN_SIZE(size);
+
+    Nursery *nursery = &vm->nursery;
+    NurseryChunk *chunk = nursery->cur;
+    bool needChunk = chunk == NULL || chunk->top + size > chunk->end;
+    uint64_t limit = vm->config.maxHeapSize;
+    // 新块会超出堆上限时也先回收新生代, 全堆回收不释放新生代, 回收后可复用腾出的块
+    if (vm->gcPauseNum == 0 && (nursery->usedBytes >= vm->config.nurserySize ||
+                                (needChunk && limit != 0 && vm->allocatedBytes + NURSERY_CHUNK_BYTES > limit))) {
+        // 晋升会改写标记线程正在读取的引用, 先结束并发标记
+        gcFinishConcurrentMark(vm);
+        minorGC(vm);
+        chunk = nursery->cur;
+    }
+    if (chunk == NULL || chunk->top + size > chunk->end) {
+        // 块和其他堆内存一样计入allocatedBytes并受堆上限约束, 超出时由memManager回收或报内存耗尽
+        chunk = (NurseryChunk *) memManager(vm, NULL, 0, NURSERY_CHUNK_BYTES);
+        chunk->top = chunk->data;
+        chunk->end = chunk->data + NURSERY_CHUNK_SIZE;
+        chunk->next = nursery->cur;
+        nursery->cur = chunk;
+    }
+
+    void *ptr = chunk->top;
+    chunk->top += size;
+    nursery->usedBytes += size;
+    return ptr;
+}
+
+/**
+ * obj是否为刚在新生代分配的对象
+ * 只在initObjHeader中调用, 此时刚分配的新生代对象必定位于当前块
+ */
+bool isFreshYoung(VM *vm, ObjHeader *obj) {
+    NurseryChunk *chunk = vm->nursery.cur;
+    return chunk != NULL && (char *) obj >= chunk->data && (char *) obj < chunk->top;
+}
+
+// 对象本身占用的字节数, 不含其指向的缓冲区
+static uint32_t objectSize(ObjHeader *obj) {
+    switch (OBJ_TYPE(obj)) {
+        case OT_CLASS:
+            return sizeof(Class);
+        case OT_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * ((ObjClosure *) obj)->fn->upvalueNum;
+        case OT_THREAD:
+            return sizeof(ObjThread);
+        case OT_FUNCTION:
+            return sizeof(ObjFn);
+        case OT_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * OBJ_CLASS(obj)->fieldNum;
+        case OT_LIST:
+            return sizeof(ObjList);
+        case OT_MAP:
+            return sizeof(ObjMap);
+        case OT_MODULE:
+            return sizeof(ObjModule);
+        case OT_RANGE:
+            return sizeof(ObjRange);
+        case OT_STRING:
+            return sizeof(ObjString) + ((ObjString *) obj)->value.length + 1;
+        case OT_UPVALUE:
+            return sizeof(ObjUpvalue);
+    }
+    NOT_REACHED();
+    return 0;
+}
+
+// 对象所拥有的缓冲区占用的字节数
+static uint32_t bufferSize(ObjHeader *obj) {
+    switch (OBJ_TYPE(obj)) {
+        case OT_CLASS:
+            return sizeof(Method) * ((Class *) obj)->methods.capacity;
+        case OT_THREAD: {
+            ObjThread *objThread = (ObjThread *) obj;
+            return sizeof(Frame) * objThread->frameCapacity + sizeof(Value) * objThread->stackCapacity;
+        }
+        case OT_FUNCTION: {
+            ObjFn *objFn = (ObjFn *) obj;
+            uint32_t size = sizeof(Byte) * objFn->instrStream.capacity +
+                            sizeof(Value) * objFn->constants.capacity;
+#if DEBUG
+            size += sizeof(FnDebug) + sizeof(int) * objFn->debug->lineNo.capacity;
+#endif
+            return size;
+        }
+        case OT_LIST:
+            return sizeof(Value) * ((ObjList *) obj)->elements.capacity;
+        case OT_MAP:
+            return sizeof(Entry) * ((ObjMap *) obj)->capacity;
+        case OT_MODULE: {
+            ObjModule *objModule = (ObjModule *) obj;
+            return sizeof(Value) * objModule->moduleVarValue.capacity +
+                   sizeof(String) * objModule->moduleVarName.capacity;
+        }
+        default:
+            return 0;
+    }
+}
+
+/**
+ * 以visitor访问value中的对象引用
+ */
+void visitValue(VM *vm, Value *value, SlotVisitor visitor) {
+    if (VALUE_IS_OBJ(*value)) {
+#ifdef NAN_BOXING
+        // 对象指针编码在value中, 先取出再访问, 只在对象被移动时写回,
+        // 否则并发标记线程的写回可能覆盖mutator同时写入的新值
+        ObjHeader *obj = VALUE_TO_OBJ(*value);
+        visitor(vm, &obj);
+        if (obj != VALUE_TO_OBJ(*value)) {
+            *value = OBJ_TO_VALUE(obj);
+        }
+#else
+        visitor(vm, &value->objHeader);
+#endif
+    }
+}
+
+// 访问buffer中所有value
+static void visitBuffer(VM *vm, ValueBuffer *buffer, SlotVisitor visitor) {
+    uint32_t idx = 0;
+    while (idx < buffer->count) {
+        visitValue(vm, &buffer->datas[idx++], visitor);
+    }
+}
+
+/**
+ * 以visitor访问obj中的每个对象引用槽, 包括对象头中的class
+ */
+void visitObjectSlots(VM *vm, ObjHeader *obj, SlotVisitor visitor) {
+    // class指针与其它位同在对象头首字中, 先取出再访问, 只在类被移动时写回
+    ObjHeader *class = (ObjHeader *) OBJ_CLASS(obj);
+    visitor(vm, &class);
+    if ((Class *) class != OBJ_CLASS(obj)) {
+        objSetClass(obj, (Class *) class);
+    }
+
+    uint32_t idx = 0;
+    switch (OBJ_TYPE(obj)) {
+        case OT_CLASS: {
+            Class *class = (Class *) obj;
+            visitor(vm, (ObjHeader **) &class->superClass);
+            // 脚本方法引用了闭包
+            while (idx < class->methods.count) {
+                if (class->methods.datas[idx].type == MT_SCRIPT) {
+                    visitor(vm, (ObjHeader **) &class->methods.datas[idx].obj);
+                }
+                idx++;
+            }
+            visitor(vm, (ObjHeader **) &class->name);
+            break;
+        }
+        case OT_CLOSURE: {
+            ObjClosure *objClosure = (ObjClosure *) obj;
+            visitor(vm, (ObjHeader **) &objClosure->fn);
+            while (idx < objClosure->fn->upvalueNum) {
+                visitor(vm, (ObjHeader **) &objClosure->upvalues[idx++]);
+            }
+            break;
+        }
+        case OT_THREAD: {
+            ObjThread *objThread = (ObjThread *) obj;
+            // 各frame中正在执行的闭包
+            while (idx < objThread->usedFrameNum) {
+                visitor(vm, (ObjHeader **) &objThread->frames[idx++].closure);
+            }
+            // 运行时栈中已使用的部分
+            Value *slot = objThread->stack;
+            while (slot < objThread->esp) {
+                visitValue(vm, slot++, visitor);
+            }
+            // 其余的open upvalue经由各upvalue的next访问
+            visitor(vm, (ObjHeader **) &objThread->openUpvalues);
+            visitor(vm, (ObjHeader **) &objThread->caller);
+            visitValue(vm, &objThread->errorObj, visitor);
+            break;
+        }
+        case OT_FUNCTION: {
+            ObjFn *objFn = (ObjFn *) obj;
+            visitBuffer(vm, &objFn->constants, visitor);
+            visitor(vm, (ObjHeader **) &objFn->module);
+            break;
+        }
+        case OT_INSTANCE: {
+            ObjInstance *objInstance = (ObjInstance *) obj;
+            uint32_t fieldNum = OBJ_CLASS(&objInstance->objHeader)->fieldNum;
+            while (idx < fieldNum) {
+                visitValue(vm, &objInstance->fields[idx++], visitor);
+            }
+            break;
+        }
+        case OT_LIST:
+            visitBuffer(vm, &((ObjList *) obj)->elements, visitor);
+            break;
+        case OT_MAP: {
+            ObjMap *objMap = (ObjMap *) obj;
+            while (idx < objMap->capacity) {
+                Entry *entry = &objMap->entries[idx++];
+                // 空槽的key为undefined, 不必处理
+                if (!VALUE_IS_UNDEFINED(entry->key)) {
+                    visitValue(vm, &entry->key, visitor);
+                    visitValue(vm, &entry->value, visitor);
+                }
+            }
+            break;
+        }
+        case OT_MODULE: {
+            ObjModule *objModule = (ObjModule *) obj;
+            visitBuffer(vm, &objModule->moduleVarValue, visitor);
+            visitor(vm, (ObjHeader **) &objModule->name);
+            break;
+        }
+        case OT_UPVALUE: {
+            // 未关闭的upvalue指向的局部变量随线程的栈访问
+            ObjUpvalue *objUpvalue = (ObjUpvalue *) obj;
+            visitValue(vm, &objUpvalue->closedUpvalue, visitor);
+            visitor(vm, (ObjHeader **) &objUpvalue->next);
+            break;
+        }
+        case OT_RANGE:
+        case OT_STRING:
+            break;
+    }
+}
+
+/**
+ * 以visitor访问所有根: 模块、临时根、线程调度队列、定时器、编译中的函数及预先分配的错误信息
+ * 核心类都是核心模块的模块变量, 随allModules访问
+ */
+void visitRootSlots(VM *vm, SlotVisitor visitor) {
+    visitor(vm, (ObjHeader **) &vm->allModules);
+
+    uint32_t idx = 0;
+    while (idx < vm->tmpRootNum) {
+        visitor(vm, &vm->tmpRoots[idx++]);
+    }
+
+    visitor(vm, (ObjHeader **) &vm->curThread);
+    visitor(vm, (ObjHeader **) &vm->memErrorMsg);
+
+    // 冻结区不参与标记: 被修改过的冻结对象和正在运行的冻结线程, 其槽视为根
+    idx = 0;
+    while (idx < vm->frozenDirty.count) {
+        visitObjectSlots(vm, vm->frozenDirty.objects[idx++], visitor);
+    }
+    if (vm->curThread != NULL && isFrozenObject(vm, (ObjHeader *) vm->curThread) &&
+        !OBJ_IS_DARK(&vm->curThread->objHeader)) {
+        visitObjectSlots(vm, (ObjHeader *) vm->curThread, visitor);
+    }
+
+    // 挂起等待io的线程和可运行队列中的线程
+    EventLoop *loop = &vm->eventLoop;
+    idx = 0;
+    while (idx < loop->waiters.count) {
+        if (loop->waiters.datas[idx] != NULL) {
+            visitor(vm, (ObjHeader **) &loop->waiters.datas[idx]);
+        }
+        idx++;
+    }
+    idx = loop->readyHead;
+    while (idx < loop->ready.count) {
+        visitor(vm, (ObjHeader **) &loop->ready.datas[idx++]);
+    }
+
+    // 定时器到期时要执行的闭包
+    TimerWheel *wheel = &vm->timerWheel;
+    idx = 0;
+    while (idx < wheel->handles.count) {
+        if (wheel->handles.datas[idx] != NULL) {
+            visitor(vm, (ObjHeader **) &wheel->handles.datas[idx]->fn);
+        }
+        idx++;
+    }
+
+    // 正在编译的函数
+    if (vm->curParser != NULL) {
+        visitCompileUnitSlots(vm, visitor);
+    }
+}
+
+// 压入对象栈gray
+static void pushObject(Gray *gray, ObjHeader *obj) {
+    if (gray->count >= gray->capacity) {
+        gray->capacity = gray->capacity == 0 ? 32 : gray->capacity * 2;
+        // 对象栈不计入allocatedBytes, 直接用realloc以免在gc中再触发gc
+        gray->grayObjects = (ObjHeader **) realloc(gray->grayObjects, gray->capacity * sizeof(ObjHeader *));
+        if (gray->grayObjects == NULL) {
+            MEM_ERROR("reallocate gray stack failed!");
+        }
+    }
+    gray->grayObjects[gray->count++] = obj;
+}
+
+// 压入灰色栈
+static void pushGray(VM *vm, ObjHeader *obj) {
+    pushObject(&vm->grays, obj);
+}
+
+/**
+ * 标记obj为可达并放入灰色栈, 其引用的对象稍后在blacken中处理
+ */
+void grayObject(VM *vm, ObjHeader *obj) {
+    // 已标记的对象不再处理, 这也避免了循环引用导致的死循环; 冻结区对象总是存活
+    if (obj == NULL || OBJ_IS_DARK(obj) || isFrozenObject(vm, obj)) {
+        return;
+    }
+    // 增量和并发标记不追踪新生代对象, 它们在重新标记时整体视为根
+    if (OBJ_IS_YOUNG(obj) && (vm->gcPhase == GC_MARKING || vm->gcPhase == GC_CONCURRENT_MARKING)) {
+        return;
+    }
+    OBJ_SET_FLAG(obj, OBJ_DARK);
+    pushGray(vm, obj);
+}
+
+/**
+ * 标记value, 只有对象需要处理
+ */
+void grayValue(VM *vm, Value value) {
+    if (!VALUE_IS_OBJ(value)) {
+        return;
+    }
+    grayObject(vm, VALUE_TO_OBJ(value));
+}
+
+// 标记槽中的对象
+static void graySlot(VM *vm, ObjHeader **slot) {
+    grayObject(vm, *slot);
+}
+
+// 是否已超出截止时刻, deadline为0表示不限时
+static bool overDeadline(uint64_t deadline, uint32_t *counter) {
+    if (deadline == 0 || ++*counter < GC_CHECK_INTERVAL) {
+        return false;
+    }
+    *counter = 0;
+    return monotonicNs() >= deadline;
+}
+
+// 存活的obj经memManager分配的字节数
+static uint32_t liveSize(ObjHeader *obj) {
+    // 新生代对象本身按整块计入allocatedBytes, 这里只累计其经memManager分配的缓冲区
+    if (OBJ_IS_YOUNG(obj)) {
+        return bufferSize(obj);
+    }
+    return objectSize(obj) + bufferSize(obj);
+}
+
+// 去重表扩容到newCapacity, 内存不足时放弃本次去重
+static bool growDedupTable(StringDedup *dedup, uint32_t newCapacity) {
+    ObjString **strings = (ObjString **) calloc(newCapacity, sizeof(ObjString *));
+    if (strings == NULL) {
+        return false;
+    }
+    uint32_t idx = 0;
+    while (idx < dedup->capacity) {
+        ObjString *string = dedup->strings[idx++];
+        if (string != NULL) {
+            uint32_t slot = string->hashCode % newCapacity;
+            while (strings[slot] != NULL) {
+                slot = (slot + 1) % newCapacity;
+            }
+            strings[slot] = string;
+        }
+    }
+    free(dedup->strings);
+    dedup->strings = strings;
+    dedup->capacity = newCapacity;
+    return true;
+}
+
+// 返回与string内容相同的规范字符串, 还没有时把string登记为规范字符串; 返回NULL表示去重已中止
+static ObjString *canonicalString(StringDedup *dedup, ObjString *string) {
+    if ((dedup->count + 1) * 2 > dedup->capacity &&
+        !growDedupTable(dedup, dedup->capacity == 0 ? 1024 : dedup->capacity * 2)) {
+        return NULL;
+    }
+    uint32_t slot = string->hashCode % dedup->capacity;
+    ObjString *found;
+    while ((found = dedup->strings[slot]) != NULL) {
+        if (found == string || (found->hashCode == string->hashCode &&
+                                found->value.length == string->value.length &&
+                                memcmp(found->value.start, string->value.start, string->value.length) == 0)) {
+            return found;
+        }
+        slot = (slot + 1) % dedup->capacity;
+    }
+    dedup->strings[slot] = string;
+    dedup->count++;
+    return string;
+}
+
+// 标记槽中的对象, 槽中的字符串已有内容相同的规范字符串时先改为指向规范字符串
+// 新生代字符串不参与, 以免老年代对象引用新生代对象; 冻结或被固定的字符串不会被释放, 只能做规范字符串
+static void dedupSlot(VM *vm, ObjHeader **slot) {
+    ObjHeader *obj = *slot;
+    StringDedup *dedup = &vm->dedup;
+    if (dedup->active && obj != NULL && OBJ_TYPE(obj) == OT_STRING && !OBJ_IS_YOUNG(obj)) {
+        ObjString *canonical = overDeadline(dedup->deadline, &dedup->counter) ? NULL :
+                               canonicalString(dedup, (ObjString *) obj);
+        if (canonical == NULL) {
+            dedup->active = false;
+        } else if ((ObjHeader *) canonical != obj && OBJ_PIN_NUM(obj) == 0 && !isFrozenObject(vm, obj)) {
+            *slot = (ObjHeader *) canonical;
+            if (!OBJ_TEST_AND_SET_FLAG(obj, OBJ_DEDUPED)) {
+                pushObject(&dedup->redirected, obj);
+            }
+        }
+    }
+    grayObject(vm, *slot);
+}
+
+// 标记obj引用的对象, 存活数据量累计到vm->liveBytes
+static void blackenObject(VM *vm, ObjHeader *obj) {
+    vm->liveBytes += liveSize(obj);
+    visitObjectSlots(vm, obj, vm->dedup.active ? dedupSlot : graySlot);
+}
+
+// 去重的标记结束, 统计被改向后不再存活的副本, 它们随后被清除
+static void finishDedup(VM *vm) {
+    StringDedup *dedup = &vm->dedup;
+    Gray *redirected = &dedup->redirected;
+    while (redirected->count > 0) {
+        ObjHeader *obj = redirected->grayObjects[--redirected->count];
+        OBJ_CLEAR_FLAG(obj, OBJ_DEDUPED);
+        if (!OBJ_IS_DARK(obj)) {
+            vm->gcStats.dedupNum++;
+            vm->gcStats.dedupBytes += objectSize(obj);
+        }
+    }
+    free(redirected->grayObjects);
+    redirected->grayObjects = NULL;
+    redirected->capacity = 0;
+    free(dedup->strings);
+    dedup->strings = NULL;
+    dedup->capacity = dedup->count = 0;
+    dedup->active = false;
+}
+
+// 处理灰色栈, 灰色栈清空时返回true, 超出时间预算时返回false
+static bool blackenObjectInGray(VM *vm, uint64_t deadline) {
+    uint32_t counter = 0;
+    while (vm->grays.count > 0) {
+        if (overDeadline(deadline, &counter)) {
+            return false;
+        }
+        blackenObject(vm, vm->grays.grayObjects[--vm->grays.count]);
+    }
+    return true;
+}
+
+/**
+ * 把老年代对象obj加入记忆集, 新生代回收时将其视为根
+ */
+void gcRememberObject(VM *vm, ObjHeader *obj) {
+    if (OBJ_IS_YOUNG(obj) || OBJ_IS_REMEMBERED(obj)) {
+        return;
+    }
+    OBJ_SET_FLAG(obj, OBJ_REMEMBERED);
+
+    RememberedSet *set = &vm->remembered;
+    if (set->count >= set->capacity) {
+        set->capacity = set->capacity == 0 ? 64 : set->capacity * 2;
+        set->objects = (ObjHeader **) realloc(set->objects, set->capacity * sizeof(ObjHeader *));
+        if (set->objects == NULL) {
+            MEM_ERROR("reallocate remembered set failed!");
+        }
+    }
+    set->objects[set->count++] = obj;
+}
+
+// 冻结区中的对象被修改后可能引用冻结区外的对象, 把它加入frozenDirty, 其槽此后视为根
+// 冻结区对象不参与标记, 借用OBJ_DARK表示已在frozenDirty中
+static void markFrozenDirty(VM *vm, ObjHeader *obj) {
+    if (OBJ_IS_DARK(obj)) {
+        return;
+    }
+    OBJ_SET_FLAG(obj, OBJ_DARK);
+
+    RememberedSet *set = &vm->frozenDirty;
+    if (set->count >= set->capacity) {
+        set->capacity = set->capacity == 0 ? 64 : set->capacity * 2;
+        set->objects = (ObjHeader **) realloc(set->objects, set->capacity * sizeof(ObjHeader *));
+        if (set->objects == NULL) {
+            MEM_ERROR("reallocate frozen dirty set failed!");
+        }
+    }
+    set->objects[set->count++] = obj;
+}
+
+/**
+ * 写屏障: 向owner中存入value后调用
+ * 老年代对象引用了新生代对象时记入记忆集
+ */
+void gcWriteBarrier(VM *vm, ObjHeader *owner, Value value) {
+    if (!VALUE_IS_OBJ(value)) {
+        return;
+    }
+    // 永生区可能只读, 标记frozenDirty也要写对象头
+    ASSERT(!isImmortalObject(vm, owner), "immortal object can't be modified!");
+    ObjHeader *obj = VALUE_TO_OBJ(value);
+    if (OBJ_IS_YOUNG(obj) && !OBJ_IS_YOUNG(owner)) {
+        gcRememberObject(vm, owner);
+    }
+    if (isFrozenObject(vm, owner) && !isFrozenObject(vm, obj)) {
+        markFrozenDirty(vm, owner);
+    }
+    // 增量标记期间已标记的对象引用了新对象, 把新对象置灰, 保证黑色对象不指向白色对象
+    if (vm->gcPhase == GC_MARKING && OBJ_IS_DARK(owner)) {
+        grayObject(vm, obj);
+    }
+}
+
+/**
+ * SATB写屏障: 覆盖或删除对象中的引用之前以旧值调用, 须位于gcLockHeap和gcUnlockHeap之间
+ * 并发标记期间把旧值置灰, 保证标记开始时的快照中可达的对象都被标记
+ */
+void gcPreWriteBarrier(VM *vm, Value oldValue) {
+    if (vm->gcPhase == GC_CONCURRENT_MARKING && VALUE_IS_OBJ(oldValue)) {
+        grayObject(vm, VALUE_TO_OBJ(oldValue));
+    }
+}
+
+/**
+ * 修改标记线程可能读取的对象(map、list、模块变量、常量表、方法表)之前调用
+ * 并发标记期间持有markLock, 其间暂停gc, 可嵌套
+ */
+void gcLockHeap(VM *vm) {
+    vm->gcPauseNum++;
+    if (vm->heapLockDepth++ == 0 && vm->gcPhase == GC_CONCURRENT_MARKING) {
+        pthread_mutex_lock(&vm->markLock);
+        vm->heapLocked = true;
+    }
+}
+
+/**
+ * 与gcLockHeap配对
+ */
+void gcUnlockHeap(VM *vm) {
+    if (--vm->heapLockDepth == 0 && vm->heapLocked) {
+        vm->heapLocked = false;
+        pthread_mutex_unlock(&vm->markLock);
+    }
+    vm->gcPauseNum--;
+}
+
+/**
+ * 线程离开运行状态时调用
+ * 运行时栈的写入不经写屏障, 因此要把线程记入记忆集, 增量标记期间还要重新扫描它
+ * 并发标记期间它可能是从堆中唤醒的, 其栈未在标记开始时扫描, 要在运行之前扫描
+ */
+void gcThreadYield(VM *vm, ObjThread *objThread) {
+    gcRememberObject(vm, (ObjHeader *) objThread);
+    if (isFrozenObject(vm, (ObjHeader *) objThread)) {
+        markFrozenDirty(vm, (ObjHeader *) objThread);
+    }
+    if (vm->gcPhase == GC_MARKING && OBJ_IS_DARK(&objThread->objHeader)) {
+        visitObjectSlots(vm, (ObjHeader *) objThread, graySlot);
+    } else if (vm->gcPhase == GC_CONCURRENT_MARKING) {
+        gcLockHeap(vm);
+        visitObjectSlots(vm, (ObjHeader *) objThread, graySlot);
+        gcUnlockHeap(vm);
+    }
+}
+
+/**
+ * 把initWorkerVM建立的分配上下文worker并入vm并释放worker自己的资源:
+ * 新建的对象、新生代对象和块、记忆集、被修改的冻结对象、slab空闲链表以及内存统计
+ * 方法名表由调用者先行处理; 只在主线程中, 所有工作线程结束之后调用
+ */
+void gcAdoptWorker(VM *vm, VM *worker) {
+    ObjHeader *tail = worker->allObjects;
+    if (tail != NULL) {
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        tail->next = vm->allObjects;
+        vm->allObjects = worker->allObjects;
+    }
+
+    tail = worker->youngObjects;
+    if (tail != NULL) {
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        tail->next = vm->youngObjects;
+        vm->youngObjects = worker->youngObjects;
+    }
+
+    // 接在当前块之后, 当前分配块保持不变
+    NurseryChunk *chunk = worker->nursery.cur;
+    if (chunk != NULL) {
+        if (vm->nursery.cur == NULL) {
+            vm->nursery.cur = chunk;
+        } else {
+            NurseryChunk *last = chunk;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = vm->nursery.cur->next;
+            vm->nursery.cur->next = chunk;
+        }
+    }
+    vm->nursery.usedBytes += worker->nursery.usedBytes;
+
+    uint32_t idx = 0;
+    while (idx < worker->remembered.count) {
+        ObjHeader *obj = worker->remembered.objects[idx++];
+        OBJ_CLEAR_FLAG(obj, OBJ_REMEMBERED);
+        gcRememberObject(vm, obj);
+    }
+    free(worker->remembered.objects);
+
+    idx = 0;
+    while (idx < worker->frozenDirty.count) {
+        ObjHeader *obj = worker->frozenDirty.objects[idx++];
+        OBJ_CLEAR_FLAG(obj, OBJ_DARK);
+        markFrozenDirty(vm, obj);
+    }
+    free(worker->frozenDirty.objects);
+
+    vm->allocatedBytes += worker->allocatedBytes;
+    if (vm->allocatedBytes > vm->peakBytes) {
+        vm->peakBytes = vm->allocatedBytes;
+    }
+    slabAdopt(vm, worker);
+
+    free(worker->grays.grayObjects);
+    pthread_mutex_destroy(&worker->markLock);
+}
+
+// 释放obj所拥有的缓冲区
+static void freeObjectBuffers(VM *vm, ObjHeader *obj) {
+    switch (OBJ_TYPE(obj)) {
+        case OT_CLASS:
+            MethodBufferClear(vm, &((Class *) obj)->methods);
+            break;
+        case OT_THREAD: {
+            ObjThread *objThread = (ObjThread *) obj;
+            DEALLOCATE_ARRAY(vm, objThread->frames, objThread->frameCapacity);
+            DEALLOCATE_ARRAY(vm, objThread->stack, objThread->stackCapacity);
+            break;
+        }
+        case OT_FUNCTION: {
+            ObjFn *objFn = (ObjFn *) obj;
+            ValueBufferClear(vm, &objFn->constants);
+            ByteBufferClear(vm, &objFn->instrStream);
+#if DEBUG
+            IntBufferClear(vm, &objFn->debug->lineNo);
+            DEALLOCATE(vm, objFn->debug->fnName);
+            DEALLOCATE(vm, objFn->debug);
+#endif
+            break;
+        }
+        case OT_LIST:
+            ValueBufferClear(vm, &((ObjList *) obj)->elements);
+            break;
+        case OT_MAP:
+            DEALLOCATE_ARRAY(vm, ((ObjMap *) obj)->entries, ((ObjMap *) obj)->capacity);
+            break;
+        case OT_MODULE: {
+            ObjModule *objModule = (ObjModule *) obj;
+            symbolTableClear(vm, &objModule->moduleVarName);
+            ValueBufferClear(vm, &objModule->moduleVarValue);
+            break;
+        }
+        case OT_STRING:
+        case OT_RANGE:
+        case OT_CLOSURE:
+        case OT_INSTANCE:
+        case OT_UPVALUE:
+            break;
+    }
+}
+
+/**
+ * 释放老年代对象obj自身及其占用的内存
+ */
+void freeObject(VM *vm, ObjHeader *obj) {
+    ASSERT(!OBJ_IS_YOUNG(obj), "young object is freed with its nursery chunk!");
+    freeObjectBuffers(vm, obj);
+    // 最后再释放自己
+    DEALLOCATE(vm, obj);
+}
+
+// 剔除记忆集中未标记的对象, 它们即将被释放
+static void purgeRememberedSet(VM *vm) {
+    RememberedSet *set = &vm->remembered;
+    uint32_t kept = 0;
+    uint32_t idx = 0;
+    while (idx < set->count) {
+        if (OBJ_IS_DARK(set->objects[idx])) {
+            set->objects[kept++] = set->objects[idx];
+        } else {
+            OBJ_CLEAR_FLAG(set->objects[idx], OBJ_REMEMBERED);
+        }
+        idx++;
+    }
+    set->count = kept;
+}
+
+// 标记结束, 转入清除阶段: 待清除的对象移到sweepList, 存活者在清除时再挂回allObjects
+static void finishMarking(VM *vm) {
+    purgeRememberedSet(vm);
+
+    vm->sweepList = vm->allObjects;
+    vm->allObjects = NULL;
+    vm->gcPhase = GC_SWEEPING;
+}
+
+// 清除sweepList, 全部清除完成时返回true, 超出时间预算时返回false
+// 清除期间新分配的对象在allObjects中, 不受影响
+static bool sweepObjects(VM *vm, uint64_t deadline) {
+    uint32_t counter = 0;
+    while (vm->sweepList != NULL) {
+        if (overDeadline(deadline, &counter)) {
+            return false;
+        }
+        ObjHeader *obj = vm->sweepList;
+        vm->sweepList = obj->next;
+        if (!OBJ_IS_DARK(obj)) {
+            freeObject(vm, obj);
+        } else {
+            // 为下次gc清除标记
+            OBJ_CLEAR_FLAG(obj, OBJ_DARK);
+            obj->next = vm->allObjects;
+            vm->allObjects = obj;
+        }
+    }
+    return true;
+}
+
+// 清除结束, 按存活数据量设置下次gc的阈值
+// 当前占用还含有符号表、定时器等非对象的内存, 因此阈值为当前占用再加上存活数据量按生长因子的增量
+static void finishSweeping(VM *vm) {
+    vm->gcPhase = GC_IDLE;
+    float growth = vm->config.heapGrowthFactor > 1 ? vm->config.heapGrowthFactor - 1 : 0;
+    vm->config.nextGC = vm->allocatedBytes + (uint64_t) (vm->liveBytes * growth);
+    if (vm->config.nextGC < vm->config.minHeapSize) {
+        vm->config.nextGC = vm->config.minHeapSize;
+    }
+}
+
+/**
+ * 重新标记: 增量标记的最后一步, 在一次停顿中完成
+ * 根、正在运行的线程和新生代对象的修改都不经写屏障, 在此重新扫描;
+ * 标记期间新分配的老年代对象一律视为存活
+ */
+static void remark(VM *vm) {
+    visitRootSlots(vm, graySlot);
+    if (vm->curThread != NULL) {
+        visitObjectSlots(vm, (ObjHeader *) vm->curThread, graySlot);
+    }
+
+    ObjHeader *obj = vm->allObjects;
+    while (obj != vm->markBoundary) {
+        grayObject(vm, obj);
+        obj = obj->next;
+    }
+
+    obj = vm->youngObjects;
+    while (obj != NULL) {
+        vm->liveBytes += bufferSize(obj);
+        visitObjectSlots(vm, obj, graySlot);
+        obj = obj->next;
+    }
+
+    blackenObjectInGray(vm, 0);
+}
+
+// 并发标记线程: 分批处理灰色栈, 每批之间释放markLock让mutator修改堆
+// 线程的栈随mutator运行而变化, 遇到线程时只记下来, 留到重新标记时扫描
+static void *markThreadMain(void *arg) {
+    VM *vm = (VM *) arg;
+    bool done = false;
+    while (!done) {
+        pthread_mutex_lock(&vm->markLock);
+        uint32_t num = 0;
+        while (vm->grays.count > 0 && num++ < MARK_BATCH_NUM) {
+            ObjHeader *obj = vm->grays.grayObjects[--vm->grays.count];
+            if (OBJ_TYPE(obj) == OT_THREAD) {
+                pushObject(&vm->deferredThreads, obj);
+            } else {
+                blackenObject(vm, obj);
+            }
+        }
+        done = vm->grays.count == 0;
+        pthread_mutex_unlock(&vm->markLock);
+    }
+    __atomic_store_n(&vm->markDone, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * 开始并发标记: 在停顿中标记根并扫描可运行线程的栈, 其余的标记交给后台线程
+ * 此后新分配的老年代对象直接标记为黑色, 对象的修改由SATB写屏障记录
+ */
+static void startConcurrentMark(VM *vm) {
+    vm->liveBytes = 0;
+    vm->markBoundary = vm->allObjects;
+    vm->gcPhase = GC_CONCURRENT_MARKING;
+    visitRootSlots(vm, graySlot);
+
+    // 栈的写入不经写屏障, SATB要求快照时刻的栈已扫描, 包括经caller到达的线程
+    uint32_t idx = 0;
+    while (idx < vm->grays.count) {
+        ObjHeader *obj = vm->grays.grayObjects[idx++];
+        if (OBJ_TYPE(obj) == OT_THREAD) {
+            visitObjectSlots(vm, obj, graySlot);
+        }
+    }
+
+    vm->markDone = false;
+    vm->markThreadRunning = pthread_create(&vm->markThread, NULL, markThreadMain, vm) == 0;
+    if (!vm->markThreadRunning) {
+        // 无法创建线程时就地完成标记
+        markThreadMain(vm);
+    }
+}
+
+/**
+ * 结束并发标记: 等待标记线程退出, 然后在停顿中重新标记并转入清除阶段
+ * 新生代回收和并行编译会移动或修改标记线程正在读取的对象, 在此之前要先调用本函数
+ */
+void gcFinishConcurrentMark(VM *vm) {
+    if (vm->gcPhase != GC_CONCURRENT_MARKING) {
+        return;
+    }
+    if (vm->markThreadRunning) {
+        pthread_join(vm->markThread, NULL);
+        vm->markThreadRunning = false;
+    }
+
+    // 标记期间新分配的老年代对象已是黑色, 只需统计其大小
+    ObjHeader *obj = vm->allObjects;
+    while (obj != vm->markBoundary) {
+        vm->liveBytes += objectSize(obj) + bufferSize(obj);
+        obj = obj->next;
+    }
+
+    // 被推迟的线程的栈和open upvalue, 正在运行的线程和根由remark处理
+    while (vm->deferredThreads.count > 0) {
+        visitObjectSlots(vm, vm->deferredThreads.grayObjects[--vm->deferredThreads.count], graySlot);
+    }
+    remark(vm);
+    finishMarking(vm);
+}
+
+// 推进增量回收周期直到deadline, deadline为0时运行到周期结束
+static void runCycle(VM *vm, uint64_t deadline) {
+    if (vm->gcPhase == GC_CONCURRENT_MARKING) {
+        gcFinishConcurrentMark(vm);
+    }
+    if (vm->gcPhase == GC_MARKING) {
+        if (!blackenObjectInGray(vm, deadline)) {
+            return;
+        }
+        remark(vm);
+        finishMarking(vm);
+    }
+    if (vm->gcPhase == GC_SWEEPING) {
+        if (!sweepObjects(vm, deadline)) {
+            return;
+        }
+        finishSweeping(vm);
+    }
+}
+
+/**
+ * 增量回收的一步, 耗时以config.pauseBudgetUs为限
+ * 空闲时开启新周期: 此时只标记根, 其余工作分摊到后续各步
+ */
+void gcStep(VM *vm) {
+    uint64_t deadline = monotonicNs() + (uint64_t) vm->config.pauseBudgetUs * 1000;
+    if (vm->gcPhase == GC_IDLE) {
+        vm->liveBytes = 0;
+        vm->markBoundary = vm->allObjects;
+        vm->gcPhase = GC_MARKING;
+        visitRootSlots(vm, graySlot);
+    }
+    runCycle(vm, deadline);
+
+    // 周期未结束时, 再分配stepBytes字节后继续下一步
+    if (vm->gcPhase != GC_IDLE) {
+        vm->config.nextGC = vm->allocatedBytes + vm->config.stepBytes;
+    }
+}
+
+/**
+ * 并行标记的工作线程, 各有一个双端队列: 自己从尾部存取, 其它线程从头部窃取
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    ObjHeader **objects;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t tail;
+    // 本线程标记的存活字节数
+    uint64_t liveBytes;
+} MarkWorker;
+
+typedef struct {
+    VM *vm;
+    MarkWorker *workers;
+    uint32_t workerNum;
+    // 以下以原子操作访问
+    // 参与标记的线程数, 线程创建失败时减少
+    uint32_t runningNum;
+    // 找不到对象可处理的线程数
+    uint32_t idleNum;
+    // 下一个待领取的队列
+    uint32_t nextWorker;
+} ParallelMark;
+
+// 当前线程的队列, 供parallelGraySlot使用
+static __thread MarkWorker *curWorker;
+
+// 压入队列尾部
+static void pushWork(MarkWorker *worker, ObjHeader *obj) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail >= worker->capacity) {
+        if (worker->head > 0) {
+            // 头部已被窃取的空间可以复用
+            memmove(worker->objects, worker->objects + worker->head,
+                    (worker->tail - worker->head) * sizeof(ObjHeader *));
+            worker->tail -= worker->head;
+            worker->head = 0;
+        } else {
+            worker->capacity = worker->capacity == 0 ? 64 : worker->capacity * 2;
+            worker->objects = (ObjHeader **) realloc(worker->objects, worker->capacity * sizeof(ObjHeader *));
+            if (worker->objects == NULL) {
+                MEM_ERROR("reallocate mark deque failed!");
+            }
+        }
+    }
+    worker->objects[worker->tail++] = obj;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// 从队列尾部取出, 队列为空时返回NULL
+static ObjHeader *popWork(MarkWorker *worker) {
+    ObjHeader *obj = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail > worker->head) {
+        obj = worker->objects[--worker->tail];
+    }
+    if (worker->tail == worker->head) {
+        worker->head = worker->tail = 0;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return obj;
+}
+
+// 从其它队列头部窃取至多一半的对象放入自己的队列, 窃取到对象时返回true
+static bool stealWork(ParallelMark *mark, uint32_t self) {
+    ObjHeader *stolen[STEAL_BATCH_NUM];
+    uint32_t idx = 1;
+    while (idx < mark->workerNum) {
+        MarkWorker *victim = &mark->workers[(self + idx++) % mark->workerNum];
+        uint32_t num = 0;
+        pthread_mutex_lock(&victim->lock);
+        uint32_t half = (victim->tail - victim->head + 1) / 2;
+        while (num < half && num < STEAL_BATCH_NUM) {
+            stolen[num++] = victim->objects[victim->head++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (num > 0) {
+            while (num > 0) {
+                pushWork(&mark->workers[self], stolen[--num]);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// 是否还有队列不为空
+static bool hasWork(ParallelMark *mark) {
+    uint32_t idx = 0;
+    while (idx < mark->workerNum) {
+        MarkWorker *worker = &mark->workers[idx++];
+        pthread_mutex_lock(&worker->lock);
+        bool empty = worker->tail == worker->head;
+        pthread_mutex_unlock(&worker->lock);
+        if (!empty) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 以原子交换认领槽中的对象, 保证每个对象只由一个线程处理
+static void parallelGraySlot(VM *vm, ObjHeader **slot) {
+    ObjHeader *obj = *slot;
+    if (obj == NULL || isFrozenObject(vm, obj) || OBJ_IS_DARK(obj) || OBJ_TEST_AND_SET_FLAG(obj, OBJ_DARK)) {
+        return;
+    }
+    pushWork(curWorker, obj);
+}
+
+// 标记线程: 处理自己的队列, 空了就去窃取, 所有线程都找不到对象时结束
+static void *markWorkerMain(void *arg) {
+    ParallelMark *mark = (ParallelMark *) arg;
+    uint32_t self = __atomic_fetch_add(&mark->nextWorker, 1, __ATOMIC_RELAXED);
+    MarkWorker *worker = &mark->workers[self];
+    curWorker = worker;
+
+    while (true) {
+        ObjHeader *obj = popWork(worker);
+        if (obj != NULL) {
+            worker->liveBytes += liveSize(obj);
+            visitObjectSlots(mark->vm, obj, parallelGraySlot);
+            continue;
+        }
+        if (stealWork(mark, self)) {
+            continue;
+        }
+
+        // 只有处理对象的线程才会产生新对象, 全部空闲时所有队列必定为空
+        __atomic_add_fetch(&mark->idleNum, 1, __ATOMIC_SEQ_CST);
+        bool finished = false;
+        while (!hasWork(mark)) {
+            if (__atomic_load_n(&mark->idleNum, __ATOMIC_SEQ_CST) ==
+                __atomic_load_n(&mark->runningNum, __ATOMIC_SEQ_CST)) {
+                finished = true;
+                break;
+            }
+            sched_yield();
+        }
+        if (finished) {
+            break;
+        }
+        __atomic_sub_fetch(&mark->idleNum, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+// 以threadNum个线程并行标记, 当前线程也参与
+// 回收中的分配一律直接用malloc, 不计入allocatedBytes
+static void parallelMark(VM *vm, uint32_t threadNum) {
+    ParallelMark mark;
+    mark.vm = vm;
+    mark.workerNum = threadNum;
+    mark.runningNum = threadNum;
+    mark.idleNum = 0;
+    mark.nextWorker = 0;
+    mark.workers = (MarkWorker *) malloc(threadNum * sizeof(MarkWorker));
+    pthread_t *threads = (pthread_t *) malloc(threadNum * sizeof(pthread_t));
+    if (mark.workers == NULL || threads == NULL) {
+        MEM_ERROR("allocate mark workers failed!");
+    }
+    uint32_t idx = 0;
+    while (idx < threadNum) {
+        MarkWorker *worker = &mark.workers[idx++];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->objects = NULL;
+        worker->capacity = worker->head = worker->tail = 0;
+        worker->liveBytes = 0;
+    }
+
+    // 根由当前线程标记, 再轮流分给各队列
+    visitRootSlots(vm, graySlot);
+    idx = 0;
+    while (vm->grays.count > 0) {
+        pushWork(&mark.workers[idx++ % threadNum], vm->grays.grayObjects[--vm->grays.count]);
+    }
+
+    // 创建失败的线程的队列留给其它线程窃取
+    uint32_t started = 0;
+    while (started < threadNum - 1 &&
+           pthread_create(&threads[started], NULL, markWorkerMain, &mark) == 0) {
+        started++;
+    }
+    __atomic_sub_fetch(&mark.runningNum, threadNum - 1 - started, __ATOMIC_SEQ_CST);
+    markWorkerMain(&mark);
+    idx = 0;
+    while (idx < started) {
+        pthread_join(threads[idx++], NULL);
+    }
+
+    idx = 0;
+    while (idx < threadNum) {
+        MarkWorker *worker = &mark.workers[idx++];
+        vm->liveBytes += worker->liveBytes;
+        free(worker->objects);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    free(threads);
+    free(mark.workers);
+}
+
+/**
+ * 并行清除的任务, 负责sweepList中互不相交的一段
+ */
+typedef struct {
+    // 私有的分配上下文, 释放对象时的内存统计和空闲块记在这里, 不与其它线程竞争
+    VM vm;
+    ObjHeader *objects;
+    // 存活对象链表及其尾部
+    ObjHeader *survivors;
+    ObjHeader *lastSurvivor;
+} SweepJob;
+
+static void *sweepWorkerMain(void *arg) {
+    SweepJob *job = (SweepJob *) arg;
+    ObjHeader *obj = job->objects;
+    while (obj != NULL) {
+        ObjHeader *next = obj->next;
+        if (!OBJ_IS_DARK(obj)) {
+            freeObject(&job->vm, obj);
+        } else {
+            OBJ_CLEAR_FLAG(obj, OBJ_DARK);
+            obj->next = job->survivors;
+            if (job->survivors == NULL) {
+                job->lastSurvivor = obj;
+            }
+            job->survivors = obj;
+        }
+        obj = next;
+    }
+    return NULL;
+}
+
+// 把sweepList等分成threadNum段并行清除, 存活对象挂回allObjects
+// 各线程在自己的分配上下文中释放, 结束后并入vm
+static void parallelSweep(VM *vm, uint32_t threadNum) {
+    uint32_t objectNum = 0;
+    ObjHeader *obj = vm->sweepList;
+    while (obj != NULL) {
+        objectNum++;
+        obj = obj->next;
+    }
+    uint32_t segment = (objectNum + threadNum - 1) / threadNum;
+
+    SweepJob *jobs = (SweepJob *) malloc(threadNum * sizeof(SweepJob));
+    pthread_t *threads = (pthread_t *) malloc(threadNum * sizeof(pthread_t));
+    if (jobs == NULL || threads == NULL) {
+        MEM_ERROR("allocate sweep jobs failed!");
+    }
+    obj = vm->sweepList;
+    uint32_t idx = 0;
+    while (idx < threadNum) {
+        SweepJob *job = &jobs[idx++];
+        // 各线程把释放的小块放入自己的空闲链表, 结束后再并入vm
+        initWorkerVM(&job->vm, vm);
+        job->objects = obj;
+        job->survivors = job->lastSurvivor = NULL;
+
+        // 截取segment个对象
+        ObjHeader *last = NULL;
+        uint32_t num = 0;
+        while (obj != NULL && num++ < segment) {
+            last = obj;
+            obj = obj->next;
+        }
+        if (last != NULL) {
+            last->next = NULL;
+        }
+    }
+    vm->sweepList = NULL;
+
+    // 第0段由当前线程清除, 创建线程失败的段也由当前线程补上
+    uint32_t started = 0;
+    while (started < threadNum - 1 &&
+           pthread_create(&threads[started], NULL, sweepWorkerMain, &jobs[started + 1]) == 0) {
+        started++;
+    }
+    idx = started + 1;
+    while (idx < threadNum) {
+        sweepWorkerMain(&jobs[idx++]);
+    }
+    sweepWorkerMain(&jobs[0]);
+    idx = 0;
+    while (idx < started) {
+        pthread_join(threads[idx++], NULL);
+    }
+
+    idx = 0;
+    while (idx < threadNum) {
+        SweepJob *job = &jobs[idx++];
+        if (job->survivors != NULL) {
+            job->lastSurvivor->next = vm->allObjects;
+            vm->allObjects = job->survivors;
+        }
+        gcAdoptWorker(vm, &job->vm);
+    }
+    free(threads);
+    free(jobs);
+}
+
+/**
+ * 对象本身及其缓冲区占用的字节数
+ */
+uint32_t gcObjectSize(ObjHeader *obj) {
+    return objectSize(obj) + bufferSize(obj);
+}
+
+// 以walker访问objects链表中的对象, skipUnmarked为真时跳过未标记的对象
+static void walkObjects(VM *vm, ObjHeader *objects, bool skipUnmarked, HeapWalker walker, void *arg) {
+    ObjHeader *obj = objects;
+    while (obj != NULL) {
+        ObjHeader *next = obj->next;
+        if (!skipUnmarked || OBJ_IS_DARK(obj)) {
+            walker(vm, obj, arg);
+        }
+        obj = next;
+    }
+}
+
+/**
+ * 以walker访问堆中的所有对象, 包括新生代、冻结区和永生区, walker中不能分配对象
+ * 清除阶段sweepList中未标记的对象即将释放, 其引用的类或函数可能已被释放, 不访问
+ */
+void gcWalkHeap(VM *vm, HeapWalker walker, void *arg) {
+    walkObjects(vm, vm->allObjects, false, walker, arg);
+    walkObjects(vm, vm->youngObjects, false, walker, arg);
+    walkObjects(vm, vm->frozen.objects, false, walker, arg);
+    walkObjects(vm, vm->immortal.objects, false, walker, arg);
+    walkObjects(vm, vm->sweepList, true, walker, arg);
+}
+
+// 把obj计入按类型的统计
+static void countObject(VM *vm UNUSED, ObjHeader *obj, void *arg) {
+    HeapStats *stats = (HeapStats *) arg;
+    ObjType type = OBJ_TYPE(obj);
+    stats->objectNum[type]++;
+    stats->bytes[type] += gcObjectSize(obj);
+}
+
+/**
+ * 按类型统计堆中的对象
+ */
+void gcHeapStats(VM *vm, HeapStats *stats) {
+    uint32_t type = 0;
+    while (type < OBJ_TYPE_NUM) {
+        stats->objectNum[type] = stats->bytes[type] = 0;
+        type++;
+    }
+    gcWalkHeap(vm, countObject, stats);
+}
+
+// 全堆回收使用的线程数
+static uint32_t gcThreadNum(VM *vm) {
+    uint32_t threadNum = vm->config.gcThreads;
+    if (threadNum == 0) {
+        long cpuNum = sysconf(_SC_NPROCESSORS_ONLN);
+        threadNum = cpuNum > 0 ? (uint32_t) cpuNum : 1;
+    }
+    return threadNum > MAX_GC_THREADS ? MAX_GC_THREADS : threadNum;
+}
+
+/**
+ * 标记-清除整个堆, 不移动对象, 因此可以在任意分配点进行
+ * 新生代对象参与标记但不在此释放, 死亡的新生代对象留待下次新生代回收
+ */
+void startGC(VM *vm) {
+#if DEBUG
+    double startTime = (double) clock() / CLOCKS_PER_SEC;
+    uint64_t before = vm->allocatedBytes;
+    printf("-- gc before:%llu nextGC:%llu vm:%p --\n", (unsigned long long) before,
+           (unsigned long long) vm->config.nextGC, vm);
+#endif
+    // 先结束进行中的增量周期, 其标记对本次回收已不完整
+    runCycle(vm, 0);
+    uint32_t threadNum = gcThreadNum(vm);
+
+    // 标记阶段, 去重要改写引用, 只能单线程标记
+    uint64_t markStart = monotonicNs();
+    bool dedup = vm->dedup.active;
+    vm->liveBytes = 0;
+    if (threadNum > 1 && !dedup) {
+        parallelMark(vm, threadNum);
+    } else {
+        visitRootSlots(vm, graySlot);
+        blackenObjectInGray(vm, 0);
+    }
+    finishMarking(vm);
+    if (dedup) {
+        finishDedup(vm);
+    }
+
+    // 清除阶段
+    uint64_t sweepStart = monotonicNs();
+    if (threadNum > 1) {
+        parallelSweep(vm, threadNum);
+    } else {
+        sweepObjects(vm, 0);
+    }
+    ObjHeader *young = vm->youngObjects;
+    while (young != NULL) {
+        OBJ_CLEAR_FLAG(young, OBJ_DARK);
+        young = young->next;
+    }
+    finishSweeping(vm);
+
+    GCStats *stats = &vm->gcStats;
+    stats->fullGCNum++;
+    stats->lastMarkNs = sweepStart - markStart;
+    stats->lastSweepNs = monotonicNs() - sweepStart;
+    stats->markNs += stats->lastMarkNs;
+    stats->sweepNs += stats->lastSweepNs;
+    if (vm->config.compactInterval != 0 && stats->fullGCNum % vm->config.compactInterval == 0) {
+        vm->compactPending = true;
+    }
+    if (!dedup && vm->config.dedupInterval != 0 && stats->fullGCNum % vm->config.dedupInterval == 0) {
+        vm->dedupPending = true;
+    }
+
+#if DEBUG
+    double elapsed = (double) clock() / CLOCKS_PER_SEC - startTime;
+    printf("GC %llu before, %llu after (%llu collected), next at %llu. take %.3fs.\n",
+           (unsigned long long) before, (unsigned long long) vm->allocatedBytes,
+           (unsigned long long) (before - vm->allocatedBytes),
+           (unsigned long long) vm->config.nextGC, elapsed);
+    printf("   %u threads, mark %.3fms, sweep %.3fms.\n", threadNum,
+           stats->lastMarkNs / 1e6, stats->lastSweepNs / 1e6);
+#endif
+}
+
+/**
+ * 并发回收的一步: 空闲时开启并发标记, 标记线程完成后在停顿中重新标记,
+ * 清除仍按时间预算分步进行
+ */
+static void concurrentStep(VM *vm) {
+    if (vm->gcPhase == GC_IDLE) {
+        startConcurrentMark(vm);
+    } else if (vm->gcPhase == GC_CONCURRENT_MARKING &&
+               __atomic_load_n(&vm->markDone, __ATOMIC_ACQUIRE)) {
+        gcFinishConcurrentMark(vm);
+    }
+    if (vm->gcPhase == GC_SWEEPING) {
+        runCycle(vm, monotonicNs() + (uint64_t) vm->config.pauseBudgetUs * 1000);
+    }
+
+    // 标记线程尚未完成或清除未结束时, 再分配stepBytes字节后再来查看
+    if (vm->gcPhase != GC_IDLE) {
+        vm->config.nextGC = vm->allocatedBytes + vm->config.stepBytes;
+    }
+}
+
+/**
+ * 堆超过阈值时由memManager调用, 按配置进行一次全堆回收或推进一步增量或并发回收
+ */
+void collectGarbage(VM *vm) {
+    if (vm->config.concurrent) {
+        concurrentStep(vm);
+    } else if (vm->config.incremental) {
+        gcStep(vm);
+    } else {
+        startGC(vm);
+    }
+}
+
+// obj复制到copy之后, 已关闭的upvalue要改为指向副本自己的closedUpvalue
+static void fixMovedUpvalue(ObjHeader *obj, ObjHeader *copy) {
+    if (OBJ_TYPE(obj) != OT_UPVALUE) {
+        return;
+    }
+    ObjUpvalue *objUpvalue = (ObjUpvalue *) obj;
+    if (objUpvalue->localVarPtr == &objUpvalue->closedUpvalue) {
+        ((ObjUpvalue *) copy)->localVarPtr = &((ObjUpvalue *) copy)->closedUpvalue;
+    }
+}
+
+// 把新生代对象obj复制到老年代, 在原对象中留下转发地址
+static void promoteObject(VM *vm, ObjHeader *obj) {
+    uint32_t size = objectSize(obj);
+    ObjHeader *copy = (ObjHeader *) memManager(vm, NULL, 0, size);
+    if (copy == NULL) {
+        MEM_ERROR("promote object failed!");
+    }
+    memcpy(copy, obj, size);
+    fixMovedUpvalue(obj, copy);
+    OBJ_CLEAR_FLAG(copy, OBJ_YOUNG | OBJ_DARK | OBJ_REMEMBERED);
+    copy->next = vm->allObjects;
+    vm->allObjects = copy;
+
+    // 原对象已无用, 借用OBJ_DARK和class记录转发地址
+    OBJ_SET_FLAG(obj, OBJ_DARK);
+    objSetClass(obj, (Class *) copy);
+
+    // 副本中的引用稍后再处理
+    pushGray(vm, copy);
+}
+
+// 若槽中是新生代对象, 则晋升之并把槽改为指向其副本
+static void evacuateSlot(VM *vm, ObjHeader **slot) {
+    ObjHeader *obj = *slot;
+    if (obj == NULL || !OBJ_IS_YOUNG(obj)) {
+        return;
+    }
+    if (!OBJ_IS_DARK(obj)) {
+        promoteObject(vm, obj);
+    }
+    *slot = (ObjHeader *) OBJ_CLASS(obj);
+}
+
+/**
+ * 新生代回收: 把从根和记忆集可达的新生代对象全部晋升到老年代, 然后整体释放新生代
+ * 会移动对象, 在安全点和新生代分配处调用, 此时除vm可见的根之外的新生代对象指针都将失效
+ */
+void minorGC(VM *vm) {
+    if (vm->youngObjects == NULL) {
+        return;
+    }
+#if DEBUG
+    double startTime = (double) clock() / CLOCKS_PER_SEC;
+    uint32_t youngBytes = vm->nursery.usedBytes;
+    uint64_t before = vm->allocatedBytes;
+#endif
+    // 晋升时的分配不能触发全堆gc, 否则会看到一半转发的堆
+    vm->gcPauseNum++;
+    // 增量标记进行中时, 灰色栈底部是其待处理的对象, 新生代回收只使用上面的部分
+    uint32_t grayBase = vm->grays.count;
+
+    visitRootSlots(vm, evacuateSlot);
+
+    // 正在运行的线程随时会压栈, 不经写屏障, 总是视为在记忆集中
+    if (vm->curThread != NULL) {
+        visitObjectSlots(vm, (ObjHeader *) vm->curThread, evacuateSlot);
+    }
+    RememberedSet *set = &vm->remembered;
+    uint32_t idx = 0;
+    while (idx < set->count) {
+        ObjHeader *obj = set->objects[idx++];
+        OBJ_CLEAR_FLAG(obj, OBJ_REMEMBERED);
+        visitObjectSlots(vm, obj, evacuateSlot);
+    }
+    // 回收后新生代为空, 记忆集也随之清空
+    set->count = 0;
+
+    // 处理晋升对象中的引用, 其间可能继续晋升
+    while (vm->grays.count > grayBase) {
+        visitObjectSlots(vm, vm->grays.grayObjects[--vm->grays.count], evacuateSlot);
+    }
+
+    // 未晋升的对象已死亡, 释放其缓冲区; 已晋升对象的缓冲区归副本所有
+    ObjHeader *young = vm->youngObjects;
+    while (young != NULL) {
+        ObjHeader *next = young->next;
+        if (!OBJ_IS_DARK(young)) {
+            freeObjectBuffers(vm, young);
+        }
+        young = next;
+    }
+    vm->youngObjects = NULL;
+
+    // 只保留一块供后续分配
+    Nursery *nursery = &vm->nursery;
+    NurseryChunk *chunk = nursery->cur->next;
+    while (chunk != NULL) {
+        NurseryChunk *next = chunk->next;
+        memManager(vm, chunk, NURSERY_CHUNK_BYTES, 0);
+        chunk = next;
+    }
+    nursery->cur->next = NULL;
+    nursery->cur->top = nursery->cur->data;
+    nursery->usedBytes = 0;
+
+    vm->gcPauseNum--;
+
+#if DEBUG
+    double elapsed = (double) clock() / CLOCKS_PER_SEC - startTime;
+    printf("minor GC %lu young, %llu promoted. take %.3fs.\n",
+           (unsigned long) youngBytes, (unsigned long long) (vm->allocatedBytes - before), elapsed);
+#endif
+
+    // 晋升使老年代增长, 必要时接着做全堆gc
+    if (vm->allocatedBytes > vm->config.nextGC && vm->gcPauseNum == 0) {
+        collectGarbage(vm);
+    }
+}
+
+/**
+ * 固定obj, 整理堆时不移动它, 供跨越安全点持有对象指针的本地代码使用
+ * 固定并不使对象存活, 调用者仍要保证其可达;
+ * 新生代对象晋升时总会移动, 不能固定, 类、模块、函数和线程总是在老年代分配
+ */
+void gcPinObject(VM *vm, ObjHeader *obj) {
+    ASSERT(!OBJ_IS_YOUNG(obj), "young object can't be pinned!");
+    // 冻结区对象永不移动, 不必固定, 也不能写其对象头
+    if (isFrozenObject(vm, obj)) {
+        return;
+    }
+    ASSERT(OBJ_PIN_NUM(obj) < UINT8_MAX, "object pinned too much!");
+    OBJ_PIN(obj);
+}
+
+/**
+ * 解除一次gcPinObject
+ */
+void gcUnpinObject(VM *vm, ObjHeader *obj) {
+    if (isFrozenObject(vm, obj)) {
+        return;
+    }
+    ASSERT(OBJ_PIN_NUM(obj) > 0, "object isn't pinned!");
+    OBJ_UNPIN(obj);
+}
+
+// 把buffer中的count个元素复制到新分配的恰好容纳它们的内存中并释放原内存, capacity随之更新
+// 单独映射的大块缓冲区不复制, 原样保留
+static void *relocateBuffer(VM *vm, void *datas, uint32_t count, uint32_t *capacity, uint32_t elemSize) {
+    if (datas != NULL && isLargeBlock(datas)) {
+        return datas;
+    }
+    void *newDatas = NULL;
+    if (count > 0) {
+        newDatas = memManager(vm, NULL, 0, count * elemSize);
+        if (newDatas == NULL) {
+            MEM_ERROR("relocate buffer failed!");
+        }
+        memcpy(newDatas, datas, count * elemSize);
+    }
+    memManager(vm, datas, *capacity * elemSize, 0);
+    *capacity = count;
+    return newDatas;
+}
+
+// 整理堆时把存活的obj复制到新分配的内存中, 原对象保持OBJ_DARK并以class记录副本地址
+// 元素数组按实际元素数重新分配以去掉realloc留下的空闲容量;
+// map的槽位依赖容量所以保持原容量; 线程的栈和函数的指令流被frame中的指针引用, 不移动
+// 原对象要到转发完成后才释放, 副本会超出堆上限时返回NULL, 对象留在原处
+static ObjHeader *relocateObject(VM *vm, ObjHeader *obj) {
+    uint32_t size = objectSize(obj);
+    uint64_t limit = vm->config.maxHeapSize;
+    if (limit != 0 && vm->allocatedBytes + size + bufferSize(obj) > limit) {
+        return NULL;
+    }
+    ObjHeader *copy = (ObjHeader *) memManager(vm, NULL, 0, size);
+    if (copy == NULL) {
+        MEM_ERROR("relocate object failed!");
+    }
+    memcpy(copy, obj, size);
+    fixMovedUpvalue(obj, copy);
+    OBJ_CLEAR_FLAG(copy, OBJ_DARK);
+
+    switch (OBJ_TYPE(copy)) {
+        case OT_CLASS: {
+            MethodBuffer *methods = &((Class *) copy)->methods;
+            methods->datas = relocateBuffer(vm, methods->datas, methods->count, &methods->capacity, sizeof(Method));
+            break;
+        }
+        case OT_FUNCTION: {
+            ValueBuffer *constants = &((ObjFn *) copy)->constants;
+            constants->datas = relocateBuffer(vm, constants->datas, constants->count, &constants->capacity,
+                                              sizeof(Value));
+            break;
+        }
+        case OT_LIST: {
+            ValueBuffer *elements = &((ObjList *) copy)->elements;
+            elements->datas = relocateBuffer(vm, elements->datas, elements->count, &elements->capacity,
+                                             sizeof(Value));
+            break;
+        }
+        case OT_MAP: {
+            ObjMap *objMap = (ObjMap *) copy;
+            uint32_t capacity = objMap->capacity;
+            objMap->entries = relocateBuffer(vm, objMap->entries, capacity, &capacity, sizeof(Entry));
+            break;
+        }
+        case OT_MODULE: {
+            ObjModule *objModule = (ObjModule *) copy;
+            ValueBuffer *values = &objModule->moduleVarValue;
+            values->datas = relocateBuffer(vm, values->datas, values->count, &values->capacity, sizeof(Value));
+            SymbolTable *names = &objModule->moduleVarName;
+            names->datas = relocateBuffer(vm, names->datas, names->count, &names->capacity, sizeof(String));
+            break;
+        }
+        default:
+            break;
+    }
+
+    // 原对象只剩转发地址有用
+    objSetClass(obj, (Class *) copy);
+    return copy;
+}
+
+// 若槽中的对象已移动, 改为指向其副本
+static void forwardSlot(VM *vm, ObjHeader **slot) {
+    ObjHeader *obj = *slot;
+    if (obj != NULL && OBJ_IS_DARK(obj) && !isFrozenObject(vm, obj)) {
+        *slot = (ObjHeader *) OBJ_CLASS(obj);
+    }
+}
+
+// vm中直接引用核心类的指针不是根, 但同样要指向移动后的类
+static void forwardCoreClasses(VM *vm) {
+    Class **classes[] = {
+            &vm->classOfClass, &vm->objectClass, &vm->stringClass, &vm->mapClass, &vm->rangeClass,
+            &vm->listClass, &vm->nullClass, &vm->boolClass, &vm->numClass, &vm->fnClass,
+            &vm->threadClass, &vm->channelClass, &vm->ioClass, &vm->systemClass, &vm->timerClass
+    };
+    uint32_t idx = 0;
+    while (idx < sizeof(classes) / sizeof(classes[0])) {
+        forwardSlot(vm, (ObjHeader **) classes[idx++]);
+    }
+}
+
+// 移动对象前的准备: 清空新生代, 暂停gc, 固定临时根, 然后标记整个堆
+// 此后所有存活对象都在老年代, 记忆集也为空
+static void beginMoving(VM *vm) {
+    gcFinishConcurrentMark(vm);
+    minorGC(vm);
+    runCycle(vm, 0);
+    ASSERT(vm->youngObjects == NULL, "nursery isn't empty before moving objects!");
+
+    vm->gcPauseNum++;
+    // 临时根由C代码中的局部变量引用, 不能移动
+    uint32_t idx = 0;
+    while (idx < vm->tmpRootNum) {
+        if (!isFrozenObject(vm, vm->tmpRoots[idx])) {
+            OBJ_PIN(vm->tmpRoots[idx]);
+        }
+        idx++;
+    }
+
+    vm->liveBytes = 0;
+    visitRootSlots(vm, graySlot);
+    blackenObjectInGray(vm, 0);
+}
+
+// 遍历allObjects: 先释放全部死对象, 复制时可复用其内存;
+// 被固定的对象和单独映射的大对象留在allObjects, 其余由relocate复制
+// relocate返回NULL表示该对象不移动, 同样留在allObjects
+// 返回副本链表, moved返回原对象链表. 此后OBJ_DARK置位的老年代对象就是已移动的原对象
+static ObjHeader *moveObjects(VM *vm, ObjHeader *(*relocate)(VM *, ObjHeader *), ObjHeader **moved) {
+    ObjHeader **link = &vm->allObjects;
+    while (*link != NULL) {
+        ObjHeader *obj = *link;
+        if (OBJ_IS_DARK(obj)) {
+            link = &obj->next;
+        } else {
+            *link = obj->next;
+            freeObject(vm, obj);
+        }
+    }
+
+    ObjHeader *pinned = NULL;
+    ObjHeader *copies = NULL;
+    *moved = NULL;
+    ObjHeader *obj = vm->allObjects;
+    while (obj != NULL) {
+        ObjHeader *next = obj->next;
+        ObjHeader *copy = NULL;
+        if (OBJ_PIN_NUM(obj) > 0 || isLargeBlock(obj) || (copy = relocate(vm, obj)) == NULL) {
+            OBJ_CLEAR_FLAG(obj, OBJ_DARK);
+            obj->next = pinned;
+            pinned = obj;
+        } else {
+            copy->next = copies;
+            copies = copy;
+            obj->next = *moved;
+            *moved = obj;
+        }
+        obj = next;
+    }
+    vm->allObjects = pinned;
+
+    // 根和vm中的核心类指针改为指向副本, 存活对象中的引用由调用者改写
+    visitRootSlots(vm, forwardSlot);
+    forwardCoreClasses(vm);
+    return copies;
+}
+
+// 释放已移动的原对象并解除临时根的固定, 与beginMoving配对
+static void endMoving(VM *vm, ObjHeader *moved) {
+    // 原对象的缓冲区已转移给副本或已释放, 只需释放其自身
+    while (moved != NULL) {
+        ObjHeader *obj = moved;
+        moved = moved->next;
+        DEALLOCATE(vm, obj);
+    }
+
+    uint32_t idx = 0;
+    while (idx < vm->tmpRootNum) {
+        if (!isFrozenObject(vm, vm->tmpRoots[idx])) {
+            OBJ_UNPIN(vm->tmpRoots[idx]);
+        }
+        idx++;
+    }
+    vm->gcPauseNum--;
+}
+
+/**
+ * 标记-整理: 回收死对象, 把存活对象逐个复制到新分配的紧凑内存中, 并改写所有引用,
+ * 包括栈、字段、upvalue、Frame.closure、Class.superClass和模块变量表
+ * 小对象和小缓冲区的副本从新的slab页依次切分, 原对象释放后整页空闲的页归还操作系统;
+ * 更大的由malloc分配, 碎片整理取决于malloc
+ * 会移动对象, 只能在安全点调用; 临时根、被固定的对象和大对象不移动
+ */
+void compactHeap(VM *vm) {
+    uint64_t startNs = monotonicNs();
+    vm->compactPending = false;
+
+    beginMoving(vm);
+    slabBeginEvacuation(vm);
+    ObjHeader *moved;
+    ObjHeader *copies = moveObjects(vm, relocateObject, &moved);
+
+    // 副本挂到被固定的对象之后
+    ObjHeader **tail = &vm->allObjects;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = copies;
+
+    // 改写存活对象中的引用, 同时统计存活数据量
+    vm->liveBytes = 0;
+    ObjHeader *obj = vm->allObjects;
+    while (obj != NULL) {
+        visitObjectSlots(vm, obj, forwardSlot);
+        vm->liveBytes += liveSize(obj);
+        obj = obj->next;
+    }
+
+    endMoving(vm, moved);
+    finishSweeping(vm);
+    slabEndEvacuation(vm);
+
+    vm->gcStats.compactNum++;
+    vm->gcStats.compactNs += monotonicNs() - startNs;
+}
+
+// 把obj复制到冻结区, 缓冲区仍归副本所有, 不移动
+static ObjHeader *freezeObject(VM *vm, ObjHeader *obj) {
+    uint32_t size = objectSize(obj);
+    ObjHeader *copy = (ObjHeader *) vm->frozen.top;
+    vm->frozen.top += ALIGN_SIZE(size);
+    memcpy(copy, obj, size);
+    fixMovedUpvalue(obj, copy);
+    OBJ_CLEAR_FLAG(copy, OBJ_DARK | OBJ_REMEMBERED);
+    objSetClass(obj, (Class *) copy);
+    return copy;
+}
+
+// 冻结时用于找出引用了冻结区外对象的冻结对象
+static bool refersOutside;
+
+static void checkFrozenSlot(VM *vm, ObjHeader **slot) {
+    forwardSlot(vm, slot);
+    if (*slot != NULL && !isFrozenObject(vm, *slot)) {
+        refersOutside = true;
+    }
+}
+
+/**
+ * obj是否位于冻结区或永生区
+ */
+bool isFrozenObject(VM *vm, ObjHeader *obj) {
+    return ((char *) obj >= vm->frozen.start && (char *) obj < vm->frozen.top) || isImmortalObject(vm, obj);
+}
+
+/**
+ * obj是否位于永生区, 永生对象不能再修改
+ */
+bool isImmortalObject(VM *vm, ObjHeader *obj) {
+    return (char *) obj >= vm->immortal.start && (char *) obj < vm->immortal.top;
+}
+
+/**
+ * 冻结堆: 把所有存活对象复制到一块连续的冻结区, 此后它们永远存活, 不再标记、清除或移动
+ * 用于prefork: 父进程载入模块后冻结, fork出的子进程的gc只读冻结区, 页面得以保持共享
+ * 只能在安全点调用一次; 临时根、被固定的对象和大对象留在普通堆中
+ */
+void freezeHeap(VM *vm) {
+    ASSERT(vm->frozen.start == NULL, "heap is already frozen!");
+    beginMoving(vm);
+
+    // 冻结区大小为所有可移动的存活对象之和
+    uint32_t size = 0;
+    ObjHeader *obj = vm->allObjects;
+    while (obj != NULL) {
+        if (OBJ_IS_DARK(obj) && OBJ_PIN_NUM(obj) == 0 && !isLargeBlock(obj)) {
+            size += ALIGN_SIZE(objectSize(obj));
+        }
+        obj = obj->next;
+    }
+    if (size > 0) {
+        vm->frozen.start = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (vm->frozen.start == MAP_FAILED) {
+            MEM_ERROR("map frozen region failed!");
+        }
+        vm->frozen.top = vm->frozen.start;
+    }
+
+    ObjHeader *moved;
+    vm->frozen.objects = moveObjects(vm, freezeObject, &moved);
+
+    // 普通堆中剩下的只有被固定的对象
+    vm->liveBytes = 0;
+    obj = vm->allObjects;
+    while (obj != NULL) {
+        visitObjectSlots(vm, obj, forwardSlot);
+        vm->liveBytes += liveSize(obj);
+        obj = obj->next;
+    }
+    // 冻结对象不再参与标记, 其缓冲区也不计入存活数据量
+    obj = vm->frozen.objects;
+    while (obj != NULL) {
+        refersOutside = false;
+        visitObjectSlots(vm, obj, checkFrozenSlot);
+        if (refersOutside) {
+            markFrozenDirty(vm, obj);
+        }
+        obj = obj->next;
+    }
+
+    endMoving(vm, moved);
+    finishSweeping(vm);
+}
+
+// 可移入永生区的对象类型: 核心模块执行后不再被脚本修改的类型
+static bool isImmortalType(ObjType type) {
+    return type == OT_CLASS || type == OT_MODULE || type == OT_RANGE ||
+           type == OT_STRING || type == OT_FUNCTION || type == OT_CLOSURE;
+}
+
+// 把带OBJ_REMEMBERED标记的候选对象复制到永生区, 其余对象不移动
+// 方法表、常量表、模块变量表和指令流仍归副本所有, 留在普通堆中, 永生区只读时它们也不受保护
+static ObjHeader *immortalizeObject(VM *vm, ObjHeader *obj) {
+    if (!OBJ_IS_REMEMBERED(obj)) {
+        return NULL;
+    }
+    uint32_t size = objectSize(obj);
+    ObjHeader *copy = (ObjHeader *) vm->immortal.top;
+    vm->immortal.top += ALIGN_SIZE(size);
+    memcpy(copy, obj, size);
+    OBJ_CLEAR_FLAG(copy, OBJ_DARK | OBJ_REMEMBERED);
+    objSetClass(obj, (Class *) copy);
+    return copy;
+}
+
+// 找出引用了非候选对象的候选对象
+static void checkImmortalSlot(VM *vm, ObjHeader **slot) {
+    if (*slot != NULL && !OBJ_IS_REMEMBERED(*slot) && !isFrozenObject(vm, *slot)) {
+        refersOutside = true;
+    }
+}
+
+/**
+ * 把核心对象移入永生区: 存活的类、模块、range、字符串、函数和闭包中,
+ * 只引用同类对象的那些被复制到一块连续内存中, 此后它们永远存活, gc不再标记、清除或移动它们;
+ * config.protectCore开启时再把这块内存设为只读. 类的方法表、函数的常量表和模块变量表不复制,
+ * 仍是memManager分配的内存, 只读的永生区中不会留下需要增长的缓冲区
+ * 永生对象不引用普通堆中的对象, 因此不需要额外的根; 移入后不能再修改, 只能在buildCore结束时调用一次
+ */
+void makeCoreImmortal(VM *vm) {
+    ASSERT(vm->immortal.start == NULL, "core is already immortal!");
+    beginMoving(vm);
+
+    // 永生区借用OBJ_REMEMBERED标记候选对象, 移动期间记忆集为空
+    ObjHeader *obj = vm->allObjects;
+    while (obj != NULL) {
+        if (OBJ_IS_DARK(obj) && OBJ_PIN_NUM(obj) == 0 && !isLargeBlock(obj) && isImmortalType(OBJ_TYPE(obj))) {
+            OBJ_SET_FLAG(obj, OBJ_REMEMBERED);
+        }
+        obj = obj->next;
+    }
+    // 反复剔除引用了非候选对象的候选对象, 直到没有变化, 剩下的候选对象只相互引用
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        obj = vm->allObjects;
+        while (obj != NULL) {
+            if (OBJ_IS_REMEMBERED(obj)) {
+                refersOutside = false;
+                visitObjectSlots(vm, obj, checkImmortalSlot);
+                if (refersOutside) {
+                    OBJ_CLEAR_FLAG(obj, OBJ_REMEMBERED);
+                    changed = true;
+                }
+            }
+            obj = obj->next;
+        }
+    }
+
+    uint32_t size = 0;
+    obj = vm->allObjects;
+    while (obj != NULL) {
+        if (OBJ_IS_REMEMBERED(obj)) {
+            size += ALIGN_SIZE(objectSize(obj));
+        }
+        obj = obj->next;
+    }
+    if (size > 0) {
+        vm->immortal.start = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (vm->immortal.start == MAP_FAILED) {
+            MEM_ERROR("map immortal region failed!");
+        }
+        vm->immortal.top = vm->immortal.start;
+    }
+
+    ObjHeader *moved;
+    vm->immortal.objects = moveObjects(vm, immortalizeObject, &moved);
+
+    vm->liveBytes = 0;
+    obj = vm->allObjects;
+    while (obj != NULL) {
+        visitObjectSlots(vm, obj, forwardSlot);
+        vm->liveBytes += liveSize(obj);
+        obj = obj->next;
+    }
+    obj = vm->immortal.objects;
+    while (obj != NULL) {
+        visitObjectSlots(vm, obj, forwardSlot);
+        obj = obj->next;
+    }
+
+    endMoving(vm, moved);
+    finishSweeping(vm);
+
+    if (vm->config.protectCore && size > 0 && mprotect(vm->immortal.start, size, PROT_READ) != 0) {
+        MEM_ERROR("protect immortal region failed!");
+    }
+}
+
+/**
+ * 带字符串去重的全堆回收: 标记时把引用了相同内容字符串的槽改为指向同一个规范字符串,
+ * 其余副本随之不可达而被清除, 字符串的对象标识因此可能改变
+ * 改写引用相当于移动对象, 只能在安全点调用; 去重的耗时以config.dedupBudgetUs为限
+ */
+void gcDedupStrings(VM *vm) {
+    vm->dedupPending = false;
+    // 先把新生代晋升, 使新近创建的字符串也能参与去重
+    gcFinishConcurrentMark(vm);
+    minorGC(vm);
+    runCycle(vm, 0);
+
+    StringDedup *dedup = &vm->dedup;
+    dedup->active = true;
+    dedup->counter = 0;
+    dedup->deadline = vm->config.dedupBudgetUs == 0 ? 0 :
+                      monotonicNs() + (uint64_t) vm->config.dedupBudgetUs * 1000;
+    startGC(vm);
+}
+
+/**
+ * 安全点: 新生代分配量超过阈值时进行新生代回收, 有整理请求时整理堆, 有去重请求时进行带去重的全堆回收
+ * 由调度器和解释器在不持有对象裸指针的位置调用
+ */
+void gcSafePoint(VM *vm) {
+    if (vm->gcPauseNum > 0) {
+        return;
+    }
+    if (vm->compactPending) {
+        compactHeap(vm);
+    } else if (vm->dedupPending) {
+        gcDedupStrings(vm);
+    } else if (vm->nursery.usedBytes >= vm->config.nurserySize) {
+        // 晋升会改写标记线程正在读取的引用, 先结束并发标记
+        gcFinishConcurrentMark(vm);
+        minorGC(vm);
+    }
+}
+
+// 把缓冲区的容量收缩到count, 大块由内核就地缩小, 其余重新分配以便换到合适的大小级别
+static void *trimBuffer(VM *vm, void *datas, uint32_t count, uint32_t *capacity, uint32_t elemSize) {
+    if (count >= *capacity) {
+        return datas;
+    }
+    if (datas != NULL && isLargeBlock(datas)) {
+        datas = memManager(vm, datas, *capacity * elemSize, count * elemSize);
+        *capacity = count;
+        return datas;
+    }
+    return relocateBuffer(vm, datas, count, capacity, elemSize);
+}
+
+// 线程栈收缩到各帧所需的最大深度, 移动后修正栈顶、各帧的栈底和打开的upvalue
+static void trimThreadStack(VM *vm, ObjThread *objThread) {
+    Value *oldStack = objThread->stack;
+    uint32_t used = (uint32_t) (objThread->esp - oldStack);
+    uint32_t needed = used;
+    uint32_t idx = 0;
+    while (idx < objThread->usedFrameNum) {
+        Frame *frame = &objThread->frames[idx++];
+        uint32_t top = (uint32_t) (frame->stackStart - oldStack) + frame->closure->fn->maxStackSlotUsedNum;
+        if (top > needed) {
+            needed = top;
+        }
+    }
+    // 与newObjThread一致, 多留一个槽存放接收者
+    uint32_t newCapacity = ceilToPowerOf2(needed + 1);
+    if (newCapacity >= objThread->stackCapacity) {
+        return;
+    }
+
+    Value *newStack = ALLOCATE_ARRAY(vm, Value, newCapacity);
+    memcpy(newStack, oldStack, used * sizeof(Value));
+    objThread->esp = newStack + used;
+    idx = 0;
+    while (idx < objThread->usedFrameNum) {
+        Frame *frame = &objThread->frames[idx++];
+        frame->stackStart = newStack + (frame->stackStart - oldStack);
+    }
+    ObjUpvalue *upvalue = objThread->openUpvalues;
+    while (upvalue != NULL) {
+        upvalue->localVarPtr = newStack + (upvalue->localVarPtr - oldStack);
+        upvalue = upvalue->next;
+    }
+    DEALLOCATE_ARRAY(vm, oldStack, objThread->stackCapacity);
+    objThread->stack = newStack;
+    objThread->stackCapacity = newCapacity;
+}
+
+// 把obj的缓冲区收缩到实际大小
+// 冻结对象不改动, 以免写入共享的冻结页; 函数的指令流被frame中的ip引用, 不移动
+static void trimObject(VM *vm, ObjHeader *obj, void *arg UNUSED) {
+    if (isFrozenObject(vm, obj)) {
+        return;
+    }
+    switch (OBJ_TYPE(obj)) {
+        case OT_CLASS: {
+            MethodBuffer *methods = &((Class *) obj)->methods;
+            methods->datas = trimBuffer(vm, methods->datas, methods->count, &methods->capacity, sizeof(Method));
+            break;
+        }
+        case OT_FUNCTION: {
+            ValueBuffer *constants = &((ObjFn *) obj)->constants;
+            constants->datas = trimBuffer(vm, constants->datas, constants->count, &constants->capacity,
+                                          sizeof(Value));
+            break;
+        }
+        case OT_LIST: {
+            ValueBuffer *elements = &((ObjList *) obj)->elements;
+            elements->datas = trimBuffer(vm, elements->datas, elements->count, &elements->capacity,
+                                         sizeof(Value));
+            break;
+        }
+        case OT_MAP:
+            shrinkMap(vm, (ObjMap *) obj);
+            break;
+        case OT_MODULE: {
+            ObjModule *objModule = (ObjModule *) obj;
+            ValueBuffer *values = &objModule->moduleVarValue;
+            values->datas = trimBuffer(vm, values->datas, values->count, &values->capacity, sizeof(Value));
+            SymbolTable *names = &objModule->moduleVarName;
+            names->datas = trimBuffer(vm, names->datas, names->count, &names->capacity, sizeof(String));
+            break;
+        }
+        case OT_THREAD:
+            trimThreadStack(vm, (ObjThread *) obj);
+            break;
+        default:
+            break;
+    }
+}
+
+// 释放新生代的全部块, 调用前新生代必须为空
+static void releaseNursery(VM *vm) {
+    ASSERT(vm->youngObjects == NULL, "nursery isn't empty before releasing!");
+    NurseryChunk *chunk = vm->nursery.cur;
+    while (chunk != NULL) {
+        NurseryChunk *next = chunk->next;
+        memManager(vm, chunk, NURSERY_CHUNK_BYTES, 0);
+        chunk = next;
+    }
+    vm->nursery.cur = NULL;
+    vm->nursery.usedBytes = 0;
+}
+
+/**
+ * 闲时收缩虚拟机占用的内存, level见TrimLevel
+ * 会移动线程栈和缓冲区, 只能在脚本执行之外的安全点调用
+ */
+void vmTrim(VM *vm, TrimLevel level) {
+    gcFinishConcurrentMark(vm);
+    minorGC(vm);
+    startGC(vm);
+    releaseNursery(vm);
+
+    // 回收之间gc的工作区是空的, 缩回初始大小
+    Gray *grays = &vm->grays;
+    if (grays->count == 0 && grays->capacity > 32) {
+        ObjHeader **grayObjects = (ObjHeader **) realloc(grays->grayObjects, 32 * sizeof(ObjHeader *));
+        if (grayObjects != NULL) {
+            grays->grayObjects = grayObjects;
+            grays->capacity = 32;
+        }
+    }
+    if (vm->remembered.count == 0) {
+        free(vm->remembered.objects);
+        vm->remembered.objects = NULL;
+        vm->remembered.capacity = 0;
+    }
+    if (vm->deferredThreads.count == 0) {
+        free(vm->deferredThreads.grayObjects);
+        vm->deferredThreads.grayObjects = NULL;
+        vm->deferredThreads.capacity = 0;
+    }
+
+    if (level >= TRIM_SHRINK) {
+        vm->gcPauseNum++;
+        gcWalkHeap(vm, trimObject, NULL);
+        vm->gcPauseNum--;
+    }
+    if (level >= TRIM_RELEASE) {
+        slabTrim(vm);
+        malloc_trim(0);
+    }
+}
@@ -0,0 +1,98 @@
+//
+// Created by Kosho on 2020/2/14.
+//
+
+#ifndef _GC_GC_H
+#define _GC_GC_H
+
+#include "vm.h"
+
+// 新生代块大小
+#define NURSERY_CHUNK_SIZE (256 * 1024)
+// 大于此值的对象直接在老年代分配
+#define NURSERY_MAX_OBJ_SIZE (NURSERY_CHUNK_SIZE / 8)
+
+// 在新生代分配对象, 只用于可能短命的对象类型
+#define ALLOCATE_YOUNG(vmPtr, type) \
+   (type*)allocateYoung(vmPtr, sizeof(type))
+
+#define ALLOCATE_YOUNG_EXTRA(vmPtr, mainType, extraSize) \
+   (mainType*)allocateYoung(vmPtr, sizeof(mainType) + extraSize)
+
+void *allocateYoung(VM *vm, uint32_t size);
+
+bool isFreshYoung(VM *vm, ObjHeader *obj);
+
+void visitValue(VM *vm, Value *value, SlotVisitor visitor);
+
+void visitObjectSlots(VM *vm, ObjHeader *obj, SlotVisitor visitor);
+
+void visitRootSlots(VM *vm, SlotVisitor visitor);
+
+void grayObject(VM *vm, ObjHeader *obj);
+
+void grayValue(VM *vm, Value value);
+
+void gcRememberObject(VM *vm, ObjHeader *obj);
+
+void gcWriteBarrier(VM *vm, ObjHeader *owner, Value value);
+
+void gcPreWriteBarrier(VM *vm, Value oldValue);
+
+void gcLockHeap(VM *vm);
+
+void gcUnlockHeap(VM *vm);
+
+void gcThreadYield(VM *vm, ObjThread *objThread);
+
+void gcAdoptWorker(VM *vm, VM *worker);
+
+void freeObject(VM *vm, ObjHeader *obj);
+
+void startGC(VM *vm);
+
+void gcStep(VM *vm);
+
+void gcFinishConcurrentMark(VM *vm);
+
+void collectGarbage(VM *vm);
+
+void minorGC(VM *vm);
+
+void gcPinObject(VM *vm, ObjHeader *obj);
+
+void gcUnpinObject(VM *vm, ObjHeader *obj);
+
+void compactHeap(VM *vm);
+
+bool isFrozenObject(VM *vm, ObjHeader *obj);
+
+bool isImmortalObject(VM *vm, ObjHeader *obj);
+
+void freezeHeap(VM *vm);
+
+void makeCoreImmortal(VM *vm);
+
+void gcDedupStrings(VM *vm);
+
+void gcSafePoint(VM *vm);
+
+// 遍历堆时对每个对象调用
+typedef void (*HeapWalker)(VM *vm, ObjHeader *obj, void *arg);
+
+uint32_t gcObjectSize(ObjHeader *obj);
+
+void gcWalkHeap(VM *vm, HeapWalker walker, void *arg);
+
+void gcHeapStats(VM *vm, HeapStats *stats);
+
+// vmTrim的程度, 高级别包含低级别的全部工作
+typedef enum {
+    TRIM_COLLECT, // 新生代和全堆回收, 释放空闲的新生代块和gc的工作区
+    TRIM_SHRINK,  // 另外把对象的缓冲区收缩到实际大小
+    TRIM_RELEASE  // 另外把空闲的slab页和malloc的空闲内存归还操作系统
+} TrimLevel;
+
+void vmTrim(VM *vm, TrimLevel level);
+
+#endif
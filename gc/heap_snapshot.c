@@ -0,0 +1,179 @@
+//
+// Created by Kosho on 2020/2/27.
+//
+
+#include "heap_snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "gc.h"
+#include "obj_string.h"
+
+/**
+ * 写快照时的状态, 内存一律直接用malloc, 不经memManager以免触发gc
+ */
+typedef struct {
+    FILE *file;
+    // 已写出类名的类, 以地址为键开放定址, classIds中为对应的类名编号
+    Class **classes;
+    uint32_t *classIds;
+    uint32_t capacity;
+    uint32_t classNum;
+    // 当前对象的引用
+    ObjHeader **refs;
+    uint32_t refNum;
+    uint32_t refCapacity;
+} SnapshotWriter;
+
+// 引用槽访问函数不带参数, 写快照期间由它指向当前的writer
+static SnapshotWriter *curWriter;
+
+static void writeVarint(FILE *file, uint64_t value) {
+    while (value >= 0x80) {
+        fputc((int) (value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int) value, file);
+}
+
+// 在classes中查找class, 返回其所在或应插入的位置
+static uint32_t findClassSlot(SnapshotWriter *writer, Class *class) {
+    uint32_t idx = (uint32_t) (((uintptr_t) class >> 4) % writer->capacity);
+    while (writer->classes[idx] != NULL && writer->classes[idx] != class) {
+        idx = (idx + 1) % writer->capacity;
+    }
+    return idx;
+}
+
+// 类名表扩容到newCapacity
+static void growClasses(SnapshotWriter *writer, uint32_t newCapacity) {
+    Class **oldClasses = writer->classes;
+    uint32_t *oldIds = writer->classIds;
+    uint32_t oldCapacity = writer->capacity;
+    writer->classes = (Class **) calloc(newCapacity, sizeof(Class *));
+    writer->classIds = (uint32_t *) malloc(newCapacity * sizeof(uint32_t));
+    if (writer->classes == NULL || writer->classIds == NULL) {
+        MEM_ERROR("allocate snapshot class table failed!");
+    }
+    writer->capacity = newCapacity;
+
+    uint32_t idx = 0;
+    while (idx < oldCapacity) {
+        if (oldClasses[idx] != NULL) {
+            uint32_t slot = findClassSlot(writer, oldClasses[idx]);
+            writer->classes[slot] = oldClasses[idx];
+            writer->classIds[slot] = oldIds[idx];
+        }
+        idx++;
+    }
+    free(oldClasses);
+    free(oldIds);
+}
+
+// 返回class的类名编号, 首次遇到时先写出类名记录
+static uint32_t classId(SnapshotWriter *writer, Class *class) {
+    if (class == NULL) {
+        return 0;
+    }
+    if ((writer->classNum + 1) * 2 > writer->capacity) {
+        growClasses(writer, writer->capacity == 0 ? 64 : writer->capacity * 2);
+    }
+    uint32_t slot = findClassSlot(writer, class);
+    if (writer->classes[slot] != NULL) {
+        return writer->classIds[slot];
+    }
+
+    uint32_t id = ++writer->classNum;
+    writer->classes[slot] = class;
+    writer->classIds[slot] = id;
+
+    uint32_t length = class->name != NULL ? class->name->value.length : 0;
+    fputc(HEAP_RECORD_CLASS, writer->file);
+    writeVarint(writer->file, id);
+    writeVarint(writer->file, length);
+    if (length > 0) {
+        fwrite(class->name->value.start, 1, length, writer->file);
+    }
+    return id;
+}
+
+// 收集当前对象的引用
+static void collectRef(VM *vm UNUSED, ObjHeader **slot) {
+    if (*slot == NULL) {
+        return;
+    }
+    SnapshotWriter *writer = curWriter;
+    if (writer->refNum >= writer->refCapacity) {
+        writer->refCapacity = writer->refCapacity == 0 ? 64 : writer->refCapacity * 2;
+        writer->refs = (ObjHeader **) realloc(writer->refs, writer->refCapacity * sizeof(ObjHeader *));
+        if (writer->refs == NULL) {
+            MEM_ERROR("allocate snapshot references failed!");
+        }
+    }
+    writer->refs[writer->refNum++] = *slot;
+}
+
+static void writeRoot(VM *vm UNUSED, ObjHeader **slot) {
+    if (*slot != NULL) {
+        fputc(HEAP_RECORD_ROOT, curWriter->file);
+        writeVarint(curWriter->file, (uintptr_t) *slot);
+    }
+}
+
+static void writeObject(VM *vm, ObjHeader *obj, void *arg) {
+    SnapshotWriter *writer = (SnapshotWriter *) arg;
+    uint32_t class = classId(writer, OBJ_CLASS(obj));
+    writer->refNum = 0;
+    visitObjectSlots(vm, obj, collectRef);
+
+    FILE *file = writer->file;
+    fputc(HEAP_RECORD_OBJECT, file);
+    writeVarint(file, (uintptr_t) obj);
+    writeVarint(file, OBJ_TYPE(obj));
+    writeVarint(file, class);
+    writeVarint(file, gcObjectSize(obj));
+    writeVarint(file, writer->refNum);
+    uint32_t idx = 0;
+    while (idx < writer->refNum) {
+        writeVarint(file, (uintptr_t) writer->refs[idx++]);
+    }
+}
+
+/**
+ * 把堆中所有对象及其引用写入path, 格式见heap_snapshot.h
+ * 写之前先做新生代回收和全堆回收, 使快照中只有存活对象, 因此只能在安全点调用
+ * 写文件失败时返回false
+ */
+bool writeHeapSnapshot(VM *vm, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    gcFinishConcurrentMark(vm);
+    minorGC(vm);
+    startGC(vm);
+
+    SnapshotWriter writer;
+    writer.file = file;
+    writer.classes = NULL;
+    writer.classIds = NULL;
+    writer.capacity = writer.classNum = 0;
+    writer.refs = NULL;
+    writer.refNum = writer.refCapacity = 0;
+    curWriter = &writer;
+
+    fwrite(HEAP_SNAPSHOT_MAGIC, 1, HEAP_SNAPSHOT_MAGIC_LEN, file);
+    writeVarint(file, HEAP_SNAPSHOT_VERSION);
+    visitRootSlots(vm, writeRoot);
+    gcWalkHeap(vm, writeObject, &writer);
+    fputc(HEAP_RECORD_END, file);
+
+    curWriter = NULL;
+    free(writer.classes);
+    free(writer.classIds);
+    free(writer.refs);
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    return ok;
+}
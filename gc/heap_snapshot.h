@@ -0,0 +1,31 @@
+//
+// Created by Kosho on 2020/2/27.
+//
+
+#ifndef _GC_HEAP_SNAPSHOT_H
+#define _GC_HEAP_SNAPSHOT_H
+
+#include "vm.h"
+
+/**
+ * 堆快照文件格式, 整数都是LEB128变长编码:
+ *   文件头   HEAP_SNAPSHOT_MAGIC, 版本号
+ *   类名记录 'C' 类名编号 长度 字节
+ *   对象记录 'O' 对象地址 对象类型 类名编号 字节数 引用数 各引用对象的地址
+ *   根记录   'R' 对象地址
+ *   结束记录 'E'
+ * 类名编号从1开始, 在对象记录之前定义; 0表示对象尚无类
+ * 字节数含对象本身及其缓冲区, 引用包括对象的类
+ */
+#define HEAP_SNAPSHOT_MAGIC "CRABHEAP"
+#define HEAP_SNAPSHOT_MAGIC_LEN 8
+#define HEAP_SNAPSHOT_VERSION 1
+
+#define HEAP_RECORD_CLASS 'C'
+#define HEAP_RECORD_OBJECT 'O'
+#define HEAP_RECORD_ROOT 'R'
+#define HEAP_RECORD_END 'E'
+
+bool writeHeapSnapshot(VM *vm, const char *path);
+
+#endif
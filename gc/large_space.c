@@ -0,0 +1,140 @@
+//
+// Created by Kosho on 2020/2/24.
+//
+
+#include "large_space.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// 页大小, 第一次用到时获取
+static size_t pageSize;
+// 已登记的大块, 并行清除时多个线程会同时释放, 由largeLock保护
+static LargeBlock *largeBlocks;
+static size_t mappedBytes;
+static pthread_mutex_t largeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t getPageSize(void) {
+    if (pageSize == 0) {
+        pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    }
+    return pageSize;
+}
+
+// 容纳块头和size字节用户内存的映射大小
+static size_t mapSizeOf(size_t size) {
+    size_t page = getPageSize();
+    return (sizeof(LargeBlock) + size + page - 1) & ~(page - 1);
+}
+
+// 调用者持有largeLock
+static void linkBlock(LargeBlock *block) {
+    block->prev = NULL;
+    block->next = largeBlocks;
+    if (largeBlocks != NULL) {
+        largeBlocks->prev = block;
+    }
+    largeBlocks = block;
+    mappedBytes += block->mapSize;
+}
+
+// 调用者持有largeLock
+static void unlinkBlock(LargeBlock *block) {
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        largeBlocks = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    mappedBytes -= block->mapSize;
+}
+
+/**
+ * ptr是否是largeAlloc分配的用户内存
+ * 先按页内偏移筛选, 只有少数malloc返回的地址需要查登记表
+ */
+bool isLargeBlock(void *ptr) {
+    if (((uintptr_t) ptr & (getPageSize() - 1)) != sizeof(LargeBlock)) {
+        return false;
+    }
+    LargeBlock *target = (LargeBlock *) ptr - 1;
+    pthread_mutex_lock(&largeLock);
+    LargeBlock *block = largeBlocks;
+    while (block != NULL && block != target) {
+        block = block->next;
+    }
+    pthread_mutex_unlock(&largeLock);
+    return block != NULL;
+}
+
+/**
+ * 单独映射一块内存, 失败时返回NULL
+ * 不经过malloc, 释放时整块归还操作系统
+ */
+void *largeAlloc(size_t size) {
+    size_t mapSize = mapSizeOf(size);
+    LargeBlock *block = (LargeBlock *) mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        return NULL;
+    }
+    block->mapSize = mapSize;
+    pthread_mutex_lock(&largeLock);
+    linkBlock(block);
+    pthread_mutex_unlock(&largeLock);
+    return block + 1;
+}
+
+/**
+ * 改变大块内存的大小, 由内核重新映射页面而不复制数据, 失败时返回NULL且原内存不变
+ */
+void *largeRealloc(void *ptr, size_t newSize) {
+    LargeBlock *block = (LargeBlock *) ptr - 1;
+    size_t mapSize = mapSizeOf(newSize);
+    if (mapSize == block->mapSize) {
+        return ptr;
+    }
+
+    pthread_mutex_lock(&largeLock);
+    unlinkBlock(block);
+    LargeBlock *newBlock = (LargeBlock *) mremap(block, block->mapSize, mapSize, MREMAP_MAYMOVE);
+    if (newBlock == MAP_FAILED) {
+        linkBlock(block);
+        pthread_mutex_unlock(&largeLock);
+        return NULL;
+    }
+    newBlock->mapSize = mapSize;
+    linkBlock(newBlock);
+    pthread_mutex_unlock(&largeLock);
+    return newBlock + 1;
+}
+
+/**
+ * 解除映射, 页面立即归还操作系统
+ */
+void largeFree(void *ptr) {
+    LargeBlock *block = (LargeBlock *) ptr - 1;
+    pthread_mutex_lock(&largeLock);
+    unlinkBlock(block);
+    pthread_mutex_unlock(&largeLock);
+    munmap(block, block->mapSize);
+}
+
+/**
+ * 当前映射的大块内存总字节数
+ */
+size_t largeMappedBytes(void) {
+    pthread_mutex_lock(&largeLock);
+    size_t bytes = mappedBytes;
+    pthread_mutex_unlock(&largeLock);
+    return bytes;
+}
+
+/**
+ * 大块内存实际占用的字节数, 含块头和页内的空余部分
+ */
+size_t largeBlockSize(void *ptr) {
+    return ((LargeBlock *) ptr - 1)->mapSize;
+}
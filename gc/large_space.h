@@ -0,0 +1,34 @@
+//
+// Created by Kosho on 2020/2/24.
+//
+
+#ifndef _GC_LARGE_SPACE_H
+#define _GC_LARGE_SPACE_H
+
+#include "common.h"
+
+/**
+ * 大块内存的块头, 位于mmap映射的起始处, 用户内存紧随其后, 因此用户内存的页内偏移恰为块头大小
+ * 所有大块以双向链表登记, 进程内的各个vm(包括并行编译和清除用的影子vm)共用
+ */
+typedef struct largeBlock {
+    struct largeBlock *prev;
+    struct largeBlock *next;
+    // 映射的字节数, 含块头, 是页大小的整数倍
+    size_t mapSize;
+    size_t padding;
+} LargeBlock;
+
+bool isLargeBlock(void *ptr);
+
+void *largeAlloc(size_t size);
+
+void *largeRealloc(void *ptr, size_t newSize);
+
+void largeFree(void *ptr);
+
+size_t largeMappedBytes(void);
+
+size_t largeBlockSize(void *ptr);
+
+#endif
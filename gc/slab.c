@@ -0,0 +1,253 @@
+//
+// Created by Kosho on 2020/2/25.
+//
+
+#include "slab.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// 整个进程共用一段预留的地址空间, 按页切分给各大小级别, 判断指针是否来自slab只需比较地址
+#define SLAB_SPACE_SIZE ((size_t) 4 * 1024 * 1024 * 1024)
+// 每页只存放同一级别的内存块
+#define SLAB_PAGE_SHIFT 16
+#define SLAB_PAGE_SIZE ((size_t) 1 << SLAB_PAGE_SHIFT)
+#define SLAB_PAGE_NUM (SLAB_SPACE_SIZE >> SLAB_PAGE_SHIFT)
+
+static char *spaceStart;
+static char *spaceEnd;
+// 下一个未分出的页
+static char *spaceTop;
+// 每页的大小级别
+static uint8_t pageClass[SLAB_PAGE_NUM];
+// 已归还操作系统的页的序号, 再分页时优先使用
+static uint32_t freePages[SLAB_PAGE_NUM];
+static uint32_t freePageNum;
+static pthread_once_t spaceOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t spaceLock = PTHREAD_MUTEX_INITIALIZER;
+
+// 只预留地址, 页面在分出时才设为可读写, 不占用提交的内存
+static void reserveSpace(void) {
+    char *start = (char *) mmap(NULL, SLAB_SPACE_SIZE, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == MAP_FAILED) {
+        return;
+    }
+    // 按页对齐, 块在页内的偏移是其大小的整数倍
+    spaceTop = spaceStart = (char *) (((uintptr_t) start + SLAB_PAGE_SIZE - 1) & ~(SLAB_PAGE_SIZE - 1));
+    spaceEnd = start + SLAB_SPACE_SIZE;
+}
+
+// 分出一页给级别cls, 地址空间用尽时返回NULL
+static char *allocPage(uint32_t cls) {
+    pthread_once(&spaceOnce, reserveSpace);
+    pthread_mutex_lock(&spaceLock);
+    char *page = NULL;
+    if (freePageNum > 0) {
+        // 归还过的页仍可读写, 内核在首次访问时重新提供清零的页面
+        page = spaceStart + ((size_t) freePages[--freePageNum] << SLAB_PAGE_SHIFT);
+        pageClass[(page - spaceStart) >> SLAB_PAGE_SHIFT] = (uint8_t) cls;
+    } else if (spaceStart != NULL && spaceTop + SLAB_PAGE_SIZE <= spaceEnd &&
+               mprotect(spaceTop, SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE) == 0) {
+        page = spaceTop;
+        spaceTop += SLAB_PAGE_SIZE;
+        pageClass[(page - spaceStart) >> SLAB_PAGE_SHIFT] = (uint8_t) cls;
+    }
+    pthread_mutex_unlock(&spaceLock);
+    return page;
+}
+
+/**
+ * 初始化为空, 不持有任何页
+ */
+void slabCacheInit(SlabCache *cache) {
+    uint32_t cls = 0;
+    while (cls < SLAB_CLASS_NUM) {
+        cache->freeCells[cls] = NULL;
+        cache->top[cls] = cache->end[cls] = NULL;
+        cls++;
+    }
+    cache->evacuating = false;
+}
+
+/**
+ * ptr是否由slabAlloc分配
+ */
+bool isSlabCell(void *ptr) {
+    return (char *) ptr >= spaceStart && (char *) ptr < spaceEnd;
+}
+
+/**
+ * slab块的实际大小
+ */
+uint32_t slabCellSize(void *ptr) {
+    return (pageClass[((char *) ptr - spaceStart) >> SLAB_PAGE_SHIFT] + 1) * SLAB_GRANULE;
+}
+
+/**
+ * 从vm自己的空闲链表分配不超过SLAB_MAX_SIZE的内存, 链表为空或正在疏散时从当前页切分
+ * 地址空间用尽时返回NULL, 由调用者改用malloc
+ */
+void *slabAlloc(VM *vm, uint32_t size) {
+    SlabCache *cache = &vm->slabs;
+    uint32_t cls = (size + (size == 0) + SLAB_GRANULE - 1) / SLAB_GRANULE - 1;
+    SlabCell *cell = cache->freeCells[cls];
+    if (cell != NULL && !cache->evacuating) {
+        cache->freeCells[cls] = cell->next;
+        return cell;
+    }
+
+    uint32_t cellSize = (cls + 1) * SLAB_GRANULE;
+    if (cache->top[cls] + cellSize > cache->end[cls]) {
+        char *page = allocPage(cls);
+        if (page == NULL) {
+            return NULL;
+        }
+        // 当前页剩余不足一块的部分直接丢弃
+        cache->top[cls] = page;
+        cache->end[cls] = page + SLAB_PAGE_SIZE;
+    }
+    void *ptr = cache->top[cls];
+    cache->top[cls] += cellSize;
+    return ptr;
+}
+
+/**
+ * 把ptr归还到vm自己的空闲链表, 不论它由哪个vm分配
+ */
+void slabFree(VM *vm, void *ptr) {
+    SlabCache *cache = &vm->slabs;
+    uint32_t cls = pageClass[((char *) ptr - spaceStart) >> SLAB_PAGE_SHIFT];
+    SlabCell *cell = (SlabCell *) ptr;
+    cell->next = cache->freeCells[cls];
+    cache->freeCells[cls] = cell;
+}
+
+// 把当前页中未切分的部分逐块挂到空闲链表上
+static void releaseCurrentPages(SlabCache *cache, SlabCache *fromCache) {
+    uint32_t cls = 0;
+    while (cls < SLAB_CLASS_NUM) {
+        uint32_t cellSize = (cls + 1) * SLAB_GRANULE;
+        char *top = fromCache->top[cls];
+        while (top != NULL && top + cellSize <= fromCache->end[cls]) {
+            SlabCell *cell = (SlabCell *) top;
+            cell->next = cache->freeCells[cls];
+            cache->freeCells[cls] = cell;
+            top += cellSize;
+        }
+        fromCache->top[cls] = fromCache->end[cls] = NULL;
+        cls++;
+    }
+}
+
+/**
+ * 影子vm结束时把其空闲链表和当前页中未切分的部分并入vm
+ */
+void slabAdopt(VM *vm, VM *from) {
+    SlabCache *cache = &vm->slabs;
+    SlabCache *fromCache = &from->slabs;
+    uint32_t cls = 0;
+    while (cls < SLAB_CLASS_NUM) {
+        SlabCell *cells = fromCache->freeCells[cls];
+        if (cells != NULL) {
+            SlabCell *tail = cells;
+            while (tail->next != NULL) {
+                tail = tail->next;
+            }
+            tail->next = cache->freeCells[cls];
+            cache->freeCells[cls] = cells;
+        }
+        cls++;
+    }
+    releaseCurrentPages(cache, fromCache);
+    slabCacheInit(fromCache);
+}
+
+/**
+ * 开始疏散: 此后的分配都从新页切分, 整理堆时副本因此集中在少数页中,
+ * 原对象所在的页随原对象释放而整页空闲, 由slabEndEvacuation归还
+ */
+void slabBeginEvacuation(VM *vm) {
+    SlabCache *cache = &vm->slabs;
+    // 当前页里多半还有旧对象, 剩余部分同样视为空闲块
+    releaseCurrentPages(cache, cache);
+    cache->evacuating = true;
+}
+
+/**
+ * 结束疏散并把整页空闲的页归还操作系统
+ */
+void slabEndEvacuation(VM *vm) {
+    vm->slabs.evacuating = false;
+    slabTrim(vm);
+}
+
+// ptr所在页的序号
+#define PAGE_INDEX(ptr) ((uint32_t) (((char *) (ptr) - spaceStart) >> SLAB_PAGE_SHIFT))
+
+// 页中的块是否都空闲
+static bool isPageFree(const uint16_t *freeNum, uint32_t page) {
+    return freeNum[page] == SLAB_PAGE_SIZE / ((pageClass[page] + 1) * SLAB_GRANULE);
+}
+
+/**
+ * 把vm中所有块都空闲的页归还操作系统, 页留在地址空间中供以后再分出
+ * 页中的块只由分出该页的vm(及其影子vm, 结束时已并入)分配和释放,
+ * 因此vm自己的空闲链表加上当前页未切分的部分就能判断整页是否空闲
+ */
+void slabTrim(VM *vm) {
+    if (spaceStart == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&spaceLock);
+    uint32_t pageNum = PAGE_INDEX(spaceTop);
+    pthread_mutex_unlock(&spaceLock);
+    uint16_t *freeNum = (uint16_t *) calloc(pageNum, sizeof(uint16_t));
+    if (freeNum == NULL) {
+        return;
+    }
+
+    // 统计每页的空闲块数
+    SlabCache *cache = &vm->slabs;
+    uint32_t cls = 0;
+    while (cls < SLAB_CLASS_NUM) {
+        SlabCell *cell = cache->freeCells[cls];
+        while (cell != NULL) {
+            freeNum[PAGE_INDEX(cell)]++;
+            cell = cell->next;
+        }
+        if (cache->top[cls] != NULL) {
+            freeNum[PAGE_INDEX(cache->top[cls])] += (cache->end[cls] - cache->top[cls]) / ((cls + 1) * SLAB_GRANULE);
+        }
+        cls++;
+    }
+
+    // 从空闲链表中摘除整页空闲的块
+    cls = 0;
+    while (cls < SLAB_CLASS_NUM) {
+        SlabCell **link = &cache->freeCells[cls];
+        while (*link != NULL) {
+            if (isPageFree(freeNum, PAGE_INDEX(*link))) {
+                *link = (*link)->next;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+        if (cache->top[cls] != NULL && isPageFree(freeNum, PAGE_INDEX(cache->top[cls]))) {
+            cache->top[cls] = cache->end[cls] = NULL;
+        }
+        cls++;
+    }
+
+    pthread_mutex_lock(&spaceLock);
+    uint32_t page = 0;
+    while (page < pageNum) {
+        if (isPageFree(freeNum, page)) {
+            madvise(spaceStart + ((size_t) page << SLAB_PAGE_SHIFT), SLAB_PAGE_SIZE, MADV_DONTNEED);
+            freePages[freePageNum++] = page;
+        }
+        page++;
+    }
+    pthread_mutex_unlock(&spaceLock);
+    free(freeNum);
+}
@@ -0,0 +1,28 @@
+//
+// Created by Kosho on 2020/2/25.
+//
+
+#ifndef _GC_SLAB_H
+#define _GC_SLAB_H
+
+#include "vm.h"
+
+void slabCacheInit(SlabCache *cache);
+
+bool isSlabCell(void *ptr);
+
+uint32_t slabCellSize(void *ptr);
+
+void *slabAlloc(VM *vm, uint32_t size);
+
+void slabFree(VM *vm, void *ptr);
+
+void slabAdopt(VM *vm, VM *from);
+
+void slabTrim(VM *vm);
+
+void slabBeginEvacuation(VM *vm);
+
+void slabEndEvacuation(VM *vm);
+
+#endif
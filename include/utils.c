@@ -5,24 +5,176 @@
 #include "utils.h"
 #include "vm.h"
 #include "parser.h"
+#include "gc.h"
 #include "common.h"
+#include "large_space.h"
+#include "slab.h"
 #include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
 #include <stdarg.h>
+#include <setjmp.h>
+
+// 按大小选择分配方式: 小块从vm的slab分配, 大块单独映射, 其余用malloc
+static void *allocBlock(VM *vm, uint32_t size) {
+    if (size <= SLAB_MAX_SIZE) {
+        void *cell = slabAlloc(vm, size);
+        if (cell != NULL) {
+            return cell;
+        }
+    }
+    if (size >= vm->config.largeObjectSize) {
+        return largeAlloc(size);
+    }
+    return malloc(size);
+}
+
+// 按ptr的来源释放
+static void freeBlock(VM *vm, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (isSlabCell(ptr)) {
+        slabFree(vm, ptr);
+    } else if (isLargeBlock(ptr)) {
+        largeFree(ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+// 经宿主分配函数分配的内存块前有8字节的头, 记录含头在内的大小, 返回给调用者的地址仍按8字节对齐
+#define HOST_BLOCK_HEADER_SIZE sizeof(uint64_t)
+
+// 经宿主分配函数把ptr改为newSize字节, 失败时返回NULL且ptr不变
+static void *resizeHostBlock(VM *vm, void *ptr, uint32_t newSize) {
+    uint64_t *block = ptr == NULL ? NULL : (uint64_t *) ptr - 1;
+    if (newSize == 0) {
+        if (block != NULL) {
+            vm->config.reallocateFn(block, 0, vm->config.userData);
+        }
+        return NULL;
+    }
+    block = (uint64_t *) vm->config.reallocateFn(block, HOST_BLOCK_HEADER_SIZE + newSize, vm->config.userData);
+    if (block == NULL) {
+        return NULL;
+    }
+    block[0] = HOST_BLOCK_HEADER_SIZE + newSize;
+    return block + 1;
+}
+
+// ptr实际占用的字节数, 内存统计以此为准, 因此不依赖调用者传入的旧大小
+static size_t blockSize(VM *vm, void *ptr) {
+    if (vm->config.reallocateFn != NULL) {
+        return ((uint64_t *) ptr)[-1];
+    }
+    if (isSlabCell(ptr)) {
+        return slabCellSize(ptr);
+    }
+    if (isLargeBlock(ptr)) {
+        return largeBlockSize(ptr);
+    }
+    return malloc_usable_size(ptr);
+}
+
+// 把ptr(usedSize字节)改为newSize字节, 失败时返回NULL且ptr不变
+// 原地能容纳时不移动, 否则按新大小重新选择分配方式并复制原内容
+static void *resizeBlock(VM *vm, void *ptr, size_t usedSize, uint32_t newSize) {
+    if (vm->config.reallocateFn != NULL) {
+        return resizeHostBlock(vm, ptr, newSize);
+    }
+    //避免realloc(NULL, 0)定义的新地址,此地址不能被释放
+    if (newSize == 0) {
+        freeBlock(vm, ptr);
+        return NULL;
+    }
+    if (ptr == NULL) {
+        return allocBlock(vm, newSize);
+    }
+
+    if (isSlabCell(ptr)) {
+        if (newSize <= usedSize) {
+            return ptr;
+        }
+    } else if (isLargeBlock(ptr)) {
+        // 大块内存由内核重新映射, 扩容时不复制数据; 缩小到阈值以下时移回普通堆
+        if (newSize >= vm->config.largeObjectSize) {
+            return largeRealloc(ptr, newSize);
+        }
+        usedSize = newSize;
+    } else if (newSize < vm->config.largeObjectSize) {
+        return realloc(ptr, newSize);
+    }
+
+    void *newPtr = allocBlock(vm, newSize);
+    if (newPtr != NULL) {
+        memcpy(newPtr, ptr, usedSize < newSize ? usedSize : newSize);
+        freeBlock(vm, ptr);
+    }
+    return newPtr;
+}
+
+// 内存耗尽: 有恢复点时跳转回去, 否则报错退出
+static void memoryExhausted(VM *vm, uint32_t size) {
+    if (vm->memErrorHandler == NULL) {
+        MEM_ERROR("out of memory: allocate %u bytes with %llu bytes in use!",
+                  size, (unsigned long long) vm->allocatedBytes);
+    }
+    memErrorThrow(vm);
+}
+
+// 即将多占用size字节: 超过堆上限时先做一次完整的全堆回收, 仍超出则内存耗尽; 超过阈值时按配置回收
+// gc暂停期间(包括gc自身的分配)既不回收也不检查上限, 此时的超出留到下次分配处理
+static void reserveBytes(VM *vm, uint32_t size) {
+    if (vm->gcPauseNum > 0) {
+        return;
+    }
+    uint64_t limit = vm->config.maxHeapSize;
+    if (limit != 0 && vm->allocatedBytes + size > limit) {
+        // 增量或并发回收的一步未必能释放内存, 在此一次完成整个周期
+        startGC(vm);
+        if (vm->allocatedBytes + size > limit) {
+            memoryExhausted(vm, size);
+        }
+    } else if (vm->allocatedBytes + size > vm->config.nextGC) {
+        collectGarbage(vm);
+    }
+}
 
 // 内存管理三种功能:
 // 1 申请内存
 // 2 修改空间大小
 // 3 释放内存
 void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize) {
-    vm->allocatedBytes += newSize - oldSize;
+    ASSERT(ptr == NULL || oldSize <= blockSize(vm, ptr), "old size is larger than the block!");
+    // 只在申请内存时判断是否需要gc, 释放内存时(包括gc自身的释放)不会触发
+    if (newSize > oldSize) {
+        reserveBytes(vm, newSize - oldSize);
+    }
 
-    //避免realloc(NULL, 0)定义的新地址,此地址不能被释放
-    if (newSize == 0) {
-        free(ptr);
-        return NULL;
+    size_t usedSize = ptr == NULL ? 0 : blockSize(vm, ptr);
+    void *newPtr = resizeBlock(vm, ptr, usedSize, newSize);
+    if (newPtr == NULL && newSize > 0) {
+        // 系统内存不足时回收一次再试, 仍失败则与超出堆上限同样处理
+        // gc暂停期间既不能回收, 也可能持有堆锁而不能跳出, 只能报错退出
+        if (vm->gcPauseNum > 0) {
+            MEM_ERROR("out of memory: allocate %u bytes while gc is paused!", newSize);
+        }
+        startGC(vm);
+        newPtr = resizeBlock(vm, ptr, usedSize, newSize);
+        if (newPtr == NULL) {
+            memoryExhausted(vm, newSize);
+        }
     }
 
-    return realloc(ptr, newSize);
+    vm->allocatedBytes -= usedSize;
+    if (newPtr != NULL) {
+        vm->allocatedBytes += blockSize(vm, newPtr);
+        if (vm->allocatedBytes > vm->peakBytes) {
+            vm->peakBytes = vm->allocatedBytes;
+        }
+    }
+    return newPtr;
 }
 
 // 找出大于等于v最近的2次幂
@@ -49,11 +201,72 @@ DEFINE_BUFFER_METHOD(Byte)
 void symbolTableClear(VM *vm, SymbolTable *buffer) {
     uint32_t idx = 0;
     while (idx < buffer->count) {
-        memManager(vm, buffer->datas[idx++].str, 0, 0);
+        DEALLOCATE_ARRAY(vm, buffer->datas[idx].str, buffer->datas[idx].length + 1);
+        idx++;
     }
     StringBufferClear(vm, buffer);
 }
 
+// arena中的分配按8字节对齐
+#define ARENA_ALIGN(size) (((size) + 7) & ~7u)
+
+void arenaInit(Arena *arena) {
+    arena->chunks = NULL;
+}
+
+/**
+ * 在当前块中分配size字节, 不够时追加新块, 当前块的剩余部分不再使用
+ */
+void *arenaAlloc(VM *vm, Arena *arena, uint32_t size) {
+    size = ARENA_ALIGN(size);
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->top + size > chunk->end) {
+        uint32_t dataSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (ArenaChunk *) memManager(vm, NULL, 0, sizeof(ArenaChunk) + dataSize);
+        if (chunk == NULL) {
+            MEM_ERROR("allocate arena chunk failed!");
+        }
+        chunk->top = chunk->data;
+        chunk->end = chunk->data + dataSize;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void *ptr = chunk->top;
+    chunk->top += size;
+    return ptr;
+}
+
+/**
+ * 把ptr处oldSize字节的内存扩大到newSize字节
+ * ptr是当前块中最后一次分配且空间足够时原地延长, 否则复制到新分配的内存中
+ */
+void *arenaRealloc(VM *vm, Arena *arena, void *ptr, uint32_t oldSize, uint32_t newSize) {
+    ArenaChunk *chunk = arena->chunks;
+    if (ptr != NULL && chunk != NULL && (char *) ptr + ARENA_ALIGN(oldSize) == chunk->top &&
+        (char *) ptr + ARENA_ALIGN(newSize) <= chunk->end) {
+        chunk->top = (char *) ptr + ARENA_ALIGN(newSize);
+        return ptr;
+    }
+    void *newPtr = arenaAlloc(vm, arena, newSize);
+    if (ptr != NULL) {
+        memcpy(newPtr, ptr, oldSize < newSize ? oldSize : newSize);
+    }
+    return newPtr;
+}
+
+/**
+ * 一次释放arena中的所有内存
+ */
+void arenaRelease(VM *vm, Arena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        memManager(vm, chunk, sizeof(ArenaChunk) + (chunk->end - chunk->data), 0);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+}
+
 //通用报错函数
 void errorReport(void *parser,
                  ErrorType errorType, const char *fmt, ...) {
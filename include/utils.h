@@ -6,6 +6,7 @@
 #define _INCLUDE_UTILS_H
 
 #include "common.h"
+#include <string.h>
 
 void* memManager(VM* vm, void* ptr, uint32_t oldSize, uint32_t newSize);
 
@@ -21,7 +22,7 @@ void* memManager(VM* vm, void* ptr, uint32_t oldSize, uint32_t newSize);
 #define DEALLOCATE_ARRAY(vmPtr, arrayPtr, count) \
    memManager(vmPtr, arrayPtr, sizeof(arrayPtr[0]) * count, 0)
 
-#define DEALLOCATE(vmPtr, memPtr) memManager(vmPtr, memPtr, 0, 0)
+#define DEALLOCATE(vmPtr, memPtr) memManager(vmPtr, memPtr, sizeof(*(memPtr)), 0)
 
 uint32_t ceilToPowerOf2(uint32_t v);
 
@@ -46,9 +47,13 @@ typedef struct {
       uint32_t capacity;\
    } type##Buffer;\
    void type##BufferInit(type##Buffer* buf);\
+   void type##BufferReserve(VM* vm, type##Buffer* buf, uint32_t extraCount);\
    void type##BufferFillWrite(VM* vm, \
      type##Buffer* buf, type data, uint32_t fillCount);\
    void type##BufferAdd(VM* vm, type##Buffer* buf, type data);\
+   void type##BufferAppendMany(VM* vm, \
+     type##Buffer* buf, const type* datas, uint32_t count);\
+   void type##BufferShrinkToFit(VM* vm, type##Buffer* buf);\
    void type##BufferClear(VM* vm, type##Buffer* buf);
 
 #define DEFINE_BUFFER_METHOD(type)\
@@ -57,16 +62,31 @@ typedef struct {
         buf->count = buf->capacity = 0;\
     }\
 \
-    void type##BufferFillWrite(VM* vm,\
-    type##Buffer* buf, type data, uint32_t fillCount) {\
-        uint32_t newCounts = buf->count + fillCount;\
+    /* 保证还能容纳extraCount个元素, 不改变count */\
+    /* memManager的大小是uint32_t, 总字节数超出时报错; 取整为2的幂后超出时容量取上限 */\
+    void type##BufferReserve(VM* vm, type##Buffer* buf, uint32_t extraCount) {\
+        uint64_t newCounts = (uint64_t)buf->count + extraCount;\
         if (newCounts > buf-> capacity) {\
+            uint32_t maxCapacity = UINT32_MAX / sizeof(type);\
+            if (newCounts > maxCapacity) {\
+                MEM_ERROR("buffer of %u elements can`t grow by %u elements!", buf->count, extraCount);\
+            }\
             size_t oldSize = buf->capacity * sizeof(type);\
-            buf->capacity = ceilToPowerOf2(newCounts);\
-            size_t newSize = buf->capacity * sizeof(type);\
+            uint32_t newCapacity = ceilToPowerOf2((uint32_t)newCounts);\
+            if (newCapacity == 0 || newCapacity > maxCapacity) {\
+                newCapacity = maxCapacity;\
+            }\
+            size_t newSize = newCapacity * sizeof(type);\
             ASSERT(newSize > oldSize, "faint...memory allocate!");\
+            /* 内存耗尽时memManager可能跳出, 分配成功后才更新容量 */\
             buf->datas = (type*)memManager(vm, buf->datas, oldSize, newSize);\
+            buf->capacity = newCapacity;\
         }\
+    }\
+\
+    void type##BufferFillWrite(VM* vm,\
+    type##Buffer* buf, type data, uint32_t fillCount) {\
+        type##BufferReserve(vm, buf, fillCount);\
         uint32_t cnt = 0;\
         while (cnt < fillCount) {\
             buf->datas[buf->count++] = data;\
@@ -75,7 +95,35 @@ typedef struct {
     }\
 \
     void type##BufferAdd(VM* vm, type##Buffer* buf, type data) {\
-       type##BufferFillWrite(vm, buf, data, 1);\
+       if (buf->count >= buf->capacity) {\
+           type##BufferReserve(vm, buf, 1);\
+       }\
+       buf->datas[buf->count++] = data;\
+    }\
+\
+    /* 一次追加count个元素, datas不能指向buf自身 */\
+    void type##BufferAppendMany(VM* vm,\
+    type##Buffer* buf, const type* datas, uint32_t count) {\
+       if (count == 0) {\
+           return;\
+       }\
+       type##BufferReserve(vm, buf, count);\
+       memcpy(buf->datas + buf->count, datas, count * sizeof(type));\
+       buf->count += count;\
+    }\
+\
+    /* 释放count之后的空闲容量 */\
+    void type##BufferShrinkToFit(VM* vm, type##Buffer* buf) {\
+       if (buf->count == buf->capacity) {\
+           return;\
+       }\
+       if (buf->count == 0) {\
+           type##BufferClear(vm, buf);\
+           return;\
+       }\
+       buf->datas = (type*)memManager(vm, buf->datas,\
+         buf->capacity * sizeof(type), buf->count * sizeof(type));\
+       buf->capacity = buf->count;\
     }\
 \
     void type##BufferClear(VM* vm, type##Buffer* buf) {\
@@ -109,6 +157,33 @@ void errorReport(void *parser,
 
 void symbolTableClear(VM *, SymbolTable *buffer);
 
+// arena块的默认大小, 更大的请求单独占一块
+#define ARENA_CHUNK_SIZE (16 * 1024)
+
+typedef struct arenaChunk {
+    struct arenaChunk *next;
+    // 下一个可分配的地址
+    char *top;
+    char *end;
+    char data[0];
+} ArenaChunk;
+
+/**
+ * 按指针碰撞分配的临时内存, 不能单独释放, 只能用arenaRelease整体释放
+ * 块链表的首结点为当前分配块
+ */
+typedef struct {
+    ArenaChunk *chunks;
+} Arena;
+
+void arenaInit(Arena *arena);
+
+void *arenaAlloc(VM *vm, Arena *arena, uint32_t size);
+
+void *arenaRealloc(VM *vm, Arena *arena, void *ptr, uint32_t oldSize, uint32_t newSize);
+
+void arenaRelease(VM *vm, Arena *arena);
+
 #define IO_ERROR(...)\
    errorReport(NULL, ERROR_IO, __VA_ARGS__)
 
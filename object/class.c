@@ -8,6 +8,7 @@
 #include "obj_range.h"
 #include "core.h"
 #include "vm.h"
+#include "gc.h"
 
 DEFINE_BUFFER_METHOD(Method)
 
@@ -16,28 +17,33 @@ DEFINE_BUFFER_METHOD(Method)
  */
 bool valueIsEqual(Value a, Value b) {
     // 类型不同则无须进行后面的比较
-    if (a.type != b.type) {
+    if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
         return false;
     }
 
     // 同为数字,比较数值
-    if (a.type == VT_NUM) {
-        return a.num == b.num;
+    if (VALUE_IS_NUM(a)) {
+        return VALUE_TO_NUM(a) == VALUE_TO_NUM(b);
+    }
+
+    // null、true、false和undefined都只有一个值
+    if (!VALUE_IS_OBJ(a)) {
+        return true;
     }
 
     // 同为对象,若所指的对象是同一个则返回true
-    if (a.objHeader == b.objHeader) {
+    if (VALUE_TO_OBJ(a) == VALUE_TO_OBJ(b)) {
         return true;
     }
 
     // 对象类型不同无须比较
-    if (a.objHeader->type != b.objHeader->type) {
+    if (OBJ_TYPE(VALUE_TO_OBJ(a)) != OBJ_TYPE(VALUE_TO_OBJ(b))) {
         return false;
     }
 
     //以下处理类型相同的对象
     //若对象同为字符串
-    if (a.objHeader->type == OT_STRING) {
+    if (OBJ_TYPE(VALUE_TO_OBJ(a)) == OT_STRING) {
         ObjString *strA = VALUE_TO_OBJSTR(a);
         ObjString *strB = VALUE_TO_OBJSTR(b);
         return (strA->value.length == strB->value.length &&
@@ -45,7 +51,7 @@ bool valueIsEqual(Value a, Value b) {
     }
 
     //若对象同为range
-    if (a.objHeader->type == OT_RANGE) {
+    if (OBJ_TYPE(VALUE_TO_OBJ(a)) == OT_RANGE) {
         ObjRange *rgA = VALUE_TO_OBJRANGE(a);
         ObjRange *rgB = VALUE_TO_OBJRANGE(b);
         return (rgA->from == rgB->from && rgA->to == rgB->to);
@@ -60,16 +66,21 @@ bool valueIsEqual(Value a, Value b) {
 Class *newRawClass(VM *vm, const char *name, uint32_t fieldNum) {
     Class *class = ALLOCATE(vm, Class);
     initObjHeader(vm, &class->objHeader, OT_CLASS, NULL);
-    class->name = newObjString(vm, name, strlen(name));
+    class->name = NULL;
     class->fieldNum = fieldNum;
     class->superClass = NULL;
     MethodBufferInit(&class->methods);
 
+    pushTmpRoot(vm, (ObjHeader *) class);
+    class->name = newObjString(vm, name, strlen(name));
+    gcWriteBarrier(vm, (ObjHeader *) class, OBJ_TO_VALUE(class->name));
+    popTmpRoot(vm);
+
     return class;
 }
 
 inline Class *getClassOfObj(VM *vm, Value object) {
-    switch (object.type) {
+    switch (VALUE_TYPE(object)) {
         case VT_NULL:
             return vm->nullClass;
         case VT_FALSE:
@@ -78,7 +89,7 @@ inline Class *getClassOfObj(VM *vm, Value object) {
         case VT_NUM:
             return vm->numClass;
         case VT_OBJ:
-            return VALUE_TO_OBJ(object)->class;
+            return OBJ_CLASS(VALUE_TO_OBJ(object));
         default:
             NOT_REACHED();
     }
@@ -21,12 +21,36 @@ typedef enum {
     MT_FN_CALL, // 有关函数对象的调用方法,用来实现函数重载
 } MethodType;
 
+#ifdef NAN_BOXING
+
+// 指数全1且最高两位尾数为1, 避开硬件运算产生的默认NaN
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+#define SIGN_BIT ((uint64_t) 1 << 63)
+
+// 单例值的标记为类型加1, 使QNAN本身不表示任何值
+#define VT_TO_VALUE(vt) ((Value){.bits = QNAN | (uint64_t) ((vt) + 1)})
+
+#define NUM_TO_VALUE(n) ((Value){.num = (n)})
+#define VALUE_TO_NUM(value) ((value).num)
+
+#define OBJ_TO_VALUE(objPtr) ((Value){.bits = SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (objPtr)})
+#define VALUE_TO_OBJ(value) ((ObjHeader *) (uintptr_t) ((value).bits & ~(SIGN_BIT | QNAN)))
+
+#define VALUE_IS_NUM(value) (((value).bits & QNAN) != QNAN)
+#define VALUE_IS_OBJ(value) (((value).bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+#define VALUE_IS_UNDEFINED(value) ((value).bits == (QNAN | (VT_UNDEFINED + 1)))
+#define VALUE_IS_NULL(value) ((value).bits == (QNAN | (VT_NULL + 1)))
+#define VALUE_IS_TRUE(value) ((value).bits == (QNAN | (VT_TRUE + 1)))
+#define VALUE_IS_FALSE(value) ((value).bits == (QNAN | (VT_FALSE + 1)))
+
+#define VALUE_TYPE(value) (VALUE_IS_NUM(value) ? VT_NUM : VALUE_IS_OBJ(value) ? VT_OBJ : \
+    (ValueType) (((value).bits & 7) - 1))
+
+#else
+
 #define VT_TO_VALUE(vt) \
     ((Value){vt, {0}})
 
-#define BOOL_TO_VALUE(boolean) (boolean ? VT_TO_VALUE(VT_TRUE) : VT_TO_VALUE(VT_FALSE))
-#define VALUE_TO_BOOL(value) ((value).type == VT_TRUE ? true : false)
-
 #define NUM_TO_VALUE(num) ((Value){VT_NUM, {num}})
 #define VALUE_TO_NUM(value) value.num
 
@@ -38,6 +62,21 @@ typedef enum {
 })
 
 #define VALUE_TO_OBJ(value) (value.objHeader)
+
+#define VALUE_IS_UNDEFINED(value) ((value).type == VT_UNDEFINED)
+#define VALUE_IS_NULL(value) ((value).type == VT_NULL)
+#define VALUE_IS_TRUE(value) ((value).type == VT_TRUE)
+#define VALUE_IS_FALSE(value) ((value).type == VT_FALSE)
+#define VALUE_IS_NUM(value) ((value).type == VT_NUM)
+#define VALUE_IS_OBJ(value) ((value).type == VT_OBJ)
+
+#define VALUE_TYPE(value) ((value).type)
+
+#endif
+
+#define BOOL_TO_VALUE(boolean) (boolean ? VT_TO_VALUE(VT_TRUE) : VT_TO_VALUE(VT_FALSE))
+#define VALUE_TO_BOOL(value) (VALUE_IS_TRUE(value) ? true : false)
+
 #define VALUE_TO_OBJSTR(value) ((ObjString*)VALUE_TO_OBJ(value))
 #define VALUE_TO_OBJFN(value) ((ObjFn*)VALUE_TO_OBJ(value))
 #define VALUE_TO_OBJRANGE(value) ((ObjRange*)VALUE_TO_OBJ(value))
@@ -49,19 +88,13 @@ typedef enum {
 #define VALUE_TO_OBJMODULE(value) ((ObjModule*)VALUE_TO_OBJ(value))
 #define VALUE_TO_CLASS(value) ((Class*)VALUE_TO_OBJ(value))
 
-#define VALUE_IS_UNDEFINED(value) ((value).type == VT_UNDEFINED)
-#define VALUE_IS_NULL(value) ((value).type == VT_NULL)
-#define VALUE_IS_TRUE(value) ((value).type == VT_TRUE)
-#define VALUE_IS_FALSE(value) ((value).type == VT_FALSE)
-#define VALUE_IS_NUM(value) ((value).type == VT_NUM)
-#define VALUE_IS_OBJ(value) ((value).type == VT_OBJ)
-#define VALUE_IS_CERTAIN_OBJ(value, objType) (VALUE_IS_OBJ(value) && VALUE_TO_OBJ(value)->type == objType)
+#define VALUE_IS_CERTAIN_OBJ(value, objType) (VALUE_IS_OBJ(value) && OBJ_TYPE(VALUE_TO_OBJ(value)) == objType)
 #define VALUE_IS_OBJSTR(value) (VALUE_IS_CERTAIN_OBJ(value, OT_STRING))
 #define VALUE_IS_OBJINSTANCE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_INSTANCE))
 #define VALUE_IS_OBJCLOSURE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_CLOSURE))
 #define VALUE_IS_OBJRANGE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_RANGE))
 #define VALUE_IS_CLASS(value) (VALUE_IS_CERTAIN_OBJ(value, OT_CLASS))
-#define VALUE_IS_0(value) (VALUE_IS_NUM(value) && (value).num == 0)
+#define VALUE_IS_0(value) (VALUE_IS_NUM(value) && VALUE_TO_NUM(value) == 0)
 
 /**
  * Native function ptr
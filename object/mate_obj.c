@@ -6,6 +6,7 @@
 #include "class.h"
 #include "vm.h"
 #include "meta_obj.h"
+#include "gc.h"
 
 /**
  * 新建模块
@@ -23,7 +24,10 @@ ObjModule *newObjModule(VM *vm, const char *modName) {
 
     objModule->name = NULL;
     if (modName != NULL) {
+        pushTmpRoot(vm, (ObjHeader *) objModule);
         objModule->name = newObjString(vm, modName, strlen(modName));
+        gcWriteBarrier(vm, (ObjHeader *) objModule, OBJ_TO_VALUE(objModule->name));
+        popTmpRoot(vm);
     }
 
     return objModule;
@@ -34,8 +38,8 @@ ObjModule *newObjModule(VM *vm, const char *modName) {
  */
 ObjInstance *newObjInstance(VM *vm, Class *class) {
     // 参数class主要作用是提供类中field的数目
-    ObjInstance *objInstance = ALLOCATE_EXTRA(vm,
-                                              ObjInstance, sizeof(Value) * class->fieldNum);
+    ObjInstance *objInstance = ALLOCATE_YOUNG_EXTRA(vm,
+                                                    ObjInstance, sizeof(Value) * class->fieldNum);
 
     // 在此关联对象的类为参数class
     initObjHeader(vm, &objInstance->objHeader, OT_INSTANCE, class);
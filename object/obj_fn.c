@@ -6,6 +6,7 @@
 #include "class.h"
 #include "vm.h"
 #include "obj_fn.h"
+#include "gc.h"
 
 /**
  * 创建空函数
@@ -22,9 +23,11 @@ ObjFn* newObjFn(VM* vm, ObjModule* objModule, uint32_t slotNum) {
     objFn->maxStackSlotUsedNum = slotNum;
     objFn->upvalueNum = objFn->argNum = 0;
 #ifdef DEBUG
+    pushTmpRoot(vm, (ObjHeader *) objFn);
     objFn->debug = ALLOCATE(vm, FnDebug);
     objFn->debug->fnName = NULL;
     IntBufferInit(&objFn->debug->lineNo);
+    popTmpRoot(vm);
 #endif
     return objFn;
 }
@@ -33,7 +36,7 @@ ObjFn* newObjFn(VM* vm, ObjModule* objModule, uint32_t slotNum) {
  * 以函数fn创建一个闭包
  */
 ObjClosure* newObjClosure(VM* vm, ObjFn* objFn) {
-    ObjClosure* objClosure = ALLOCATE_EXTRA(vm, ObjClosure, sizeof(ObjUpvalue*) * objFn->upvalueNum);
+    ObjClosure* objClosure = ALLOCATE_YOUNG_EXTRA(vm, ObjClosure, sizeof(ObjUpvalue*) * objFn->upvalueNum);
     initObjHeader(vm, &objClosure->objHeader, OT_CLOSURE, vm->fnClass);
     objClosure->fn = objFn;
 
@@ -49,7 +52,7 @@ ObjClosure* newObjClosure(VM* vm, ObjFn* objFn) {
  * 创建upvalue对象
  */
 ObjUpvalue* newObjUpvalue(VM* vm, Value* localVarPtr) {
-    ObjUpvalue* objUpvalue = ALLOCATE(vm, ObjUpvalue);
+    ObjUpvalue* objUpvalue = ALLOCATE_YOUNG(vm, ObjUpvalue);
     initObjHeader(vm, &objUpvalue->objHeader, OT_UPVALUE, NULL);
     objUpvalue->localVarPtr = localVarPtr;
     objUpvalue->closedUpvalue = VT_TO_VALUE(VT_NULL);
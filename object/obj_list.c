@@ -3,6 +3,7 @@
 //
 
 #include "obj_list.h"
+#include "gc.h"
 
 /**
  * 新建list对象
@@ -15,7 +16,7 @@ ObjList *newObjList(VM *vm, uint32_t elementNum) {
         elementArray = ALLOCATE_ARRAY(vm, Value, elementNum);
     }
 
-    ObjList *objList = ALLOCATE(vm, ObjList);
+    ObjList *objList = ALLOCATE_YOUNG(vm, ObjList);
 
     objList->elements.datas = elementArray;
     objList->elements.capacity = objList->elements.count = elementNum;
@@ -31,26 +32,28 @@ void insertElement(VM *vm, ObjList *objList, uint32_t index, Value value) {
         RUN_ERROR("index out bounded!");
     }
 
-    // 增加一个空位
-    ValueBufferAdd(vm, &objList->elements, VT_TO_VALUE(VT_NULL));
-
-    // index后面的元素整体后移一位
-    uint32_t idx = objList->elements.count - 1;
-    while (idx > index) {
-        objList->elements.datas[idx] = objList->elements.datas[idx - 1];
-        idx--;
-    }
+    gcLockHeap(vm);
+    // 预留一个空位, index后面的元素整体后移一位
+    ValueBufferReserve(vm, &objList->elements, 1);
+    Value *datas = objList->elements.datas;
+    memmove(datas + index + 1, datas + index, (objList->elements.count - index) * sizeof(Value));
+    objList->elements.count++;
 
     // 插入Value
     objList->elements.datas[index] = value;
+    gcWriteBarrier(vm, (ObjHeader *) objList, value);
+    gcUnlockHeap(vm);
 }
 
 // 调整list容量
 void shrinkList(VM *vm, ObjList *objList, uint32_t newCapacity) {
     uint32_t oldSize = objList->elements.capacity * sizeof(Value);
     uint32_t newSize = newCapacity * sizeof(Value);
-    memManager(vm, objList->elements.datas, oldSize, newSize);
+    gcLockHeap(vm);
+    // 大块缩到阈值以下时会移回普通堆, 地址可能改变
+    objList->elements.datas = memManager(vm, objList->elements.datas, oldSize, newSize);
     objList->elements.capacity = newCapacity;
+    gcUnlockHeap(vm);
 }
 
 /**
@@ -58,13 +61,12 @@ void shrinkList(VM *vm, ObjList *objList, uint32_t newCapacity) {
  */
 Value removeElement(VM *vm, ObjList *objList, uint32_t index) {
     Value valueToRemove = objList->elements.datas[index];
+    gcLockHeap(vm);
+    gcPreWriteBarrier(vm, valueToRemove);
 
     // index后面的元素整体前移一位
-    uint32_t idx = index;
-    while (idx < objList->elements.count) {
-        objList->elements.datas[idx] = objList->elements.datas[idx + 1];
-        idx++;
-    }
+    Value *datas = objList->elements.datas;
+    memmove(datas + index, datas + index + 1, (objList->elements.count - index - 1) * sizeof(Value));
 
     // 若容量利用率过低减小容量
     uint32_t capacity = objList->elements.capacity / CAPACITY_GROW_FACTOR;
@@ -73,6 +75,7 @@ Value removeElement(VM *vm, ObjList *objList, uint32_t index) {
     }
 
     objList->elements.count--;
+    gcUnlockHeap(vm);
     return valueToRemove;
 }
 
@@ -7,12 +7,13 @@
 #include "vm.h"
 #include "obj_string.h"
 #include "obj_range.h"
+#include "gc.h"
 
 /**
  * 创建Map对象
  */
 ObjMap *newObjMap(VM *vm) {
-    ObjMap *objMap = ALLOCATE(vm, ObjMap);
+    ObjMap *objMap = ALLOCATE_YOUNG(vm, ObjMap);
     initObjHeader(vm, &objMap->objHeader, OT_MAP, vm->mapClass);
     objMap->capacity = objMap->count = 0;
     objMap->entries = NULL;
@@ -28,7 +29,7 @@ static uint32_t hashNum(double num) {
 
 // 计算对象的哈希码
 static uint32_t hashObj(ObjHeader *objHeader) {
-    switch (objHeader->type) {
+    switch (OBJ_TYPE(objHeader)) {
         case OT_CLASS:  //计算class的哈希值
             return hashString(((Class *) objHeader)->name->value.start,
                               ((Class *) objHeader)->name->value.length);
@@ -47,17 +48,17 @@ static uint32_t hashObj(ObjHeader *objHeader) {
 
 // 根据value的类型调用相应的hash函数
 static uint32_t hashValue(Value value) {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VT_FALSE:
             return 0;
         case VT_NULL:
             return 1;
         case VT_NUM:
-            return hashNum(value.num);
+            return hashNum(VALUE_TO_NUM(value));
         case VT_TRUE:
             return 2;
         case VT_OBJ:
-            return hashObj(value.objHeader);
+            return hashObj(VALUE_TO_OBJ(value));
         default:
             RUN_ERROR("unsupport type hashed!");
     }
@@ -73,7 +74,7 @@ static bool addEntry(Entry *entries, uint32_t capacity, Value key, Value value)
     //通过开放探测法去找可用的slot
     while (true) {
         //找到空闲的slot,说明目前没有此key,直接赋值返回
-        if (entries[index].key.type == VT_UNDEFINED) {
+        if (VALUE_IS_UNDEFINED(entries[index].key)) {
             entries[index].key = key;
             entries[index].value = value;
             return true;       //新的key就返回true
@@ -106,7 +107,7 @@ static void resizeMap(VM *vm, ObjMap *objMap, uint32_t newCapacity) {
         idx = 0;
         while (idx < objMap->capacity) {
             //该slot有值
-            if (entryArr[idx].key.type != VT_UNDEFINED) {
+            if (!VALUE_IS_UNDEFINED(entryArr[idx].key)) {
                 addEntry(newEntries, newCapacity,
                          entryArr[idx].key, entryArr[idx].value);
             }
@@ -115,7 +116,7 @@ static void resizeMap(VM *vm, ObjMap *objMap, uint32_t newCapacity) {
     }
 
     // 3 将老entry数组空间回收
-    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->count);
+    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->capacity);
     objMap->entries = newEntries;     //更新指针为新的entry数组
     objMap->capacity = newCapacity;    //更新容量
 }
@@ -156,6 +157,12 @@ static Entry *findEntry(ObjMap *objMap, Value key) {
  * 添加Entry
  */
 void mapSet(VM *vm, ObjMap *objMap, Value key, Value value) {
+    gcLockHeap(vm);
+    // 被覆盖的旧值
+    if (vm->gcPhase == GC_CONCURRENT_MARKING) {
+        gcPreWriteBarrier(vm, mapGet(objMap, key));
+    }
+
     // 当容量达到阈值时扩容
     if (objMap->count + 1 > objMap->capacity * MAP_LOAD_PERCENT) {
         uint32_t newCapacity = objMap->capacity * CAPACITY_GROW_FACTOR;
@@ -169,6 +176,9 @@ void mapSet(VM *vm, ObjMap *objMap, Value key, Value value) {
     if (addEntry(objMap->entries, objMap->capacity, key, value)) {
         objMap->count++;
     }
+    gcWriteBarrier(vm, (ObjHeader *) objMap, key);
+    gcWriteBarrier(vm, (ObjHeader *) objMap, value);
+    gcUnlockHeap(vm);
 }
 
 /**
@@ -186,9 +196,21 @@ Value mapGet(ObjMap *objMap, Value key) {
  * 回收objMap.entries空间
  */
 void clearMap(VM *vm, ObjMap *objMap) {
-    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->count);
+    gcLockHeap(vm);
+    if (vm->gcPhase == GC_CONCURRENT_MARKING) {
+        uint32_t idx = 0;
+        while (idx < objMap->capacity) {
+            Entry *entry = &objMap->entries[idx++];
+            if (!VALUE_IS_UNDEFINED(entry->key)) {
+                gcPreWriteBarrier(vm, entry->key);
+                gcPreWriteBarrier(vm, entry->value);
+            }
+        }
+    }
+    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->capacity);
     objMap->entries = NULL;
     objMap->capacity = objMap->count = 0;
+    gcUnlockHeap(vm);
 }
 
 /**
@@ -201,6 +223,10 @@ Value removeKey(VM *vm, ObjMap *objMap, Value key) {
         return VT_TO_VALUE(VT_NULL);
     }
 
+    gcLockHeap(vm);
+    gcPreWriteBarrier(vm, entry->key);
+    gcPreWriteBarrier(vm, entry->value);
+
     // 开放定址的伪删除
     Value value = entry->value;
     entry->key = VT_TO_VALUE(VT_UNDEFINED);
@@ -217,6 +243,26 @@ Value removeKey(VM *vm, ObjMap *objMap, Value key) {
         }
         resizeMap(vm, objMap, newCapacity);
     }
+    gcUnlockHeap(vm);
 
     return value;
 }
+
+/**
+ * 把map的容量收缩到恰好容纳现有的key, 同时去掉伪删除的entry
+ * 容量可以小于MIN_CAPACITY, 再次扩容时仍按MIN_CAPACITY起步
+ */
+void shrinkMap(VM *vm, ObjMap *objMap) {
+    if (objMap->count == 0) {
+        if (objMap->capacity > 0) {
+            clearMap(vm, objMap);
+        }
+        return;
+    }
+    uint32_t newCapacity = ceilToPowerOf2((uint32_t) (objMap->count / MAP_LOAD_PERCENT) + 1);
+    if (newCapacity < objMap->capacity) {
+        gcLockHeap(vm);
+        resizeMap(vm, objMap, newCapacity);
+        gcUnlockHeap(vm);
+    }
+}
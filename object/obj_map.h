@@ -34,4 +34,6 @@ void clearMap(VM *vm, ObjMap *objMap);
 
 Value removeKey(VM *vm, ObjMap *objMap, Value key);
 
+void shrinkMap(VM *vm, ObjMap *objMap);
+
 #endif
@@ -6,12 +6,13 @@
 #include "utils.h"
 #include "class.h"
 #include "vm.h"
+#include "gc.h"
 
 /**
  * 新建range对象
  */
 ObjRange* newObjRange(VM* vm, int from, int to) {
-    ObjRange* objRange = ALLOCATE(vm, ObjRange);
+    ObjRange* objRange = ALLOCATE_YOUNG(vm, ObjRange);
     initObjHeader(vm, &objRange->objHeader, OT_RANGE, vm->rangeClass);
     objRange->from = from;
     objRange->to = to;
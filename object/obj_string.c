@@ -8,6 +8,7 @@
 #include "utils.h"
 #include "common.h"
 #include "obj_string.h"
+#include "gc.h"
 
 const uint32_t FNV_OFFSET_BASIS = 2166136261;
 const uint32_t FNV_PRIME = 16777619;
@@ -39,7 +40,7 @@ ObjString *newObjString(VM *vm, const char *str, uint32_t length) {
 
     ASSERT(length == 0 || str != NULL, "str length don`t match str!");
 
-    ObjString *objString = ALLOCATE_EXTRA(vm, ObjString, length + 1);
+    ObjString *objString = ALLOCATE_YOUNG_EXTRA(vm, ObjString, length + 1);
 
     if (objString != NULL) {
         initObjHeader(vm, &objString->objHeader, OT_STRING, vm->stringClass);
@@ -4,6 +4,7 @@
 
 #include "obj_thread.h"
 #include "vm.h"
+#include "gc.h"
 
 void prepareFrame(ObjThread *objThread, ObjClosure *objClosure, Value *stackStart) {
     ASSERT(objThread->frameCapacity > objThread->usedFrameNum, "Frame not enough!");
@@ -35,6 +36,7 @@ ObjThread *newObjThread(VM *vm, ObjClosure *objClosure) {
     objThread->stackCapacity = stackCapacity;
 
     resetThread(objThread, objClosure);
+    gcWriteBarrier(vm, (ObjHeader *) objThread, OBJ_TO_VALUE(objClosure));
     return objThread;
 }
 
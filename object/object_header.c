@@ -5,14 +5,42 @@
 #include "object_header.h"
 #include "class.h"
 #include "vm.h"
+#include "gc.h"
 
 DEFINE_BUFFER_METHOD(Value)
 
 // 初始化对象头
 void initObjHeader(VM* vm, ObjHeader* objHeader, ObjType objType, Class* class) {
-    objHeader->type = objType;
-    objHeader->isDark = false;
-    objHeader->class = class; // 设置meta类
-    objHeader->next = vm->allObjects;
-    vm->allObjects = objHeader;
+    ASSERT(((uintptr_t) class & ~OBJ_CLASS_MASK) == 0, "class pointer exceeds 48 bits!");
+    uint64_t word = (uint64_t) (uintptr_t) class | ((uint64_t) objType << OBJ_TYPE_SHIFT);
+
+    // 新生代对象单独成链, 新生代回收时只需遍历此链表
+    bool isYoung = isFreshYoung(vm, objHeader);
+    if (isYoung) {
+        word |= OBJ_YOUNG;
+    } else if (vm->gcPhase == GC_CONCURRENT_MARKING) {
+        // 并发标记期间新分配的老年代对象直接标记为黑色, 标记线程不会读到正在初始化的对象
+        word |= OBJ_DARK;
+    }
+    objHeader->word = word;
+
+    if (isYoung) {
+        objHeader->next = vm->youngObjects;
+        vm->youngObjects = objHeader;
+    } else {
+        objHeader->next = vm->allObjects;
+        vm->allObjects = objHeader;
+    }
+}
+
+/**
+ * 改写对象所属的类, 保留其余各位; 也用于记录已移动对象的副本地址
+ */
+void objSetClass(ObjHeader* objHeader, Class* class) {
+    ASSERT(((uintptr_t) class & ~OBJ_CLASS_MASK) == 0, "class pointer exceeds 48 bits!");
+    uint64_t word = OBJ_WORD(objHeader);
+    while (!__atomic_compare_exchange_n(&objHeader->word, &word,
+                                        (word & ~OBJ_CLASS_MASK) | (uint64_t) (uintptr_t) class,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
 }
@@ -24,20 +24,54 @@ typedef enum {
     OT_THREAD
 } ObjType;
 
+// 对象类型的个数
+#define OBJ_TYPE_NUM (OT_THREAD + 1)
+
+// 对象头首字的布局: 低48位为class指针, 其上4位为对象类型, 再上4位为gc标志位, 最高8位为固定次数
+#define OBJ_CLASS_MASK (((uint64_t) 1 << 48) - 1)
+#define OBJ_TYPE_SHIFT 48
+#define OBJ_TYPE_MASK ((uint64_t) 0xf << OBJ_TYPE_SHIFT)
+// 对象是否可达, 新生代回收和整理堆时表示对象已移动, 此时class指向其副本
+// 冻结区对象不参与标记, 此时表示对象已在vm->frozenDirty中
+#define OBJ_DARK ((uint64_t) 1 << 52)
+// 对象是否位于新生代
+#define OBJ_YOUNG ((uint64_t) 1 << 53)
+// 对象是否已在记忆集中
+#define OBJ_REMEMBERED ((uint64_t) 1 << 54)
+// 字符串去重时表示引用已被改为指向规范字符串, 只在一次标记中有效
+#define OBJ_DEDUPED ((uint64_t) 1 << 55)
+// 被本地代码固定的次数, 大于0时整理堆不会移动它
+#define OBJ_PIN_SHIFT 56
+#define OBJ_PIN_ONE ((uint64_t) 1 << OBJ_PIN_SHIFT)
+
 /**
  * 对象头 <br/>
- * 用于记录元数据和GC
+ * 用于记录元数据和GC, 共16字节
  */
 typedef struct objHeader {
-    ObjType type;
-    // 对象是否可达
-    bool isDark;
-    // 对象所属的类
-    Class* class;
+    // 类型、所属的类、gc标志位和固定次数, 只能通过下面的宏读写
+    // 标记线程与mutator可能同时改写不同的位, 因此改写一律用原子操作
+    uint64_t word;
     // 链接所有分配对象
     struct objHeader* next;
 } ObjHeader;
 
+#define OBJ_WORD(obj) __atomic_load_n(&(obj)->word, __ATOMIC_RELAXED)
+#define OBJ_TYPE(obj) ((ObjType) ((OBJ_WORD(obj) & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT))
+#define OBJ_CLASS(obj) ((Class*) (uintptr_t) (OBJ_WORD(obj) & OBJ_CLASS_MASK))
+#define OBJ_IS_DARK(obj) ((OBJ_WORD(obj) & OBJ_DARK) != 0)
+#define OBJ_IS_YOUNG(obj) ((OBJ_WORD(obj) & OBJ_YOUNG) != 0)
+#define OBJ_IS_REMEMBERED(obj) ((OBJ_WORD(obj) & OBJ_REMEMBERED) != 0)
+#define OBJ_PIN_NUM(obj) ((uint32_t) (OBJ_WORD(obj) >> OBJ_PIN_SHIFT))
+
+#define OBJ_SET_FLAG(obj, flag) ((void) __atomic_fetch_or(&(obj)->word, (flag), __ATOMIC_RELAXED))
+// 置位flag, 返回此前是否已置位, 用于多个线程争抢同一个对象
+#define OBJ_TEST_AND_SET_FLAG(obj, flag) \
+    ((__atomic_fetch_or(&(obj)->word, (flag), __ATOMIC_RELAXED) & (flag)) != 0)
+#define OBJ_CLEAR_FLAG(obj, flag) ((void) __atomic_fetch_and(&(obj)->word, ~(flag), __ATOMIC_RELAXED))
+#define OBJ_PIN(obj) ((void) __atomic_fetch_add(&(obj)->word, OBJ_PIN_ONE, __ATOMIC_RELAXED))
+#define OBJ_UNPIN(obj) ((void) __atomic_fetch_sub(&(obj)->word, OBJ_PIN_ONE, __ATOMIC_RELAXED))
+
 /**
  * Value类型
  */
@@ -50,6 +84,18 @@ typedef enum {
     VT_OBJ
 } ValueType;
 
+#ifdef NAN_BOXING
+/**
+ * Value, NaN-boxing表示, 8字节 <br/>
+ * 数字直接存double; 其余值都落在quiet NaN的编码空间中,
+ * 对象为符号位|QNAN|指针(低48位), null/false/true/undefined为QNAN|标记
+ * 只能通过class.h中的VALUE_IS_*、*_TO_VALUE等宏访问
+ */
+typedef union {
+    uint64_t bits;
+    double num;
+} Value;
+#else
 /**
  * Value
  */
@@ -60,9 +106,17 @@ typedef struct {
         ObjHeader* objHeader;
     };
 } Value;
+#endif
 
 DECLARE_BUFFER_TYPE(Value)
 
+/**
+ * 引用槽访问函数, gc通过它读取或改写对象中的引用
+ */
+typedef void (*SlotVisitor)(VM *vm, ObjHeader **slot);
+
 void initObjHeader(VM* vm, ObjHeader* objHeader, ObjType objType, Class* class);
 
+void objSetClass(ObjHeader* objHeader, Class* class);
+
 #endif
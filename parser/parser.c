@@ -172,6 +172,30 @@ static void parseNum(Parser *parser) {
     parser->curToken.type = TOKEN_NUM;
 }
 
+/**
+ * 字符串字面量在parser的arena中拼接, 预留num个字节
+ * 正在拼接的字面量总是arena中最后的分配, 扩容时通常原地延长
+ */
+static void reserveStrBuffer(Parser *parser, ByteBuffer *buf, uint32_t num) {
+    if (buf->count + num <= buf->capacity) {
+        return;
+    }
+    uint32_t capacity = ceilToPowerOf2(buf->count + num);
+    buf->datas = (Byte *) arenaRealloc(parser->vm, &parser->arena, buf->datas, buf->capacity, capacity);
+    buf->capacity = capacity;
+}
+
+static void addStrByte(Parser *parser, ByteBuffer *buf, Byte byte) {
+    reserveStrBuffer(parser, buf, 1);
+    buf->datas[buf->count++] = byte;
+}
+
+static void appendStrBytes(Parser *parser, ByteBuffer *buf, const char *bytes, uint32_t num) {
+    reserveStrBuffer(parser, buf, num);
+    memcpy(buf->datas + buf->count, bytes, num);
+    buf->count += num;
+}
+
 /**
  * 解析unicode码点
  */
@@ -201,8 +225,9 @@ static void parseUnicodeCodePoint(Parser *parser, ByteBuffer *buf) {
     uint32_t byteNum = getByteNumOfEncodeUtf8(value);
     ASSERT(byteNum != 0, "utf8 encode bytes should be between 1 and 4!");
 
-    //为代码通用, 下面会直接写buf->datas,在此先写入byteNum个0,以保证事先有byteNum个空间
-    ByteBufferFillWrite(parser->vm, buf, 0, byteNum);
+    //为代码通用, 下面会直接写buf->datas,在此先预留byteNum个字节
+    reserveStrBuffer(parser, buf, byteNum);
+    buf->count += byteNum;
 
     //把value编码为utf8后写入缓冲区buf
     encodeUtf8(buf->datas + buf->count - byteNum, value);
@@ -246,48 +271,54 @@ static void parseString(Parser *parser) {
 
             switch (parser->curChar) {
                 case '0':
-                    ByteBufferAdd(parser->vm, &str, '\0');
+                    addStrByte(parser, &str, '\0');
                     break;
                 case 'a':
-                    ByteBufferAdd(parser->vm, &str, '\a');
+                    addStrByte(parser, &str, '\a');
                     break;
                 case 'b':
-                    ByteBufferAdd(parser->vm, &str, '\b');
+                    addStrByte(parser, &str, '\b');
                     break;
                 case 'f':
-                    ByteBufferAdd(parser->vm, &str, '\f');
+                    addStrByte(parser, &str, '\f');
                     break;
                 case 'n':
-                    ByteBufferAdd(parser->vm, &str, '\n');
+                    addStrByte(parser, &str, '\n');
                     break;
                 case 'r':
-                    ByteBufferAdd(parser->vm, &str, '\r');
+                    addStrByte(parser, &str, '\r');
                     break;
                 case 't':
-                    ByteBufferAdd(parser->vm, &str, '\t');
+                    addStrByte(parser, &str, '\t');
                     break;
                 case 'u':
                     parseUnicodeCodePoint(parser, &str);
                     break;
                 case '"':
-                    ByteBufferAdd(parser->vm, &str, '"');
+                    addStrByte(parser, &str, '"');
                     break;
                 case '\\':
-                    ByteBufferAdd(parser->vm, &str, '\\');
+                    addStrByte(parser, &str, '\\');
                     break;
                 default:
                     LEX_ERROR(parser, "unsupport escape \\%c", parser->curChar);
                     break;
             }
         } else {
-            ByteBufferAdd(parser->vm, &str, parser->curChar);
+            // 直到引号、插值或转义之前都是普通字符, 整段复制
+            const char *runStart = parser->nextCharPtr - 1;
+            char c = *parser->nextCharPtr;
+            while (c != '\0' && c != '"' && c != '%' && c != '\\') {
+                c = *++parser->nextCharPtr;
+            }
+            appendStrBytes(parser, &str, runStart, (uint32_t) (parser->nextCharPtr - runStart));
         }
     }
 
     // 识别到的字符串新建字符串对象存储到curToken的value中
     ObjString *objString = newObjString(parser->vm, (const char *) str.datas, str.count);
     parser->curToken.value = OBJ_TO_VALUE(objString);
-    ByteBufferClear(parser->vm, &str);
+    // str在compileModule返回时随arena一起释放
 }
 
 /**
@@ -542,8 +573,10 @@ void initParser(VM *vm, Parser *parser, const char *file, const char *sourceCode
     parser->curToken.type = TOKEN_UNKNOWN;
     parser->curToken.start = NULL;
     parser->curToken.length = 0;
+    parser->curToken.value = VT_TO_VALUE(VT_UNDEFINED);
     parser->preToken = parser->curToken;
     parser->interpolationExpectRightParenNum = 0;
     parser->vm = vm;
     parser->curModule = objModule;
+    arenaInit(&parser->arena);
 }
\ No newline at end of file
@@ -102,6 +102,7 @@ struct parser {
 
     int interpolationExpectRightParenNum; // 处于内嵌表达式之中时, 期望的右括号数量, 用于跟踪小括号对的嵌套
     struct parser *parent;                // 指向父parser
+    Arena arena;                          // 编译期间的临时内存, compileModule返回时一次释放
     VM *vm;
 };
 
@@ -0,0 +1,228 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "vm.h"
+#include "core.h"
+#include "compiler.h"
+#include "bytecode_cache.h"
+#include "meta_obj.h"
+#include "obj_fn.h"
+#include "obj_string.h"
+
+// 字节码缓存只对源码取哈希, 不重新编译, 任意字符串都可作为源码
+static const char *moduleCode = "var a = 1\nvar b = a.foo(2)\n";
+
+static char cachePath[64];
+
+// 方法符号操作数
+static uint32_t symbolAt(Byte *code, uint32_t ip) {
+    return (code[ip + 1] << 8) | code[ip + 2];
+}
+
+static int symbolOf(VM *vm, const char *name) {
+    return getIndexFromSymbolTable(&vm->allMethodNames, name, strlen(name));
+}
+
+// 手工构造模块函数: 常量有数字、字符串和内层函数, 指令中引用两个方法名和一个编译时定义的模块变量
+static ObjFn *buildModuleFn(VM *vm, ObjModule *objModule) {
+    int foo = ensureSymbolExist(vm, &vm->allMethodNames, "foo(_)", 6);
+    int bar = ensureSymbolExist(vm, &vm->allMethodNames, "bar", 3);
+    defineModuleVar(vm, objModule, "a", 1, NUM_TO_VALUE(1));
+    defineModuleVar(vm, objModule, "b", 1, VT_TO_VALUE(VT_NULL));
+
+    ObjFn *inner = newObjFn(vm, objModule, 1);
+    Byte innerCode[] = {OPCODE_LOAD_MODULE_VAR, 0, 0, OPCODE_CALL0, 0, (Byte) bar, OPCODE_RETURN, OPCODE_END};
+    ByteBufferAppendMany(vm, &inner->instrStream, innerCode, sizeof(innerCode));
+
+    ObjFn *fn = newObjFn(vm, objModule, 2);
+    ValueBufferAdd(vm, &fn->constants, NUM_TO_VALUE(1.5));
+    ValueBufferAdd(vm, &fn->constants, OBJ_TO_VALUE(newObjString(vm, "hi", 2)));
+    ValueBufferAdd(vm, &fn->constants, OBJ_TO_VALUE(inner));
+    Byte code[] = {
+            OPCODE_LOAD_CONSTANT, 0, 0,
+            OPCODE_LOAD_CONSTANT, 0, 1,
+            OPCODE_CALL1, (Byte) (foo >> 8), (Byte) foo,
+            OPCODE_STORE_MODULE_VAR, 0, 1,
+            OPCODE_CREATE_CLOSURE, 0, 2,
+            OPCODE_PUSH_NULL, OPCODE_RETURN, OPCODE_END
+    };
+    ByteBufferAppendMany(vm, &fn->instrStream, code, sizeof(code));
+    return fn;
+}
+
+// 与bytecode_cache.c相同的64位FNV-1a哈希, 用于在改动文件后重算校验和
+static uint64_t fnv(const uint8_t *bytes, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t idx = 0;
+    while (idx < length) {
+        hash ^= bytes[idx++];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint8_t *readAll(size_t *size) {
+    FILE *file = fopen(cachePath, "rb");
+    CHECK(file != NULL);
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    rewind(file);
+    uint8_t *data = (uint8_t *) malloc(*size);
+    CHECK(data != NULL && fread(data, 1, *size, file) == *size);
+    fclose(file);
+    return data;
+}
+
+// 把data的前size字节写为缓存文件, withChecksum时在末尾追加重算的校验和
+static void writeAll(const uint8_t *data, size_t size, bool withChecksum) {
+    FILE *file = fopen(cachePath, "wb");
+    CHECK(file != NULL);
+    fwrite(data, 1, size, file);
+    if (withChecksum) {
+        uint64_t checksum = fnv(data, size);
+        fwrite(&checksum, 1, sizeof(uint64_t), file);
+    }
+    fclose(file);
+}
+
+// 用新模块读取缓存, 失败时模块不能被改动
+static ObjFn *loadInto(VM *vm, const char *code) {
+    vm->gcPauseNum++;
+    ObjModule *objModule = newObjModule(vm, "cached");
+    ObjFn *fn = loadBytecodeCache(vm, objModule, code, cachePath);
+    if (fn == NULL) {
+        CHECK(objModule->moduleVarValue.count == 0);
+    }
+    vm->gcPauseNum--;
+    return fn;
+}
+
+// 写入后在另一个vm中读回: 方法名表顺序不同, 方法符号按名字重新链接
+static void testRoundTrip(VM *writer, VM *reader) {
+    reader->gcPauseNum++;
+    ObjModule *objModule = newObjModule(reader, "cached");
+    ObjFn *fn = loadBytecodeCache(reader, objModule, moduleCode, cachePath);
+    CHECK(fn != NULL);
+    CHECK(fn->module == objModule && fn->maxStackSlotUsedNum == 2);
+
+    // 编译时定义的模块变量按原顺序重新定义
+    CHECK(objModule->moduleVarName.count == 2);
+    CHECK(strcmp(objModule->moduleVarName.datas[0].str, "a") == 0);
+    CHECK(strcmp(objModule->moduleVarName.datas[1].str, "b") == 0);
+
+    CHECK(fn->constants.count == 3);
+    CHECK(VALUE_TO_NUM(fn->constants.datas[0]) == 1.5);
+    ObjString *hi = VALUE_TO_OBJSTR(fn->constants.datas[1]);
+    CHECK(hi->value.length == 2 && memcmp(hi->value.start, "hi", 2) == 0);
+    CHECK(VALUE_IS_CERTAIN_OBJ(fn->constants.datas[2], OT_FUNCTION));
+    ObjFn *inner = VALUE_TO_OBJFN(fn->constants.datas[2]);
+    CHECK(inner->module == objModule);
+
+    // 两个vm中"foo(_)"和"bar"的索引不同
+    CHECK(symbolOf(writer, "foo(_)") != symbolOf(reader, "foo(_)"));
+    CHECK(symbolOf(writer, "bar") != symbolOf(reader, "bar"));
+    CHECK(symbolAt(fn->instrStream.datas, 6) == (uint32_t) symbolOf(reader, "foo(_)"));
+    CHECK(symbolAt(inner->instrStream.datas, 3) == (uint32_t) symbolOf(reader, "bar"));
+    // 其它操作数不变
+    CHECK(symbolAt(fn->instrStream.datas, 9) == 1 && symbolAt(fn->instrStream.datas, 12) == 2);
+    reader->gcPauseNum--;
+}
+
+// 源码、版本或编译前的模块变量不符时视为过期
+static void testStale(VM *vm) {
+    CHECK(loadInto(vm, "var a = 2\nvar b = a.foo(2)\n") == NULL);
+    CHECK(loadInto(vm, "") == NULL);
+
+    size_t size;
+    uint8_t *data = readAll(&size);
+    // 版本号紧跟在8字节的magic之后
+    CHECK(data[BYTECODE_CACHE_MAGIC_LEN] == BYTECODE_CACHE_VERSION);
+    data[BYTECODE_CACHE_MAGIC_LEN] = BYTECODE_CACHE_VERSION + 1;
+    writeAll(data, size - sizeof(uint64_t), true);
+    CHECK(loadInto(vm, moduleCode) == NULL);
+    data[BYTECODE_CACHE_MAGIC_LEN] = BYTECODE_CACHE_VERSION;
+    writeAll(data, size - sizeof(uint64_t), true);
+    CHECK(loadInto(vm, moduleCode) != NULL);
+    free(data);
+
+    // 缓存写于没有模块变量的模块, 模块变量数或变量名不同时索引都对不上
+    vm->gcPauseNum++;
+    ObjModule *objModule = newObjModule(vm, "cached");
+    defineModuleVar(vm, objModule, "x", 1, VT_TO_VALUE(VT_NULL));
+    CHECK(loadBytecodeCache(vm, objModule, moduleCode, cachePath) == NULL);
+    CHECK(objModule->moduleVarValue.count == 1);
+    vm->gcPauseNum--;
+}
+
+// 截断或改动任一字节都不会越界读取; 校验和不符时一律拒绝
+static void testCorrupt(VM *vm) {
+    size_t size;
+    uint8_t *data = readAll(&size);
+    size_t payload = size - sizeof(uint64_t);
+
+    // 各种长度的截断, 包括为截断后的内容重算校验和, 使解析本身遇到文件结尾
+    size_t length = 0;
+    while (length < size) {
+        writeAll(data, length, false);
+        CHECK(loadInto(vm, moduleCode) == NULL);
+        if (length < payload) {
+            writeAll(data, length, true);
+            CHECK(loadInto(vm, moduleCode) == NULL);
+        }
+        length++;
+    }
+
+    // 逐字节改动: 校验和不变时必定拒绝, 重算校验和后可能仍是合法的缓存, 但不能出错
+    size_t idx = 0;
+    while (idx < payload) {
+        uint8_t byte = data[idx];
+        data[idx] = byte ^ 0x5a;
+        writeAll(data, payload, false);
+        FILE *file = fopen(cachePath, "ab");
+        fwrite(data + payload, 1, sizeof(uint64_t), file);
+        fclose(file);
+        CHECK(loadInto(vm, moduleCode) == NULL);
+        writeAll(data, payload, true);
+        loadInto(vm, moduleCode);
+        data[idx] = byte;
+        idx++;
+    }
+
+    writeAll(data, payload, true);
+    CHECK(loadInto(vm, moduleCode) != NULL);
+    free(data);
+}
+
+int main(void) {
+    snprintf(cachePath, sizeof(cachePath), "/tmp/crab_cache_test_%d.crabc", (int) getpid());
+
+    VM writerStorage, readerStorage;
+    VM *writer = &writerStorage;
+    VM *reader = &readerStorage;
+    initVM(writer);
+    buildCoreNatives(writer);
+    initVM(reader);
+    buildCoreNatives(reader);
+    // 读者先登记了另外的方法名, 同名方法的索引与写者不同
+    ensureSymbolExist(reader, &reader->allMethodNames, "bar", 3);
+    ensureSymbolExist(reader, &reader->allMethodNames, "zzz(_,_)", 8);
+
+    writer->gcPauseNum++;
+    ObjModule *objModule = newObjModule(writer, "cached");
+    ObjFn *fn = buildModuleFn(writer, objModule);
+    CHECK(writeBytecodeCache(writer, objModule, 0, fn, moduleCode, cachePath));
+    writer->gcPauseNum--;
+
+    testRoundTrip(writer, reader);
+    testStale(reader);
+    testCorrupt(reader);
+    CHECK(access(cachePath, F_OK) == 0);
+    unlink(cachePath);
+    CHECK(loadInto(reader, moduleCode) == NULL);
+    printf("cache test passed\n");
+    return 0;
+}
@@ -0,0 +1,265 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "test.h"
+#include "vm.h"
+#include "gc.h"
+#include "core.h"
+#include "channel.h"
+#include "class.h"
+#include "obj_fn.h"
+#include "obj_list.h"
+#include "obj_map.h"
+#include "obj_string.h"
+#include "obj_thread.h"
+
+// 以宿主身份调用Channel的原生方法signature, 静态方法的args[0]为Channel类, 返回值在args[0]中
+static bool callChannel(VM *vm, const char *signature, Value *args) {
+    int symbol = getIndexFromSymbolTable(&vm->allMethodNames, signature, strlen(signature));
+    CHECK(symbol != -1);
+    Class *class = VALUE_IS_CLASS(args[0]) ? OBJ_CLASS(&vm->channelClass->objHeader) : vm->channelClass;
+    CHECK((uint32_t) symbol < class->methods.count && class->methods.datas[symbol].type == MT_PRIMITIVE);
+    return class->methods.datas[symbol].primFn(vm, args);
+}
+
+static Value str(VM *vm, const char *s) {
+    return OBJ_TO_VALUE(newObjString(vm, s, strlen(s)));
+}
+
+static bool isStr(Value value, const char *s) {
+    return VALUE_IS_OBJSTR(value) && VALUE_TO_OBJSTR(value)->value.length == strlen(s) &&
+           memcmp(VALUE_TO_OBJSTR(value)->value.start, s, strlen(s)) == 0;
+}
+
+// 建立原生类并设置当前线程, 原生方法报错时写入它的errorObj
+static void initChannelVM(VM *vm) {
+    initVM(vm);
+    buildCoreNatives(vm);
+    // 核心模块以null为名
+    ObjModule *coreModule = VALUE_TO_OBJMODULE(mapGet(vm->allModules, VT_TO_VALUE(VT_NULL)));
+    vm->curThread = newObjThread(vm, newObjClosure(vm, newObjFn(vm, coreModule, 0)));
+}
+
+// Channel.create(name, capacity)或Channel.open(name)
+static Value openChannel(VM *vm, const char *name, uint32_t capacity, bool create) {
+    Value args[3] = {OBJ_TO_VALUE(vm->channelClass), str(vm, name), NUM_TO_VALUE(capacity)};
+    CHECK(callChannel(vm, create ? "create(_,_)" : "open(_)", args));
+    CHECK(VALUE_IS_OBJINSTANCE(args[0]));
+    return args[0];
+}
+
+static Channel *channelOf(VM *vm, Value channelObj) {
+    return vm->channels.datas[(uint32_t) VALUE_TO_NUM(VALUE_TO_OBJINSTANCE(channelObj)->fields[0])];
+}
+
+// 子进程: 在自己的vm中打开两个通道, 把收到的每条消息原样发回, 直到收到"end"
+static void echoChild(const char *requestName, const char *replyName) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initChannelVM(vm);
+    Value request = openChannel(vm, requestName, 0, false);
+    pushTmpRoot(vm, VALUE_TO_OBJ(request));
+    Value reply = openChannel(vm, replyName, 0, false);
+    pushTmpRoot(vm, VALUE_TO_OBJ(reply));
+
+    while (true) {
+        Value args[2] = {OBJ_TO_VALUE(vm->tmpRoots[0]), VT_TO_VALUE(VT_NULL)};
+        CHECK(callChannel(vm, "receive", args));
+        if (isStr(args[0], "end")) {
+            break;
+        }
+        args[1] = args[0];
+        args[0] = OBJ_TO_VALUE(vm->tmpRoots[1]);
+        CHECK(callChannel(vm, "send(_)", args));
+        CHECK(VALUE_IS_TRUE(args[0]));
+    }
+    _exit(0);
+}
+
+// 等到收齐num条消息, 经receiveAll成批取出后追加到list
+static ObjList *receiveN(VM *vm, Value channelObj, uint32_t num) {
+    ObjList *received = newObjList(vm, 0);
+    pushTmpRoot(vm, (ObjHeader *) received);
+    while (received->elements.count < num) {
+        Value args[2] = {channelObj, NUM_TO_VALUE(num)};
+        CHECK(callChannel(vm, "receiveAll(_)", args));
+        ObjList *batch = VALUE_TO_OBJLIST(args[0]);
+        received = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+        ValueBufferAppendMany(vm, &received->elements, batch->elements.datas, batch->elements.count);
+        if (batch->elements.count == 0) {
+            usleep(100);
+        }
+    }
+    popTmpRoot(vm);
+    return received;
+}
+
+// 经fork出的进程往返: 阻塞、非阻塞和成批的收发都得到原值
+static void testRoundTrip(VM *vm, Value request, Value reply) {
+    Value args[2] = {request, NUM_TO_VALUE(1)};
+    CHECK(callChannel(vm, "send(_)", args));
+    CHECK(VALUE_IS_TRUE(args[0]));
+    args[0] = request;
+    args[1] = str(vm, "two");
+    CHECK(callChannel(vm, "trySend(_)", args));
+    CHECK(VALUE_IS_TRUE(args[0]));
+
+    // [[1, "x"], {"k": 2}, null, true]
+    vm->gcPauseNum++;
+    ObjList *inner = newObjList(vm, 0);
+    ValueBufferAdd(vm, &inner->elements, NUM_TO_VALUE(1));
+    ValueBufferAdd(vm, &inner->elements, str(vm, "x"));
+    ObjMap *objMap = newObjMap(vm);
+    mapSet(vm, objMap, str(vm, "k"), NUM_TO_VALUE(2));
+    ObjList *batch = newObjList(vm, 0);
+    ValueBufferAdd(vm, &batch->elements, OBJ_TO_VALUE(inner));
+    ValueBufferAdd(vm, &batch->elements, OBJ_TO_VALUE(objMap));
+    ValueBufferAdd(vm, &batch->elements, VT_TO_VALUE(VT_NULL));
+    ValueBufferAdd(vm, &batch->elements, VT_TO_VALUE(VT_TRUE));
+    vm->gcPauseNum--;
+    args[0] = request;
+    args[1] = OBJ_TO_VALUE(batch);
+    CHECK(callChannel(vm, "sendAll(_)", args));
+    CHECK(VALUE_IS_TRUE(args[0]));
+
+    args[0] = reply;
+    CHECK(callChannel(vm, "receive", args));
+    CHECK(VALUE_IS_NUM(args[0]) && VALUE_TO_NUM(args[0]) == 1);
+    do {
+        args[0] = reply;
+        CHECK(callChannel(vm, "tryReceive", args));
+    } while (VALUE_IS_NULL(args[0]));
+    CHECK(isStr(args[0], "two"));
+
+    ObjList *received = receiveN(vm, reply, 4);
+    // 检查期间还要新建key字符串, 暂停gc以免received被移动
+    vm->gcPauseNum++;
+    CHECK(received->elements.count == 4);
+    Value *values = received->elements.datas;
+    CHECK(VALUE_IS_CERTAIN_OBJ(values[0], OT_LIST));
+    ObjList *list = VALUE_TO_OBJLIST(values[0]);
+    CHECK(list->elements.count == 2 && VALUE_TO_NUM(list->elements.datas[0]) == 1);
+    CHECK(isStr(list->elements.datas[1], "x"));
+    CHECK(VALUE_IS_CERTAIN_OBJ(values[1], OT_MAP));
+    Value k = str(vm, "k");
+    CHECK(valueIsEqual(mapGet(VALUE_TO_OBJMAP(values[1]), k), NUM_TO_VALUE(2)));
+    CHECK(VALUE_IS_NULL(values[2]));
+    CHECK(VALUE_IS_TRUE(values[3]));
+    vm->gcPauseNum--;
+
+    args[0] = request;
+    args[1] = str(vm, "end");
+    CHECK(callChannel(vm, "send(_)", args));
+}
+
+// 缓冲区满时trySend返回false, 读出后又有空间
+static void testFull(VM *vm, Value channelObj) {
+    char big[1000];
+    memset(big, 'b', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    uint32_t sent = 0;
+    Value args[2];
+    while (true) {
+        args[0] = channelObj;
+        args[1] = str(vm, big);
+        CHECK(callChannel(vm, "trySend(_)", args));
+        if (!VALUE_IS_TRUE(args[0])) {
+            break;
+        }
+        sent++;
+    }
+    CHECK(sent >= 3 && sent <= 4);
+    while (sent-- > 0) {
+        args[0] = channelObj;
+        CHECK(callChannel(vm, "tryReceive", args));
+        CHECK(isStr(args[0], big));
+    }
+    args[0] = channelObj;
+    CHECK(callChannel(vm, "tryReceive", args));
+    CHECK(VALUE_IS_NULL(args[0]));
+}
+
+// 损坏的帧和对端写坏的头部都只报错, 不越界访问, 之后的收发恢复正常
+static void testCorrupt(VM *vm, Value channelObj) {
+    Channel *channel = channelOf(vm, channelObj);
+    ChannelShm *shm = channel->shm;
+    Value args[2];
+
+    // payload的类型标记不存在
+    uint8_t frame[5] = {1, 0, 0, 0, 99};
+    CHECK(channelTryWrite(channel, frame, sizeof(frame)) == CHANNEL_OK);
+    args[0] = channelObj;
+    CHECK(!callChannel(vm, "tryReceive", args));
+    CHECK(isStr(vm->curThread->errorObj, "channel message corrupted!"));
+    CHECK(shm->tail == shm->head);
+
+    // 对端把head推到容量之外, 并改写头部的容量
+    shm->head = shm->tail + (uint64_t) channel->capacity * 4;
+    shm->capacity = UINT32_MAX;
+    args[0] = channelObj;
+    CHECK(!callChannel(vm, "tryReceive", args));
+    CHECK(shm->tail == shm->head);
+
+    // 对端把tail推到head之后
+    uint64_t head = shm->head;
+    shm->tail = head + 64;
+    args[0] = channelObj;
+    args[1] = str(vm, "after");
+    CHECK(!callChannel(vm, "trySend(_)", args));
+    shm->tail = head;
+
+    // 容量以打开时为准, 收发照常进行
+    args[0] = channelObj;
+    args[1] = str(vm, "after");
+    CHECK(callChannel(vm, "trySend(_)", args));
+    CHECK(VALUE_IS_TRUE(args[0]));
+    args[0] = channelObj;
+    CHECK(callChannel(vm, "tryReceive", args));
+    CHECK(isStr(args[0], "after"));
+}
+
+int main(void) {
+    char requestName[64], replyName[64];
+    snprintf(requestName, sizeof(requestName), "/crab_test_request_%d", (int) getpid());
+    snprintf(replyName, sizeof(replyName), "/crab_test_reply_%d", (int) getpid());
+
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initChannelVM(vm);
+    pushTmpRoot(vm, VALUE_TO_OBJ(openChannel(vm, requestName, 4096, true)));
+    pushTmpRoot(vm, VALUE_TO_OBJ(openChannel(vm, replyName, 4096, true)));
+    // 晋升到老年代后不再移动, 此后可以直接持有
+    minorGC(vm);
+    Value request = OBJ_TO_VALUE(vm->tmpRoots[0]);
+    Value reply = OBJ_TO_VALUE(vm->tmpRoots[1]);
+    CHECK(channelOf(vm, request)->capacity == 4096);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    CHECK(pid != -1);
+    if (pid == 0) {
+        echoChild(requestName, replyName);
+    }
+    testRoundTrip(vm, request, reply);
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    testFull(vm, request);
+    testCorrupt(vm, reply);
+
+    Value args[2] = {request, VT_TO_VALUE(VT_NULL)};
+    CHECK(callChannel(vm, "close", args));
+    args[0] = reply;
+    CHECK(callChannel(vm, "close", args));
+    channelUnlink(requestName);
+    channelUnlink(replyName);
+    popTmpRoot(vm);
+    popTmpRoot(vm);
+    printf("channel test passed\n");
+    return 0;
+}
@@ -0,0 +1,800 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "test.h"
+#include "vm.h"
+#include "core.h"
+#include "compiler.h"
+#include "meta_obj.h"
+#include "gc.h"
+#include "obj_fn.h"
+#include "obj_list.h"
+#include "obj_map.h"
+#include "obj_string.h"
+#include "obj_thread.h"
+
+#define ELEMENT_NUM 20000
+
+// 新生代块链表的长度
+static uint32_t chunkNum(NurseryChunk *chunk) {
+    uint32_t num = 0;
+    while (chunk != NULL) {
+        num++;
+        chunk = chunk->next;
+    }
+    return num;
+}
+
+// 新生代块计入allocatedBytes, 新块将超出堆上限时先回收新生代而不是报内存耗尽
+static void testChunkAccounting(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    vm->config.nurserySize = UINT32_MAX;
+
+    // initVM新建的模块表已在新生代中
+    CHECK(vm->nursery.cur != NULL);
+    CHECK(vm->allocatedBytes >= NURSERY_CHUNK_SIZE);
+    CHECK(vm->peakBytes >= vm->allocatedBytes);
+
+    // 堆上限容不下第二块, 当前块用尽时只能回收新生代后复用它
+    vm->config.maxHeapSize = vm->allocatedBytes + NURSERY_CHUNK_SIZE;
+    char str[64];
+    memset(str, 'x', sizeof(str));
+    uint32_t idx = 0;
+    while (idx < 4 * NURSERY_CHUNK_SIZE / sizeof(str)) {
+        newObjString(vm, str, sizeof(str));
+        CHECK(vm->allocatedBytes <= vm->config.maxHeapSize);
+        idx++;
+    }
+    CHECK(chunkNum(vm->nursery.cur) == 1);
+}
+
+#define COMPACT_NUM 10000
+
+// list中字符串所占地址范围的跨度
+static uintptr_t addressSpan(ObjList *objList) {
+    uintptr_t low = UINTPTR_MAX, high = 0;
+    uint32_t idx = 0;
+    while (idx < objList->elements.count) {
+        Value value = objList->elements.datas[idx++];
+        if (VALUE_IS_OBJSTR(value)) {
+            uintptr_t addr = (uintptr_t) VALUE_TO_OBJSTR(value);
+            low = addr < low ? addr : low;
+            high = addr > high ? addr : high;
+        }
+    }
+    return high - low;
+}
+
+static int compareAddress(const void *a, const void *b) {
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// 第idx个字符串的内容不变
+static void checkElement(ObjList *objList, uint32_t idx) {
+    char str[32];
+    int length = snprintf(str, sizeof(str), "compact %05u", idx);
+    ObjString *objString = VALUE_TO_OBJSTR(objList->elements.datas[idx]);
+    CHECK(objString->value.length == (uint32_t) length && memcmp(objString->value.start, str, length) == 0);
+}
+
+// 整理后存活对象集中到新页中, 原先分散的页被归还; 副本会超出堆上限时对象留在原处
+static void testCompaction(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+
+    ObjList *objList = newObjList(vm, COMPACT_NUM);
+    uint32_t idx = 0;
+    while (idx < COMPACT_NUM) {
+        objList->elements.datas[idx++] = VT_TO_VALUE(VT_NULL);
+    }
+    pushTmpRoot(vm, (ObjHeader *) objList);
+    char str[32];
+    idx = 0;
+    while (idx < COMPACT_NUM) {
+        int length = snprintf(str, sizeof(str), "compact %05u", idx);
+        ObjString *objString = newObjString(vm, str, length);
+        objList = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+        objList->elements.datas[idx++] = OBJ_TO_VALUE(objString);
+        gcWriteBarrier(vm, (ObjHeader *) objList, OBJ_TO_VALUE(objString));
+    }
+    minorGC(vm);
+    objList = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+    static uintptr_t addresses[COMPACT_NUM];
+    idx = 0;
+    while (idx < COMPACT_NUM) {
+        addresses[idx] = (uintptr_t) VALUE_TO_OBJSTR(objList->elements.datas[idx]);
+        idx++;
+    }
+    qsort(addresses, COMPACT_NUM, sizeof(uintptr_t), compareAddress);
+
+    // 每10个只留1个, 存活对象散布在所有页中
+    idx = 0;
+    while (idx < COMPACT_NUM) {
+        if (idx % 10 != 0) {
+            objList->elements.datas[idx] = VT_TO_VALUE(VT_NULL);
+        }
+        idx++;
+    }
+    startGC(vm);
+    uintptr_t span = addressSpan(objList);
+    uint64_t allocatedBytes = vm->allocatedBytes;
+
+    compactHeap(vm);
+    // list是临时根, 被固定在原处
+    CHECK((ObjList *) vm->tmpRoots[vm->tmpRootNum - 1] == objList);
+    CHECK(addressSpan(objList) < span / 4);
+    CHECK(vm->allocatedBytes <= allocatedBytes);
+    // 副本不复用死对象留下的空位, 否则原来的页仍不能归还
+    idx = 0;
+    while (idx < COMPACT_NUM) {
+        checkElement(objList, idx);
+        uintptr_t addr = (uintptr_t) VALUE_TO_OBJSTR(objList->elements.datas[idx]);
+        CHECK(bsearch(&addr, addresses, COMPACT_NUM, sizeof(uintptr_t), compareAddress) == NULL);
+        idx += 10;
+    }
+
+    vm->config.maxHeapSize = vm->allocatedBytes;
+    ObjString *first = VALUE_TO_OBJSTR(objList->elements.datas[0]);
+    compactHeap(vm);
+    CHECK(VALUE_TO_OBJSTR(objList->elements.datas[0]) == first);
+    CHECK(vm->allocatedBytes <= vm->config.maxHeapSize);
+    idx = 0;
+    while (idx < COMPACT_NUM) {
+        checkElement(objList, idx);
+        idx += 10;
+    }
+    popTmpRoot(vm);
+}
+
+// 缓冲区不在永生区中
+static bool outsideImmortal(VM *vm, void *datas) {
+    return datas == NULL || !isImmortalObject(vm, (ObjHeader *) datas);
+}
+
+// 只读的永生区中只有对象本身, 方法表、常量表和模块变量表仍由memManager管理, 收缩和整理都不会写入永生区
+static void testImmortalCore(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    vm->config.protectCore = true;
+    buildCoreNatives(vm);
+    makeCoreImmortal(vm);
+    CHECK(vm->immortal.objects != NULL);
+
+    uint32_t classNum = 0;
+    ObjHeader *obj = vm->immortal.objects;
+    while (obj != NULL) {
+        CHECK(isImmortalObject(vm, obj));
+        if (OBJ_TYPE(obj) == OT_CLASS) {
+            CHECK(outsideImmortal(vm, ((Class *) obj)->methods.datas));
+            classNum++;
+        } else if (OBJ_TYPE(obj) == OT_FUNCTION) {
+            CHECK(outsideImmortal(vm, ((ObjFn *) obj)->constants.datas));
+        } else if (OBJ_TYPE(obj) == OT_MODULE) {
+            CHECK(outsideImmortal(vm, ((ObjModule *) obj)->moduleVarValue.datas));
+            CHECK(outsideImmortal(vm, ((ObjModule *) obj)->moduleVarName.datas));
+        }
+        obj = obj->next;
+    }
+    CHECK(classNum > 0);
+
+    vmTrim(vm, TRIM_RELEASE);
+    compactHeap(vm);
+    // 永生的类的方法表依然可用
+    int symbol = getIndexFromSymbolTable(&vm->allMethodNames, "toString", 8);
+    CHECK(symbol != -1);
+    Class *objectClass = vm->objectClass;
+    CHECK((uint32_t) symbol < objectClass->methods.count && objectClass->methods.datas[symbol].type == MT_PRIMITIVE);
+}
+
+// 超出堆上限时跳回恢复点, 临时根和parser随之恢复, 回收后可以继续分配和编译
+static void testMemErrorRecovery(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    startGC(vm);
+    vm->config.maxHeapSize = vm->allocatedBytes + 256 * 1024;
+
+    ObjList *objList = newObjList(vm, 0);
+    pushTmpRoot(vm, (ObjHeader *) objList);
+    uint32_t tmpRootNum = vm->tmpRootNum;
+    volatile uint32_t allocNum = 0;
+    MemErrorHandler handler;
+    memErrorPush(vm, &handler);
+    if (setjmp(handler.jump) == 0) {
+        // 持续增长的list迟早超出上限
+        while (true) {
+            ObjString *objString = newObjString(vm, "recover", 7);
+            objList = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+            ValueBufferAdd(vm, &objList->elements, OBJ_TO_VALUE(objString));
+            gcWriteBarrier(vm, (ObjHeader *) objList, OBJ_TO_VALUE(objString));
+            allocNum++;
+        }
+    }
+    CHECK(allocNum > 0);
+    CHECK(vm->memErrorHandler == NULL);
+    CHECK(vm->tmpRootNum == tmpRootNum);
+
+    // 放弃list后继续分配; 回收时晋升的对象可能暂时超出上限, 回收掉list后回到上限以内
+    popTmpRoot(vm);
+    startGC(vm);
+    CHECK(vm->allocatedBytes <= vm->config.maxHeapSize);
+    uint32_t idx = 0;
+    while (idx < 4 * allocNum) {
+        newObjString(vm, "recover", 7);
+        CHECK(vm->allocatedBytes <= vm->config.maxHeapSize);
+        idx++;
+    }
+
+    // 编译中超出上限: curParser不能再指向已失效的栈上parser
+    ObjModule *objModule = newObjModule(vm, "recover");
+    pushTmpRoot(vm, (ObjHeader *) objModule);
+    startGC(vm);
+    vm->config.maxHeapSize = vm->allocatedBytes;
+    memErrorPush(vm, &handler);
+    if (setjmp(handler.jump) == 0) {
+        compileModule(vm, (ObjModule *) vm->tmpRoots[vm->tmpRootNum - 1], "");
+        CHECK(false);
+    }
+    CHECK(vm->curParser == NULL);
+    CHECK(vm->memErrorHandler == NULL);
+    startGC(vm);
+
+    vm->config.maxHeapSize = 0;
+    CHECK(compileModule(vm, (ObjModule *) vm->tmpRoots[vm->tmpRootNum - 1], "") != NULL);
+    CHECK(vm->curParser == NULL);
+    popTmpRoot(vm);
+}
+
+// 在子进程中执行reserve, 它应报内存错误退出, 而不是按回绕后的大小分配再越界写入
+static void expectMemError(void (*reserve)(VM *vm)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    CHECK(pid != -1);
+    if (pid == 0) {
+        VM vmStorage;
+        initVM(&vmStorage);
+        freopen("/dev/null", "w", stderr);
+        reserve(&vmStorage);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+}
+
+// count + extraCount超出uint32_t
+static void reserveWrappedCount(VM *vm) {
+    ByteBuffer buf;
+    ByteBufferInit(&buf);
+    buf.count = UINT32_MAX - 10;
+    ByteBufferReserve(vm, &buf, 11);
+}
+
+// 元素数在uint32_t之内, 字节数超出memManager的uint32_t大小
+static void reserveWrappedSize(VM *vm) {
+    ValueBuffer buf;
+    ValueBufferInit(&buf);
+    ValueBufferReserve(vm, &buf, UINT32_MAX / sizeof(Value) + 1);
+}
+
+static void testBufferOverflow(void) {
+    expectMemError(reserveWrappedCount);
+    expectMemError(reserveWrappedSize);
+
+    // 不溢出的请求照常分配
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    ByteBuffer buf;
+    ByteBufferInit(&buf);
+    ByteBufferReserve(vm, &buf, 1000);
+    CHECK(buf.capacity == 1024 && buf.count == 0);
+    ByteBufferClear(vm, &buf);
+}
+
+#define STRESS_SLOT_NUM 512
+#define STRESS_KEY_NUM 256
+#define STRESS_ROUND_NUM 60000
+#define STRESS_CHECK_INTERVAL 4096
+// 被删除的key
+#define STRESS_REMOVED UINT32_MAX
+
+// 压力测试中list和map的预期内容: 每个槽和key最后一次写入的轮次
+typedef struct {
+    uint32_t slotRounds[STRESS_SLOT_NUM];
+    bool slotNested[STRESS_SLOT_NUM];
+    uint32_t keyRounds[STRESS_KEY_NUM];
+    // 观察到的回收周期数
+    uint32_t cycleNum;
+} StressState;
+
+static Value stressString(VM *vm, char tag, uint32_t idx, uint32_t round) {
+    char str[32];
+    int length = snprintf(str, sizeof(str), "%c%u-%u", tag, idx, round);
+    return OBJ_TO_VALUE(newObjString(vm, str, length));
+}
+
+static bool isStressString(Value value, char tag, uint32_t idx, uint32_t round) {
+    char str[32];
+    int length = snprintf(str, sizeof(str), "%c%u-%u", tag, idx, round);
+    return VALUE_IS_OBJSTR(value) && VALUE_TO_OBJSTR(value)->value.length == (uint32_t) length &&
+           memcmp(VALUE_TO_OBJSTR(value)->value.start, str, length) == 0;
+}
+
+// list和map分别是最后两个临时根
+static ObjList *stressList(VM *vm) {
+    return (ObjList *) vm->tmpRoots[vm->tmpRootNum - 2];
+}
+
+static ObjMap *stressMap(VM *vm) {
+    return (ObjMap *) vm->tmpRoots[vm->tmpRootNum - 1];
+}
+
+// 可达的值都未被回收且内容不变, 并发标记期间持有堆锁以免与标记线程同时访问对象
+static void checkStress(VM *vm, StressState *state) {
+    gcLockHeap(vm);
+    ObjList *objList = stressList(vm);
+    CHECK(objList->elements.count == STRESS_SLOT_NUM);
+    uint32_t idx = 0;
+    while (idx < STRESS_SLOT_NUM) {
+        Value value = objList->elements.datas[idx];
+        if (state->slotNested[idx]) {
+            CHECK(VALUE_IS_CERTAIN_OBJ(value, OT_LIST));
+            ObjList *inner = VALUE_TO_OBJLIST(value);
+            CHECK(inner->elements.count == 2 && VALUE_TO_NUM(inner->elements.datas[0]) == idx);
+            value = inner->elements.datas[1];
+        }
+        CHECK(isStressString(value, 'l', idx, state->slotRounds[idx]));
+        idx++;
+    }
+
+    ObjMap *objMap = stressMap(vm);
+    uint32_t count = 0;
+    idx = 0;
+    while (idx < STRESS_KEY_NUM) {
+        char key[16];
+        int length = snprintf(key, sizeof(key), "k%u", idx);
+        // 查找用的key不挂到任何对象上, 堆锁已暂停gc
+        Value value = mapGet(objMap, OBJ_TO_VALUE(newObjString(vm, key, length)));
+        if (state->keyRounds[idx] == STRESS_REMOVED) {
+            CHECK(VALUE_IS_UNDEFINED(value));
+        } else {
+            CHECK(isStressString(value, 'm', idx, state->keyRounds[idx]));
+            count++;
+        }
+        idx++;
+    }
+    CHECK(objMap->count == count);
+    gcUnlockHeap(vm);
+}
+
+// 一轮修改: 覆盖list的一个槽, 修改或删除map的一个key, 另外产生一些垃圾
+static void stressRound(VM *vm, StressState *state, uint32_t round) {
+    uint32_t slot = (round * 7) % STRESS_SLOT_NUM;
+    Value value;
+    bool nested = round % 3 == 0;
+    if (nested) {
+        // 内层list在创建字符串时可能被移动, 成批创建时暂停gc
+        vm->gcPauseNum++;
+        ObjList *inner = newObjList(vm, 0);
+        ValueBufferAdd(vm, &inner->elements, NUM_TO_VALUE(slot));
+        ValueBufferAdd(vm, &inner->elements, stressString(vm, 'l', slot, round));
+        value = OBJ_TO_VALUE(inner);
+        vm->gcPauseNum--;
+    } else {
+        value = stressString(vm, 'l', slot, round);
+    }
+    gcLockHeap(vm);
+    ObjList *objList = stressList(vm);
+    gcPreWriteBarrier(vm, objList->elements.datas[slot]);
+    objList->elements.datas[slot] = value;
+    gcWriteBarrier(vm, (ObjHeader *) objList, value);
+    gcUnlockHeap(vm);
+    state->slotRounds[slot] = round;
+    state->slotNested[slot] = nested;
+
+    uint32_t keyIdx = (round * 13) % STRESS_KEY_NUM;
+    char key[16];
+    int length = snprintf(key, sizeof(key), "k%u", keyIdx);
+    vm->gcPauseNum++;
+    Value keyValue = OBJ_TO_VALUE(newObjString(vm, key, length));
+    if (round % 5 == 0) {
+        removeKey(vm, stressMap(vm), keyValue);
+        state->keyRounds[keyIdx] = STRESS_REMOVED;
+    } else {
+        mapSet(vm, stressMap(vm), keyValue, stressString(vm, 'm', keyIdx, round));
+        state->keyRounds[keyIdx] = round;
+    }
+    vm->gcPauseNum--;
+
+    stressString(vm, 'g', slot, round);
+    newObjList(vm, 4);
+
+    if (vm->gcPhase != GC_IDLE) {
+        state->cycleNum++;
+    }
+}
+
+// 按config反复修改list和map, 期间触发多次新生代回收和全堆回收, 可达的值始终完好, 垃圾最终被回收
+static void stressCollector(const Configuration *config) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVMWithConfig(vm, config);
+
+    StressState state;
+    ObjList *objList = newObjList(vm, STRESS_SLOT_NUM);
+    uint32_t idx = 0;
+    while (idx < STRESS_SLOT_NUM) {
+        objList->elements.datas[idx] = VT_TO_VALUE(VT_NULL);
+        state.slotRounds[idx] = 0;
+        state.slotNested[idx] = false;
+        idx++;
+    }
+    pushTmpRoot(vm, (ObjHeader *) objList);
+    pushTmpRoot(vm, (ObjHeader *) newObjMap(vm));
+    idx = 0;
+    while (idx < STRESS_KEY_NUM) {
+        state.keyRounds[idx++] = STRESS_REMOVED;
+    }
+    state.cycleNum = 0;
+
+    uint32_t round = 0;
+    while (round < STRESS_ROUND_NUM) {
+        stressRound(vm, &state, round);
+        round++;
+        // 槽都写过一遍后才开始检查
+        if (round >= STRESS_SLOT_NUM && round % STRESS_CHECK_INTERVAL == 0) {
+            checkStress(vm, &state);
+        }
+        if (round % 256 == 0) {
+            gcSafePoint(vm);
+        }
+    }
+    checkStress(vm, &state);
+    // 增量和并发回收的周期跨越多轮修改, 否则每次都是完整的全堆回收
+    if (config->incremental || config->concurrent) {
+        CHECK(state.cycleNum > 0);
+    } else {
+        CHECK(vm->gcStats.fullGCNum > 1);
+    }
+
+    // 结束进行中的周期并回收新生代, 只剩下可达的字符串; checkStress新建的查找用key在统计之后
+    startGC(vm);
+    minorGC(vm);
+    HeapStats stats;
+    gcHeapStats(vm, &stats);
+    CHECK(stats.objectNum[OT_STRING] <= STRESS_SLOT_NUM + STRESS_KEY_NUM * 2);
+    CHECK(stats.objectNum[OT_LIST] <= STRESS_SLOT_NUM / 3 + 2);
+    checkStress(vm, &state);
+    popTmpRoot(vm);
+    popTmpRoot(vm);
+}
+
+static void testCollectorModes(void) {
+    Configuration config;
+    initConfiguration(&config);
+    config.nurserySize = 64 * 1024;
+    config.initialHeapSize = config.nextGC = config.minHeapSize = 512 * 1024;
+    config.stepBytes = 16 * 1024;
+    config.pauseBudgetUs = 50;
+
+    config.incremental = true;
+    stressCollector(&config);
+
+    config.incremental = false;
+    config.concurrent = true;
+    stressCollector(&config);
+
+    config.concurrent = false;
+    config.gcThreads = 4;
+    stressCollector(&config);
+
+    config.concurrent = true;
+    stressCollector(&config);
+}
+
+#define DEDUP_NUM 1000
+#define DEDUP_DISTINCT 10
+#define DEDUP_KEY_NUM 100
+
+// 内容为"dup <idx % DEDUP_DISTINCT>"的字符串
+static Value dupString(VM *vm, uint32_t idx) {
+    char str[16];
+    int length = snprintf(str, sizeof(str), "dup %u", idx % DEDUP_DISTINCT);
+    return OBJ_TO_VALUE(newObjString(vm, str, length));
+}
+
+static Value dedupKey(VM *vm, uint32_t idx) {
+    char str[16];
+    int length = snprintf(str, sizeof(str), "key %u", idx);
+    return OBJ_TO_VALUE(newObjString(vm, str, length));
+}
+
+// 去重后各副本的内容不变且仍然可达, 内容相同的槽指向同一个字符串, 释放的副本计入dedupNum和dedupBytes
+static void testStringDedup(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    vm->config.dedupBudgetUs = 0;
+    vm->config.dedupInterval = 1;
+
+    // list中有DEDUP_NUM个副本, map的值另有DEDUP_KEY_NUM个, key各不相同
+    vm->gcPauseNum++;
+    ObjList *objList = newObjList(vm, DEDUP_NUM);
+    ObjMap *objMap = newObjMap(vm);
+    uint32_t idx = 0;
+    while (idx < DEDUP_NUM) {
+        objList->elements.datas[idx] = dupString(vm, idx);
+        idx++;
+    }
+    idx = 0;
+    while (idx < DEDUP_KEY_NUM) {
+        mapSet(vm, objMap, dedupKey(vm, idx), dupString(vm, idx));
+        idx++;
+    }
+    uint32_t stringSize = gcObjectSize(VALUE_TO_OBJ(objList->elements.datas[0]));
+    pushTmpRoot(vm, (ObjHeader *) objList);
+    pushTmpRoot(vm, (ObjHeader *) objMap);
+    vm->gcPauseNum--;
+
+    // 全堆回收按dedupInterval请求去重, 在安全点进行
+    startGC(vm);
+    CHECK(vm->dedupPending);
+    CHECK(vm->gcStats.dedupNum == 0);
+    gcSafePoint(vm);
+    CHECK(!vm->dedupPending);
+    CHECK(!vm->dedup.active && vm->dedup.strings == NULL);
+
+    uint64_t dedupNum = DEDUP_NUM + DEDUP_KEY_NUM - DEDUP_DISTINCT;
+    CHECK(vm->gcStats.dedupNum == dedupNum);
+    CHECK(vm->gcStats.dedupBytes == dedupNum * stringSize);
+    HeapStats stats;
+    gcHeapStats(vm, &stats);
+    CHECK(stats.objectNum[OT_STRING] == DEDUP_DISTINCT + DEDUP_KEY_NUM);
+
+    objList = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 2];
+    objMap = (ObjMap *) vm->tmpRoots[vm->tmpRootNum - 1];
+    // 查找用的字符串不挂到任何对象上
+    vm->gcPauseNum++;
+    idx = 0;
+    while (idx < DEDUP_NUM) {
+        Value value = objList->elements.datas[idx];
+        CHECK(valueIsEqual(value, dupString(vm, idx)));
+        CHECK(VALUE_TO_OBJ(value) == VALUE_TO_OBJ(objList->elements.datas[idx % DEDUP_DISTINCT]));
+        idx++;
+    }
+    CHECK(objMap->count == DEDUP_KEY_NUM);
+    idx = 0;
+    while (idx < DEDUP_KEY_NUM) {
+        Value value = mapGet(objMap, dedupKey(vm, idx));
+        CHECK(valueIsEqual(value, dupString(vm, idx)));
+        CHECK(VALUE_TO_OBJ(value) == VALUE_TO_OBJ(objList->elements.datas[idx % DEDUP_DISTINCT]));
+        idx++;
+    }
+    vm->gcPauseNum--;
+
+    // 再次去重时已没有副本
+    gcDedupStrings(vm);
+    CHECK(vm->gcStats.dedupNum == dedupNum);
+    popTmpRoot(vm);
+    popTmpRoot(vm);
+}
+
+#define TRIM_LIST_NUM 1000
+#define TRIM_LARGE_NUM 200000
+#define TRIM_KEY_NUM 1000
+#define TRIM_KEPT_NUM 100
+
+static Value trimString(VM *vm, uint32_t idx) {
+    char str[16];
+    int length = snprintf(str, sizeof(str), "trim %u", idx);
+    return OBJ_TO_VALUE(newObjString(vm, str, length));
+}
+
+// list、map和线程栈缩小后, 各级vmTrim依次释放新生代、收缩缓冲区, 内容不变且此后可以继续增长
+static void testTrimAfterShrink(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+
+    // 小list放字符串, 大list的缓冲区超过largeObjectSize而单独映射
+    vm->gcPauseNum++;
+    ObjList *small = newObjList(vm, 0);
+    ObjList *large = newObjList(vm, 0);
+    ObjMap *objMap = newObjMap(vm);
+    uint32_t idx = 0;
+    while (idx < TRIM_LIST_NUM) {
+        ValueBufferAdd(vm, &small->elements, trimString(vm, idx));
+        mapSet(vm, objMap, trimString(vm, idx), NUM_TO_VALUE(idx));
+        idx++;
+    }
+    idx = 0;
+    while (idx < TRIM_LARGE_NUM) {
+        ValueBufferAdd(vm, &large->elements, NUM_TO_VALUE(idx));
+        idx++;
+    }
+
+    // 栈按1000个槽分配, 之后函数只需要2个槽, 栈中的值和打开的upvalue随栈移动
+    ObjModule *objModule = newObjModule(vm, "trim");
+    ObjFn *fn = newObjFn(vm, objModule, 1000);
+    ObjThread *objThread = newObjThread(vm, newObjClosure(vm, fn));
+    CHECK(objThread->stackCapacity == 1024);
+    objThread->stack[0] = NUM_TO_VALUE(0);
+    objThread->stack[1] = NUM_TO_VALUE(1);
+    objThread->stack[2] = NUM_TO_VALUE(2);
+    objThread->esp = objThread->stack + 3;
+    objThread->openUpvalues = newObjUpvalue(vm, objThread->stack + 1);
+    fn->maxStackSlotUsedNum = 2;
+
+    pushTmpRoot(vm, (ObjHeader *) small);
+    pushTmpRoot(vm, (ObjHeader *) large);
+    pushTmpRoot(vm, (ObjHeader *) objMap);
+    pushTmpRoot(vm, (ObjHeader *) objThread);
+    vm->gcPauseNum--;
+    // 晋升之后对象不再移动, 可以直接持有
+    minorGC(vm);
+    small = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 4];
+    large = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 3];
+    objMap = (ObjMap *) vm->tmpRoots[vm->tmpRootNum - 2];
+    objThread = (ObjThread *) vm->tmpRoots[vm->tmpRootNum - 1];
+
+    // 删除元素时缓冲区只按倍数缩小, 余下的空间留给vmTrim
+    while (small->elements.count > TRIM_KEPT_NUM) {
+        removeElement(vm, small, small->elements.count - 1);
+    }
+    while (large->elements.count > TRIM_LARGE_NUM / 2 + 1) {
+        removeElement(vm, large, large->elements.count - 1);
+    }
+    idx = TRIM_KEPT_NUM;
+    while (idx < TRIM_KEY_NUM) {
+        vm->gcPauseNum++;
+        removeKey(vm, objMap, trimString(vm, idx));
+        vm->gcPauseNum--;
+        idx++;
+    }
+    CHECK(small->elements.capacity > small->elements.count);
+    CHECK(large->elements.capacity > large->elements.count);
+    uint32_t mapCapacity = objMap->capacity;
+
+    // 只回收, 新生代块全部释放, 缓冲区不动
+    uint64_t before = vm->allocatedBytes;
+    vmTrim(vm, TRIM_COLLECT);
+    CHECK(vm->nursery.cur == NULL && vm->nursery.usedBytes == 0);
+    CHECK(vm->allocatedBytes < before);
+    CHECK(small->elements.capacity > small->elements.count);
+    CHECK(objMap->capacity == mapCapacity);
+    CHECK(objThread->stackCapacity == 1024);
+
+    // 收缩缓冲区
+    before = vm->allocatedBytes;
+    vmTrim(vm, TRIM_SHRINK);
+    CHECK(vm->allocatedBytes < before);
+    CHECK(small->elements.capacity == TRIM_KEPT_NUM);
+    CHECK(large->elements.capacity == TRIM_LARGE_NUM / 2 + 1);
+    CHECK(objMap->capacity < mapCapacity && objMap->count == TRIM_KEPT_NUM);
+    CHECK(objThread->stackCapacity == 4);
+    CHECK(objThread->esp == objThread->stack + 3 && objThread->frames[0].stackStart == objThread->stack);
+    CHECK(objThread->openUpvalues->localVarPtr == objThread->stack + 1);
+    CHECK(VALUE_TO_NUM((*objThread->openUpvalues->localVarPtr)) == 1);
+
+    // 再次收缩不再变化
+    before = vm->allocatedBytes;
+    vmTrim(vm, TRIM_RELEASE);
+    CHECK(vm->allocatedBytes <= before);
+    CHECK(small->elements.capacity == TRIM_KEPT_NUM && objThread->stackCapacity == 4);
+
+    // 内容不变
+    vm->gcPauseNum++;
+    idx = 0;
+    while (idx < TRIM_KEPT_NUM) {
+        CHECK(valueIsEqual(small->elements.datas[idx], trimString(vm, idx)));
+        CHECK(VALUE_TO_NUM(mapGet(objMap, trimString(vm, idx))) == idx);
+        idx++;
+    }
+    vm->gcPauseNum--;
+    idx = 0;
+    while (idx < large->elements.count) {
+        CHECK(VALUE_TO_NUM(large->elements.datas[idx]) == idx);
+        idx++;
+    }
+
+    // 收缩后照常增长
+    idx = TRIM_KEPT_NUM;
+    while (idx < TRIM_LIST_NUM) {
+        Value value = trimString(vm, idx);
+        ValueBufferAdd(vm, &small->elements, value);
+        gcWriteBarrier(vm, (ObjHeader *) small, value);
+        ValueBufferAdd(vm, &large->elements, NUM_TO_VALUE(idx));
+        idx++;
+    }
+    CHECK(vm->nursery.cur != NULL);
+    startGC(vm);
+    minorGC(vm);
+    CHECK(small->elements.count == TRIM_LIST_NUM);
+    CHECK(valueIsEqual(small->elements.datas[TRIM_LIST_NUM - 1], trimString(vm, TRIM_LIST_NUM - 1)));
+    CHECK(VALUE_TO_NUM(large->elements.datas[large->elements.count - 1]) == TRIM_LIST_NUM - 1);
+    idx = 0;
+    while (idx < 4) {
+        popTmpRoot(vm);
+        idx++;
+    }
+}
+
+// 新生代分配达到阈值时就地回收: 新生代不会无限增长, 经tmpRoots可达的对象晋升后依然完整
+int main(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    vm->config.nurserySize = 64 * 1024;
+
+    ObjList *objList = newObjList(vm, ELEMENT_NUM);
+    uint32_t idx = 0;
+    while (idx < ELEMENT_NUM) {
+        objList->elements.datas[idx++] = VT_TO_VALUE(VT_NULL);
+    }
+    pushTmpRoot(vm, (ObjHeader *) objList);
+
+    uint32_t maxChunkNum = 0;
+    char str[32];
+    idx = 0;
+    while (idx < ELEMENT_NUM) {
+        int length = snprintf(str, sizeof(str), "element %u", idx);
+        newObjString(vm, str, length);
+        ObjString *objString = newObjString(vm, str, length);
+
+        // 回收后list已被晋升, 从tmpRoots重新读取, 并经写屏障记录对新生代对象的引用
+        objList = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+        objList->elements.datas[idx++] = OBJ_TO_VALUE(objString);
+        gcWriteBarrier(vm, (ObjHeader *) objList, OBJ_TO_VALUE(objString));
+
+        CHECK(vm->nursery.usedBytes <= vm->config.nurserySize + NURSERY_MAX_OBJ_SIZE);
+        uint32_t num = chunkNum(vm->nursery.cur);
+        maxChunkNum = num > maxChunkNum ? num : maxChunkNum;
+    }
+    CHECK(maxChunkNum == 1);
+    CHECK(!OBJ_IS_YOUNG(&objList->objHeader));
+
+    minorGC(vm);
+    objList = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+    idx = 0;
+    while (idx < ELEMENT_NUM) {
+        int length = snprintf(str, sizeof(str), "element %u", idx);
+        ObjString *objString = VALUE_TO_OBJSTR(objList->elements.datas[idx++]);
+        CHECK(!OBJ_IS_YOUNG(&objString->objHeader));
+        CHECK(objString->value.length == (uint32_t) length && memcmp(objString->value.start, str, length) == 0);
+    }
+
+    // 暂停gc时不回收, 新生代只能追加新块
+    vm->gcPauseNum++;
+    uint32_t usedBytes = vm->nursery.usedBytes;
+    idx = 0;
+    while (idx < ELEMENT_NUM) {
+        newObjString(vm, str, strlen(str));
+        idx++;
+    }
+    CHECK(vm->nursery.usedBytes > usedBytes + vm->config.nurserySize);
+    vm->gcPauseNum--;
+    popTmpRoot(vm);
+
+    testChunkAccounting();
+    testCompaction();
+    testImmortalCore();
+    testMemErrorRecovery();
+    testBufferOverflow();
+    testCollectorModes();
+    testStringDedup();
+    testTrimAfterShrink();
+    printf("gc test passed\n");
+    return 0;
+}
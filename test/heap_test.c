@@ -0,0 +1,227 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+// 堆快照经crab-heap往返: 用法 heap_test <crab-heap的路径>
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "test.h"
+#include "vm.h"
+#include "gc.h"
+#include "core.h"
+#include "class.h"
+#include "heap_snapshot.h"
+#include "meta_obj.h"
+#include "obj_list.h"
+#include "obj_string.h"
+
+#define HOLDER_STRING_NUM 1000
+#define ADDED_STRING_NUM 300
+
+static const char *heapTool;
+static char beforePath[64];
+static char afterPath[64];
+
+/**
+ * crab-heap输出中的一行
+ */
+typedef struct {
+    long long count;
+    long long shallow;
+    long long retained;
+} ToolRow;
+
+/**
+ * 执行crab-heap, 在输出中找出类名为className的行; className为NULL时找合计行, 此时retained为不可达的字节数
+ */
+static bool runTool(const char *args, const char *className, ToolRow *row) {
+    char command[256];
+    snprintf(command, sizeof(command), "%s %s", heapTool, args);
+    FILE *output = popen(command, "r");
+    CHECK(output != NULL);
+    bool found = false;
+    char line[256];
+    while (fgets(line, sizeof(line), output) != NULL) {
+        char name[64];
+        ToolRow cur;
+        if (className != NULL &&
+            sscanf(line, "%lld %lld %lld %63s", &cur.count, &cur.shallow, &cur.retained, name) == 4 &&
+            strcmp(name, className) == 0) {
+            *row = cur;
+            found = true;
+        } else if (className == NULL &&
+                   sscanf(line, "%lld %lld total, %lld", &cur.count, &cur.shallow, &cur.retained) == 3) {
+            *row = cur;
+            found = true;
+        }
+    }
+    int status = pclose(output);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return found;
+}
+
+// crab-heap处理损坏的快照时报错退出
+static void checkToolRejects(const char *path) {
+    char command[256];
+    snprintf(command, sizeof(command), "%s summary %s 2>/dev/null", heapTool, path);
+    int status = system(command);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+}
+
+// crab-heap输出中class的对象所在行的名字, 与工具一样, 没有类或类没有名字时以"(类型)"代替
+static const char *rowName(Class *class, const char *typeName, char *buffer, size_t bufferSize) {
+    if (class == NULL || class->name == NULL || class->name->value.length == 0) {
+        return typeName;
+    }
+    snprintf(buffer, bufferSize, "%.*s", (int) class->name->value.length, class->name->value.start);
+    return buffer;
+}
+
+static Value holderString(VM *vm, uint32_t idx) {
+    char str[32];
+    int length = snprintf(str, sizeof(str), "held string %u", idx);
+    return OBJ_TO_VALUE(newObjString(vm, str, length));
+}
+
+static ObjList *holderList(VM *vm) {
+    ObjInstance *holder = (ObjInstance *) vm->tmpRoots[vm->tmpRootNum - 1];
+    return VALUE_TO_OBJLIST(holder->fields[0]);
+}
+
+// holder独占的对象: holder自身、它的类和类名, list及其中的字符串
+static uint64_t holderBytes(VM *vm) {
+    ObjInstance *holder = (ObjInstance *) vm->tmpRoots[vm->tmpRootNum - 1];
+    Class *class = OBJ_CLASS(&holder->objHeader);
+    uint64_t bytes = gcObjectSize((ObjHeader *) holder) + gcObjectSize((ObjHeader *) class) +
+                     gcObjectSize((ObjHeader *) class->name);
+    ObjList *objList = holderList(vm);
+    bytes += gcObjectSize((ObjHeader *) objList);
+    uint32_t idx = 0;
+    while (idx < objList->elements.count) {
+        bytes += gcObjectSize(VALUE_TO_OBJ(objList->elements.datas[idx++]));
+    }
+    return bytes;
+}
+
+// summary的合计与堆统计一致, holder的保留大小包含它独占的全部对象
+static void testSummary(VM *vm) {
+    CHECK(writeHeapSnapshot(vm, beforePath));
+    HeapStats stats;
+    gcHeapStats(vm, &stats);
+    uint64_t objectNum = 0, bytes = 0;
+    uint32_t type = 0;
+    while (type < OBJ_TYPE_NUM) {
+        objectNum += stats.objectNum[type];
+        bytes += stats.bytes[type];
+        type++;
+    }
+
+    char args[128];
+    snprintf(args, sizeof(args), "summary %s", beforePath);
+    ToolRow total, holder, string;
+    CHECK(runTool(args, NULL, &total));
+    CHECK((uint64_t) total.count == objectNum && (uint64_t) total.shallow == bytes);
+    // 快照前刚做过全堆回收, 堆中没有不可达的对象
+    CHECK(total.retained == 0);
+
+    CHECK(runTool(args, "Holder", &holder));
+    CHECK(holder.count == 1);
+    CHECK((uint64_t) holder.retained == holderBytes(vm));
+    char name[64];
+    CHECK(runTool(args, rowName(vm->stringClass, "(string)", name, sizeof(name)), &string));
+    CHECK(string.count >= HOLDER_STRING_NUM);
+}
+
+// 新增字符串后比较两个快照, 字符串多出新增的部分, list只有缓冲区变大
+static void testDiff(VM *vm) {
+    ObjList *objList = holderList(vm);
+    uint64_t stringBytes = 0;
+    uint32_t idx = 0;
+    while (idx < ADDED_STRING_NUM) {
+        Value value = holderString(vm, HOLDER_STRING_NUM + idx);
+        stringBytes += gcObjectSize(VALUE_TO_OBJ(value));
+        objList = holderList(vm);
+        ValueBufferAdd(vm, &objList->elements, value);
+        gcWriteBarrier(vm, (ObjHeader *) objList, value);
+        idx++;
+    }
+    CHECK(writeHeapSnapshot(vm, afterPath));
+
+    char args[160];
+    snprintf(args, sizeof(args), "diff %s %s", beforePath, afterPath);
+    ToolRow string, list;
+    char name[64];
+    CHECK(runTool(args, rowName(vm->stringClass, "(string)", name, sizeof(name)), &string));
+    CHECK(string.count == ADDED_STRING_NUM && (uint64_t) string.shallow == stringBytes);
+    // list对象数不变, 缓冲区随元素增多而变大
+    CHECK(runTool(args, rowName(vm->listClass, "(list)", name, sizeof(name)), &list));
+    CHECK(list.count == 0 && list.shallow > 0);
+}
+
+// 截断的快照、错误的magic和未知的记录都报错
+static void testCorrupt(void) {
+    FILE *file = fopen(afterPath, "rb");
+    CHECK(file != NULL);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char *data = (char *) malloc(size);
+    CHECK(data != NULL && fread(data, 1, size, file) == (size_t) size);
+    fclose(file);
+
+    // 去掉结束记录
+    file = fopen(beforePath, "wb");
+    fwrite(data, 1, size - 1, file);
+    fclose(file);
+    checkToolRejects(beforePath);
+
+    data[0] = 'X';
+    file = fopen(beforePath, "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+    checkToolRejects(beforePath);
+
+    data[0] = HEAP_SNAPSHOT_MAGIC[0];
+    data[size - 1] = 'Z';
+    file = fopen(beforePath, "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+    checkToolRejects(beforePath);
+    free(data);
+}
+
+int main(int argc, const char **argv) {
+    CHECK(argc == 2);
+    heapTool = argv[1];
+    snprintf(beforePath, sizeof(beforePath), "/tmp/crab_heap_before_%d.snapshot", (int) getpid());
+    snprintf(afterPath, sizeof(afterPath), "/tmp/crab_heap_after_%d.snapshot", (int) getpid());
+
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    buildCoreNatives(vm);
+
+    // 一个Holder实例独占一个装着字符串的list, 类不挂在任何模块上
+    vm->gcPauseNum++;
+    Class *class = newRawClass(vm, "Holder", 1);
+    ObjInstance *holder = newObjInstance(vm, class);
+    ObjList *objList = newObjList(vm, 0);
+    holder->fields[0] = OBJ_TO_VALUE(objList);
+    uint32_t idx = 0;
+    while (idx < HOLDER_STRING_NUM) {
+        ValueBufferAdd(vm, &objList->elements, holderString(vm, idx));
+        idx++;
+    }
+    pushTmpRoot(vm, (ObjHeader *) holder);
+    vm->gcPauseNum--;
+
+    testSummary(vm);
+    testDiff(vm);
+    testCorrupt();
+    unlink(beforePath);
+    unlink(afterPath);
+    popTmpRoot(vm);
+    printf("heap test passed\n");
+    return 0;
+}
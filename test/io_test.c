@@ -0,0 +1,138 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+
+#include <string.h>
+#include "test.h"
+#include "vm.h"
+#include "core.h"
+#include "obj_fn.h"
+#include "obj_string.h"
+#include "obj_thread.h"
+#include "event_loop.h"
+
+// 以宿主身份调用IO的静态方法signature, 返回值在args[0]中
+static bool callIO(VM *vm, const char *signature, Value *args) {
+    int symbol = getIndexFromSymbolTable(&vm->allMethodNames, signature, strlen(signature));
+    CHECK(symbol != -1);
+    Class *ioMeta = OBJ_CLASS(&vm->ioClass->objHeader);
+    CHECK((uint32_t) symbol < ioMeta->methods.count && ioMeta->methods.datas[symbol].type == MT_PRIMITIVE);
+    args[0] = OBJ_TO_VALUE(vm->ioClass);
+    return ioMeta->methods.datas[symbol].primFn(vm, args);
+}
+
+static Value str(VM *vm, const char *s) {
+    return OBJ_TO_VALUE(newObjString(vm, s, strlen(s)));
+}
+
+// 当前线程在fd上等待events, 然后由事件循环唤醒, 被唤醒的应是同一个线程
+static void waitAndResume(VM *vm, int fd, const char *events) {
+    ObjThread *objThread = vm->curThread;
+    Value args[3] = {VT_TO_VALUE(VT_NULL), NUM_TO_VALUE(fd), str(vm, events)};
+    // 挂起时返回false且不设errorObj, 表示切换线程
+    CHECK(!callIO(vm, "wait(_,_)", args));
+    CHECK(vm->curThread == NULL);
+    CHECK(VALUE_IS_NULL(objThread->errorObj));
+    CHECK(vm->eventLoop.waitingNum == 1);
+
+    ObjThread *next = schedulerNext(vm);
+    CHECK(next == objThread);
+    CHECK(vm->eventLoop.waitingNum == 0);
+    vm->curThread = next;
+}
+
+// 非阻塞读取fd, 尚无数据时挂起等待
+static Value readOrWait(VM *vm, int fd, uint32_t max) {
+    Value args[3] = {VT_TO_VALUE(VT_NULL), NUM_TO_VALUE(fd), NUM_TO_VALUE(max)};
+    CHECK(callIO(vm, "read(_,_)", args));
+    if (VALUE_IS_NULL(args[0])) {
+        waitAndResume(vm, fd, "r");
+        args[1] = NUM_TO_VALUE(fd);
+        args[2] = NUM_TO_VALUE(max);
+        CHECK(callIO(vm, "read(_,_)", args));
+    }
+    CHECK(VALUE_IS_OBJSTR(args[0]));
+    return args[0];
+}
+
+static void writeAll(VM *vm, int fd, const char *data) {
+    Value args[3] = {VT_TO_VALUE(VT_NULL), NUM_TO_VALUE(fd), str(vm, data)};
+    CHECK(callIO(vm, "write(_,_)", args));
+    CHECK(VALUE_IS_NUM(args[0]) && VALUE_TO_NUM(args[0]) == strlen(data));
+}
+
+// 经127.0.0.1上的tcp连接往返一次数据, 等待都经过eventLoopWait、eventLoopPoll和调度队列
+int main(void) {
+    // 编译器尚不能执行核心模块脚本, 只建立原生类
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    buildCoreNatives(vm);
+    // 核心模块以null为名
+    ObjModule *coreModule = VALUE_TO_OBJMODULE(mapGet(vm->allModules, VT_TO_VALUE(VT_NULL)));
+    ObjFn *fn = newObjFn(vm, coreModule, 0);
+    vm->curThread = newObjThread(vm, newObjClosure(vm, fn));
+
+    Value args[3] = {VT_TO_VALUE(VT_NULL), NUM_TO_VALUE(0), VT_TO_VALUE(VT_NULL)};
+    CHECK(callIO(vm, "tcpListen(_)", args));
+    int listenFd = (int) VALUE_TO_NUM(args[0]);
+    args[1] = NUM_TO_VALUE(listenFd);
+    CHECK(callIO(vm, "localPort(_)", args));
+    double port = VALUE_TO_NUM(args[0]);
+    CHECK(port > 0);
+
+    args[1] = NUM_TO_VALUE(port);
+    CHECK(callIO(vm, "tcpConnect(_)", args));
+    int clientFd = (int) VALUE_TO_NUM(args[0]);
+    // 连接完成时可写
+    waitAndResume(vm, clientFd, "w");
+
+    args[1] = NUM_TO_VALUE(listenFd);
+    CHECK(callIO(vm, "accept(_)", args));
+    if (VALUE_IS_NULL(args[0])) {
+        waitAndResume(vm, listenFd, "r");
+        args[1] = NUM_TO_VALUE(listenFd);
+        CHECK(callIO(vm, "accept(_)", args));
+    }
+    CHECK(VALUE_IS_NUM(args[0]));
+    int serverFd = (int) VALUE_TO_NUM(args[0]);
+
+    // 服务端先读, 此时还没有数据, 线程挂起直到客户端写入
+    args[1] = NUM_TO_VALUE(serverFd);
+    args[2] = NUM_TO_VALUE(16);
+    CHECK(callIO(vm, "read(_,_)", args));
+    CHECK(VALUE_IS_NULL(args[0]));
+    writeAll(vm, clientFd, "ping");
+    Value received = readOrWait(vm, serverFd, 16);
+    CHECK(strcmp(VALUE_TO_OBJSTR(received)->value.start, "ping") == 0);
+
+    writeAll(vm, serverFd, "pong");
+    received = readOrWait(vm, clientFd, 16);
+    CHECK(strcmp(VALUE_TO_OBJSTR(received)->value.start, "pong") == 0);
+
+    // 过大的max按上限读取, 不会溢出
+    args[1] = NUM_TO_VALUE(clientFd);
+    args[2] = NUM_TO_VALUE(UINT32_MAX);
+    CHECK(callIO(vm, "read(_,_)", args));
+    CHECK(VALUE_IS_NULL(args[0]));
+
+    // 关闭描述符时唤醒在其上等待的线程
+    ObjThread *objThread = vm->curThread;
+    args[1] = NUM_TO_VALUE(clientFd);
+    args[2] = str(vm, "r");
+    CHECK(!callIO(vm, "wait(_,_)", args));
+    args[1] = NUM_TO_VALUE(clientFd);
+    CHECK(callIO(vm, "close(_)", args));
+    CHECK(schedulerNext(vm) == objThread);
+    vm->curThread = objThread;
+
+    // 没有可运行、等待io的线程和定时器时调度器返回NULL
+    CHECK(schedulerNext(vm) == NULL);
+
+    args[1] = NUM_TO_VALUE(serverFd);
+    CHECK(callIO(vm, "close(_)", args));
+    args[1] = NUM_TO_VALUE(listenFd);
+    CHECK(callIO(vm, "close(_)", args));
+    printf("io test passed\n");
+    return 0;
+}
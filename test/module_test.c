@@ -0,0 +1,284 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+
+#include <string.h>
+#include "test.h"
+#include "vm.h"
+#include "gc.h"
+#include "core.h"
+#include "compiler.h"
+#include "class.h"
+#include "obj_fn.h"
+#include "obj_list.h"
+#include "obj_map.h"
+#include "obj_string.h"
+#include "obj_thread.h"
+
+#define MODULE_NUM 16
+
+// 编译器尚只能处理空的源码, 各模块以不同的空白区分
+static const char *moduleCodes[MODULE_NUM] = {
+        "", "\n", " ", "\t", "\n\n", "  ", "\t\n", " \n ",
+        "\n\n\n", "", "\r\n", "\t\t", "   ", "\n \n", " \t ", "\n\t\n"
+};
+
+static void initModuleVM(VM *vm) {
+    initVM(vm);
+    buildCoreNatives(vm);
+}
+
+// 模块名, 调用期间须暂停gc
+static Value moduleNameOf(VM *vm, uint32_t idx) {
+    char name[16];
+    int length = snprintf(name, sizeof(name), "m%u", idx);
+    return OBJ_TO_VALUE(newObjString(vm, name, length));
+}
+
+static ObjModule *moduleOf(VM *vm, uint32_t idx) {
+    vm->gcPauseNum++;
+    Value value = mapGet(vm->allModules, moduleNameOf(vm, idx));
+    vm->gcPauseNum--;
+    CHECK(VALUE_IS_CERTAIN_OBJ(value, OT_MODULE));
+    return VALUE_TO_OBJMODULE(value);
+}
+
+// 两个vm中的方法名表、模块变量和模块的指令流完全一致
+static void checkSameModules(VM *serial, VM *parallel) {
+    CHECK(serial->allMethodNames.count == parallel->allMethodNames.count);
+    uint32_t idx = 0;
+    while (idx < serial->allMethodNames.count) {
+        String *a = &serial->allMethodNames.datas[idx];
+        String *b = &parallel->allMethodNames.datas[idx];
+        CHECK(a->length == b->length && memcmp(a->str, b->str, a->length) == 0);
+        idx++;
+    }
+    CHECK(serial->allModules->count == parallel->allModules->count);
+
+    idx = 0;
+    while (idx < MODULE_NUM) {
+        ObjModule *a = moduleOf(serial, idx);
+        ObjModule *b = moduleOf(parallel, idx);
+        CHECK(a->moduleVarName.count == b->moduleVarName.count);
+        uint32_t varIdx = 0;
+        while (varIdx < a->moduleVarName.count) {
+            CHECK(strcmp(a->moduleVarName.datas[varIdx].str, b->moduleVarName.datas[varIdx].str) == 0);
+            // 两个vm中的核心类是不同的对象, 只比较类型
+            Value x = a->moduleVarValue.datas[varIdx];
+            Value y = b->moduleVarValue.datas[varIdx];
+            CHECK(VALUE_TYPE(x) == VALUE_TYPE(y));
+            CHECK(!VALUE_IS_OBJ(x) || OBJ_TYPE(VALUE_TO_OBJ(x)) == OBJ_TYPE(VALUE_TO_OBJ(y)));
+            varIdx++;
+        }
+        idx++;
+    }
+}
+
+// 临时根容不下所有模块线程, 把它们挂在作为临时根的list上
+static void keepThread(VM *vm, ObjThread *objThread) {
+    ObjList *threads = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+    ValueBufferAdd(vm, &threads->elements, OBJ_TO_VALUE(objThread));
+    gcWriteBarrier(vm, (ObjHeader *) threads, OBJ_TO_VALUE(objThread));
+}
+
+static void checkThreads(VM *vm) {
+    ObjList *threads = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+    CHECK(threads->elements.count == MODULE_NUM);
+    uint32_t idx = 0;
+    while (idx < MODULE_NUM) {
+        ObjFn *fn = VALUE_TO_OBJTHREAD(threads->elements.datas[idx])->frames[0].closure->fn;
+        CHECK(fn->module == moduleOf(vm, idx));
+        // 空模块只有return null和结束标记
+        Byte *code = fn->instrStream.datas;
+        CHECK(fn->instrStream.count == 3);
+        CHECK(code[0] == OPCODE_PUSH_NULL && code[1] == OPCODE_RETURN && code[2] == OPCODE_END);
+        idx++;
+    }
+}
+
+// 并行载入的结果与逐个串行载入相同, 工作线程中创建的对象并入vm后经回收依然存活
+static void testParallelLoad(void) {
+    VM serialStorage, parallelStorage;
+    VM *serial = &serialStorage;
+    VM *parallel = &parallelStorage;
+    initModuleVM(serial);
+    initModuleVM(parallel);
+    pushTmpRoot(serial, (ObjHeader *) newObjList(serial, 0));
+    pushTmpRoot(parallel, (ObjHeader *) newObjList(parallel, 0));
+
+    uint32_t idx = 0;
+    while (idx < MODULE_NUM) {
+        serial->gcPauseNum++;
+        Value name = moduleNameOf(serial, idx);
+        serial->gcPauseNum--;
+        keepThread(serial, loadModule(serial, name, moduleCodes[idx]));
+        idx++;
+    }
+
+    parallel->gcPauseNum++;
+    Value names[MODULE_NUM];
+    idx = 0;
+    while (idx < MODULE_NUM) {
+        names[idx] = moduleNameOf(parallel, idx);
+        idx++;
+    }
+    parallel->gcPauseNum--;
+    ObjThread *threads[MODULE_NUM];
+    loadModulesParallel(parallel, MODULE_NUM, names, moduleCodes, threads);
+    // 模块线程在keepThread的分配中可能被移动, 挂接期间暂停gc
+    parallel->gcPauseNum++;
+    idx = 0;
+    while (idx < MODULE_NUM) {
+        keepThread(parallel, threads[idx++]);
+    }
+    parallel->gcPauseNum--;
+
+    checkSameModules(serial, parallel);
+    CHECK(parallel->allocatedBytes > 0 && parallel->peakBytes >= parallel->allocatedBytes);
+
+    // 工作线程的对象和新生代已并入vm, 全堆回收和整理后模块和线程依然完整
+    startGC(parallel);
+    compactHeap(parallel);
+    startGC(serial);
+    checkSameModules(serial, parallel);
+    checkThreads(serial);
+    checkThreads(parallel);
+
+    HeapStats serialStats, parallelStats;
+    gcHeapStats(serial, &serialStats);
+    gcHeapStats(parallel, &parallelStats);
+    CHECK(serialStats.objectNum[OT_MODULE] == parallelStats.objectNum[OT_MODULE]);
+    CHECK(serialStats.objectNum[OT_FUNCTION] == parallelStats.objectNum[OT_FUNCTION]);
+    CHECK(serialStats.objectNum[OT_THREAD] == parallelStats.objectNum[OT_THREAD]);
+}
+
+// 编译期间暂存的方法名按提交时的映射改写, 内层函数一并处理, 闭包指令的upvalue操作数不受影响
+static void testRelocateSymbols(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initModuleVM(vm);
+    ObjModule *coreModule = VALUE_TO_OBJMODULE(mapGet(vm->allModules, VT_TO_VALUE(VT_NULL)));
+
+    vm->gcPauseNum++;
+    ObjFn *inner = newObjFn(vm, coreModule, 0);
+    inner->upvalueNum = 1;
+    Byte innerCode[] = {OPCODE_CALL0, 0, 1, OPCODE_RETURN};
+    ByteBufferAppendMany(vm, &inner->instrStream, innerCode, sizeof(innerCode));
+
+    ObjFn *outer = newObjFn(vm, coreModule, 0);
+    ValueBufferAdd(vm, &outer->constants, OBJ_TO_VALUE(inner));
+    Byte outerCode[] = {
+            OPCODE_CALL1, 0, 0,
+            OPCODE_CREATE_CLOSURE, 0, 0, 1, 0,
+            OPCODE_SUPER2, 0, 2, 0, 0,
+            OPCODE_INSTANCE_METHOD, 0, 1,
+            OPCODE_LOAD_CONSTANT, 0, 0,
+            OPCODE_RETURN
+    };
+    ByteBufferAppendMany(vm, &outer->instrStream, outerCode, sizeof(outerCode));
+
+    int symbolMap[] = {300, 7, 65535};
+    relocateMethodSymbols(outer, symbolMap);
+    Byte *code = outer->instrStream.datas;
+    CHECK(code[1] == 1 && code[2] == 44);
+    // CREATE_CLOSURE的操作数是常量索引和upvalue描述, 不是方法符号
+    CHECK(code[4] == 0 && code[5] == 0 && code[6] == 1 && code[7] == 0);
+    CHECK(code[9] == 0xff && code[10] == 0xff);
+    // SUPERx的第二个操作数是基类常量
+    CHECK(code[11] == 0 && code[12] == 0);
+    CHECK(code[14] == 0 && code[15] == 7);
+    CHECK(code[17] == 0 && code[18] == 0);
+    CHECK(inner->instrStream.datas[1] == 0 && inner->instrStream.datas[2] == 7);
+    vm->gcPauseNum--;
+}
+
+// 以宿主身份调用Module.unload(name)
+static bool callUnload(VM *vm, Value *args) {
+    ObjModule *coreModule = VALUE_TO_OBJMODULE(mapGet(vm->allModules, VT_TO_VALUE(VT_NULL)));
+    uint32_t idx = 0;
+    while (strcmp(coreModule->moduleVarName.datas[idx].str, "Module") != 0) {
+        idx++;
+    }
+    Class *moduleClass = VALUE_TO_CLASS(coreModule->moduleVarValue.datas[idx]);
+    int symbol = getIndexFromSymbolTable(&vm->allMethodNames, "unload(_)", 9);
+    CHECK(symbol != -1);
+    args[0] = OBJ_TO_VALUE(moduleClass);
+    return OBJ_CLASS(&moduleClass->objHeader)->methods.datas[symbol].primFn(vm, args);
+}
+
+// 卸载后旧模块的闭包依然完整, 再次载入同名模块时重新编译出新的模块和函数
+static void testUnload(void) {
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initModuleVM(vm);
+    ObjModule *coreModule = VALUE_TO_OBJMODULE(mapGet(vm->allModules, VT_TO_VALUE(VT_NULL)));
+    vm->curThread = newObjThread(vm, newObjClosure(vm, newObjFn(vm, coreModule, 0)));
+    pushTmpRoot(vm, (ObjHeader *) vm->curThread);
+    pushTmpRoot(vm, (ObjHeader *) newObjList(vm, 0));
+
+    vm->gcPauseNum++;
+    Value name = moduleNameOf(vm, 0);
+    vm->gcPauseNum--;
+    keepThread(vm, loadModule(vm, name, moduleCodes[0]));
+    // 晋升后模块线程不再移动
+    minorGC(vm);
+    ObjList *threads = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+    ObjClosure *oldClosure = VALUE_TO_OBJTHREAD(threads->elements.datas[0])->frames[0].closure;
+    ObjModule *oldModule = moduleOf(vm, 0);
+    CHECK(oldClosure->fn->module == oldModule);
+    uint32_t moduleNum = vm->allModules->count;
+
+    Value args[2];
+    vm->gcPauseNum++;
+    args[1] = moduleNameOf(vm, 0);
+    CHECK(callUnload(vm, args) && VALUE_IS_TRUE(args[0]));
+    CHECK(vm->allModules->count == moduleNum - 1);
+    CHECK(VALUE_IS_UNDEFINED(mapGet(vm->allModules, moduleNameOf(vm, 0))));
+    // 不存在的模块和核心模块都不卸载, 模块名必须是字符串
+    args[1] = moduleNameOf(vm, 0);
+    CHECK(callUnload(vm, args) && VALUE_IS_FALSE(args[0]));
+    args[1] = moduleNameOf(vm, 1);
+    CHECK(callUnload(vm, args) && VALUE_IS_FALSE(args[0]));
+    CHECK(!unloadModule(vm, VT_TO_VALUE(VT_NULL)));
+    args[1] = NUM_TO_VALUE(1);
+    CHECK(!callUnload(vm, args));
+    CHECK(vm->allModules->count == moduleNum - 1);
+    vm->gcPauseNum--;
+
+    // 旧模块只经由闭包可达, 回收和整理后闭包、函数和模块依然完整
+    startGC(vm);
+    compactHeap(vm);
+    threads = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+    oldClosure = VALUE_TO_OBJTHREAD(threads->elements.datas[0])->frames[0].closure;
+    oldModule = oldClosure->fn->module;
+    CHECK(oldModule->name->value.length == 2 && memcmp(oldModule->name->value.start, "m0", 2) == 0);
+    // 核心模块也可能被整理移动
+    coreModule = VALUE_TO_OBJMODULE(mapGet(vm->allModules, VT_TO_VALUE(VT_NULL)));
+    CHECK(oldModule->moduleVarName.count == coreModule->moduleVarName.count);
+    Byte *code = oldClosure->fn->instrStream.datas;
+    CHECK(oldClosure->fn->instrStream.count == 3);
+    CHECK(code[0] == OPCODE_PUSH_NULL && code[1] == OPCODE_RETURN && code[2] == OPCODE_END);
+
+    // 重新载入得到新的模块和函数, 旧闭包仍指向旧模块
+    vm->gcPauseNum++;
+    name = moduleNameOf(vm, 0);
+    vm->gcPauseNum--;
+    keepThread(vm, loadModule(vm, name, moduleCodes[0]));
+    threads = (ObjList *) vm->tmpRoots[vm->tmpRootNum - 1];
+    oldClosure = VALUE_TO_OBJTHREAD(threads->elements.datas[0])->frames[0].closure;
+    ObjClosure *newClosure = VALUE_TO_OBJTHREAD(threads->elements.datas[1])->frames[0].closure;
+    CHECK(newClosure->fn != oldClosure->fn);
+    CHECK(newClosure->fn->module == moduleOf(vm, 0));
+    CHECK(newClosure->fn->module != oldClosure->fn->module);
+    CHECK(vm->allModules->count == moduleNum);
+    popTmpRoot(vm);
+    popTmpRoot(vm);
+}
+
+int main(void) {
+    testParallelLoad();
+    testRelocateSymbols();
+    testUnload();
+    printf("module test passed\n");
+    return 0;
+}
@@ -0,0 +1,20 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+
+#ifndef _TEST_TEST_H
+#define _TEST_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// 测试失败时打印位置并退出
+#define CHECK(condition) \
+   do {\
+      if (!(condition)) {\
+         fprintf(stderr, "%s:%d check failed: %s\n", __FILE__, __LINE__, #condition);\
+         exit(1);\
+      }\
+   } while (0)
+
+#endif
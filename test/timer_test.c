@@ -0,0 +1,110 @@
+//
+// Created by Kosho on 2020/2/29.
+//
+
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "vm.h"
+#include "core.h"
+#include "meta_obj.h"
+#include "obj_fn.h"
+#include "obj_thread.h"
+#include "event_loop.h"
+#include "timer.h"
+
+// 以宿主身份调用class上的原生方法signature, 返回值在args[0]中
+static bool callPrim(VM *vm, Class *class, const char *signature, Value *args) {
+    int symbol = getIndexFromSymbolTable(&vm->allMethodNames, signature, strlen(signature));
+    CHECK(symbol != -1);
+    CHECK((uint32_t) symbol < class->methods.count && class->methods.datas[symbol].type == MT_PRIMITIVE);
+    return class->methods.datas[symbol].primFn(vm, args);
+}
+
+// Timer.after或Timer.every, 返回Timer实例
+static Value newTimerOf(VM *vm, const char *signature, uint32_t ms, ObjClosure *fn) {
+    Value args[3] = {OBJ_TO_VALUE(vm->timerClass), NUM_TO_VALUE(ms), OBJ_TO_VALUE(fn)};
+    CHECK(callPrim(vm, OBJ_CLASS(&vm->timerClass->objHeader), signature, args));
+    return args[0];
+}
+
+static bool cancelTimer(VM *vm, Value timer) {
+    Value args[1] = {timer};
+    CHECK(callPrim(vm, vm->timerClass, "cancel", args));
+    return VALUE_IS_TRUE(args[0]);
+}
+
+static void sleepMs(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+// 可运行队列中尚未取出的线程数
+static uint32_t readyNum(VM *vm) {
+    return vm->eventLoop.ready.count - vm->eventLoop.readyHead;
+}
+
+// 取出可运行队列中的线程, 检查它们都执行fn
+static void drainReady(VM *vm, ObjClosure *fn) {
+    while (readyNum(vm) > 0) {
+        ObjThread *objThread = vm->eventLoop.ready.datas[vm->eventLoop.readyHead++];
+        CHECK(objThread->frames[0].closure == fn);
+    }
+}
+
+// 推进时间轮: 一次性定时器到期后释放, 周期定时器每次到期后重新插入, 取消的定时器不再触发
+int main(void) {
+    // 编译器尚不能执行核心模块脚本, 只建立原生类
+    VM vmStorage;
+    VM *vm = &vmStorage;
+    initVM(vm);
+    buildCoreNatives(vm);
+    // 核心模块以null为名
+    ObjModule *coreModule = VALUE_TO_OBJMODULE(mapGet(vm->allModules, VT_TO_VALUE(VT_NULL)));
+    ObjClosure *fn = newObjClosure(vm, newObjFn(vm, coreModule, 1));
+    pushTmpRoot(vm, (ObjHeader *) fn);
+
+    Value once = newTimerOf(vm, "after(_,_)", 20, fn);
+    Value periodic = newTimerOf(vm, "every(_,_)", 10, fn);
+    Value cancelled = newTimerOf(vm, "after(_,_)", 30, fn);
+    CHECK(vm->timerWheel.timerNum == 3);
+    CHECK(timerWheelTimeout(vm) >= 0 && timerWheelTimeout(vm) <= 10);
+
+    CHECK(cancelTimer(vm, cancelled));
+    CHECK(!cancelTimer(vm, cancelled));
+    CHECK(vm->timerWheel.timerNum == 2);
+
+    // 10ms与20ms处周期定时器各触发一次, 一次性定时器触发后被释放
+    sleepMs(45);
+    uint32_t fired = timerWheelAdvance(vm);
+    CHECK(fired >= 5);
+    CHECK(readyNum(vm) == fired);
+    CHECK(vm->timerWheel.timerNum == 1);
+    drainReady(vm, fn);
+    CHECK(!cancelTimer(vm, once));
+
+    // 周期定时器重新插入后继续触发
+    sleepMs(25);
+    fired = timerWheelAdvance(vm);
+    CHECK(fired >= 2);
+    CHECK(readyNum(vm) == fired);
+    drainReady(vm, fn);
+
+    CHECK(cancelTimer(vm, periodic));
+    CHECK(vm->timerWheel.timerNum == 0);
+    CHECK(timerWheelTimeout(vm) == -1);
+    sleepMs(15);
+    CHECK(timerWheelAdvance(vm) == 0);
+
+    // 调度器在没有可运行线程时等待定时器到期
+    newTimerOf(vm, "after(_,_)", 5, fn);
+    uint64_t startNs = monotonicNs();
+    ObjThread *objThread = schedulerNext(vm);
+    CHECK(objThread != NULL && objThread->frames[0].closure == fn);
+    CHECK(monotonicNs() - startNs >= 4000000);
+    CHECK(schedulerNext(vm) == NULL);
+
+    popTmpRoot(vm);
+    printf("timer test passed\n");
+    return 0;
+}
@@ -0,0 +1,663 @@
+//
+// Created by Kosho on 2020/2/27.
+//
+// 堆快照分析工具:
+//   crab-heap summary <snapshot>      按类统计对象数、自身大小和保留大小
+//   crab-heap diff <old> <new>        比较两个快照中各类的变化
+// 保留大小由支配树求出: 对象被回收时随之可回收的字节数
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap_snapshot.h"
+
+// 与ObjType的顺序一致
+static const char *objTypeNames[OBJ_TYPE_NUM] = {
+        "class", "list", "map", "module", "range", "string",
+        "upvalue", "function", "closure", "instance", "thread"
+};
+
+// 支配树中尚未确定的直接支配者
+#define IDOM_UNDEFINED UINT32_MAX
+
+typedef struct {
+    uint64_t addr;
+    uint32_t type;
+    // 类名编号, 0为无类
+    uint32_t class;
+    uint64_t size;
+    // 引用在refs中的起始下标
+    uint32_t firstRef;
+    uint32_t refNum;
+} Node;
+
+/**
+ * 载入内存的快照, 图中0号结点为虚拟根, 指向所有根对象; 第i个对象为i+1号结点
+ */
+typedef struct {
+    char **classNames;
+    uint32_t classNum;
+    Node *nodes;
+    uint32_t nodeNum;
+    // 引用先记为地址, 载入完成后转换为结点号, 0表示目标不在快照中
+    uint64_t *refAddrs;
+    uint32_t *refs;
+    uint32_t refNum;
+    uint64_t *rootAddrs;
+    uint32_t *roots;
+    uint32_t rootNum;
+} Snapshot;
+
+/**
+ * 按类名汇总的统计
+ */
+typedef struct {
+    char *name;
+    uint64_t count;
+    uint64_t shallow;
+    uint64_t retained;
+} ClassSummary;
+
+typedef struct {
+    ClassSummary *classes;
+    uint32_t classNum;
+    uint64_t unreachable;
+} Summary;
+
+static void fatal(const char *fmt, const char *arg) {
+    fprintf(stderr, fmt, arg);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void *checkedRealloc(void *ptr, size_t size) {
+    void *newPtr = realloc(ptr, size == 0 ? 1 : size);
+    if (newPtr == NULL) {
+        fatal("%s", "out of memory!");
+    }
+    return newPtr;
+}
+
+// 容量不足时把数组扩大一倍
+#define ENSURE_CAPACITY(array, count, capacity) \
+    do {\
+        if ((count) >= (capacity)) {\
+            (capacity) = (capacity) == 0 ? 64 : (capacity) * 2;\
+            (array) = checkedRealloc((array), (capacity) * sizeof(*(array)));\
+        }\
+    } while (0)
+
+typedef struct {
+    const unsigned char *cur;
+    const unsigned char *end;
+    const char *path;
+} Reader;
+
+static uint64_t readVarint(Reader *reader) {
+    uint64_t value = 0;
+    uint32_t shift = 0;
+    while (reader->cur < reader->end && shift < 64) {
+        unsigned char byte = *reader->cur++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+        shift += 7;
+    }
+    fatal("%s: truncated snapshot!", reader->path);
+    return 0;
+}
+
+// 地址到结点号的开放定址表
+typedef struct {
+    uint64_t *addrs;
+    uint32_t *nodes;
+    uint32_t capacity;
+} AddrTable;
+
+static uint32_t addrSlot(AddrTable *table, uint64_t addr) {
+    uint32_t idx = (uint32_t) ((addr >> 4) * 0x9e3779b97f4a7c15ull >> 32) & (table->capacity - 1);
+    while (table->nodes[idx] != 0 && table->addrs[idx] != addr) {
+        idx = (idx + 1) & (table->capacity - 1);
+    }
+    return idx;
+}
+
+static void buildAddrTable(AddrTable *table, Snapshot *snapshot) {
+    table->capacity = 64;
+    while (table->capacity < snapshot->nodeNum * 2) {
+        table->capacity *= 2;
+    }
+    table->addrs = (uint64_t *) checkedRealloc(NULL, table->capacity * sizeof(uint64_t));
+    table->nodes = (uint32_t *) calloc(table->capacity, sizeof(uint32_t));
+    if (table->nodes == NULL) {
+        fatal("%s", "out of memory!");
+    }
+    uint32_t idx = 1;
+    while (idx < snapshot->nodeNum) {
+        uint32_t slot = addrSlot(table, snapshot->nodes[idx].addr);
+        table->addrs[slot] = snapshot->nodes[idx].addr;
+        table->nodes[slot] = idx;
+        idx++;
+    }
+}
+
+static uint32_t lookupAddr(AddrTable *table, uint64_t addr) {
+    return table->nodes[addrSlot(table, addr)];
+}
+
+static void loadSnapshot(Snapshot *snapshot, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fatal("%s: can`t open snapshot!", path);
+    }
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+    if (fileSize < 0) {
+        fatal("%s: read snapshot failed!", path);
+    }
+    unsigned char *data = (unsigned char *) checkedRealloc(NULL, fileSize);
+    if (fread(data, 1, fileSize, file) != (size_t) fileSize) {
+        fatal("%s: read snapshot failed!", path);
+    }
+    fclose(file);
+
+    Reader reader = {data, data + fileSize, path};
+    if (fileSize < HEAP_SNAPSHOT_MAGIC_LEN || memcmp(data, HEAP_SNAPSHOT_MAGIC, HEAP_SNAPSHOT_MAGIC_LEN) != 0) {
+        fatal("%s: not a heap snapshot!", path);
+    }
+    reader.cur += HEAP_SNAPSHOT_MAGIC_LEN;
+    if (readVarint(&reader) != HEAP_SNAPSHOT_VERSION) {
+        fatal("%s: unsupported snapshot version!", path);
+    }
+
+    memset(snapshot, 0, sizeof(Snapshot));
+    uint32_t classCapacity = 0, nodeCapacity = 0, refCapacity = 0, rootCapacity = 0;
+    // 0号为虚拟根, 其引用即各个根
+    ENSURE_CAPACITY(snapshot->nodes, snapshot->nodeNum, nodeCapacity);
+    memset(&snapshot->nodes[snapshot->nodeNum++], 0, sizeof(Node));
+    ENSURE_CAPACITY(snapshot->classNames, snapshot->classNum, classCapacity);
+    snapshot->classNames[snapshot->classNum++] = NULL;
+
+    bool ended = false;
+    while (!ended) {
+        if (reader.cur >= reader.end) {
+            fatal("%s: truncated snapshot!", path);
+        }
+        switch (*reader.cur++) {
+            case HEAP_RECORD_CLASS: {
+                uint64_t id = readVarint(&reader);
+                uint64_t length = readVarint(&reader);
+                if (id != snapshot->classNum || length > (uint64_t) (reader.end - reader.cur)) {
+                    fatal("%s: corrupted class record!", path);
+                }
+                ENSURE_CAPACITY(snapshot->classNames, snapshot->classNum, classCapacity);
+                char *name = (char *) checkedRealloc(NULL, length + 1);
+                memcpy(name, reader.cur, length);
+                name[length] = '\0';
+                reader.cur += length;
+                snapshot->classNames[snapshot->classNum++] = name;
+                break;
+            }
+            case HEAP_RECORD_OBJECT: {
+                ENSURE_CAPACITY(snapshot->nodes, snapshot->nodeNum, nodeCapacity);
+                Node *node = &snapshot->nodes[snapshot->nodeNum++];
+                node->addr = readVarint(&reader);
+                node->type = (uint32_t) readVarint(&reader);
+                node->class = (uint32_t) readVarint(&reader);
+                node->size = readVarint(&reader);
+                node->refNum = (uint32_t) readVarint(&reader);
+                node->firstRef = snapshot->refNum;
+                if (node->type >= OBJ_TYPE_NUM || node->class >= snapshot->classNum) {
+                    fatal("%s: corrupted object record!", path);
+                }
+                uint32_t idx = 0;
+                while (idx++ < node->refNum) {
+                    ENSURE_CAPACITY(snapshot->refAddrs, snapshot->refNum, refCapacity);
+                    snapshot->refAddrs[snapshot->refNum++] = readVarint(&reader);
+                }
+                break;
+            }
+            case HEAP_RECORD_ROOT:
+                ENSURE_CAPACITY(snapshot->rootAddrs, snapshot->rootNum, rootCapacity);
+                snapshot->rootAddrs[snapshot->rootNum++] = readVarint(&reader);
+                break;
+            case HEAP_RECORD_END:
+                ended = true;
+                break;
+            default:
+                fatal("%s: unknown record in snapshot!", path);
+        }
+    }
+    free(data);
+
+    // 把引用的地址转换为结点号
+    AddrTable table;
+    buildAddrTable(&table, snapshot);
+    snapshot->refs = (uint32_t *) checkedRealloc(NULL, snapshot->refNum * sizeof(uint32_t));
+    uint32_t idx = 0;
+    while (idx < snapshot->refNum) {
+        snapshot->refs[idx] = lookupAddr(&table, snapshot->refAddrs[idx]);
+        idx++;
+    }
+    snapshot->roots = (uint32_t *) checkedRealloc(NULL, snapshot->rootNum * sizeof(uint32_t));
+    idx = 0;
+    while (idx < snapshot->rootNum) {
+        snapshot->roots[idx] = lookupAddr(&table, snapshot->rootAddrs[idx]);
+        idx++;
+    }
+    free(table.addrs);
+    free(table.nodes);
+}
+
+static void freeSnapshot(Snapshot *snapshot) {
+    uint32_t idx = 0;
+    while (idx < snapshot->classNum) {
+        free(snapshot->classNames[idx++]);
+    }
+    free(snapshot->classNames);
+    free(snapshot->nodes);
+    free(snapshot->refAddrs);
+    free(snapshot->refs);
+    free(snapshot->rootAddrs);
+    free(snapshot->roots);
+}
+
+// 结点node的第idx个后继, 0表示该引用不在快照中
+static uint32_t successor(Snapshot *snapshot, uint32_t node, uint32_t idx) {
+    if (node == 0) {
+        return snapshot->roots[idx];
+    }
+    return snapshot->refs[snapshot->nodes[node].firstRef + idx];
+}
+
+static uint32_t successorNum(Snapshot *snapshot, uint32_t node) {
+    return node == 0 ? snapshot->rootNum : snapshot->nodes[node].refNum;
+}
+
+// 从虚拟根深度优先遍历, 返回可达结点数, order中为后序
+static uint32_t postOrder(Snapshot *snapshot, uint32_t *order) {
+    uint32_t nodeNum = snapshot->nodeNum;
+    bool *visited = (bool *) calloc(nodeNum, sizeof(bool));
+    uint32_t *stack = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    uint32_t *nextEdge = (uint32_t *) calloc(nodeNum, sizeof(uint32_t));
+    if (visited == NULL || nextEdge == NULL) {
+        fatal("%s", "out of memory!");
+    }
+
+    uint32_t orderNum = 0;
+    uint32_t top = 0;
+    stack[top++] = 0;
+    visited[0] = true;
+    while (top > 0) {
+        uint32_t node = stack[top - 1];
+        if (nextEdge[node] < successorNum(snapshot, node)) {
+            uint32_t next = successor(snapshot, node, nextEdge[node]++);
+            if (next != 0 && !visited[next]) {
+                visited[next] = true;
+                stack[top++] = next;
+            }
+        } else {
+            order[orderNum++] = node;
+            top--;
+        }
+    }
+    free(visited);
+    free(stack);
+    free(nextEdge);
+    return orderNum;
+}
+
+// 支配树上a与b的最近公共祖先, rank为逆后序中的位置
+static uint32_t intersect(uint32_t *idom, uint32_t *rank, uint32_t a, uint32_t b) {
+    while (a != b) {
+        while (rank[a] > rank[b]) {
+            a = idom[a];
+        }
+        while (rank[b] > rank[a]) {
+            b = idom[b];
+        }
+    }
+    return a;
+}
+
+/**
+ * 用Cooper-Harvey-Kennedy迭代算法求直接支配者, 不可达结点为IDOM_UNDEFINED
+ * order为后序, 返回的idom由调用者释放
+ */
+static uint32_t *dominators(Snapshot *snapshot, uint32_t *order, uint32_t orderNum) {
+    uint32_t nodeNum = snapshot->nodeNum;
+    uint32_t *idom = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    uint32_t *rank = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    uint32_t idx = 0;
+    while (idx < nodeNum) {
+        idom[idx] = IDOM_UNDEFINED;
+        rank[idx++] = UINT32_MAX;
+    }
+    idx = 0;
+    while (idx < orderNum) {
+        rank[order[idx]] = orderNum - 1 - idx;
+        idx++;
+    }
+
+    // 前驱表, 只含可达结点之间的边
+    uint32_t *predStart = (uint32_t *) calloc(nodeNum + 1, sizeof(uint32_t));
+    if (predStart == NULL) {
+        fatal("%s", "out of memory!");
+    }
+    idx = 0;
+    while (idx < orderNum) {
+        uint32_t node = order[idx++];
+        uint32_t edge = 0;
+        while (edge < successorNum(snapshot, node)) {
+            uint32_t next = successor(snapshot, node, edge++);
+            if (next != 0) {
+                predStart[next + 1]++;
+            }
+        }
+    }
+    idx = 0;
+    while (idx < nodeNum) {
+        predStart[idx + 1] += predStart[idx];
+        idx++;
+    }
+    uint32_t *preds = (uint32_t *) checkedRealloc(NULL, predStart[nodeNum] * sizeof(uint32_t));
+    uint32_t *fill = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    memcpy(fill, predStart, nodeNum * sizeof(uint32_t));
+    idx = 0;
+    while (idx < orderNum) {
+        uint32_t node = order[idx++];
+        uint32_t edge = 0;
+        while (edge < successorNum(snapshot, node)) {
+            uint32_t next = successor(snapshot, node, edge++);
+            if (next != 0) {
+                preds[fill[next]++] = node;
+            }
+        }
+    }
+    free(fill);
+
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        // 按逆后序处理, 跳过虚拟根
+        uint32_t pos = orderNum - 1;
+        while (pos-- > 0) {
+            uint32_t node = order[pos];
+            uint32_t newIdom = IDOM_UNDEFINED;
+            uint32_t edge = predStart[node];
+            while (edge < predStart[node + 1]) {
+                uint32_t pred = preds[edge++];
+                if (idom[pred] == IDOM_UNDEFINED) {
+                    continue;
+                }
+                newIdom = newIdom == IDOM_UNDEFINED ? pred : intersect(idom, rank, pred, newIdom);
+            }
+            if (newIdom != idom[node]) {
+                idom[node] = newIdom;
+                changed = true;
+            }
+        }
+    }
+    free(rank);
+    free(predStart);
+    free(preds);
+    return idom;
+}
+
+// 对象的类名, 没有类或类没有名字时以对象类型代替
+static const char *nodeName(Snapshot *snapshot, Node *node, char *buffer, size_t bufferSize) {
+    const char *name = snapshot->classNames[node->class];
+    if (name != NULL && name[0] != '\0') {
+        return name;
+    }
+    snprintf(buffer, bufferSize, "(%s)", objTypeNames[node->type]);
+    return buffer;
+}
+
+// 返回name在summary中的下标, 不存在时新建
+static uint32_t summaryClass(Summary *summary, uint32_t *capacity, const char *name) {
+    uint32_t idx = 0;
+    while (idx < summary->classNum) {
+        if (strcmp(summary->classes[idx].name, name) == 0) {
+            return idx;
+        }
+        idx++;
+    }
+    ENSURE_CAPACITY(summary->classes, summary->classNum, *capacity);
+    ClassSummary *class = &summary->classes[summary->classNum];
+    class->name = strdup(name);
+    class->count = class->shallow = class->retained = 0;
+    return summary->classNum++;
+}
+
+/**
+ * 按类名汇总快照
+ * 类的保留大小是该类对象的保留大小之和, 但被同类对象支配的对象不重复计入
+ */
+static void summarize(Snapshot *snapshot, Summary *summary) {
+    uint32_t nodeNum = snapshot->nodeNum;
+    uint32_t *order = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    uint32_t orderNum = postOrder(snapshot, order);
+    uint32_t *idom = dominators(snapshot, order, orderNum);
+
+    // 后序中子结点先于支配者, 逐个累加到直接支配者上
+    uint64_t *retained = (uint64_t *) calloc(nodeNum, sizeof(uint64_t));
+    if (retained == NULL) {
+        fatal("%s", "out of memory!");
+    }
+    uint32_t idx = 0;
+    while (idx < orderNum) {
+        uint32_t node = order[idx++];
+        retained[node] += snapshot->nodes[node].size;
+        if (node != 0) {
+            retained[idom[node]] += retained[node];
+        }
+    }
+
+    memset(summary, 0, sizeof(Summary));
+    uint32_t capacity = 0;
+    uint32_t *classOf = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    char buffer[32];
+    idx = 1;
+    while (idx < nodeNum) {
+        Node *node = &snapshot->nodes[idx];
+        classOf[idx] = summaryClass(summary, &capacity, nodeName(snapshot, node, buffer, sizeof(buffer)));
+        ClassSummary *class = &summary->classes[classOf[idx]];
+        class->count++;
+        class->shallow += node->size;
+        if (idom[idx] == IDOM_UNDEFINED) {
+            summary->unreachable += node->size;
+        }
+        idx++;
+    }
+
+    // 支配树的子结点表
+    uint32_t *childStart = (uint32_t *) calloc(nodeNum + 1, sizeof(uint32_t));
+    uint32_t *children = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    if (childStart == NULL) {
+        fatal("%s", "out of memory!");
+    }
+    idx = 1;
+    while (idx < nodeNum) {
+        if (idom[idx] != IDOM_UNDEFINED) {
+            childStart[idom[idx] + 1]++;
+        }
+        idx++;
+    }
+    idx = 0;
+    while (idx < nodeNum) {
+        childStart[idx + 1] += childStart[idx];
+        idx++;
+    }
+    uint32_t *fill = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    memcpy(fill, childStart, nodeNum * sizeof(uint32_t));
+    idx = 1;
+    while (idx < nodeNum) {
+        if (idom[idx] != IDOM_UNDEFINED) {
+            children[fill[idom[idx]]++] = idx;
+        }
+        idx++;
+    }
+
+    // 自上而下遍历支配树, active记录当前路径上各类的对象数, 为0时该对象的保留大小才计入其类
+    uint32_t *active = (uint32_t *) calloc(summary->classNum + 1, sizeof(uint32_t));
+    uint32_t *stack = (uint32_t *) checkedRealloc(NULL, nodeNum * sizeof(uint32_t));
+    uint32_t *nextChild = fill;
+    memcpy(nextChild, childStart, nodeNum * sizeof(uint32_t));
+    if (active == NULL) {
+        fatal("%s", "out of memory!");
+    }
+    uint32_t top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        uint32_t node = stack[top - 1];
+        if (nextChild[node] < childStart[node + 1]) {
+            uint32_t child = children[nextChild[node]++];
+            if (active[classOf[child]]++ == 0) {
+                summary->classes[classOf[child]].retained += retained[child];
+            }
+            stack[top++] = child;
+        } else {
+            if (node != 0) {
+                active[classOf[node]]--;
+            }
+            top--;
+        }
+    }
+
+    free(order);
+    free(idom);
+    free(retained);
+    free(classOf);
+    free(childStart);
+    free(children);
+    free(fill);
+    free(active);
+    free(stack);
+}
+
+static int compareRetained(const void *a, const void *b) {
+    const ClassSummary *x = (const ClassSummary *) a;
+    const ClassSummary *y = (const ClassSummary *) b;
+    if (x->retained != y->retained) {
+        return x->retained < y->retained ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static void printSummary(Summary *summary) {
+    qsort(summary->classes, summary->classNum, sizeof(ClassSummary), compareRetained);
+    uint64_t count = 0, shallow = 0;
+    printf("%12s %14s %14s  %s\n", "count", "shallow", "retained", "class");
+    uint32_t idx = 0;
+    while (idx < summary->classNum) {
+        ClassSummary *class = &summary->classes[idx++];
+        printf("%12llu %14llu %14llu  %s\n", (unsigned long long) class->count,
+               (unsigned long long) class->shallow, (unsigned long long) class->retained, class->name);
+        count += class->count;
+        shallow += class->shallow;
+    }
+    printf("%12llu %14llu %14s  total, %llu bytes unreachable\n", (unsigned long long) count,
+           (unsigned long long) shallow, "", (unsigned long long) summary->unreachable);
+}
+
+static void freeSummary(Summary *summary) {
+    uint32_t idx = 0;
+    while (idx < summary->classNum) {
+        free(summary->classes[idx++].name);
+    }
+    free(summary->classes);
+}
+
+/**
+ * 两个快照中同名类的变化
+ */
+typedef struct {
+    const char *name;
+    long long count;
+    long long shallow;
+    long long retained;
+} ClassDiff;
+
+static int compareDiff(const void *a, const void *b) {
+    const ClassDiff *x = (const ClassDiff *) a;
+    const ClassDiff *y = (const ClassDiff *) b;
+    long long dx = llabs(x->shallow), dy = llabs(y->shallow);
+    if (dx != dy) {
+        return dx < dy ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static void printDiff(Summary *before, Summary *after) {
+    ClassDiff *diffs = (ClassDiff *) checkedRealloc(NULL, (before->classNum + after->classNum) *
+                                                            sizeof(ClassDiff));
+    uint32_t diffNum = 0;
+    uint32_t idx = 0;
+    while (idx < after->classNum) {
+        ClassSummary *class = &after->classes[idx++];
+        ClassDiff *diff = &diffs[diffNum++];
+        diff->name = class->name;
+        diff->count = (long long) class->count;
+        diff->shallow = (long long) class->shallow;
+        diff->retained = (long long) class->retained;
+    }
+    idx = 0;
+    while (idx < before->classNum) {
+        ClassSummary *class = &before->classes[idx++];
+        uint32_t pos = 0;
+        while (pos < diffNum && strcmp(diffs[pos].name, class->name) != 0) {
+            pos++;
+        }
+        if (pos == diffNum) {
+            diffs[diffNum].name = class->name;
+            diffs[diffNum].count = diffs[diffNum].shallow = diffs[diffNum].retained = 0;
+            diffNum++;
+        }
+        diffs[pos].count -= (long long) class->count;
+        diffs[pos].shallow -= (long long) class->shallow;
+        diffs[pos].retained -= (long long) class->retained;
+    }
+
+    qsort(diffs, diffNum, sizeof(ClassDiff), compareDiff);
+    printf("%12s %14s %14s  %s\n", "count", "shallow", "retained", "class");
+    idx = 0;
+    while (idx < diffNum) {
+        ClassDiff *diff = &diffs[idx++];
+        if (diff->count != 0 || diff->shallow != 0 || diff->retained != 0) {
+            printf("%+12lld %+14lld %+14lld  %s\n", diff->count, diff->shallow, diff->retained, diff->name);
+        }
+    }
+    free(diffs);
+}
+
+int main(int argc, const char **argv) {
+    if (argc == 3 && strcmp(argv[1], "summary") == 0) {
+        Snapshot snapshot;
+        Summary summary;
+        loadSnapshot(&snapshot, argv[2]);
+        summarize(&snapshot, &summary);
+        freeSnapshot(&snapshot);
+        printSummary(&summary);
+        freeSummary(&summary);
+    } else if (argc == 4 && strcmp(argv[1], "diff") == 0) {
+        Snapshot snapshot;
+        Summary before, after;
+        loadSnapshot(&snapshot, argv[2]);
+        summarize(&snapshot, &before);
+        freeSnapshot(&snapshot);
+        loadSnapshot(&snapshot, argv[3]);
+        summarize(&snapshot, &after);
+        freeSnapshot(&snapshot);
+        printDiff(&before, &after);
+        freeSummary(&before);
+        freeSummary(&after);
+    } else {
+        fprintf(stderr, "usage: %s summary <snapshot>\n       %s diff <old> <new>\n", argv[0], argv[0]);
+        return 1;
+    }
+    return 0;
+}
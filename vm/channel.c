@@ -0,0 +1,484 @@
+//
+// Created by Kosho on 2020/2/8.
+//
+
+#include "channel.h"
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vm.h"
+#include "obj_list.h"
+#include "obj_map.h"
+
+DEFINE_BUFFER_METHOD(ChannelPtr)
+
+// 等待对端时的退避: 先自旋, 再让出cpu, 最后短暂休眠
+static void backoff(uint32_t round) {
+    if (round < CHANNEL_SPIN_COUNT) {
+        return;
+    }
+    if (round < CHANNEL_SPIN_COUNT * 2) {
+        sched_yield();
+        return;
+    }
+    struct timespec ts = {0, 50000};
+    nanosleep(&ts, NULL);
+}
+
+// 创建者在O_EXCL成功后才扩展并初始化共享内存, 其余打开者等它完成, 超过此轮数(约1秒)仍未完成视为失败
+#define CHANNEL_INIT_ROUNDS (CHANNEL_SPIN_COUNT * 2 + 20000)
+
+// 打开已存在的共享内存对象并等待创建者完成初始化, 其大小须为头部加上2的幂
+static ChannelShm *mapExisting(int fd, size_t *mapSize) {
+    struct stat fileStat;
+    uint32_t round = 0;
+    while (true) {
+        if (fstat(fd, &fileStat) == -1) {
+            return NULL;
+        }
+        if (fileStat.st_size != 0) {
+            break;
+        }
+        if (round >= CHANNEL_INIT_ROUNDS) {
+            return NULL;
+        }
+        backoff(round++);
+    }
+
+    if ((uint64_t) fileStat.st_size <= sizeof(ChannelShm) ||
+        (uint64_t) fileStat.st_size - sizeof(ChannelShm) > CHANNEL_MAX_CAPACITY) {
+        return NULL;
+    }
+    uint32_t capacity = (uint32_t) (fileStat.st_size - sizeof(ChannelShm));
+    if ((capacity & (capacity - 1)) != 0) {
+        return NULL;
+    }
+
+    *mapSize = (size_t) fileStat.st_size;
+    ChannelShm *shm = mmap(NULL, *mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        return NULL;
+    }
+    while (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != CHANNEL_MAGIC) {
+        if (round >= CHANNEL_INIT_ROUNDS) {
+            munmap(shm, *mapSize);
+            return NULL;
+        }
+        backoff(round++);
+    }
+    if (shm->capacity != capacity) {
+        munmap(shm, *mapSize);
+        return NULL;
+    }
+    return shm;
+}
+
+/**
+ * 打开名为name的共享内存通道, create为true时不存在则创建
+ * capacity为数据区字节数, 会向上取整为2的幂, 不能超过CHANNEL_MAX_CAPACITY
+ * 只有以O_EXCL创建成功的一方初始化头部, 同时创建的另一方和其余打开者等待其完成
+ */
+Channel *channelOpen(const char *name, uint32_t capacity, bool create) {
+    if (capacity > CHANNEL_MAX_CAPACITY) {
+        return NULL;
+    }
+    if (capacity < CHANNEL_MIN_CAPACITY) {
+        capacity = CHANNEL_MIN_CAPACITY;
+    }
+    capacity = ceilToPowerOf2(capacity);
+
+    ChannelShm *shm = NULL;
+    size_t mapSize = sizeof(ChannelShm) + capacity;
+    int fd = create ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : -1;
+    if (fd != -1) {
+        // 新建的共享内存大小为0, 扩展后其余部分为0, 只需填写头部
+        if (ftruncate(fd, (off_t) mapSize) == -1) {
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+        shm = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shm == MAP_FAILED) {
+            shm_unlink(name);
+            return NULL;
+        }
+        shm->capacity = capacity;
+        __atomic_store_n(&shm->head, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&shm->tail, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&shm->magic, CHANNEL_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        if (create && errno != EEXIST) {
+            return NULL;
+        }
+        // 已存在的以其实际大小为准
+        fd = shm_open(name, O_RDWR, 0600);
+        if (fd == -1) {
+            return NULL;
+        }
+        shm = mapExisting(fd, &mapSize);
+        close(fd);
+        if (shm == NULL) {
+            return NULL;
+        }
+    }
+
+    Channel *channel = (Channel *) malloc(sizeof(Channel));
+    if (channel == NULL) {
+        munmap(shm, mapSize);
+        return NULL;
+    }
+    channel->shm = shm;
+    channel->mapSize = mapSize;
+    channel->capacity = (uint32_t) (mapSize - sizeof(ChannelShm));
+    channel->mask = channel->capacity - 1;
+    return channel;
+}
+
+/**
+ * 解除映射并释放句柄, 共享内存对象本身仍保留
+ */
+void channelClose(Channel *channel) {
+    munmap(channel->shm, channel->mapSize);
+    free(channel);
+}
+
+/**
+ * 删除共享内存对象, 已打开的映射不受影响
+ */
+int channelUnlink(const char *name) {
+    return shm_unlink(name);
+}
+
+// 向buf追加length字节
+static void appendBytes(VM *vm, ByteBuffer *buf, const void *bytes, uint32_t length) {
+    ByteBufferAppendMany(vm, buf, (const Byte *) bytes, length);
+}
+
+static void appendUint32(VM *vm, ByteBuffer *buf, uint32_t num) {
+    appendBytes(vm, buf, &num, sizeof(uint32_t));
+}
+
+// 编码value的类型和内容,不含帧长度
+static ChannelResult encodeValue(VM *vm, ByteBuffer *buf, Value value, int depth) {
+    if (depth > CHANNEL_MAX_DEPTH) {
+        return CHANNEL_UNSUPPORTED;
+    }
+
+    switch (VALUE_TYPE(value)) {
+        case VT_NULL:
+            ByteBufferAdd(vm, buf, CT_NULL);
+            return CHANNEL_OK;
+        case VT_FALSE:
+            ByteBufferAdd(vm, buf, CT_FALSE);
+            return CHANNEL_OK;
+        case VT_TRUE:
+            ByteBufferAdd(vm, buf, CT_TRUE);
+            return CHANNEL_OK;
+        case VT_NUM: {
+            double num = VALUE_TO_NUM(value);
+            ByteBufferAdd(vm, buf, CT_NUM);
+            appendBytes(vm, buf, &num, sizeof(double));
+            return CHANNEL_OK;
+        }
+        case VT_OBJ:
+            break;
+        default:
+            return CHANNEL_UNSUPPORTED;
+    }
+
+    switch (OBJ_TYPE(VALUE_TO_OBJ(value))) {
+        case OT_STRING: {
+            ObjString *objString = VALUE_TO_OBJSTR(value);
+            ByteBufferAdd(vm, buf, CT_STRING);
+            appendUint32(vm, buf, objString->value.length);
+            appendBytes(vm, buf, objString->value.start, objString->value.length);
+            return CHANNEL_OK;
+        }
+        case OT_LIST: {
+            ObjList *objList = VALUE_TO_OBJLIST(value);
+            ByteBufferAdd(vm, buf, CT_LIST);
+            appendUint32(vm, buf, objList->elements.count);
+            uint32_t idx = 0;
+            while (idx < objList->elements.count) {
+                ChannelResult result = encodeValue(vm, buf, objList->elements.datas[idx++], depth + 1);
+                if (result != CHANNEL_OK) {
+                    return result;
+                }
+            }
+            return CHANNEL_OK;
+        }
+        case OT_MAP: {
+            ObjMap *objMap = VALUE_TO_OBJMAP(value);
+            ByteBufferAdd(vm, buf, CT_MAP);
+            appendUint32(vm, buf, objMap->count);
+            uint32_t idx = 0;
+            while (idx < objMap->capacity) {
+                Entry *entry = &objMap->entries[idx++];
+                if (VALUE_IS_UNDEFINED(entry->key)) {
+                    continue;
+                }
+                // 只有数字,字符串,null和bool能在另一端重建为key
+                if (VALUE_IS_OBJ(entry->key) && !VALUE_IS_OBJSTR(entry->key)) {
+                    return CHANNEL_UNSUPPORTED;
+                }
+                ChannelResult result = encodeValue(vm, buf, entry->key, depth + 1);
+                if (result == CHANNEL_OK) {
+                    result = encodeValue(vm, buf, entry->value, depth + 1);
+                }
+                if (result != CHANNEL_OK) {
+                    return result;
+                }
+            }
+            return CHANNEL_OK;
+        }
+        default:
+            return CHANNEL_UNSUPPORTED;
+    }
+}
+
+/**
+ * 把value编码为一帧追加到buf: 4字节payload长度 + payload
+ * 失败时buf恢复原状
+ */
+ChannelResult channelEncode(VM *vm, ByteBuffer *buf, Value value) {
+    uint32_t frameStart = buf->count;
+    appendUint32(vm, buf, 0);
+
+    ChannelResult result = encodeValue(vm, buf, value, 0);
+    if (result != CHANNEL_OK) {
+        buf->count = frameStart;
+        return result;
+    }
+
+    uint32_t payloadLen = buf->count - frameStart - sizeof(uint32_t);
+    memcpy(buf->datas + frameStart, &payloadLen, sizeof(uint32_t));
+    return CHANNEL_OK;
+}
+
+// 从环形缓冲区的pos处拷贝length字节到dest, 处理回绕
+static void ringCopyOut(Channel *channel, uint64_t pos, void *dest, uint32_t length) {
+    uint64_t offset = pos & channel->mask;
+    uint64_t firstPart = channel->capacity - offset;
+    if (firstPart >= length) {
+        memcpy(dest, channel->shm->data + offset, length);
+    } else {
+        memcpy(dest, channel->shm->data + offset, firstPart);
+        memcpy((uint8_t *) dest + firstPart, channel->shm->data, length - firstPart);
+    }
+}
+
+// 把src的length字节拷贝到环形缓冲区的pos处, 处理回绕
+static void ringCopyIn(Channel *channel, uint64_t pos, const void *src, uint32_t length) {
+    uint64_t offset = pos & channel->mask;
+    uint64_t firstPart = channel->capacity - offset;
+    if (firstPart >= length) {
+        memcpy(channel->shm->data + offset, src, length);
+    } else {
+        memcpy(channel->shm->data + offset, src, firstPart);
+        memcpy(channel->shm->data, (const uint8_t *) src + firstPart, length - firstPart);
+    }
+}
+
+/**
+ * 非阻塞写入若干已编码的帧, 要么全部写入要么都不写
+ * 整批只发布一次head, 快速路径上没有系统调用
+ */
+ChannelResult channelTryWrite(Channel *channel, const uint8_t *frames, uint32_t size) {
+    if (size > channel->capacity) {
+        return CHANNEL_TOO_LARGE;
+    }
+
+    // head只有本进程写, 无需同步读取
+    uint64_t head = channel->shm->head;
+    uint64_t tail = __atomic_load_n(&channel->shm->tail, __ATOMIC_ACQUIRE);
+    // tail由对端写入, 超过head或落后超过容量说明共享内存已被破坏
+    if (head - tail > channel->capacity) {
+        return CHANNEL_CORRUPT;
+    }
+    if (channel->capacity - (head - tail) < size) {
+        return CHANNEL_FULL;
+    }
+
+    ringCopyIn(channel, head, frames, size);
+    __atomic_store_n(&channel->shm->head, head + size, __ATOMIC_RELEASE);
+    return CHANNEL_OK;
+}
+
+/**
+ * 阻塞写入, 空间不足时等待消费者
+ * 共享内存没有可供epoll等待的描述符, 等待期间整个vm停在这里而不是只挂起当前线程,
+ * 需要与io或定时器并存的脚本应使用非阻塞的trySend
+ */
+ChannelResult channelWrite(Channel *channel, const uint8_t *frames, uint32_t size) {
+    uint32_t round = 0;
+    ChannelResult result;
+    while ((result = channelTryWrite(channel, frames, size)) == CHANNEL_FULL) {
+        backoff(round++);
+    }
+    return result;
+}
+
+// 从[*cursor, end)解码一个Value
+static ChannelResult decodeValue(VM *vm, const uint8_t **cursor, const uint8_t *end, Value *value, int depth) {
+    if (*cursor >= end || depth > CHANNEL_MAX_DEPTH) {
+        return CHANNEL_CORRUPT;
+    }
+
+    uint8_t tag = *(*cursor)++;
+    uint32_t count;
+    switch (tag) {
+        case CT_NULL:
+            *value = VT_TO_VALUE(VT_NULL);
+            return CHANNEL_OK;
+        case CT_FALSE:
+            *value = VT_TO_VALUE(VT_FALSE);
+            return CHANNEL_OK;
+        case CT_TRUE:
+            *value = VT_TO_VALUE(VT_TRUE);
+            return CHANNEL_OK;
+        case CT_NUM: {
+            double num;
+            if (end - *cursor < (long) sizeof(double)) {
+                return CHANNEL_CORRUPT;
+            }
+            memcpy(&num, *cursor, sizeof(double));
+            *cursor += sizeof(double);
+            // 对端写入的NaN可能带任意载荷, NaN-boxing下会被误认为其它值, 统一为默认NaN
+            if (isnan(num)) {
+                num = NAN;
+            }
+            *value = NUM_TO_VALUE(num);
+            return CHANNEL_OK;
+        }
+        case CT_STRING:
+        case CT_LIST:
+        case CT_MAP:
+            if (end - *cursor < (long) sizeof(uint32_t)) {
+                return CHANNEL_CORRUPT;
+            }
+            memcpy(&count, *cursor, sizeof(uint32_t));
+            *cursor += sizeof(uint32_t);
+            break;
+        default:
+            return CHANNEL_CORRUPT;
+    }
+
+    if (tag == CT_STRING) {
+        if ((uint64_t) (end - *cursor) < count) {
+            return CHANNEL_CORRUPT;
+        }
+        *value = OBJ_TO_VALUE(newObjString(vm, (const char *) *cursor, count));
+        *cursor += count;
+        return CHANNEL_OK;
+    }
+
+    // 每个元素至少占1字节, 以此拒绝伪造的超大count
+    if ((uint64_t) (end - *cursor) < count) {
+        return CHANNEL_CORRUPT;
+    }
+
+    if (tag == CT_LIST) {
+        ObjList *objList = newObjList(vm, count);
+        uint32_t idx = 0;
+        while (idx < count) {
+            objList->elements.datas[idx] = VT_TO_VALUE(VT_NULL);
+            idx++;
+        }
+        *value = OBJ_TO_VALUE(objList);
+        idx = 0;
+        while (idx < count) {
+            ChannelResult result = decodeValue(vm, cursor, end, &objList->elements.datas[idx++], depth + 1);
+            if (result != CHANNEL_OK) {
+                return result;
+            }
+        }
+        return CHANNEL_OK;
+    }
+
+    ObjMap *objMap = newObjMap(vm);
+    *value = OBJ_TO_VALUE(objMap);
+    uint32_t idx = 0;
+    while (idx++ < count) {
+        Value key, val;
+        ChannelResult result = decodeValue(vm, cursor, end, &key, depth + 1);
+        if (result == CHANNEL_OK) {
+            result = decodeValue(vm, cursor, end, &val, depth + 1);
+        }
+        if (result != CHANNEL_OK) {
+            return result;
+        }
+        if (VALUE_IS_OBJ(key) && !VALUE_IS_OBJSTR(key)) {
+            return CHANNEL_CORRUPT;
+        }
+        mapSet(vm, objMap, key, val);
+    }
+    return CHANNEL_OK;
+}
+
+/**
+ * 非阻塞读取一条消息并解码到value
+ * scratch用于拼接回绕的消息, 由调用方复用以免反复分配
+ * 消息损坏时丢弃缓冲区中已有的全部数据, 从生产者下一次写入处重新对齐帧边界,
+ * 因此只有损坏的这一批消息丢失, 之后的读取不受影响
+ */
+ChannelResult channelTryRead(VM *vm, Channel *channel, ByteBuffer *scratch, Value *value) {
+    // tail只有本进程写, 无需同步读取
+    uint64_t tail = channel->shm->tail;
+    uint64_t head = __atomic_load_n(&channel->shm->head, __ATOMIC_ACQUIRE);
+    // head由对端写入, 未读数据超过容量时无法从中找回帧边界
+    if (head - tail > channel->capacity) {
+        __atomic_store_n(&channel->shm->tail, head, __ATOMIC_RELEASE);
+        return CHANNEL_CORRUPT;
+    }
+    if (head - tail < sizeof(uint32_t)) {
+        return CHANNEL_EMPTY;
+    }
+
+    uint32_t payloadLen;
+    ringCopyOut(channel, tail, &payloadLen, sizeof(uint32_t));
+    if (payloadLen > head - tail - sizeof(uint32_t)) {
+        // 生产者每次发布head时写入的都是完整的帧, head处必定是帧边界
+        __atomic_store_n(&channel->shm->tail, head, __ATOMIC_RELEASE);
+        return CHANNEL_CORRUPT;
+    }
+
+    scratch->count = 0;
+    ByteBufferReserve(vm, scratch, payloadLen);
+    ringCopyOut(channel, tail + sizeof(uint32_t), scratch->datas, payloadLen);
+
+    // 先归还空间再解码, 让生产者尽早继续写
+    __atomic_store_n(&channel->shm->tail, tail + sizeof(uint32_t) + payloadLen, __ATOMIC_RELEASE);
+
+    // 解码中新建的容器在挂接到外层之前无处可达, 暂停gc直到整条消息解码完成
+    const uint8_t *cursor = scratch->datas;
+    vm->gcPauseNum++;
+    ChannelResult result = decodeValue(vm, &cursor, scratch->datas + payloadLen, value, 0);
+    vm->gcPauseNum--;
+    if (result == CHANNEL_OK && cursor != scratch->datas + payloadLen) {
+        result = CHANNEL_CORRUPT;
+    }
+    if (result == CHANNEL_CORRUPT) {
+        __atomic_store_n(&channel->shm->tail, head, __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+/**
+ * 阻塞读取一条消息, 缓冲区为空时等待生产者
+ * 与channelWrite一样, 等待期间阻塞整个vm
+ */
+ChannelResult channelRead(VM *vm, Channel *channel, ByteBuffer *scratch, Value *value) {
+    uint32_t round = 0;
+    ChannelResult result;
+    while ((result = channelTryRead(vm, channel, scratch, value)) == CHANNEL_EMPTY) {
+        backoff(round++);
+    }
+    return result;
+}
@@ -0,0 +1,93 @@
+//
+// Created by Kosho on 2020/2/8.
+//
+
+#ifndef _VM_CHANNEL_H
+#define _VM_CHANNEL_H
+
+#include "utils.h"
+#include "object_header.h"
+
+#define CHANNEL_MAGIC 0x4352424d       // "CRBM"
+#define CHANNEL_MIN_CAPACITY 4096      // 数据区最小字节数
+#define CHANNEL_MAX_CAPACITY ((uint32_t) 1 << 31) // 数据区最大字节数, 取整为2的幂后仍在uint32_t范围内
+#define CHANNEL_MAX_DEPTH 64           // 编码list/map时允许的最大嵌套深度
+#define CHANNEL_SPIN_COUNT 128         // 阻塞收发时进入休眠前的自旋次数
+
+/**
+ * 通道操作结果
+ */
+typedef enum {
+    CHANNEL_OK,
+    CHANNEL_FULL,        // 缓冲区空间不足
+    CHANNEL_EMPTY,       // 缓冲区中没有消息
+    CHANNEL_TOO_LARGE,   // 消息大于缓冲区容量
+    CHANNEL_UNSUPPORTED, // 值的类型无法编码
+    CHANNEL_CORRUPT      // 消息格式错误
+} ChannelResult;
+
+/**
+ * 编码后Value的类型标记
+ */
+typedef enum {
+    CT_NULL,
+    CT_FALSE,
+    CT_TRUE,
+    CT_NUM,
+    CT_STRING,
+    CT_LIST,
+    CT_MAP
+} ChannelTag;
+
+/**
+ * 位于共享内存起始处的环形缓冲区头
+ * 单生产者单消费者: head只由生产者写, tail只由消费者写,
+ * 两者分处不同的cache line, 避免伪共享
+ */
+typedef struct {
+    uint32_t magic;
+    // 数据区字节数, 为2的幂
+    uint32_t capacity;
+    uint8_t pad0[56];
+    // 已写入的累计字节数
+    uint64_t head;
+    uint8_t pad1[56];
+    // 已读出的累计字节数
+    uint64_t tail;
+    uint8_t pad2[56];
+    uint8_t data[0];
+} ChannelShm;
+
+/**
+ * 进程内的通道句柄
+ */
+typedef struct channel {
+    ChannelShm *shm;
+    // 映射区总大小
+    size_t mapSize;
+    // 打开时按映射大小确定的数据区容量, 对端可写shm->capacity, 此后不再读取它
+    uint32_t capacity;
+    // 数据区容量减1, 用于取模
+    uint64_t mask;
+} Channel;
+
+typedef Channel *ChannelPtr;
+DECLARE_BUFFER_TYPE(ChannelPtr)
+
+Channel *channelOpen(const char *name, uint32_t capacity, bool create);
+
+void channelClose(Channel *channel);
+
+int channelUnlink(const char *name);
+
+ChannelResult channelEncode(VM *vm, ByteBuffer *buf, Value value);
+
+ChannelResult channelTryWrite(Channel *channel, const uint8_t *frames, uint32_t size);
+
+ChannelResult channelWrite(Channel *channel, const uint8_t *frames, uint32_t size);
+
+ChannelResult channelTryRead(VM *vm, Channel *channel, ByteBuffer *scratch, Value *value);
+
+ChannelResult channelRead(VM *vm, Channel *channel, ByteBuffer *scratch, Value *value);
+
+#endif
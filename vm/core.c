@@ -5,9 +5,19 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "vm.h"
 #include "utils.h"
 #include "compiler.h"
+#include "obj_list.h"
+#include "gc.h"
+#include "bytecode_cache.h"
 #include "core.script.inc"
 
 // 根目录
@@ -107,7 +117,7 @@ static bool primObjectIs(VM *vm, Value *args) {
     }
 
     Class *thisClass = getClassOfObj(vm, args[0]);
-    Class *baseClass = (Class *) (args[1].objHeader);
+    Class *baseClass = VALUE_TO_CLASS(args[1]);
 
     //有可能是多级继承,因此自下而上遍历基类链
     while (baseClass != NULL) {
@@ -125,7 +135,7 @@ static bool primObjectIs(VM *vm, Value *args) {
 
 // args[0].tostring: 返回args[0]所属class的名字
 static bool primObjectToString(VM *vm UNUSED, Value *args) {
-    Class *class = args[0].objHeader->class;
+    Class *class = OBJ_CLASS(VALUE_TO_OBJ(args[0]));
     Value nameValue = OBJ_TO_VALUE(class->name);
     RET_VALUE(nameValue);
 }
@@ -161,42 +171,645 @@ static bool primObjectmetaSame(VM *vm UNUSED, Value *args) {
     RET_VALUE(boolValue);
 }
 
+// 校验arg是否为字符串
+static bool validateString(VM *vm, Value arg) {
+    if (VALUE_IS_OBJSTR(arg)) {
+        return true;
+    }
+    SET_ERROR_FALSE(vm, "argument must be string!");
+}
+
+// 校验arg是否为非负整数
+static bool validateUint(VM *vm, Value arg) {
+    if (VALUE_IS_NUM(arg) && VALUE_TO_NUM(arg) >= 0 &&
+        VALUE_TO_NUM(arg) == (uint32_t) VALUE_TO_NUM(arg)) {
+        return true;
+    }
+    SET_ERROR_FALSE(vm, "argument must be non-negative integer!");
+}
+
+// 取出Channel实例中记录的通道, 已关闭则报错
+static Channel *getChannel(VM *vm, Value channelObj) {
+    Value handle = VALUE_TO_OBJINSTANCE(channelObj)->fields[0];
+    if (!VALUE_IS_NUM(handle)) {
+        return NULL;
+    }
+    return vm->channels.datas[(uint32_t) VALUE_TO_NUM(handle)];
+}
+
+// 打开或创建通道并包装为Channel实例
+static bool openChannel(VM *vm, Value *args, uint32_t capacity, bool create) {
+    if (!validateString(vm, args[1])) {
+        return false;
+    }
+    Channel *channel = channelOpen(VALUE_TO_OBJSTR(args[1])->value.start, capacity, create);
+    if (channel == NULL) {
+        SET_ERROR_FALSE(vm, "open channel failed!");
+    }
+
+    // 复用已关闭通道的句柄
+    uint32_t handle = 0;
+    while (handle < vm->channels.count && vm->channels.datas[handle] != NULL) {
+        handle++;
+    }
+    if (handle == vm->channels.count) {
+        ChannelPtrBufferAdd(vm, &vm->channels, channel);
+    } else {
+        vm->channels.datas[handle] = channel;
+    }
+
+    ObjInstance *objInstance = newObjInstance(vm, vm->channelClass);
+    objInstance->fields[0] = NUM_TO_VALUE(handle);
+    RET_OBJ(objInstance);
+}
+
+// 把通道操作的结果转为报错
+static bool channelError(VM *vm, ChannelResult result) {
+    switch (result) {
+        case CHANNEL_TOO_LARGE:
+            SET_ERROR_FALSE(vm, "message is larger than channel capacity!");
+        case CHANNEL_UNSUPPORTED:
+            SET_ERROR_FALSE(vm, "only null, bool, num, string, list and map can be sent!");
+        case CHANNEL_CORRUPT:
+            SET_ERROR_FALSE(vm, "channel message corrupted!");
+        default:
+            SET_ERROR_FALSE(vm, "channel error!");
+    }
+}
+
+#define GET_CHANNEL(vmPtr, value, channelPtr) \
+   Channel *channelPtr = getChannel(vmPtr, value);\
+   if (channelPtr == NULL) {\
+      SET_ERROR_FALSE(vmPtr, "channel is closed!");\
+   }
+
+// Channel.create(name, capacity): 创建共享内存通道
+static bool primChannelCreate(VM *vm, Value *args) {
+    if (!validateUint(vm, args[2])) {
+        return false;
+    }
+    if (VALUE_TO_NUM(args[2]) > CHANNEL_MAX_CAPACITY) {
+        SET_ERROR_FALSE(vm, "capacity must not exceed 2^31 bytes!");
+    }
+    return openChannel(vm, args, (uint32_t) VALUE_TO_NUM(args[2]), true);
+}
+
+// Channel.open(name): 打开已存在的通道
+static bool primChannelOpen(VM *vm, Value *args) {
+    return openChannel(vm, args, 0, false);
+}
+
+// Channel.unlink(name): 删除通道的共享内存对象
+static bool primChannelUnlink(VM *vm, Value *args) {
+    if (!validateString(vm, args[1])) {
+        return false;
+    }
+    RET_BOOL(channelUnlink(VALUE_TO_OBJSTR(args[1])->value.start) == 0);
+}
+
+// 编码后写入, blocking决定空间不足时是否等待
+static bool sendValues(VM *vm, Value *args, Value *values, uint32_t count, bool blocking) {
+    GET_CHANNEL(vm, args[0], channel);
+    ByteBuffer frames;
+    ByteBufferInit(&frames);
+
+    ChannelResult result = CHANNEL_OK;
+    uint32_t idx = 0;
+    while (idx < count && result == CHANNEL_OK) {
+        result = channelEncode(vm, &frames, values[idx++]);
+    }
+    if (result == CHANNEL_OK) {
+        result = blocking ? channelWrite(channel, frames.datas, frames.count) :
+                 channelTryWrite(channel, frames.datas, frames.count);
+    }
+    ByteBufferClear(vm, &frames);
+
+    if (result == CHANNEL_OK) {
+        RET_TRUE;
+    }
+    if (result == CHANNEL_FULL) {
+        RET_FALSE;
+    }
+    return channelError(vm, result);
+}
+
+// args[0].send(args[1]): 阻塞发送, 等待期间整个vm停止运行而不只是当前线程
+static bool primChannelSend(VM *vm, Value *args) {
+    return sendValues(vm, args, &args[1], 1, true);
+}
+
+// args[0].trySend(args[1]): 非阻塞发送,空间不足返回false
+static bool primChannelTrySend(VM *vm, Value *args) {
+    return sendValues(vm, args, &args[1], 1, false);
+}
+
+// args[0].sendAll(args[1]): 阻塞地把list中的元素整批发送, 等待期间整个vm停止运行
+static bool primChannelSendAll(VM *vm, Value *args) {
+    if (!VALUE_IS_CERTAIN_OBJ(args[1], OT_LIST)) {
+        SET_ERROR_FALSE(vm, "argument must be list!");
+    }
+    ObjList *objList = VALUE_TO_OBJLIST(args[1]);
+    return sendValues(vm, args, objList->elements.datas, objList->elements.count, true);
+}
+
+// 读取一条消息, blocking决定没有消息时是否等待
+static bool receiveValue(VM *vm, Value *args, bool blocking) {
+    GET_CHANNEL(vm, args[0], channel);
+    ByteBuffer scratch;
+    ByteBufferInit(&scratch);
+
+    Value value;
+    ChannelResult result = blocking ? channelRead(vm, channel, &scratch, &value) :
+                           channelTryRead(vm, channel, &scratch, &value);
+    ByteBufferClear(vm, &scratch);
+
+    if (result == CHANNEL_OK) {
+        RET_VALUE(value);
+    }
+    if (result == CHANNEL_EMPTY) {
+        RET_NULL;
+    }
+    return channelError(vm, result);
+}
+
+// args[0].receive: 阻塞接收, 等待期间整个vm停止运行而不只是当前线程
+static bool primChannelReceive(VM *vm, Value *args) {
+    return receiveValue(vm, args, true);
+}
+
+// args[0].tryReceive: 非阻塞接收,没有消息时返回null
+static bool primChannelTryReceive(VM *vm, Value *args) {
+    return receiveValue(vm, args, false);
+}
+
+// args[0].receiveAll(args[1]): 非阻塞地接收至多args[1]条消息,返回list
+static bool primChannelReceiveAll(VM *vm, Value *args) {
+    if (!validateUint(vm, args[1])) {
+        return false;
+    }
+    GET_CHANNEL(vm, args[0], channel);
+    uint32_t max = (uint32_t) VALUE_TO_NUM(args[1]);
+    ObjList *objList = newObjList(vm, 0);
+    ByteBuffer scratch;
+    ByteBufferInit(&scratch);
+
+    // 解码出的消息在加入list前无处可达
+    vm->gcPauseNum++;
+    ChannelResult result = CHANNEL_OK;
+    while (objList->elements.count < max) {
+        Value value;
+        result = channelTryRead(vm, channel, &scratch, &value);
+        if (result != CHANNEL_OK) {
+            break;
+        }
+        ValueBufferAdd(vm, &objList->elements, value);
+    }
+    vm->gcPauseNum--;
+    ByteBufferClear(vm, &scratch);
+
+    if (result != CHANNEL_OK && result != CHANNEL_EMPTY) {
+        return channelError(vm, result);
+    }
+    RET_OBJ(objList);
+}
+
+// args[0].close: 关闭通道
+static bool primChannelClose(VM *vm, Value *args) {
+    GET_CHANNEL(vm, args[0], channel);
+    uint32_t handle = (uint32_t) VALUE_TO_NUM(VALUE_TO_OBJINSTANCE(args[0])->fields[0]);
+    vm->channels.datas[handle] = NULL;
+    VALUE_TO_OBJINSTANCE(args[0])->fields[0] = VT_TO_VALUE(VT_NULL);
+    channelClose(channel);
+    RET_NULL;
+}
+
+// 以errno设置线程报错
+#define SET_ERRNO_FALSE(vmPtr, action) \
+   do {\
+      char errMsg[DEFAULT_BUfFER_SIZE];\
+      snprintf(errMsg, DEFAULT_BUfFER_SIZE, "%s failed: %s", action, strerror(errno));\
+      SET_ERROR_FALSE(vmPtr, errMsg);\
+   } while (0);
+
+// IO.read单次读取的上限, 更大的max按此截断, 也避免max + 1溢出
+#define IO_MAX_READ ((uint32_t) 1 << 24)
+
+// 把描述符包装为返回值, 失败时报错
+static bool retFd(VM *vm, Value *args, int fd, const char *action) {
+    if (fd == -1) {
+        SET_ERRNO_FALSE(vm, action);
+    }
+    RET_NUM(fd);
+}
+
+// 填充unix域套接字地址
+static bool unixAddress(VM *vm, Value path, struct sockaddr_un *addr) {
+    if (!validateString(vm, path)) {
+        return false;
+    }
+    ObjString *pathStr = VALUE_TO_OBJSTR(path);
+    if (pathStr->value.length >= sizeof(addr->sun_path)) {
+        SET_ERROR_FALSE(vm, "unix socket path too long!");
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, pathStr->value.start, pathStr->value.length);
+    return true;
+}
+
+// 填充本机回环tcp地址
+static bool loopbackAddress(VM *vm, Value port, struct sockaddr_in *addr) {
+    if (!validateUint(vm, port) || VALUE_TO_NUM(port) > 65535) {
+        SET_ERROR_FALSE(vm, "port must be integer in [0, 65535]!");
+    }
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t) VALUE_TO_NUM(port));
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return true;
+}
+
+// 创建非阻塞套接字并监听addr
+static bool listenOn(VM *vm, Value *args, int domain, struct sockaddr *addr, socklen_t addrLen) {
+    int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        SET_ERRNO_FALSE(vm, "socket");
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, addr, addrLen) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        SET_ERRNO_FALSE(vm, "listen");
+    }
+    RET_NUM(fd);
+}
+
+// 创建非阻塞套接字并连接addr, 连接可能尚未完成, 需等待可写
+static bool connectTo(VM *vm, Value *args, int domain, struct sockaddr *addr, socklen_t addrLen) {
+    int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        SET_ERRNO_FALSE(vm, "socket");
+    }
+    if (connect(fd, addr, addrLen) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        SET_ERRNO_FALSE(vm, "connect");
+    }
+    RET_NUM(fd);
+}
+
+// IO.open(path, mode): 以"r","w"或"a"模式非阻塞打开文件
+static bool primIoOpen(VM *vm, Value *args) {
+    if (!validateString(vm, args[1]) || !validateString(vm, args[2])) {
+        return false;
+    }
+    const char *mode = VALUE_TO_OBJSTR(args[2])->value.start;
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        SET_ERROR_FALSE(vm, "mode must be \"r\", \"w\" or \"a\"!");
+    }
+    int fd = open(VALUE_TO_OBJSTR(args[1])->value.start, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    return retFd(vm, args, fd, "open");
+}
+
+// IO.pipe(): 创建非阻塞管道,返回[读端,写端]
+static bool primIoPipe(VM *vm, Value *args) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        SET_ERRNO_FALSE(vm, "pipe");
+    }
+    ObjList *objList = newObjList(vm, 2);
+    objList->elements.datas[0] = NUM_TO_VALUE(fds[0]);
+    objList->elements.datas[1] = NUM_TO_VALUE(fds[1]);
+    RET_OBJ(objList);
+}
+
+// IO.tcpListen(port): 在127.0.0.1:port上监听, port为0时由系统分配
+static bool primIoTcpListen(VM *vm, Value *args) {
+    struct sockaddr_in addr;
+    if (!loopbackAddress(vm, args[1], &addr)) {
+        return false;
+    }
+    return listenOn(vm, args, AF_INET, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+// IO.tcpConnect(port): 连接127.0.0.1:port
+static bool primIoTcpConnect(VM *vm, Value *args) {
+    struct sockaddr_in addr;
+    if (!loopbackAddress(vm, args[1], &addr)) {
+        return false;
+    }
+    return connectTo(vm, args, AF_INET, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+// IO.unixListen(path): 在unix域套接字path上监听
+static bool primIoUnixListen(VM *vm, Value *args) {
+    struct sockaddr_un addr;
+    if (!unixAddress(vm, args[1], &addr)) {
+        return false;
+    }
+    return listenOn(vm, args, AF_UNIX, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+// IO.unixConnect(path): 连接unix域套接字path
+static bool primIoUnixConnect(VM *vm, Value *args) {
+    struct sockaddr_un addr;
+    if (!unixAddress(vm, args[1], &addr)) {
+        return false;
+    }
+    return connectTo(vm, args, AF_UNIX, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+// IO.localPort(fd): 返回tcp套接字绑定的本地端口
+static bool primIoLocalPort(VM *vm, Value *args) {
+    if (!validateUint(vm, args[1])) {
+        return false;
+    }
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname((int) VALUE_TO_NUM(args[1]), (struct sockaddr *) &addr, &addrLen) == -1) {
+        SET_ERRNO_FALSE(vm, "getsockname");
+    }
+    RET_NUM(ntohs(addr.sin_port));
+}
+
+// IO.accept(fd): 接受连接, 没有待处理的连接时返回null
+static bool primIoAccept(VM *vm, Value *args) {
+    if (!validateUint(vm, args[1])) {
+        return false;
+    }
+    int fd = accept4((int) VALUE_TO_NUM(args[1]), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        RET_NULL;
+    }
+    return retFd(vm, args, fd, "accept");
+}
+
+// IO.read(fd, max): 读取至多max字节(不超过IO_MAX_READ), 尚无数据时返回null, 到达结尾时返回""
+static bool primIoRead(VM *vm, Value *args) {
+    if (!validateUint(vm, args[1]) || !validateUint(vm, args[2])) {
+        return false;
+    }
+    double maxNum = VALUE_TO_NUM(args[2]);
+    uint32_t max = maxNum > IO_MAX_READ ? IO_MAX_READ : (uint32_t) maxNum;
+    char *buf = ALLOCATE_ARRAY(vm, char, max + 1);
+    ssize_t readNum = read((int) VALUE_TO_NUM(args[1]), buf, max);
+    if (readNum == -1) {
+        DEALLOCATE_ARRAY(vm, buf, max + 1);
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            RET_NULL;
+        }
+        SET_ERRNO_FALSE(vm, "read");
+    }
+    ObjString *objString = newObjString(vm, buf, (uint32_t) readNum);
+    DEALLOCATE_ARRAY(vm, buf, max + 1);
+    RET_OBJ(objString);
+}
+
+// IO.write(fd, str): 写入str, 返回实际写入的字节数, 暂不可写时返回null
+static bool primIoWrite(VM *vm, Value *args) {
+    if (!validateUint(vm, args[1]) || !validateString(vm, args[2])) {
+        return false;
+    }
+    ObjString *objString = VALUE_TO_OBJSTR(args[2]);
+    ssize_t writeNum = write((int) VALUE_TO_NUM(args[1]), objString->value.start, objString->value.length);
+    if (writeNum == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            RET_NULL;
+        }
+        SET_ERRNO_FALSE(vm, "write");
+    }
+    RET_NUM(writeNum);
+}
+
+// IO.close(fd): 关闭描述符, 在其上等待的线程会被唤醒
+static bool primIoClose(VM *vm, Value *args) {
+    if (!validateUint(vm, args[1])) {
+        return false;
+    }
+    int fd = (int) VALUE_TO_NUM(args[1]);
+    eventLoopForget(vm, fd);
+    if (close(fd) == -1) {
+        SET_ERRNO_FALSE(vm, "close");
+    }
+    RET_NULL;
+}
+
+// IO.wait(fd, events): 挂起当前线程直到fd可读("r"),可写("w")或两者之一("rw")
+// 返回false且errorObj为null表示切换线程, 由调度器从schedulerNext取下一个线程运行
+static bool primIoWait(VM *vm, Value *args) {
+    if (!validateUint(vm, args[1]) || !validateString(vm, args[2])) {
+        return false;
+    }
+    const char *mode = VALUE_TO_OBJSTR(args[2])->value.start;
+    uint32_t events = (strchr(mode, 'r') ? IO_READABLE : 0) | (strchr(mode, 'w') ? IO_WRITABLE : 0);
+    if (events == 0) {
+        SET_ERROR_FALSE(vm, "events must be \"r\", \"w\" or \"rw\"!");
+    }
+    if (!eventLoopWait(vm, (int) VALUE_TO_NUM(args[1]), events, vm->curThread)) {
+        SET_ERROR_FALSE(vm, "fd can`t be waited on!");
+    }
+    vm->curThread = NULL;
+    return false;
+}
+
+// System.clock: 单调时钟, 单位纳秒
+static bool primSystemClock(VM *vm UNUSED, Value *args) {
+    RET_NUM((double) monotonicNs());
+}
+
+// Module.unload(name): 卸载名为name的模块, 返回是否卸载
+static bool primModuleUnload(VM *vm, Value *args) {
+    if (!validateString(vm, args[1])) {
+        return false;
+    }
+    RET_BOOL(unloadModule(vm, args[1]));
+}
+
+// 新建定时器并包装为Timer实例
+static bool newTimer(VM *vm, Value *args, bool periodic) {
+    if (!validateUint(vm, args[1])) {
+        return false;
+    }
+    if (!VALUE_IS_OBJCLOSURE(args[2])) {
+        SET_ERROR_FALSE(vm, "argument must be a function!");
+    }
+    uint32_t ms = (uint32_t) VALUE_TO_NUM(args[1]);
+    if (periodic && ms == 0) {
+        SET_ERROR_FALSE(vm, "period must be greater than 0!");
+    }
+
+    Timer *timer = timerAdd(vm, ms, periodic ? ms : 0, VALUE_TO_OBJCLOSURE(args[2]));
+    ObjInstance *objInstance = newObjInstance(vm, vm->timerClass);
+    objInstance->fields[0] = NUM_TO_VALUE(timer->handle);
+    objInstance->fields[1] = NUM_TO_VALUE(timer->serial);
+    RET_OBJ(objInstance);
+}
+
+// Timer.after(ms, fn): ms毫秒后在新线程中执行fn
+static bool primTimerAfter(VM *vm, Value *args) {
+    return newTimer(vm, args, false);
+}
+
+// Timer.every(ms, fn): 每隔ms毫秒在新线程中执行fn
+static bool primTimerEvery(VM *vm, Value *args) {
+    return newTimer(vm, args, true);
+}
+
+// args[0].cancel: 取消定时器, 已触发的一次性定时器返回false
+static bool primTimerCancel(VM *vm, Value *args) {
+    ObjInstance *objInstance = VALUE_TO_OBJINSTANCE(args[0]);
+    if (!VALUE_IS_NUM(objInstance->fields[0])) {
+        RET_FALSE;
+    }
+    uint32_t handle = (uint32_t) VALUE_TO_NUM(objInstance->fields[0]);
+    uint32_t serial = (uint32_t) VALUE_TO_NUM(objInstance->fields[1]);
+    objInstance->fields[0] = VT_TO_VALUE(VT_NULL);
+
+    // 一次性定时器触发后句柄可能已被新定时器复用, 以序号区分
+    Timer *timer = vm->timerWheel.handles.datas[handle];
+    if (timer == NULL || timer->serial != serial) {
+        RET_FALSE;
+    }
+    timerCancel(vm, timer);
+    RET_TRUE;
+}
+
 // 从modules中获取名为moduleName的模块
 static ObjModule *getModule(VM *vm, Value moduleName) {
     Value value = mapGet(vm->allModules, moduleName);
-    if (value.type == VT_UNDEFINED) {
+    if (VALUE_IS_UNDEFINED(value)) {
         return NULL;
     }
 
     return VALUE_TO_OBJMODULE(value);
 }
 
+// 新建模块并导入核心模块中的模块变量
+// 模块名直接引用moduleName, 不从可能在新生代中的字符串复制内容
+static ObjModule *newModuleWithCore(VM *vm, Value moduleName) {
+    ObjModule *module = newObjModule(vm, NULL);
+    module->name = VALUE_TO_OBJSTR(moduleName);
+    gcWriteBarrier(vm, (ObjHeader *) module, moduleName);
+    pushTmpRoot(vm, (ObjHeader *) module);
+
+    ObjModule *coreModule = getModule(vm, CORE_MODULE);
+    for (int i = 0; i < coreModule->moduleVarName.count; i++) {
+        defineModuleVar(vm, module, coreModule->moduleVarName.datas[i].str,
+                        strlen(coreModule->moduleVarName.datas[i].str), coreModule->moduleVarValue.datas[i]);
+    }
+    popTmpRoot(vm);
+    return module;
+}
+
 /**
  * 载入模块并进行编译
  */
 ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode) {
+    return loadModuleCached(vm, moduleName, moduleCode, NULL);
+}
+
+/**
+ * 载入模块, cachePath不为NULL时先尝试字节码缓存, 缓存不可用时编译并把结果写入缓存
+ * 写缓存失败不影响载入
+ */
+ObjThread *loadModuleCached(VM *vm, Value moduleName, const char *moduleCode, const char *cachePath) {
+    // 模块名可能是刚创建的字符串, 登记到allModules前需要保护
+    if (VALUE_IS_OBJ(moduleName)) {
+        pushTmpRoot(vm, VALUE_TO_OBJ(moduleName));
+    }
     ObjModule *module = getModule(vm, moduleName);
     if (module == NULL) {
-        ObjString *modNameStr = VALUE_TO_OBJSTR(moduleName);
-        ASSERT(modNameStr->value.start[modNameStr->value.length] == '\0', "string.value.start is not terminated!");
-
-        module = newObjModule(vm, modNameStr->value.start);
-        mapSet(vm, vm->allModules, moduleName, OBJ_TO_VALUE(module));
+        module = newModuleWithCore(vm, moduleName);
+        pushTmpRoot(vm, (ObjHeader *) module);
+        // 新建模块时的新生代回收可能已移动模块名, 以模块中记录的为准
+        mapSet(vm, vm->allModules, OBJ_TO_VALUE(module->name), OBJ_TO_VALUE(module));
+        popTmpRoot(vm);
+    }
+    if (VALUE_IS_OBJ(moduleName)) {
+        popTmpRoot(vm);
+    }
 
-        ObjModule *coreModule = getModule(vm, CORE_MODULE);
-        for (int i = 0; i < coreModule->moduleVarName.count; i++) {
-            defineModuleVar(vm, module, coreModule->moduleVarName.datas[i].str,
-                            strlen(coreModule->moduleVarName.datas[i].str), coreModule->moduleVarValue.datas[i]);
+    ObjFn *fn = NULL;
+    uint32_t moduleVarBase = module->moduleVarValue.count;
+    if (cachePath != NULL) {
+        fn = loadBytecodeCache(vm, module, moduleCode, cachePath);
+    }
+    if (fn == NULL) {
+        fn = compileModule(vm, module, moduleCode);
+        if (cachePath != NULL) {
+            writeBytecodeCache(vm, module, moduleVarBase, fn, moduleCode, cachePath);
         }
     }
-
-    ObjFn *fn = compileModule(vm, module, moduleCode);
+    pushTmpRoot(vm, (ObjHeader *) fn);
     ObjClosure *objClosure = newObjClosure(vm, fn);
+    pushTmpRoot(vm, (ObjHeader *) objClosure);
     ObjThread *moduleThread = newObjThread(vm, objClosure);
+    popTmpRoot(vm);
+    popTmpRoot(vm);
 
     return moduleThread;
 }
 
+/**
+ * 从vm->allModules中移除名为moduleName的模块, 此后再载入同名模块会重新编译
+ * 模块本身不立即释放: 其它模块仍持有的闭包、类和实例经由ObjFn.module保持它可达,
+ * 这些引用继续有效; 不再有引用后由gc回收其模块变量和指令流
+ * 核心模块不能卸载; 模块不存在时返回false
+ */
+bool unloadModule(VM *vm, Value moduleName) {
+    if (VALUE_IS_NULL(moduleName) || getModule(vm, moduleName) == NULL) {
+        return false;
+    }
+    removeKey(vm, vm->allModules, moduleName);
+    return true;
+}
+
+/**
+ * 并行载入并编译多个相互独立的模块, moduleThreads返回各模块的执行线程
+ * 新模块在编译全部完成后才登记到vm->allModules
+ * 供宿主预先载入一批模块; 编译器尚未实现import语句, 脚本中的导入还不会经过这里
+ */
+void loadModulesParallel(VM *vm, uint32_t moduleNum, Value *moduleNames,
+                         const char **moduleCodes, ObjThread **moduleThreads) {
+    // 新模块、编译结果和模块线程在全部登记前都无处可达, 整个过程暂停gc
+    vm->gcPauseNum++;
+    ObjModule **modules = ALLOCATE_ARRAY(vm, ObjModule*, moduleNum);
+    ObjFn **fns = ALLOCATE_ARRAY(vm, ObjFn*, moduleNum);
+    bool *isNew = ALLOCATE_ARRAY(vm, bool, moduleNum);
+
+    uint32_t idx = 0;
+    while (idx < moduleNum) {
+        modules[idx] = getModule(vm, moduleNames[idx]);
+        isNew[idx] = modules[idx] == NULL;
+        if (isNew[idx]) {
+            modules[idx] = newModuleWithCore(vm, moduleNames[idx]);
+        }
+        idx++;
+    }
+
+    compileModulesParallel(vm, moduleNum, modules, moduleCodes, fns);
+
+    idx = 0;
+    while (idx < moduleNum) {
+        if (isNew[idx]) {
+            mapSet(vm, vm->allModules, moduleNames[idx], OBJ_TO_VALUE(modules[idx]));
+        }
+        moduleThreads[idx] = newObjThread(vm, newObjClosure(vm, fns[idx]));
+        idx++;
+    }
+
+    DEALLOCATE_ARRAY(vm, isNew, moduleNum);
+    DEALLOCATE_ARRAY(vm, fns, moduleNum);
+    DEALLOCATE_ARRAY(vm, modules, moduleNum);
+    vm->gcPauseNum--;
+}
+
 /**
  * 执行模块
  */
@@ -250,7 +863,28 @@ int ensureSymbolExist(VM *vm, SymbolTable *table, const char *symbol, uint32_t l
  */
 static Class *defineClass(VM *vm, ObjModule *objModule, const char *name) {
     Class *class = newRawClass(vm, name, 0);
+    pushTmpRoot(vm, (ObjHeader *) class);
     defineModuleVar(vm, objModule, name, strlen(name), OBJ_TO_VALUE(class));
+    popTmpRoot(vm);
+    return class;
+}
+
+/**
+ * 定义带meta类的原生类, 静态方法绑定在meta类上
+ */
+static Class *defineNativeClass(VM *vm, ObjModule *objModule, const char *name, uint32_t fieldNum) {
+    Class *class = defineClass(vm, objModule, name);
+    class->fieldNum = fieldNum;
+    bindSuperClass(vm, class, vm->objectClass);
+
+    char metaName[MAX_ID_LEN] = {'\0'};
+    snprintf(metaName, MAX_ID_LEN, "%sMeta", name);
+    Class *metaClass = newRawClass(vm, metaName, 0);
+    pushTmpRoot(vm, (ObjHeader *) metaClass);
+    bindSuperClass(vm, metaClass, vm->classOfClass);
+    objSetClass(&metaClass->objHeader, vm->classOfClass);
+    objSetClass(&class->objHeader, metaClass);
+    popTmpRoot(vm);
     return class;
 }
 
@@ -258,11 +892,19 @@ static Class *defineClass(VM *vm, ObjModule *objModule, const char *name) {
  * 添加方法
  */
 void bindMethod(VM *vm, Class *class, uint32_t index, Method method) {
+    ASSERT(!isImmortalObject(vm, (ObjHeader *) class), "can't bind method to immortal class!");
+    gcLockHeap(vm);
     if (index >= class->methods.count) {
         Method emptyPad = {MT_NONE, {0}};
         MethodBufferFillWrite(vm, &class->methods, emptyPad, index - class->methods.count + 1);
+    } else if (class->methods.datas[index].type == MT_SCRIPT) {
+        gcPreWriteBarrier(vm, OBJ_TO_VALUE(class->methods.datas[index].obj));
     }
     class->methods.datas[index] = method;
+    if (method.type == MT_SCRIPT) {
+        gcWriteBarrier(vm, (ObjHeader *) class, OBJ_TO_VALUE(method.obj));
+    }
+    gcUnlockHeap(vm);
 }
 
 /**
@@ -279,14 +921,16 @@ void bindSuperClass(VM *vm, Class *subClass, Class *superClass) {
 }
 
 /**
- * 编译核心模块
+ * 创建核心模块和原生类并绑定原生方法, 不执行核心模块脚本
  * meta: object -> objectMetaclass -> classOfClass
  * extend: objectMetaClass -> classOfClass -> object
  */
-void buildCore(VM *vm) {
+void buildCoreNatives(VM *vm) {
     // 创建核心模块
     ObjModule *coreModule = newObjModule(vm, NULL);
+    pushTmpRoot(vm, (ObjHeader *) coreModule);
     mapSet(vm, vm->allModules, CORE_MODULE, OBJ_TO_VALUE(coreModule));
+    popTmpRoot(vm);
 
     // 定义object类并绑定方法
     vm->objectClass = defineClass(vm, coreModule, "object");
@@ -317,10 +961,67 @@ void buildCore(VM *vm) {
     PRIM_METHOD_BIND(objectMetaclass, "same(_,_)", primObjectmetaSame);
 
     // 绑定各自的meta类
-    vm->objectClass->objHeader.class = objectMetaclass;
-    objectMetaclass->objHeader.class = vm->classOfClass;
-    vm->classOfClass->objHeader.class = vm->classOfClass; // 元信息类回路,meta类终点
+    objSetClass(&vm->objectClass->objHeader, objectMetaclass);
+    objSetClass(&objectMetaclass->objHeader, vm->classOfClass);
+    objSetClass(&vm->classOfClass->objHeader, vm->classOfClass); // 元信息类回路,meta类终点
+
+    // 进程间共享内存通道, 唯一的字段记录通道句柄
+    vm->channelClass = defineNativeClass(vm, coreModule, "Channel", 1);
+    PRIM_METHOD_BIND(OBJ_CLASS(&vm->channelClass->objHeader), "create(_,_)", primChannelCreate);
+    PRIM_METHOD_BIND(OBJ_CLASS(&vm->channelClass->objHeader), "open(_)", primChannelOpen);
+    PRIM_METHOD_BIND(OBJ_CLASS(&vm->channelClass->objHeader), "unlink(_)", primChannelUnlink);
+    PRIM_METHOD_BIND(vm->channelClass, "send(_)", primChannelSend);
+    PRIM_METHOD_BIND(vm->channelClass, "trySend(_)", primChannelTrySend);
+    PRIM_METHOD_BIND(vm->channelClass, "sendAll(_)", primChannelSendAll);
+    PRIM_METHOD_BIND(vm->channelClass, "receive", primChannelReceive);
+    PRIM_METHOD_BIND(vm->channelClass, "tryReceive", primChannelTryReceive);
+    PRIM_METHOD_BIND(vm->channelClass, "receiveAll(_)", primChannelReceiveAll);
+    PRIM_METHOD_BIND(vm->channelClass, "close", primChannelClose);
+
+    // 非阻塞io, 全部为静态方法, 描述符以数字表示
+    vm->ioClass = defineNativeClass(vm, coreModule, "IO", 0);
+    Class *ioMeta = OBJ_CLASS(&vm->ioClass->objHeader);
+    PRIM_METHOD_BIND(ioMeta, "open(_,_)", primIoOpen);
+    PRIM_METHOD_BIND(ioMeta, "pipe()", primIoPipe);
+    PRIM_METHOD_BIND(ioMeta, "tcpListen(_)", primIoTcpListen);
+    PRIM_METHOD_BIND(ioMeta, "tcpConnect(_)", primIoTcpConnect);
+    PRIM_METHOD_BIND(ioMeta, "unixListen(_)", primIoUnixListen);
+    PRIM_METHOD_BIND(ioMeta, "unixConnect(_)", primIoUnixConnect);
+    PRIM_METHOD_BIND(ioMeta, "localPort(_)", primIoLocalPort);
+    PRIM_METHOD_BIND(ioMeta, "accept(_)", primIoAccept);
+    PRIM_METHOD_BIND(ioMeta, "read(_,_)", primIoRead);
+    PRIM_METHOD_BIND(ioMeta, "write(_,_)", primIoWrite);
+    PRIM_METHOD_BIND(ioMeta, "close(_)", primIoClose);
+    PRIM_METHOD_BIND(ioMeta, "wait(_,_)", primIoWait);
+
+    vm->systemClass = defineNativeClass(vm, coreModule, "System", 0);
+    PRIM_METHOD_BIND(OBJ_CLASS(&vm->systemClass->objHeader), "clock", primSystemClock);
+
+    // 模块管理, 全部为静态方法
+    Class *moduleClass = defineNativeClass(vm, coreModule, "Module", 0);
+    PRIM_METHOD_BIND(OBJ_CLASS(&moduleClass->objHeader), "unload(_)", primModuleUnload);
+
+    // 定时器, 字段依次为定时器句柄和创建序号
+    vm->timerClass = defineNativeClass(vm, coreModule, "Timer", 2);
+    PRIM_METHOD_BIND(OBJ_CLASS(&vm->timerClass->objHeader), "after(_,_)", primTimerAfter);
+    PRIM_METHOD_BIND(OBJ_CLASS(&vm->timerClass->objHeader), "every(_,_)", primTimerEvery);
+    PRIM_METHOD_BIND(vm->timerClass, "cancel", primTimerCancel);
+
+    // 内存耗尽时已无法分配, 预先建好错误信息
+    vm->memErrorMsg = newObjString(vm, "out of memory!", 14);
+}
+
+/**
+ * 编译核心模块
+ */
+void buildCore(VM *vm) {
+    buildCoreNatives(vm);
 
     // 执行核心模块
     executeModule(vm, CORE_MODULE, coreModuleCode);
+
+    // 核心对象此后不再改变, 移入永生区
+    if (vm->config.immortalCore) {
+        makeCoreImmortal(vm);
+    }
 }
@@ -11,14 +11,25 @@ extern char *rootDir;
 
 char *readFile(const char *sourceFile);
 
+void loadModulesParallel(VM *vm, uint32_t moduleNum, Value *moduleNames,
+                         const char **moduleCodes, ObjThread **moduleThreads);
+
 VMResult executeModule(VM *vm, Value moduleName, const char *moduleCode);
 
+ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode);
+
+ObjThread *loadModuleCached(VM *vm, Value moduleName, const char *moduleCode, const char *cachePath);
+
+bool unloadModule(VM *vm, Value moduleName);
+
 int getIndexFromSymbolTable(SymbolTable *table, const char *symbol, uint32_t length);
 
 int addSymbol(VM *vm, SymbolTable *table, const char *symbol, uint32_t length);
 
 int ensureSymbolExist(VM *vm, SymbolTable *table, const char *symbol, uint32_t length);
 
+void buildCoreNatives(VM *vm);
+
 void buildCore(VM *vm);
 
 void bindMethod(VM *vm, Class *class, uint32_t index, Method method);
@@ -0,0 +1,161 @@
+//
+// Created by Kosho on 2020/2/10.
+//
+
+#include "event_loop.h"
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "vm.h"
+#include "gc.h"
+
+DEFINE_BUFFER_METHOD(ObjThreadPtr)
+
+/**
+ * 初始化事件循环, epoll实例在第一次等待时才创建
+ */
+void eventLoopInit(EventLoop *loop) {
+    loop->epollFd = -1;
+    ObjThreadPtrBufferInit(&loop->waiters);
+    loop->waitingNum = 0;
+    ObjThreadPtrBufferInit(&loop->ready);
+    loop->readyHead = 0;
+}
+
+/**
+ * 把线程加入可运行队列尾部
+ */
+void scheduleThread(VM *vm, ObjThread *objThread) {
+    EventLoop *loop = &vm->eventLoop;
+    // 队列已取空时复用缓冲区
+    if (loop->readyHead == loop->ready.count) {
+        loop->ready.count = loop->readyHead = 0;
+    }
+    // 队列扩容可能触发gc, 此时objThread可能尚无处可达
+    pushTmpRoot(vm, (ObjHeader *) objThread);
+    ObjThreadPtrBufferAdd(vm, &loop->ready, objThread);
+    popTmpRoot(vm);
+    gcThreadYield(vm, objThread);
+}
+
+/**
+ * 挂起objThread直到fd满足events(IO_READABLE/IO_WRITABLE)
+ * 每个fd同时只允许一个线程等待, 否则返回false
+ */
+bool eventLoopWait(VM *vm, int fd, uint32_t events, ObjThread *objThread) {
+    EventLoop *loop = &vm->eventLoop;
+    if (loop->epollFd == -1) {
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epollFd == -1) {
+            IO_ERROR("create epoll instance failed!");
+        }
+    }
+
+    if ((uint32_t) fd >= loop->waiters.count) {
+        ObjThreadPtrBufferFillWrite(vm, &loop->waiters, NULL, fd - loop->waiters.count + 1);
+    }
+    if (loop->waiters.datas[fd] != NULL) {
+        return false;
+    }
+
+    // 单次触发, 线程被唤醒后描述符自动停止监听, 再次等待时用MOD重新启用
+    struct epoll_event event;
+    event.events = EPOLLONESHOT | EPOLLRDHUP |
+                   ((events & IO_READABLE) ? EPOLLIN : 0) |
+                   ((events & IO_WRITABLE) ? EPOLLOUT : 0);
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        if (errno == ENOENT) {
+            if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+                // 普通文件不支持epoll, 其读写总是就绪的
+                if (errno != EPERM) {
+                    return false;
+                }
+                scheduleThread(vm, objThread);
+                return true;
+            }
+        } else {
+            return false;
+        }
+    }
+
+    loop->waiters.datas[fd] = objThread;
+    loop->waitingNum++;
+    gcThreadYield(vm, objThread);
+    return true;
+}
+
+/**
+ * 关闭fd前调用, 撤销监听并唤醒在其上等待的线程
+ */
+void eventLoopForget(VM *vm, int fd) {
+    EventLoop *loop = &vm->eventLoop;
+    if (loop->epollFd == -1) {
+        return;
+    }
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    if ((uint32_t) fd < loop->waiters.count && loop->waiters.datas[fd] != NULL) {
+        scheduleThread(vm, loop->waiters.datas[fd]);
+        loop->waiters.datas[fd] = NULL;
+        loop->waitingNum--;
+    }
+}
+
+/**
+ * 最多等待timeoutMs毫秒(-1为无限等待), 把就绪描述符上的线程移入可运行队列
+ * 返回被唤醒的线程数
+ */
+int eventLoopPoll(VM *vm, int timeoutMs) {
+    EventLoop *loop = &vm->eventLoop;
+    if (loop->waitingNum == 0) {
+        // 没有描述符可等, 只需等到定时器到期
+        if (timeoutMs > 0) {
+            struct timespec ts = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+        return 0;
+    }
+
+    struct epoll_event events[EVENT_BATCH_NUM];
+    int readyNum;
+    do {
+        readyNum = epoll_wait(loop->epollFd, events, EVENT_BATCH_NUM, timeoutMs);
+    } while (readyNum == -1 && errno == EINTR);
+
+    int woken = 0;
+    int idx = 0;
+    while (idx < readyNum) {
+        int fd = events[idx++].data.fd;
+        ObjThread *objThread = loop->waiters.datas[fd];
+        if (objThread != NULL) {
+            loop->waiters.datas[fd] = NULL;
+            loop->waitingNum--;
+            scheduleThread(vm, objThread);
+            woken++;
+        }
+    }
+    return woken;
+}
+
+/**
+ * 取出下一个可运行的线程, 队列为空时阻塞等待io或定时器
+ * 既无可运行线程也无等待io的线程和定时器时返回NULL
+ */
+ObjThread *schedulerNext(VM *vm) {
+    // 线程切换处没有指向对象的裸指针, 是新生代回收的安全点
+    gcSafePoint(vm);
+
+    EventLoop *loop = &vm->eventLoop;
+    while (loop->readyHead == loop->ready.count) {
+        if (timerWheelAdvance(vm) > 0) {
+            continue;
+        }
+        int timeoutMs = timerWheelTimeout(vm);
+        if (loop->waitingNum == 0 && timeoutMs == -1) {
+            return NULL;
+        }
+        eventLoopPoll(vm, timeoutMs);
+    }
+    return loop->ready.datas[loop->readyHead++];
+}
@@ -0,0 +1,48 @@
+//
+// Created by Kosho on 2020/2/10.
+//
+
+#ifndef _VM_EVENT_LOOP_H
+#define _VM_EVENT_LOOP_H
+
+#include "utils.h"
+#include "obj_thread.h"
+
+#define EVENT_BATCH_NUM 64   // 每次epoll_wait最多取回的事件数
+
+#define IO_READABLE 1
+#define IO_WRITABLE 2
+
+typedef ObjThread *ObjThreadPtr;
+DECLARE_BUFFER_TYPE(ObjThreadPtr)
+
+/**
+ * 基于epoll的事件循环和线程(fiber)调度队列
+ * 执行io的线程在描述符未就绪时挂起在waiters中,
+ * 就绪后被移入ready队列, 由调度器依次恢复执行
+ */
+typedef struct {
+    // 懒创建, -1表示尚未创建
+    int epollFd;
+    // 以fd为下标, 记录挂起在该描述符上的线程
+    ObjThreadPtrBuffer waiters;
+    // 挂起等待io的线程数
+    uint32_t waitingNum;
+    // 可运行线程的FIFO队列, readyHead为队首
+    ObjThreadPtrBuffer ready;
+    uint32_t readyHead;
+} EventLoop;
+
+void eventLoopInit(EventLoop *loop);
+
+bool eventLoopWait(VM *vm, int fd, uint32_t events, ObjThread *objThread);
+
+void eventLoopForget(VM *vm, int fd);
+
+int eventLoopPoll(VM *vm, int timeoutMs);
+
+void scheduleThread(VM *vm, ObjThread *objThread);
+
+ObjThread *schedulerNext(VM *vm);
+
+#endif
@@ -0,0 +1,232 @@
+//
+// Created by Kosho on 2020/2/12.
+//
+
+#include "timer.h"
+#include <time.h>
+#include "vm.h"
+
+DEFINE_BUFFER_METHOD(TimerPtr)
+
+/**
+ * 单调时钟, 单位纳秒
+ */
+uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * 初始化时间轮, 以当前时刻为零点
+ */
+void timerWheelInit(TimerWheel *wheel) {
+    uint32_t level = 0;
+    while (level < TIMER_LEVEL_NUM) {
+        uint32_t slot = 0;
+        while (slot < TIMER_SLOT_NUM) {
+            wheel->slots[level][slot++] = NULL;
+        }
+        level++;
+    }
+    wheel->startNs = monotonicNs();
+    wheel->currentTick = 0;
+    wheel->timerNum = 0;
+    wheel->nextSerial = 0;
+    TimerPtrBufferInit(&wheel->handles);
+    IntBufferInit(&wheel->freeHandles);
+}
+
+// 当前时刻对应的tick
+static uint64_t nowTick(TimerWheel *wheel) {
+    return (monotonicNs() - wheel->startNs) / 1000000;
+}
+
+// 按剩余时间把timer挂到对应层的槽中
+static void placeTimer(TimerWheel *wheel, Timer *timer) {
+    uint64_t expire = timer->expireTick;
+    if (expire <= wheel->currentTick) {
+        expire = wheel->currentTick + 1;
+    }
+    uint64_t delta = expire - wheel->currentTick;
+    if (delta >= TIMER_MAX_SPAN) {
+        expire = wheel->currentTick + TIMER_MAX_SPAN - 1;
+        delta = TIMER_MAX_SPAN - 1;
+    }
+
+    // 找到能容纳delta的最低层
+    uint32_t level = 0;
+    while (delta >= ((uint64_t) 1 << (TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    uint32_t slot = (expire >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK;
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[level][slot];
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[level][slot] = timer;
+}
+
+// 把timer从所在槽中摘下
+static void unlinkTimer(TimerWheel *wheel, Timer *timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = NULL;
+}
+
+/**
+ * 添加delayMs毫秒后到期的定时器, periodMs非0时周期触发
+ */
+Timer *timerAdd(VM *vm, uint32_t delayMs, uint32_t periodMs, ObjClosure *fn) {
+    TimerWheel *wheel = &vm->timerWheel;
+    // 先把时间轮追到当前时刻, 使delay从现在算起
+    timerWheelAdvance(vm);
+
+    Timer *timer = ALLOCATE(vm, Timer);
+    if (timer == NULL) {
+        MEM_ERROR("allocate Timer failed!");
+    }
+    timer->expireTick = nowTick(wheel) + delayMs;
+    timer->periodMs = periodMs;
+    timer->fn = fn;
+
+    // 优先复用已删除定时器的句柄
+    uint32_t handle;
+    if (wheel->freeHandles.count > 0) {
+        handle = wheel->freeHandles.datas[--wheel->freeHandles.count];
+        wheel->handles.datas[handle] = timer;
+    } else {
+        handle = wheel->handles.count;
+        TimerPtrBufferAdd(vm, &wheel->handles, timer);
+    }
+    timer->handle = handle;
+    timer->serial = wheel->nextSerial++;
+
+    placeTimer(wheel, timer);
+    wheel->timerNum++;
+    return timer;
+}
+
+// 归还句柄并释放定时器
+static void freeTimer(VM *vm, Timer *timer) {
+    TimerWheel *wheel = &vm->timerWheel;
+    wheel->handles.datas[timer->handle] = NULL;
+    IntBufferAdd(vm, &wheel->freeHandles, (int) timer->handle);
+    wheel->timerNum--;
+    DEALLOCATE(vm, timer);
+}
+
+/**
+ * 删除定时器
+ */
+void timerCancel(VM *vm, Timer *timer) {
+    unlinkTimer(&vm->timerWheel, timer);
+    freeTimer(vm, timer);
+}
+
+// 在新线程中执行到期定时器的闭包
+static void fireTimer(VM *vm, Timer *timer) {
+    ObjThread *objThread = newObjThread(vm, timer->fn);
+    // stack[0]为接收者, 保持栈平衡
+    objThread->stack[0] = VT_TO_VALUE(VT_NULL);
+    objThread->esp++;
+    scheduleThread(vm, objThread);
+}
+
+// 把第level层当前槽中的定时器重新定位到更低层
+static void cascade(TimerWheel *wheel, uint32_t level) {
+    uint32_t slot = (wheel->currentTick >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK;
+    Timer *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        placeTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * 把时间轮推进到当前时刻, 到期定时器的闭包以新线程加入调度队列
+ * 返回触发的定时器数
+ */
+uint32_t timerWheelAdvance(VM *vm) {
+    TimerWheel *wheel = &vm->timerWheel;
+    uint64_t now = nowTick(wheel);
+
+    // 没有定时器时直接跳到当前时刻
+    if (wheel->timerNum == 0) {
+        wheel->currentTick = now;
+        return 0;
+    }
+
+    uint32_t fired = 0;
+    while (wheel->currentTick < now) {
+        wheel->currentTick++;
+
+        // 低层转完一圈时由高层逐级下落
+        uint32_t level = 1;
+        while (level < TIMER_LEVEL_NUM &&
+               (wheel->currentTick & (((uint64_t) 1 << (TIMER_SLOT_BITS * level)) - 1)) == 0) {
+            cascade(wheel, level++);
+        }
+
+        // 先摘下整个槽, 周期定时器重新插入时不会落回正在遍历的链表
+        uint32_t slot = wheel->currentTick & TIMER_SLOT_MASK;
+        Timer *timer = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        while (timer != NULL) {
+            Timer *next = timer->next;
+            if (timer->expireTick > wheel->currentTick) {
+                // 被截断到最大跨度的远期定时器, 继续等待
+                placeTimer(wheel, timer);
+            } else {
+                fireTimer(vm, timer);
+                fired++;
+                if (timer->periodMs != 0) {
+                    timer->expireTick += timer->periodMs;
+                    placeTimer(wheel, timer);
+                } else {
+                    freeTimer(vm, timer);
+                }
+            }
+            timer = next;
+        }
+
+        if (wheel->timerNum == 0) {
+            wheel->currentTick = now;
+        }
+    }
+    return fired;
+}
+
+/**
+ * 距下一次可能有定时器到期的毫秒数, 没有定时器时返回-1
+ * 只扫描最低层, 其余情况以最低层转完一圈的时刻为上界
+ */
+int timerWheelTimeout(VM *vm) {
+    TimerWheel *wheel = &vm->timerWheel;
+    if (wheel->timerNum == 0) {
+        return -1;
+    }
+
+    uint64_t now = nowTick(wheel);
+    uint64_t tick = wheel->currentTick + 1;
+    uint64_t wrap = (wheel->currentTick | TIMER_SLOT_MASK) + 1;
+    while (tick <= wrap) {
+        if (wheel->slots[0][tick & TIMER_SLOT_MASK] != NULL || tick == wrap) {
+            return tick > now ? (int) (tick - now) : 0;
+        }
+        tick++;
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+//
+// Created by Kosho on 2020/2/12.
+//
+
+#ifndef _VM_TIMER_H
+#define _VM_TIMER_H
+
+#include "utils.h"
+#include "obj_fn.h"
+
+#define TIMER_LEVEL_NUM 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOT_NUM (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOT_NUM - 1)
+// 时间轮所能直接表示的最大间隔, 更远的定时器先放在最高层, 下落时再重新定位
+#define TIMER_MAX_SPAN ((uint64_t) 1 << (TIMER_SLOT_BITS * TIMER_LEVEL_NUM))
+
+/**
+ * 定时器, 以毫秒为一个tick
+ */
+typedef struct timer {
+    struct timer *prev;
+    struct timer *next;
+    // 到期的tick
+    uint64_t expireTick;
+    // 周期, 0表示只触发一次
+    uint32_t periodMs;
+    // 所在的层和槽, 用于O(1)删除
+    uint8_t level;
+    uint8_t slot;
+    // 在handles中的下标,即脚本中的句柄
+    uint32_t handle;
+    // 创建序号, 句柄被复用后用于识别过期的引用
+    uint32_t serial;
+    // 到期时在新线程中执行的闭包
+    ObjClosure *fn;
+} Timer;
+
+typedef Timer *TimerPtr;
+DECLARE_BUFFER_TYPE(TimerPtr)
+
+/**
+ * 分层时间轮: 第n层每个槽跨度为64^n个tick
+ * 插入和删除O(1), 每个定时器在到期前最多下落TIMER_LEVEL_NUM-1次
+ */
+typedef struct {
+    Timer *slots[TIMER_LEVEL_NUM][TIMER_SLOT_NUM];
+    // 时间轮的零点,单调时钟纳秒
+    uint64_t startNs;
+    // 已推进到的tick
+    uint64_t currentTick;
+    // 时间轮中的定时器数
+    uint32_t timerNum;
+    // 下一个定时器的创建序号
+    uint32_t nextSerial;
+    // 以句柄为下标的定时器表,已删除的为NULL
+    TimerPtrBuffer handles;
+    // 可复用的句柄
+    IntBuffer freeHandles;
+} TimerWheel;
+
+uint64_t monotonicNs(void);
+
+void timerWheelInit(TimerWheel *wheel);
+
+Timer *timerAdd(VM *vm, uint32_t delayMs, uint32_t periodMs, ObjClosure *fn);
+
+void timerCancel(VM *vm, Timer *timer);
+
+uint32_t timerWheelAdvance(VM *vm);
+
+int timerWheelTimeout(VM *vm);
+
+#endif
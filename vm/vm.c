@@ -5,23 +5,250 @@
 #include <stdlib.h>
 #include "vm.h"
 #include "core.h"
+#include "slab.h"
 
-//初始化虚拟机
-void initVM(VM *vm) {
-    vm->allocatedBytes = 0;
+//以默认值填充配置, 宿主可在此基础上修改后创建虚拟机
+void initConfiguration(Configuration *config) {
+    config->heapGrowthFactor = 1.5;
+    // 最小堆大小为1MB
+    config->minHeapSize = 1024 * 1024;
+    // 初始堆大小为10MB
+    config->initialHeapSize = 1024 * 1024 * 10;
+    config->nextGC = config->initialHeapSize;
+    config->maxHeapSize = 0;
+    config->nurserySize = 1024 * 1024 * 2;
+    config->incremental = false;
+    config->pauseBudgetUs = 1000;
+    config->stepBytes = 1024 * 64;
+    config->concurrent = false;
+    config->gcThreads = 1;
+    config->compactInterval = 0;
+    config->largeObjectSize = 1024 * 1024;
+    config->dedupInterval = 0;
+    config->dedupBudgetUs = 1000;
+    config->immortalCore = true;
+    config->protectCore = false;
+    config->reallocateFn = NULL;
+    config->userData = NULL;
+}
+
+//按config初始化虚拟机
+void initVMWithConfig(VM *vm, const Configuration *config) {
+    vm->allocatedBytes = vm->peakBytes = 0;
     vm->allObjects = NULL;
     vm->curParser = NULL;
+    vm->curThread = NULL;
+
+    // 核心类在buildCore中才创建, 此前新建的对象的class为NULL, gc据此跳过
+    vm->classOfClass = vm->objectClass = vm->stringClass = vm->mapClass = NULL;
+    vm->rangeClass = vm->listClass = vm->nullClass = vm->boolClass = NULL;
+    vm->numClass = vm->fnClass = vm->threadClass = NULL;
+    vm->channelClass = vm->ioClass = vm->systemClass = vm->timerClass = NULL;
+
+    vm->config = *config;
+    vm->compactPending = false;
+    vm->dedupPending = false;
+    vm->dedup.active = false;
+    vm->dedup.strings = NULL;
+    vm->dedup.capacity = vm->dedup.count = 0;
+    vm->dedup.redirected.grayObjects = NULL;
+    vm->dedup.redirected.capacity = vm->dedup.redirected.count = 0;
+    vm->frozen.start = vm->frozen.top = NULL;
+    vm->frozen.objects = NULL;
+    vm->immortal.start = vm->immortal.top = NULL;
+    vm->immortal.objects = NULL;
+    vm->frozenDirty.objects = NULL;
+    vm->frozenDirty.capacity = vm->frozenDirty.count = 0;
+    slabCacheInit(&vm->slabs);
+    vm->memErrorHandler = NULL;
+    vm->memErrorMsg = NULL;
+    vm->gcStats.fullGCNum = 0;
+    vm->gcStats.lastMarkNs = vm->gcStats.lastSweepNs = 0;
+    vm->gcStats.markNs = vm->gcStats.sweepNs = 0;
+    vm->gcStats.compactNum = 0;
+    vm->gcStats.compactNs = 0;
+    vm->gcStats.dedupNum = vm->gcStats.dedupBytes = 0;
+    vm->gcPhase = GC_IDLE;
+    vm->markBoundary = vm->sweepList = NULL;
+    vm->liveBytes = 0;
+    vm->markThreadRunning = vm->markDone = false;
+    pthread_mutex_init(&vm->markLock, NULL);
+    vm->heapLockDepth = 0;
+    vm->heapLocked = false;
+    vm->deferredThreads.grayObjects = NULL;
+    vm->deferredThreads.capacity = vm->deferredThreads.count = 0;
+
+    vm->grays.count = 0;
+    vm->grays.capacity = 32;
+    vm->grays.grayObjects = (ObjHeader **) malloc(vm->grays.capacity * sizeof(ObjHeader *));
+    if (vm->grays.grayObjects == NULL) {
+        MEM_ERROR("allocate gray stack failed!");
+    }
+    vm->youngObjects = NULL;
+    vm->nursery.cur = NULL;
+    vm->nursery.usedBytes = 0;
+    vm->remembered.objects = NULL;
+    vm->remembered.capacity = vm->remembered.count = 0;
+    vm->tmpRootNum = 0;
+    vm->gcPauseNum = 0;
+
     StringBufferInit(&vm->allMethodNames);
+    ChannelPtrBufferInit(&vm->channels);
+    eventLoopInit(&vm->eventLoop);
+    timerWheelInit(&vm->timerWheel);
+    // 模块表所在的新生代块计入堆, 分配它时可能触发gc, 此时模块表的根须已有效
+    vm->allModules = NULL;
     vm->allModules = newObjMap(vm);
-    vm->curParser = NULL;
 }
 
-VM *newVM() {
-    VM *vm = (VM *) malloc(sizeof(VM));
+/**
+ * 初始化工作线程的分配上下文worker, 用于并行编译和并行清除
+ * 对象链表、新生代、记忆集、slab缓存、方法名表和内存统计都是私有的, 从空开始,
+ * 分配和释放因此不必加锁; 核心类、模块表、冻结区和永生区的位置以及配置取自vm, 只读
+ * worker中不进行gc也不检查堆上限, 用完后以gcAdoptWorker把私有状态并入vm
+ */
+void initWorkerVM(VM *worker, const VM *vm) {
+    worker->classOfClass = vm->classOfClass;
+    worker->objectClass = vm->objectClass;
+    worker->stringClass = vm->stringClass;
+    worker->mapClass = vm->mapClass;
+    worker->rangeClass = vm->rangeClass;
+    worker->listClass = vm->listClass;
+    worker->nullClass = vm->nullClass;
+    worker->boolClass = vm->boolClass;
+    worker->numClass = vm->numClass;
+    worker->fnClass = vm->fnClass;
+    worker->threadClass = vm->threadClass;
+    worker->channelClass = vm->channelClass;
+    worker->ioClass = vm->ioClass;
+    worker->systemClass = vm->systemClass;
+    worker->timerClass = vm->timerClass;
+    worker->allModules = vm->allModules;
+    worker->config = vm->config;
+    worker->frozen = vm->frozen;
+    worker->immortal = vm->immortal;
+    worker->memErrorMsg = vm->memErrorMsg;
+
+    // allocatedBytes记录的是净增量, 只释放vm中的内存时会回绕, 并入时按模2^64相加
+    worker->allocatedBytes = worker->peakBytes = 0;
+    worker->allObjects = NULL;
+    worker->curParser = NULL;
+    worker->curThread = NULL;
+    StringBufferInit(&worker->allMethodNames);
+    ChannelPtrBufferInit(&worker->channels);
+    eventLoopInit(&worker->eventLoop);
+    timerWheelInit(&worker->timerWheel);
+
+    // 不参与回收周期, 写屏障也就不会向灰色栈压入对象
+    worker->gcPhase = GC_IDLE;
+    worker->grays.grayObjects = NULL;
+    worker->grays.capacity = worker->grays.count = 0;
+    worker->markBoundary = worker->sweepList = NULL;
+    worker->liveBytes = 0;
+    worker->markThreadRunning = worker->markDone = false;
+    pthread_mutex_init(&worker->markLock, NULL);
+    worker->heapLockDepth = 0;
+    worker->heapLocked = false;
+    worker->deferredThreads.grayObjects = NULL;
+    worker->deferredThreads.capacity = worker->deferredThreads.count = 0;
+    worker->compactPending = worker->dedupPending = false;
+    worker->dedup.active = false;
+    worker->dedup.strings = NULL;
+    worker->dedup.capacity = worker->dedup.count = 0;
+    worker->dedup.redirected.grayObjects = NULL;
+    worker->dedup.redirected.capacity = worker->dedup.redirected.count = 0;
+
+    worker->youngObjects = NULL;
+    worker->nursery.cur = NULL;
+    worker->nursery.usedBytes = 0;
+    worker->remembered.objects = NULL;
+    worker->remembered.capacity = worker->remembered.count = 0;
+    worker->frozenDirty.objects = NULL;
+    worker->frozenDirty.capacity = worker->frozenDirty.count = 0;
+    slabCacheInit(&worker->slabs);
+    worker->memErrorHandler = NULL;
+    worker->tmpRootNum = 0;
+    worker->gcPauseNum = 1;
+}
+
+//以默认配置初始化虚拟机
+void initVM(VM *vm) {
+    Configuration config;
+    initConfiguration(&config);
+    initVMWithConfig(vm, &config);
+}
+
+/**
+ * 临时根入栈
+ */
+void pushTmpRoot(VM *vm, ObjHeader *obj) {
+    ASSERT(obj != NULL, "root is NULL!");
+    ASSERT(vm->tmpRootNum < MAX_TEMP_ROOTS_NUM, "temporary roots too much!");
+    vm->tmpRoots[vm->tmpRootNum++] = obj;
+}
+
+/**
+ * 临时根出栈
+ */
+void popTmpRoot(VM *vm) {
+    ASSERT(vm->tmpRootNum > 0, "temporary roots empty!");
+    vm->tmpRootNum--;
+}
+
+/**
+ * 进入内存耗尽恢复点, 随后应以setjmp(handler->jump)设置跳转目标
+ */
+void memErrorPush(VM *vm, MemErrorHandler *handler) {
+    handler->prev = vm->memErrorHandler;
+    handler->tmpRootNum = vm->tmpRootNum;
+    handler->curParser = vm->curParser;
+    vm->memErrorHandler = handler;
+}
+
+/**
+ * 正常离开最内层的恢复点
+ */
+void memErrorPop(VM *vm) {
+    ASSERT(vm->memErrorHandler != NULL, "memory error handler empty!");
+    vm->memErrorHandler = vm->memErrorHandler->prev;
+}
+
+//按config创建虚拟机, 配置了分配函数时虚拟机本身也经由它分配
+VM *newVMWithConfig(const Configuration *config) {
+    VM *vm;
+    if (config->reallocateFn != NULL) {
+        vm = (VM *) config->reallocateFn(NULL, sizeof(VM), config->userData);
+    } else {
+        vm = (VM *) malloc(sizeof(VM));
+    }
     if (vm == NULL) {
         MEM_ERROR("allocate VM failed!");
     }
-    initVM(vm);
+    initVMWithConfig(vm, config);
     buildCore(vm);
     return vm;
 }
+
+VM *newVM() {
+    Configuration config;
+    initConfiguration(&config);
+    return newVMWithConfig(&config);
+}
+
+/**
+ * 跳转到最内层的恢复点, 恢复进入时的临时根和parser; 没有恢复点时报错退出
+ * 恢复点清理自己的资源后可再次调用, 把错误交给外层
+ */
+void memErrorThrow(VM *vm) {
+    MemErrorHandler *handler = vm->memErrorHandler;
+    if (handler == NULL) {
+        MEM_ERROR("out of memory with %llu bytes in use!", (unsigned long long) vm->allocatedBytes);
+    }
+    vm->memErrorHandler = handler->prev;
+    vm->tmpRootNum = handler->tmpRootNum;
+    vm->curParser = handler->curParser;
+    if (vm->curThread != NULL && vm->memErrorMsg != NULL) {
+        vm->curThread->errorObj = OBJ_TO_VALUE(vm->memErrorMsg);
+    }
+    longjmp(handler->jump, 1);
+}
@@ -5,11 +5,16 @@
 #ifndef _VM_VM_H
 #define _VM_VM_H
 
+#include <pthread.h>
+#include <setjmp.h>
 #include "common.h"
 #include "class.h"
 #include "object_header.h"
 #include "obj_thread.h"
 #include "obj_map.h"
+#include "channel.h"
+#include "event_loop.h"
+#include "timer.h"
 
 
 // 为定义在opcode.inc中的操作码加上前缀OPCODE_
@@ -19,6 +24,199 @@ typedef enum {
 } OpCode;
 #undef OPCODE_SLOTS
 
+#define MAX_TEMP_ROOTS_NUM 8
+
+/**
+ * 灰色对象栈, 存放已标记但尚未遍历其引用的对象
+ */
+typedef struct {
+    ObjHeader **grayObjects;
+    uint32_t capacity;
+    uint32_t count;
+} Gray;
+
+/**
+ * 新生代内存块, 对象在其中按指针碰撞分配
+ */
+typedef struct nurseryChunk {
+    struct nurseryChunk *next;
+    // 下一个可分配的地址
+    char *top;
+    char *end;
+    char data[0];
+} NurseryChunk;
+
+/**
+ * 新生代, 由若干等大的块组成, 块链表的首结点为当前分配块
+ * 分配量达到config.nurserySize时在分配处进行新生代回收, 回收期间暂停gc时则追加新块
+ */
+typedef struct {
+    NurseryChunk *cur;
+    // 已分配出的字节数
+    uint32_t usedBytes;
+} Nursery;
+
+/**
+ * 记忆集, 记录可能引用了新生代对象的老年代对象
+ */
+typedef struct {
+    ObjHeader **objects;
+    uint32_t capacity;
+    uint32_t count;
+} RememberedSet;
+
+/**
+ * 冻结区: 冻结堆时存活对象被复制到这块连续内存中, 此后不再标记、清除或移动
+ */
+typedef struct {
+    char *start;
+    // 已使用部分的末尾
+    char *top;
+    // 冻结区中的对象链表
+    ObjHeader *objects;
+} FrozenRegion;
+
+// 小块内存的大小级别数, 按SLAB_GRANULE递增, 最大为SLAB_MAX_SIZE
+#define SLAB_GRANULE 16
+#define SLAB_CLASS_NUM 16
+#define SLAB_MAX_SIZE (SLAB_GRANULE * SLAB_CLASS_NUM)
+
+typedef struct slabCell {
+    struct slabCell *next;
+} SlabCell;
+
+/**
+ * 各大小级别的空闲链表, 以及当前页中尚未切分的部分
+ * 每个vm(包括并行编译和清除用的影子vm)各自独享, 分配和释放都不加锁
+ */
+typedef struct {
+    SlabCell *freeCells[SLAB_CLASS_NUM];
+    char *top[SLAB_CLASS_NUM];
+    char *end[SLAB_CLASS_NUM];
+    // 整理堆期间不用空闲链表, 只从新页切分, 使副本紧凑排列
+    bool evacuating;
+} SlabCache;
+
+/**
+ * 字符串去重的状态, 只在一次带去重的全堆标记中有效
+ * strings以开放定址存放本次标记中遇到的各内容的规范字符串
+ */
+typedef struct {
+    bool active;
+    ObjString **strings;
+    uint32_t capacity;
+    uint32_t count;
+    // 被改为指向规范字符串的副本, 标记结束后统计其中未存活的
+    Gray redirected;
+    // 时间预算的截止时刻, 为0表示不限时
+    uint64_t deadline;
+    uint32_t counter;
+} StringDedup;
+
+/**
+ * 增量gc所处的阶段
+ */
+typedef enum {
+    GC_IDLE,               // 不在回收周期中
+    GC_MARKING,            // 增量标记
+    GC_CONCURRENT_MARKING, // 后台线程并发标记
+    GC_SWEEPING            // 惰性清除
+} GCPhase;
+
+/**
+ * 全堆回收各阶段的耗时, 单位纳秒
+ */
+typedef struct {
+    // 全堆回收次数
+    uint32_t fullGCNum;
+    // 最近一次全堆回收
+    uint64_t lastMarkNs;
+    uint64_t lastSweepNs;
+    // 累计
+    uint64_t markNs;
+    uint64_t sweepNs;
+    // 整理堆的次数及累计耗时
+    uint32_t compactNum;
+    uint64_t compactNs;
+    // 字符串去重释放的副本数及字节数
+    uint64_t dedupNum;
+    uint64_t dedupBytes;
+} GCStats;
+
+/**
+ * 宿主提供的内存分配函数, 语义同realloc: ptr为NULL时分配, newSize为0时释放并返回NULL,
+ * 分配失败时返回NULL且ptr保持不变; userData即配置中的同名字段
+ */
+typedef void *(*ReallocateFn)(void *ptr, size_t newSize, void *userData);
+
+/**
+ * gc配置
+ */
+typedef struct {
+    // 堆生长因子, gc后以存活数据量乘以此因子做为下次gc的阈值
+    float heapGrowthFactor;
+    // 初始堆大小,默认为10MB
+    uint64_t initialHeapSize;
+    // 最小堆大小,默认为1MB
+    uint64_t minHeapSize;
+    // 下次触发gc的堆大小
+    uint64_t nextGC;
+    // 堆的硬上限, 超出时先做全堆回收, 仍不够则报内存耗尽, 0为不限, 默认为0
+    uint64_t maxHeapSize;
+    // 新生代分配量达到此值后, 在下一次新生代分配或安全点进行新生代回收, 默认为2MB
+    uint32_t nurserySize;
+    // 是否以增量方式进行全堆回收, 默认关闭
+    bool incremental;
+    // 增量回收每一步的时间预算, 单位微秒, 默认为1000
+    uint32_t pauseBudgetUs;
+    // 增量回收周期中每分配这么多字节推进一步, 默认为64KB
+    uint32_t stepBytes;
+    // 是否在后台线程中并发标记, 优先于incremental, 默认关闭
+    bool concurrent;
+    // 全堆回收时并行标记和清除的线程数, 0为每个cpu一个线程, 默认为1即单线程
+    uint32_t gcThreads;
+    // 每进行这么多次全堆回收, 在下一个安全点整理一次堆, 0为不整理, 默认为0
+    uint32_t compactInterval;
+    // 不小于此值的内存块单独mmap映射, gc不复制这样的对象和缓冲区, 默认为1MB
+    uint32_t largeObjectSize;
+    // 每进行这么多次全堆回收, 在下一个安全点进行一次带字符串去重的全堆回收, 0为不去重, 默认为0
+    uint32_t dedupInterval;
+    // 去重在每次回收中的时间预算, 用尽后本次回收不再去重, 单位微秒, 0为不限, 默认为1000
+    uint32_t dedupBudgetUs;
+    // buildCore之后是否把核心类、方法表、核心函数和字符串移入永生区, 此后gc不再标记、清除或移动它们, 默认开启
+    bool immortalCore;
+    // 是否用mprotect把永生区设为只读, 此后对核心对象的任何写入都会触发段错误, 默认关闭
+    // 方法表、常量表和模块变量表不在永生区中, 不受保护
+    bool protectCore;
+    // 宿主的内存分配函数, 对象、缓冲区和新生代都经由它分配, 为NULL时使用内置的分配方式, 默认为NULL
+    // 只能在创建虚拟机时指定; 并行清除和并行编译时会在多个线程中调用, 需自行保证线程安全
+    ReallocateFn reallocateFn;
+    // 原样传给reallocateFn
+    void *userData;
+} Configuration;
+
+/**
+ * 堆中对象按类型的统计, 字节数含对象本身及其缓冲区
+ */
+typedef struct {
+    uint64_t objectNum[OBJ_TYPE_NUM];
+    uint64_t bytes[OBJ_TYPE_NUM];
+} HeapStats;
+
+/**
+ * 内存耗尽时的恢复点, 嵌套时以链表相连
+ * 用法: memErrorPush(vm, &handler); if (setjmp(handler.jump) == 0) { ...; memErrorPop(vm); } else { ... }
+ * 跳转回来时恢复点已出栈, 临时根和当前parser已恢复, 当前线程的errorObj已设为内存耗尽错误
+ */
+typedef struct memErrorHandler {
+    struct memErrorHandler *prev;
+    jmp_buf jump;
+    // 进入时的临时根数
+    uint32_t tmpRootNum;
+    // 进入时的parser, 其间开始编译的parser在栈上, 跳转后即失效
+    Parser *curParser;
+} MemErrorHandler;
+
 /**
  * 虚拟机执行结果
  * 如果执行无误, 可以将字符码输出到文件缓存, 避免下次重新编译
@@ -40,16 +238,73 @@ struct vm {
     Class *numClass;
     Class *fnClass;
     Class *threadClass;
-    uint32_t allocatedBytes;    // 累计已分配的内存量
+    Class *channelClass;
+    Class *ioClass;
+    Class *systemClass;
+    Class *timerClass;
+    uint64_t allocatedBytes;    // 经memManager分配且尚未释放的字节数, 按内存块的实际大小统计
+    uint64_t peakBytes;         // allocatedBytes的峰值
     ObjHeader *allObjects;      // 所有已分配对象链表
     SymbolTable allMethodNames; // (所有)类的方法名
     ObjMap *allModules;
     ObjThread *curThread;       // 当前正在执行的线程
     Parser *curParser;          // 当前词法分析器
+    ChannelPtrBuffer channels;  // 已打开的共享内存通道, 下标即脚本中的句柄
+    EventLoop eventLoop;        // io事件循环及线程调度队列
+    TimerWheel timerWheel;      // 定时器
+    Gray grays;                 // gc标记阶段的灰色对象
+    ObjHeader *youngObjects;    // 新生代对象链表
+    Nursery nursery;            // 新生代
+    RememberedSet remembered;   // 老年代到新生代的引用
+    GCPhase gcPhase;            // 增量gc的阶段
+    ObjHeader *markBoundary;    // 标记开始时的allObjects, 其前面的对象都是周期中新分配的
+    ObjHeader *sweepList;       // 待清除的对象链表
+    uint64_t liveBytes;         // 本周期已标记的存活字节数
+    pthread_t markThread;       // 并发标记线程
+    bool markThreadRunning;     // markThread是否尚待回收
+    bool markDone;              // 并发标记线程已处理完灰色栈
+    pthread_mutex_t markLock;   // 并发标记期间, 标记线程与修改堆的mutator互斥
+    uint32_t heapLockDepth;     // gcLockHeap的嵌套层数
+    bool heapLocked;            // 最外层gcLockHeap是否持有markLock
+    Gray deferredThreads;       // 并发标记时遇到的线程, 其栈留到重新标记时扫描
+    Configuration config;       // gc配置
+    GCStats gcStats;            // 全堆回收的耗时统计
+    bool compactPending;        // 在下一个安全点整理堆
+    bool dedupPending;          // 在下一个安全点进行带字符串去重的全堆回收
+    StringDedup dedup;          // 字符串去重的状态
+    FrozenRegion frozen;        // 冻结区
+    FrozenRegion immortal;      // 永生区, 存放核心对象, gc视同冻结区
+    RememberedSet frozenDirty;  // 被修改过的冻结对象, 其槽视为根
+    SlabCache slabs;            // 小块内存的空闲链表
+    MemErrorHandler *memErrorHandler; // 最内层的内存耗尽恢复点, 为NULL时内存耗尽即报错退出
+    ObjString *memErrorMsg;     // 预先分配的内存耗尽错误, 报错时已无法再分配
+    // 临时根, 保护C代码中新建而尚未挂接到其它对象上的对象
+    ObjHeader *tmpRoots[MAX_TEMP_ROOTS_NUM];
+    uint32_t tmpRootNum;
+    // 大于0时暂停gc, 用于成批创建尚无法逐个保护的对象
+    uint32_t gcPauseNum;
 };
 
+void initConfiguration(Configuration *config);
+
+void initVMWithConfig(VM *vm, const Configuration *config);
+
 void initVM(VM *vm);
 
+void initWorkerVM(VM *worker, const VM *vm);
+
+void pushTmpRoot(VM *vm, ObjHeader *obj);
+
+void popTmpRoot(VM *vm);
+
+void memErrorPush(VM *vm, MemErrorHandler *handler);
+
+void memErrorPop(VM *vm);
+
+void memErrorThrow(VM *vm);
+
+VM *newVMWithConfig(const Configuration *config);
+
 VM *newVM(void);
 
 #endif